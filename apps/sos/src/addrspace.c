@@ -16,6 +16,7 @@
 #include "addrspace.h"
 #include "swap.h"
 #include "process.h"
+#include "time_page.h"
 #include <assert.h>
 
 #define verbose 0
@@ -148,6 +149,16 @@ static void as_free_region(sos_addrspace_t *as) {
     dprintf(4, "[AS] regions free'd\n");
 }
 
+static void as_free_shared(sos_addrspace_t *as) {
+    for (int i = 0; i < as->nshared; i++) {
+        cspace_err_t err = cspace_delete_cap(cur_cspace, as->shared_caps[i]);
+        if (err != CSPACE_NOERROR) {
+            ERR("[AS]: failed to delete shared frame cap\n");
+        }
+    }
+    as->nshared = 0;
+}
+
 static void as_free_kpts(sos_addrspace_t *as) {
     kpt_t *kpt;
     dprintf(3, "[AS] Freeing KPTs\n");
@@ -257,6 +268,7 @@ void as_free(sos_addrspace_t *as) {
         return;
     }
     as_free_region(as);
+    as_free_shared(as);
     as_free_kpts(as);
     as_free_ptes(as);
     as_free_pd(as);
@@ -270,14 +282,9 @@ void as_free(sos_addrspace_t *as) {
 static seL4_CPtr as_alloc_page(sos_addrspace_t *as, seL4_Word* sos_vaddr) {
     assert(as);
 
-    sos_proc_t *proc = current_process();
-    if (proc->cont.alloc_page_frame) {
-        *sos_vaddr = proc->cont.alloc_page_frame;
-    } else {
-        // Create a frame
-        proc->cont.alloc_page_frame = frame_alloc(sos_vaddr);
-        conditional_panic(*sos_vaddr == 0, "Unable to allocate memory from the SOS frametable\n");
-    }
+    // Create a frame
+    frame_alloc(sos_vaddr);
+    conditional_panic(*sos_vaddr == 0, "Unable to allocate memory from the SOS frametable\n");
 
     // Retrieve the Cap for the newly created frame
     seL4_CPtr fc = frame_cap(*sos_vaddr);
@@ -382,7 +389,6 @@ int as_create_page(sos_addrspace_t *as, seL4_Word vaddr, seL4_CapRights rights)
     seL4_Word sos_vaddr;
     cap = as_alloc_page(as, &sos_vaddr);
     int err = as_add_page(as, vaddr, sos_vaddr);
-    current_process()->cont.alloc_page_frame = 0;
 
     if (err) {
         assert(err);
@@ -391,6 +397,42 @@ int as_create_page(sos_addrspace_t *as, seL4_Word vaddr, seL4_CapRights rights)
     return as_map_page(as, vaddr, cap, rights);
 }
 
+/**
+ * Map a frame sos keeps ownership of read-only into the address space.
+ * It gets no pte, so it is never swapped or freed with the process' pages
+ * @param as the address space
+ * @param vaddr where to map it
+ * @param fc cap of the frame, a copy is used for the mapping
+ * @param attr VM attributes, e.g. 0 for uncached device registers
+ * @return 0 on success, non-zero otherwise.
+ */
+int as_map_shared_frame(sos_addrspace_t *as, client_vaddr vaddr, seL4_CPtr fc,
+                        seL4_ARM_VMAttributes attr) {
+    assert(as);
+    if (as->nshared == AS_SHARED_FRAMES) {
+        return ENOMEM;
+    }
+    seL4_CPtr proc_fc = cspace_copy_cap(cur_cspace, cur_cspace, fc, seL4_CanRead);
+    if (proc_fc == seL4_CapNull) {
+        return ENOMEM;
+    }
+    int err = seL4_ARM_Page_Map(proc_fc, as->sos_pd_cap, PAGE_ALIGN(vaddr),
+                                seL4_CanRead, attr);
+    if (err == seL4_FailedLookup) {
+        err = _proc_map_pagetable(as, PD_LOOKUP(vaddr), vaddr);
+        if (!err) {
+            err = seL4_ARM_Page_Map(proc_fc, as->sos_pd_cap, PAGE_ALIGN(vaddr),
+                                    seL4_CanRead, attr);
+        }
+    }
+    if (err) {
+        cspace_delete_cap(cur_cspace, proc_fc);
+        return EINVAL;
+    }
+    as->shared_caps[as->nshared++] = proc_fc;
+    return 0;
+}
+
 /**  ---  REGION HANDLING  --- **/
 
 /**
@@ -513,47 +555,53 @@ void as_activate(sos_addrspace_t* as) {
 int as_create(sos_addrspace_t **pas) {
     int err;
     dprintf(3, "[AS] as_create\n");
-    sos_addrspace_t *as = NULL;
-    if (*pas == NULL) {
-        as = malloc(sizeof(sos_addrspace_t));
-        conditional_panic(!as, "No memory for address space");
-        memset(as, 0, sizeof(sos_addrspace_t));
-        dprintf(3, "[AS] finished memset\n");
-        as->sos_pd_addr = ut_alloc(seL4_PageDirBits);
-        if (!as->sos_pd_addr) {
-            ERR("No memory for new Page Directory");
-            return ENOMEM;
-        }
-        dprintf(3, "[AS] cspace_ut_retyping\n");
-        err = cspace_ut_retype_addr(as->sos_pd_addr,
-                                    seL4_ARM_PageDirectoryObject,
-                                    seL4_PageDirBits,
-                                    cur_cspace,
-                                    &as->sos_pd_cap);
-        if (err) {
-            ERR("Failed to allocate page directory cap for client");
-            return err;
-        }
-        *pas = as;
-    } else 
-        as = *pas;
+    sos_addrspace_t *as = malloc(sizeof(sos_addrspace_t));
+    conditional_panic(!as, "No memory for address space");
+    memset(as, 0, sizeof(sos_addrspace_t));
+    dprintf(3, "[AS] finished memset\n");
+    as->sos_pd_addr = ut_alloc(seL4_PageDirBits);
+    if (!as->sos_pd_addr) {
+        ERR("No memory for new Page Directory");
+        free(as);
+        return ENOMEM;
+    }
+    dprintf(3, "[AS] cspace_ut_retyping\n");
+    err = cspace_ut_retype_addr(as->sos_pd_addr,
+                                seL4_ARM_PageDirectoryObject,
+                                seL4_PageDirBits,
+                                cur_cspace,
+                                &as->sos_pd_cap);
+    if (err) {
+        ERR("Failed to allocate page directory cap for client");
+        ut_free(as->sos_pd_addr, seL4_PageDirBits);
+        free(as);
+        return err;
+    }
+    // Published before allocating frames, which may block, so that
+    // process_delete can free a partially built address space
+    *pas = as;
     // Create the page directory
     dprintf(3, "Allocating new frame for PD\n");
-    if (!as->pd) {
-        int ret = (int)frame_alloc((seL4_Word*)&as->pd);
-        if (!ret) {
-            ERR("Unable to get frame for PD!\n");
-            return ENOMEM;
-        }
-        dprintf(3, "allocating page for buf addr\n");
-    }
-    if (!as->sos_ipc_buf_addr) {
-        as_create_page(as, PROCESS_IPC_BUFFER, seL4_AllRights);
-        pte_t* pte = as_lookup_pte(as, PROCESS_IPC_BUFFER);
-        pte->pinned = true;
-        as->sos_ipc_buf_addr = LOAD_PAGE(pte->addr);
-        as->pages_mapped--;
-        addrspace_pages--;
+    int ret = (int)frame_alloc((seL4_Word*)&as->pd);
+    if (!ret) {
+        ERR("Unable to get frame for PD!\n");
+        return ENOMEM;
+    }
+    dprintf(3, "allocating page for buf addr\n");
+    err = as_create_page(as, PROCESS_IPC_BUFFER, seL4_AllRights);
+    if (err) {
+        ERR("Unable to create IPC buffer page\n");
+        return err;
+    }
+    pte_t* pte = as_lookup_pte(as, PROCESS_IPC_BUFFER);
+    pte->pinned = true;
+    as->sos_ipc_buf_addr = LOAD_PAGE(pte->addr);
+    as->pages_mapped--;
+    addrspace_pages--;
+    err = time_page_map(as);
+    if (err) {
+        ERR("Unable to map the time page\n");
+        return err;
     }
     dprintf(3, "[AS] as_create success\n");
     return 0;
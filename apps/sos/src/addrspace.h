@@ -8,6 +8,8 @@
 #include "swap.h"
 #include "sos_type.h"
 
+#define AS_SHARED_FRAMES (2)
+
 #define SAVE_PAGE(a) (assert((a << 20) == 0), a >> 12)
 #define LOAD_PAGE(a) (assert((a >> 20) == 0), a << 12)
 
@@ -53,6 +55,9 @@ typedef struct address_space {
     // page list used in swaping algorithm
     pte_t* repllist_head;
     pte_t* repllist_tail;
+    // copies of caps to frames owned by sos and mapped read-only here
+    seL4_CPtr shared_caps[AS_SHARED_FRAMES];
+    int nshared;
 } sos_addrspace_t;
 
 typedef struct iovec {
@@ -77,6 +82,7 @@ void as_reference_page(sos_addrspace_t *as, client_vaddr vaddr, seL4_CapRights r
 pte_t* as_lookup_pte(sos_addrspace_t *as, client_vaddr vaddr);
 int as_add_page(sos_addrspace_t *as, client_vaddr vaddr, sos_vaddr sos_vaddr);
 void as_free(sos_addrspace_t *as);
+int as_map_shared_frame(sos_addrspace_t *as, client_vaddr vaddr, seL4_CPtr fc, seL4_ARM_VMAttributes attr);
 void unpin_iov(sos_addrspace_t *as, iovec_t *iov);
 void as_pin_page(sos_addrspace_t *as, client_vaddr vaddr);
 void as_unpin_page(sos_addrspace_t *as, client_vaddr vaddr);
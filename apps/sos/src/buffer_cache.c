@@ -0,0 +1,261 @@
+/**
+ * @file buffer_cache.c
+ * @brief File data read over NFS, kept in sos frames
+ *
+ * Blocks are found through a hash on (file handle, block number) and kept
+ * in LRU order. The cache only takes frames the frame table has free; when
+ * it is full, or the frame table is empty, its least recently used block
+ * is recycled. A process short of a frame takes one back from the cache
+ * before any process page is swapped out.
+ *
+ * The cache follows the usual NFS close-to-open rule: cached blocks of a
+ * file are dropped when an open finds that the file has changed on the
+ * server. Writes through sos drop the blocks they cover.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "buffer_cache.h"
+#include "frametable.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+#ifdef CONFIG_SOS_BCACHE_BLOCKS
+#define BCACHE_MAX_BLOCKS CONFIG_SOS_BCACHE_BLOCKS
+#else
+#define BCACHE_MAX_BLOCKS 512
+#endif
+
+#define BCACHE_BUCKETS      256 // power of two
+#define BCACHE_BUCKET(h)    ((h) & (BCACHE_BUCKETS - 1))
+
+typedef struct bcache_block {
+    fhandle3_t fh;
+    uint32_t block;
+    size_t valid;                   // bytes of file data, less than a block at EOF
+    nfstime3_t mtime;               // of the file when the block was read
+    sos_vaddr frame;
+    struct bcache_block *hnext;     // hash chain
+    struct bcache_block *prev;      // LRU list, head is the most recent
+    struct bcache_block *next;
+} bcache_block_t;
+
+static bcache_block_t *bcache_hash[BCACHE_BUCKETS];
+static bcache_block_t *lru_head;
+static bcache_block_t *lru_tail;
+/* Bumped whenever blocks of files in the bucket are dropped, so data
+ * fetched before a write can't be inserted after it */
+static unsigned bcache_epochs[BCACHE_BUCKETS];
+static bcache_stats_t stats;
+
+static unsigned fh_hash(const fhandle3_t *fh) {
+    unsigned h = 0;
+    for (int i = 0; i < NFS3_FHSIZE; i++) {
+        h = h * 31 + (unsigned char)fh->data[i];
+    }
+    return h;
+}
+
+static inline unsigned block_bucket(const fhandle3_t *fh, uint32_t block) {
+    return BCACHE_BUCKET(fh_hash(fh) ^ (block * 2654435761u));
+}
+
+static inline bool same_file(const fhandle3_t *a, const fhandle3_t *b) {
+    return memcmp(a, b, sizeof(fhandle3_t)) == 0;
+}
+
+static void lru_unlink(bcache_block_t *b) {
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        lru_head = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    } else {
+        lru_tail = b->prev;
+    }
+    b->prev = b->next = NULL;
+}
+
+static void lru_push(bcache_block_t *b) {
+    b->prev = NULL;
+    b->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = b;
+    } else {
+        lru_tail = b;
+    }
+    lru_head = b;
+}
+
+static bcache_block_t *bcache_find(const fhandle3_t *fh, uint32_t block) {
+    bcache_block_t *b = bcache_hash[block_bucket(fh, block)];
+    while (b && !(b->block == block && same_file(&b->fh, fh))) {
+        b = b->hnext;
+    }
+    return b;
+}
+
+/**
+ * @brief Take a block out of the cache, keeping its frame
+ *
+ * @return the frame the block held
+ */
+static sos_vaddr bcache_remove(bcache_block_t *b) {
+    bcache_block_t **p = &bcache_hash[block_bucket(&b->fh, b->block)];
+    while (*p != b) {
+        p = &(*p)->hnext;
+    }
+    *p = b->hnext;
+    lru_unlink(b);
+    sos_vaddr frame = b->frame;
+    free(b);
+    stats.blocks--;
+    return frame;
+}
+
+static void bcache_drop(bcache_block_t *b) {
+    bcache_epochs[BCACHE_BUCKET(fh_hash(&b->fh))]++;
+    frame_free_cache(bcache_remove(b));
+}
+
+/**
+ * @brief Find a cached block and make it the most recent one
+ *
+ * @param valid returns the bytes of the block holding file data
+ * @return where the block is in sos, 0 if it isn't cached
+ */
+sos_vaddr bcache_lookup(const fhandle3_t *fh, uint32_t block, size_t *valid) {
+    bcache_block_t *b = bcache_find(fh, block);
+    if (b == NULL) {
+        stats.misses++;
+        return 0;
+    }
+    stats.hits++;
+    lru_unlink(b);
+    lru_push(b);
+    *valid = b->valid;
+    return b->frame;
+}
+
+/**
+ * @brief Whether a block is cached, without counting it as a lookup
+ */
+bool bcache_contains(const fhandle3_t *fh, uint32_t block) {
+    return bcache_find(fh, block) != NULL;
+}
+
+/**
+ * @brief Token to pass to bcache_insert() for data about to be fetched
+ */
+unsigned bcache_epoch(const fhandle3_t *fh) {
+    return bcache_epochs[BCACHE_BUCKET(fh_hash(fh))];
+}
+
+/**
+ * @brief Cache a block that was just read from the server. Nothing is
+ *        cached if blocks of the file were dropped since "epoch" was taken,
+ *        or there is no frame to spare.
+ *
+ * @param count bytes in data, the block is short of a full one at EOF
+ * @param fattr attributes of the file the read returned, without them the
+ *        block can't be checked later and isn't cached
+ */
+void bcache_insert(const fhandle3_t *fh, uint32_t block, unsigned epoch,
+                   const void *data, size_t count, const fattr3_t *fattr) {
+    if (epoch != bcache_epoch(fh) || count > BCACHE_BLOCK_SIZE || fattr == NULL) {
+        return;
+    }
+    bcache_block_t *b = bcache_find(fh, block);
+    if (b) { // fetched twice, the data is the same
+        return;
+    }
+
+    sos_vaddr frame = 0;
+    if (stats.blocks < BCACHE_MAX_BLOCKS) {
+        frame_alloc_cache(&frame);
+    }
+    if (frame == 0 && lru_tail) {
+        dprintf(3, "[BCACHE] evicting block %u\n", lru_tail->block);
+        frame = bcache_remove(lru_tail);
+        stats.evictions++;
+    }
+    if (frame == 0) {
+        return;
+    }
+    b = malloc(sizeof(bcache_block_t));
+    if (b == NULL) {
+        frame_free_cache(frame);
+        return;
+    }
+    b->fh = *fh;
+    b->block = block;
+    b->valid = count;
+    b->mtime = fattr->mtime;
+    b->frame = frame;
+    memcpy((void*)frame, data, count);
+
+    unsigned i = block_bucket(fh, block);
+    b->hnext = bcache_hash[i];
+    bcache_hash[i] = b;
+    lru_push(b);
+    stats.blocks++;
+}
+
+/**
+ * @brief Drop the cached blocks covering [offset, offset + len) of a file
+ */
+void bcache_invalidate(const fhandle3_t *fh, size_t offset, size_t len) {
+    bcache_epochs[BCACHE_BUCKET(fh_hash(fh))]++;
+    if (len == 0) {
+        return;
+    }
+    for (uint32_t block = BCACHE_BLOCK(offset);
+         block <= BCACHE_BLOCK(offset + len - 1); block++) {
+        bcache_block_t *b = bcache_find(fh, block);
+        if (b) {
+            bcache_drop(b);
+        }
+    }
+}
+
+/**
+ * @brief Drop the cached blocks of a file read before it last changed on
+ *        the server. Called with fresh attributes when the file is opened,
+ *        or with none if the server gave none, which drops every block.
+ */
+void bcache_validate(const fhandle3_t *fh, const fattr3_t *fattr) {
+    bcache_block_t *b = lru_head;
+    while (b) {
+        bcache_block_t *next = b->next;
+        if (same_file(&b->fh, fh) && (fattr == NULL ||
+            b->mtime.seconds != fattr->mtime.seconds ||
+            b->mtime.nseconds != fattr->mtime.nseconds)) {
+            bcache_drop(b);
+        }
+        b = next;
+    }
+}
+
+/**
+ * @brief Give the frame of the least recently used block back for a
+ *        process page
+ *
+ * @return the frame, 0 if the cache is empty
+ */
+sos_vaddr bcache_reclaim(void) {
+    if (lru_tail == NULL) {
+        return 0;
+    }
+    stats.reclaims++;
+    return bcache_remove(lru_tail);
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+    *out = stats;
+}
@@ -0,0 +1,35 @@
+/** buffer_cache.h --- NFS file data cached in sos frames **/
+
+#ifndef _SOS_BUFFER_CACHE_H_
+#define _SOS_BUFFER_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <nfs/nfs3.h>
+#include "sos_type.h"
+
+// Files are cached in blocks of a frame, block n covering file offsets
+// [n * BCACHE_BLOCK_SIZE, (n + 1) * BCACHE_BLOCK_SIZE)
+#define BCACHE_BLOCK_SIZE   PAGE_SIZE
+#define BCACHE_BLOCK(off)   ((off) / BCACHE_BLOCK_SIZE)
+
+typedef struct bcache_stats {
+    unsigned hits;
+    unsigned misses;
+    unsigned evictions;     // blocks dropped to make room for other blocks
+    unsigned reclaims;      // frames handed back for process pages
+    unsigned blocks;        // blocks cached now
+} bcache_stats_t;
+
+sos_vaddr bcache_lookup(const fhandle3_t *fh, uint32_t block, size_t *valid);
+bool bcache_contains(const fhandle3_t *fh, uint32_t block);
+unsigned bcache_epoch(const fhandle3_t *fh);
+void bcache_insert(const fhandle3_t *fh, uint32_t block, unsigned epoch,
+                   const void *data, size_t count, const fattr3_t *fattr);
+void bcache_invalidate(const fhandle3_t *fh, size_t offset, size_t len);
+void bcache_validate(const fhandle3_t *fh, const fattr3_t *fattr);
+sos_vaddr bcache_reclaim(void);
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * @file coroutine.c
+ * @brief Per-request coroutines used to suspend and resume blocking sos code
+ *
+ * Every client request (syscall or vm fault) runs on its own stack. When it
+ * has to wait for an NFS callback it calls coroutine_wait(), which parks the
+ * stack and returns to the event loop. The callback puts the process back on
+ * the ready queue and the event loop calls coroutine_resume(), which carries
+ * on right after the coroutine_wait() call. Nothing done before the block is
+ * executed a second time.
+ */
+
+#include <stdlib.h>
+#include <setjmp.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "coroutine.h"
+#include "process.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+typedef struct coroutine {
+    jmp_buf env;        // where to continue inside the coroutine
+    jmp_buf caller;     // where to go back to in the event loop
+    coroutine_fn fn;
+    pid_t pid;          // process the coroutine is waiting on behalf of
+    bool dead;          // finished, or its process was deleted
+    struct coroutine *next_free;
+    char stack[COROUTINE_STACK_SIZE] __attribute__((aligned(8)));
+} coroutine_t;
+
+/* coroutine currently executing, NULL when in the event loop */
+static coroutine_t *running = NULL;
+/* suspended coroutines indexed by pid */
+static coroutine_t *suspended[MAX_PROCESS_NUM];
+/* finished coroutines kept around so their stacks can be reused */
+static coroutine_t *free_list = NULL;
+
+static coroutine_t *coroutine_alloc(void) {
+    coroutine_t *co = free_list;
+    if (co) {
+        free_list = co->next_free;
+    } else {
+        co = malloc(sizeof(coroutine_t));
+    }
+    return co;
+}
+
+static void coroutine_release(coroutine_t *co) {
+    co->next_free = free_list;
+    free_list = co;
+}
+
+/**
+ * @brief Called in the event loop once a coroutine waits or finishes
+ */
+static void coroutine_return(coroutine_t *co) {
+    assert(running == co);
+    running = NULL;
+    if (co->dead) {
+        coroutine_release(co);
+    }
+}
+
+/**
+ * @brief First function executed on a coroutine stack
+ */
+static void __attribute__((noreturn)) coroutine_entry(void) {
+    coroutine_t *co = running;
+    co->fn();
+    co->dead = true;
+    longjmp(co->caller, 1);
+}
+
+/**
+ * @brief Run fn on a new coroutine for the current process.
+ *        Returns once fn finishes or blocks in coroutine_wait()
+ *
+ * @return 0 on success, ENOMEM if no stack could be allocated
+ */
+int coroutine_start(coroutine_fn fn) {
+    assert(!running);
+    coroutine_t *co = coroutine_alloc();
+    if (!co) {
+        ERR("[COROUTINE] No memory for coroutine stack\n");
+        return ENOMEM;
+    }
+    co->fn = fn;
+    co->dead = false;
+    co->pid = current_process() ? current_process()->pid : 0;
+    running = co;
+    if (setjmp(co->caller) == 0) {
+        seL4_Word sp = (seL4_Word)co->stack + COROUTINE_STACK_SIZE;
+        asm volatile("mov sp, %[sp]\n\t"
+                     "blx %[entry]\n\t"
+                     : : [sp] "r" (sp), [entry] "r" (coroutine_entry) : "memory");
+        __builtin_unreachable();
+    }
+    coroutine_return(co);
+    return 0;
+}
+
+/**
+ * @brief Suspend the running coroutine until the current process is put
+ *        on the ready queue and coroutine_resume() is called for it
+ */
+void coroutine_wait(void) {
+    coroutine_t *co = running;
+    assert(co);
+    if (co->dead) { // process was deleted under us, nothing left to wait for
+        longjmp(co->caller, 1);
+    }
+    co->pid = current_process()->pid;
+    assert(!suspended[co->pid]);
+    suspended[co->pid] = co;
+    dprintf(4, "[COROUTINE] %d waiting\n", co->pid);
+    if (setjmp(co->env) == 0) {
+        longjmp(co->caller, 1);
+    }
+    dprintf(4, "[COROUTINE] %d resumed\n", co->pid);
+}
+
+/**
+ * @brief Continue the coroutine a process is waiting in
+ *
+ * @return false if the process has no suspended coroutine
+ */
+bool coroutine_resume(pid_t pid) {
+    assert(!running);
+    assert(pid > 0 && pid < MAX_PROCESS_NUM);
+    coroutine_t *co = suspended[pid];
+    if (!co) {
+        return false;
+    }
+    suspended[pid] = NULL;
+    running = co;
+    if (setjmp(co->caller) == 0) {
+        longjmp(co->env, 1);
+    }
+    coroutine_return(co);
+    return true;
+}
+
+/**
+ * @brief Abandon the running coroutine, e.g. after its process got killed
+ */
+void coroutine_exit(void) {
+    assert(running);
+    running->dead = true;
+    longjmp(running->caller, 1);
+}
+
+/**
+ * @brief Drop any coroutine belonging to a process which is being deleted
+ */
+void coroutine_cancel(pid_t pid) {
+    if (suspended[pid]) {
+        coroutine_release(suspended[pid]);
+        suspended[pid] = NULL;
+    }
+    if (running && running->pid == pid) {
+        running->dead = true; // released once it gives control back
+    }
+}
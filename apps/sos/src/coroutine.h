@@ -0,0 +1,22 @@
+/** coroutine.h --- Per-request continuations for blocking sos code paths **/
+
+#ifndef _SOS_COROUTINE_H_
+#define _SOS_COROUTINE_H_
+
+#include <stdbool.h>
+#include <limits.h>
+#include <sos.h>
+
+/* Stack given to each in-flight request. Big enough for the deepest path:
+ * vm fault -> page creation -> frame eviction -> swap write */
+#define COROUTINE_STACK_SIZE    (4 * PAGE_SIZE)
+
+typedef void (*coroutine_fn)(void);
+
+int coroutine_start(coroutine_fn fn);
+void coroutine_wait(void);
+bool coroutine_resume(pid_t pid);
+void coroutine_exit(void) __attribute__((noreturn));
+void coroutine_cancel(pid_t pid);
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * @file dir_cache.c
+ * @brief Listings of NFS directories
+ *
+ * A listing is read from the server once, with as many READDIR calls as it
+ * takes, and then serves getdirent at any position without asking again.
+ * Names are kept back to back in one arena per listing, found through an
+ * array of offsets, so a listing costs two allocations however many names
+ * it holds.
+ *
+ * A listing is only installed once it is complete, and not at all if the
+ * directory changed through sos while it was read. It is dropped when a
+ * file is created in the directory, and trusted for DIR_TIMEOUT only, as
+ * other clients of the server may change the directory too.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <clock/clock.h>
+
+#include "dir_cache.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+/* Timeout in milliseconds */
+#ifdef CONFIG_SOS_NFS_DIR_TIMEOUT
+#define DIR_TIMEOUT CONFIG_SOS_NFS_DIR_TIMEOUT
+#else
+#define DIR_TIMEOUT 3000
+#endif
+
+#define DCACHE_DIRS         4
+#define DCACHE_MIN_NAMES    32
+#define DCACHE_MIN_ARENA    1024
+#define MS                  1000ull
+
+struct dcache_dir {
+    fhandle3_t fh;
+    unsigned generation;    // of the cache when the listing was started
+    timestamp_t expire;
+    int count;
+    int max;                // room in offsets
+    uint32_t *offsets;      // of each name in the arena
+    char *arena;
+    size_t used;
+    size_t size;
+};
+
+static dcache_dir_t *dirs[DCACHE_DIRS];
+/* Bumped whenever a listing is dropped, so a listing read before a change
+ * isn't installed after it */
+static unsigned generation;
+
+static inline bool same_dir(const fhandle3_t *a, const fhandle3_t *b) {
+    return memcmp(a, b, sizeof(fhandle3_t)) == 0;
+}
+
+static void dcache_free(dcache_dir_t *d) {
+    free(d->offsets);
+    free(d->arena);
+    free(d);
+}
+
+/**
+ * @brief The complete listing of a directory, if there is a recent one
+ */
+dcache_dir_t *dcache_find(const fhandle3_t *dir) {
+    for (int i = 0; i < DCACHE_DIRS; i++) {
+        dcache_dir_t *d = dirs[i];
+        if (d == NULL || !same_dir(&d->fh, dir)) {
+            continue;
+        }
+        if (time_stamp() >= d->expire) {
+            dcache_free(d);
+            dirs[i] = NULL;
+            return NULL;
+        }
+        return d;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start a listing of a directory, to be filled by dcache_append()
+ *        and then either installed by dcache_commit() or thrown away by
+ *        dcache_abort()
+ *
+ * @return the listing, NULL if out of memory
+ */
+dcache_dir_t *dcache_begin(const fhandle3_t *dir) {
+    dcache_dir_t *d = calloc(1, sizeof(dcache_dir_t));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->fh = *dir;
+    d->generation = generation;
+    return d;
+}
+
+/**
+ * @brief Add the next name of the directory to a listing being filled
+ *
+ * @return 0, or ENOMEM
+ */
+int dcache_append(dcache_dir_t *d, const char *name) {
+    size_t len = strlen(name) + 1;
+    if (d->count == d->max) {
+        int max = d->max ? 2 * d->max : DCACHE_MIN_NAMES;
+        uint32_t *offsets = realloc(d->offsets, max * sizeof(uint32_t));
+        if (offsets == NULL) {
+            return ENOMEM;
+        }
+        d->offsets = offsets;
+        d->max = max;
+    }
+    if (d->used + len > d->size) {
+        size_t size = d->size ? 2 * d->size : DCACHE_MIN_ARENA;
+        while (size < d->used + len) {
+            size *= 2;
+        }
+        char *arena = realloc(d->arena, size);
+        if (arena == NULL) {
+            return ENOMEM;
+        }
+        d->arena = arena;
+        d->size = size;
+    }
+    memcpy(d->arena + d->used, name, len);
+    d->offsets[d->count++] = d->used;
+    d->used += len;
+    return 0;
+}
+
+/**
+ * @brief Install a complete listing in place of any older one of the
+ *        directory. The listing is freed instead if the directory changed
+ *        since it was started.
+ */
+void dcache_commit(dcache_dir_t *d) {
+    if (d->generation != generation) {
+        dprintf(3, "[DCACHE] listing went stale while read\n");
+        dcache_free(d);
+        return;
+    }
+    int slot = 0;
+    for (int i = 0; i < DCACHE_DIRS; i++) {
+        if (dirs[i] && same_dir(&dirs[i]->fh, &d->fh)) {
+            slot = i;
+            break;
+        }
+        if (dirs[slot] && (dirs[i] == NULL || dirs[i]->expire < dirs[slot]->expire)) {
+            slot = i;
+        }
+    }
+    if (dirs[slot]) {
+        dcache_free(dirs[slot]);
+    }
+    d->expire = time_stamp() + DIR_TIMEOUT * MS;
+    dirs[slot] = d;
+    dprintf(2, "[DCACHE] %d names, %u bytes\n", d->count, d->used);
+}
+
+void dcache_abort(dcache_dir_t *d) {
+    dcache_free(d);
+}
+
+int dcache_count(const dcache_dir_t *d) {
+    return d->count;
+}
+
+/**
+ * @brief Name at position i of a listing, 0 <= i < dcache_count()
+ */
+const char *dcache_name(const dcache_dir_t *d, int i) {
+    return d->arena + d->offsets[i];
+}
+
+/**
+ * @brief The directory changes through sos, drop its listing
+ */
+void dcache_invalidate(const fhandle3_t *dir) {
+    generation++;
+    for (int i = 0; i < DCACHE_DIRS; i++) {
+        if (dirs[i] && same_dir(&dirs[i]->fh, dir)) {
+            dcache_free(dirs[i]);
+            dirs[i] = NULL;
+        }
+    }
+}
@@ -0,0 +1,19 @@
+/** dir_cache.h --- NFS directory listings **/
+
+#ifndef _SOS_DIR_CACHE_H_
+#define _SOS_DIR_CACHE_H_
+
+#include <nfs/nfs3.h>
+
+typedef struct dcache_dir dcache_dir_t;
+
+dcache_dir_t *dcache_find(const fhandle3_t *dir);
+dcache_dir_t *dcache_begin(const fhandle3_t *dir);
+int dcache_append(dcache_dir_t *d, const char *name);
+void dcache_commit(dcache_dir_t *d);
+void dcache_abort(dcache_dir_t *d);
+int dcache_count(const dcache_dir_t *d);
+const char *dcache_name(const dcache_dir_t *d, int i);
+void dcache_invalidate(const fhandle3_t *dir);
+
+#endif
@@ -14,13 +14,13 @@
 #include <assert.h>
 #include <cspace/cspace.h>
 #include <errno.h>
-#include <setjmp.h>
 
 #include "elf.h"
 #include "process.h"
 #include "addrspace.h"
 #include "frametable.h"
 #include "syscall.h"
+#include "coroutine.h"
 
 #include <device/vmem_layout.h>
 #include <ut/ut.h>
@@ -39,8 +39,6 @@
 #define IS_PAGESIZE_ALIGNED(addr) !((addr) &  (PAGEMASK))
 
 
-extern jmp_buf ipc_event_env;
-
 /*
  * Convert ELF permissions into seL4 permissions.
  */
@@ -57,6 +55,39 @@ static inline seL4_Word get_sel4_rights_from_elf(unsigned long permissions) {
     return result;
 }
 
+/**
+ * @brief Read part of the binary of proc into an io vector list.
+ *        Blocks the current request until the read finishes
+ *
+ * @param proc the client whose binary (BINARY_READ_FD) is read
+ * @param iov destination, consumed and freed by the read
+ * @param offset position in the elf file
+ * @param nbytes number of bytes to read
+ *
+ * @return 0 on success, non-zero on failure
+ */
+int elf_read(sos_proc_t* proc, iovec_t *iov, uint32_t offset, size_t nbytes) {
+    sos_proc_t *cur_proc = current_process();
+    of_entry_t *of = proc->fd_table[BINARY_READ_FD];
+    assert(of && of->io);
+    int err = 0;
+
+    of->offset = offset;
+    cur_proc->cont.fd = BINARY_READ_FD;
+    cur_proc->cont.iov = iov;
+    cur_proc->cont.binary_nfs_read = true;
+    cur_proc->cont.binary_nfs_failed = false;
+    /* The read returns once the whole iov list is in, or the file ended */
+    err = of->io->read(cur_proc->cont.iov, BINARY_READ_FD, nbytes);
+    if (!err && cur_proc->cont.binary_nfs_failed) {
+        err = EIO;
+    }
+    iov_free(cur_proc->cont.iov);
+    cur_proc->cont.iov = NULL;
+    cur_proc->cont.binary_nfs_read = false;
+    return err;
+}
+
 /**
  * @brief load a page from elf file
  *
@@ -95,16 +126,19 @@ int load_page_into_vspace(sos_proc_t* proc,
     unsigned long src = offset + dst - reg->start;
     dprintf(3, "load_page_into_vspace: src=%08x,dst=%08x\n", src, dst);
 
-    proc->cont.iov = iov_create(dst, nbytes, NULL, NULL, false);
-    assert(proc->fd_table[proc->cont.fd]);
-    proc->fd_table[proc->cont.fd]->offset = src;
-
-    if (!proc->cont.binary_nfs_read) {
-        proc->cont.binary_nfs_read = true;
-        proc->fd_table[BINARY_READ_FD]->io->read(proc->cont.iov,
-                                                 proc->cont.fd,
-                                                 nbytes);
-        longjmp(ipc_event_env, -1);
+    iovec_t *iov = iov_create(dst, nbytes, NULL, NULL, false);
+    if (iov == NULL) {
+        return ENOMEM;
+    }
+    /* Keep the page from being evicted while the NFS reply is pending */
+    as_pin_page(as, dst);
+    int err = elf_read(proc, iov, src, nbytes);
+    pte_t *pt = as_lookup_pte(as, dst);
+    if (pt && pt->pinned) {
+        as_unpin_page(as, dst);
+    }
+    if (err) {
+        return err;
     }
 
     unsigned long kdst = as_lookup_sos_vaddr(as, dst);
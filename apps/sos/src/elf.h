@@ -15,6 +15,7 @@
 #include "process.h"
 
 int elf_load(sos_proc_t * proc, char* elf_file);
+int elf_read(sos_proc_t* proc, iovec_t *iov, uint32_t offset, size_t nbytes);
 int load_page_into_vspace(sos_proc_t* proc,
                           uint32_t src,
                           unsigned long dst);
@@ -9,6 +9,7 @@
 #include "process.h"
 #include "frametable.h"
 #include "serial.h"
+#include "sos_nfs.h"
 
 #define verbose 0
 #include <log/debug.h>
@@ -28,7 +29,7 @@ of_entry_t* get_ofe() {
     return NULL;
 }
 
-int fd_create_fd(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mode, int i) {
+int fd_create_fd(fd_table_t fdt, fhandle3_t* handle, io_device_t* io, fmode_t mode, int i) {
     assert (fdt[i] == NULL);
 
     fdt[i] = get_ofe();
@@ -37,6 +38,12 @@ int fd_create_fd(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mod
     fdt[i]->mode = mode;
     fdt[i]->fhandle = handle;
     fdt[i]->io = io;
+    fdt[i]->ra_next = 0;
+    fdt[i]->ra_block = 0;
+    fdt[i]->ra_window = 0;
+    fdt[i]->wb = NULL;
+    fdt[i]->unstable = false;
+    fdt[i]->verf_lost = false;
     return 0;
 }
 
@@ -45,7 +52,7 @@ int fd_create_fd(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mod
  *
  * @return fd or -1
  */
-int fd_create(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mode) {
+int fd_create(fd_table_t fdt, fhandle3_t* handle, io_device_t* io, fmode_t mode) {
     assert(fdt);
     assert(handle || io);
     for (int i = 0; i < FD_TABLE_SIZE; i++) {
@@ -56,6 +63,12 @@ int fd_create(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mode)
             fdt[i]->mode = mode;
             fdt[i]->fhandle = handle;
             fdt[i]->io = io;
+            fdt[i]->ra_next = 0;
+            fdt[i]->ra_block = 0;
+            fdt[i]->ra_window = 0;
+            fdt[i]->wb = NULL;
+            fdt[i]->unstable = false;
+            fdt[i]->verf_lost = false;
             return i;
         }
     }
@@ -68,6 +81,7 @@ int fd_free(fd_table_t fd_table, int fd) {
         dprintf(3, "[FILE] fd %d not found to close\n", fd);
         return -1;
     }
+    sos_nfs_release(fd_table[fd]); // buffered writes still go out
     fd_table[fd]->io = NULL;
     if(fd_table[fd]->fhandle)
         free(fd_table[fd]->fhandle);
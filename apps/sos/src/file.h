@@ -2,7 +2,7 @@
 #define _SOS_FILE_H_
 
 #include <sos.h>
-#include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 #include "addrspace.h"
 
 #define MAX_FD (1023)
@@ -15,20 +15,32 @@ typedef struct io_device {
     int (*write)(iovec_t*, int fd, int count);
     int (*stat)(void);
     int (*getdirent)(void);
+    int (*getdirents)(void);
 } io_device_t;
 
+struct nfs_wbuf;
+
 typedef struct open_file_entry {
     size_t offset;
     fmode_t mode;
-    fhandle_t* fhandle;
+    fhandle3_t* fhandle;
     io_device_t *io;
+    // readahead of nfs files
+    size_t ra_next;         // where a sequential read would continue
+    uint32_t ra_block;      // blocks below this were read ahead already
+    unsigned ra_window;     // blocks kept read ahead, 0 while reads are random
+    struct nfs_wbuf *wb;    // small writes not sent yet
+    // unstable nfs writes
+    bool unstable;          // written data the server may not have committed
+    bool verf_lost;         // the server restarted since, the data may be gone
+    nfs3_writeverf_t verf;  // of the server when the data was written
 } of_entry_t;
 
 typedef of_entry_t** fd_table_t;
 
 int init_open_file_table(void);
-int fd_create(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mode);
-int fd_create_fd(fd_table_t fdt, fhandle_t* handle, io_device_t* io, fmode_t mode, int fd);
+int fd_create(fd_table_t fdt, fhandle3_t* handle, io_device_t* io, fmode_t mode);
+int fd_create_fd(fd_table_t fdt, fhandle3_t* handle, io_device_t* io, fmode_t mode, int fd);
 int fd_free(fd_table_t fd_table, int fd);
 int free_fd_table(fd_table_t fdt);
 
@@ -20,6 +20,8 @@
 #include "process.h"
 #include "page_replacement.h"
 #include "swap.h"
+#include "buffer_cache.h"
+#include "sos_nfs.h"
 
 #define verbose 0
 #include <log/debug.h>
@@ -198,9 +200,30 @@ void frame_init(void) {
     }
 }
 
+/**
+ * @brief Take a frame off the free list and map it
+ *
+ * @return sos vaddr of the frame; 0 if failed to map it
+ */
+static seL4_Word frame_take(void) {
+    assert(free_list);
+    frame_entry_t* new_frame = free_list;
+    free_list = free_list->next_free;
+    unsigned idx = ((unsigned)new_frame-(unsigned)frame_table) / sizeof(frame_entry_t);
+    int err = frame_map_page(idx);
+    if (err) {
+        ERR("[frametable] Failed to map page: err %d\n", err);
+        return 0;
+    }
+    new_frame->next_free = NULL;
+    return FADDR_TO_VADDR(idx*PAGE_SIZE);
+}
+
 /**
  * Allocate a new frame
- * If there is no available frame, force a process to swap out one of it's page
+ * If there is no available frame, take one back from the buffer cache, or
+ * force a process to swap out one of it's page.
+ * In that case the current request blocks until the page is written out.
  *
  * @param vaddr Pointer to the location the pointer will be provided
  * @return index of the frame in the table (faddr); 0 if failed to allocate
@@ -212,70 +235,64 @@ seL4_Word frame_alloc(seL4_Word *vaddr) {
         ERR("frame_alloc: passed null pointer\n");
         return 0;
     }
-    sos_proc_t *proc = current_process();
-    sos_proc_t *evict_proc = NULL;
-    assert(proc);
-
-    if (proc) {
-        if (proc->cont.swap_status || !frame_available_frames()) {
-            dprintf(3, "[FRAME] no available frame\n");
-            // evict a process
-            if (!proc->cont.page_eviction_process) {
-                proc->cont.page_eviction_process = select_eviction_process();
-                if (!proc->cont.page_eviction_process) {
-                    assert("Didn't expect this");
-                }
-            }
-            evict_proc = proc->cont.page_eviction_process;
-            dprintf(3, "[FRAME] Evicting from PID: %d\n", evict_proc->pid);
-            // swap out it's page
-            swap_evict_page(evict_proc);
-        }
+    assert(current_process());
 
-        // If we had a page swapping out, reuse the frame of that swapped page
-        if (proc->cont.original_page_addr) {
-            assert(proc->cont.page_replacement_victim);
-            dprintf(3, "[FRAME] start to unmap frame\n");
-            memset((void*)proc->cont.original_page_addr, 0, PAGE_SIZE);
-            assert(proc->cont.original_page_addr % PAGE_SIZE == 0);
-            assert(proc->cont.page_replacement_victim->swapd);
-            proc->cont.page_replacement_victim = NULL;
-            *vaddr = proc->cont.original_page_addr;
-            proc->cont.original_page_addr = 0;
-            proc->cont.parent_pid = 0;
-            assert(proc->cont.page_eviction_process);
-            ((sos_proc_t*)proc->cont.page_eviction_process)->frames_available--;
-            effective_process()->frames_available++; // if we are starting a new process, allocated frames should belong to the new process
-            proc->cont.page_eviction_process = NULL;
+    while (!frame_available_frames()) {
+        dprintf(3, "[FRAME] no available frame\n");
+        sos_nfs_flush_all(); // don't sit on buffered writes while memory is short
+        // cached file data goes before any process page
+        sos_vaddr frame = bcache_reclaim();
+        if (frame) {
+            memset((void*)frame, 0, PAGE_SIZE);
+            effective_process()->frames_available++;
+            process_frames++;
+            *vaddr = frame;
             return *vaddr;
         }
+        // evict a process
+        sos_proc_t *evict_proc = select_eviction_process();
+        assert(evict_proc);
+        dprintf(3, "[FRAME] Evicting from PID: %d\n", evict_proc->pid);
+        // swap out it's page and reuse the frame of that swapped page
+        frame = swap_evict_page(evict_proc);
+        if (frame == 0) {
+            continue; // evict_proc died while swapping, its frames are free now
+        }
+        assert(frame % PAGE_SIZE == 0);
+        memset((void*)frame, 0, PAGE_SIZE);
+        evict_proc->frames_available--;
+        effective_process()->frames_available++; // if we are starting a new process, allocated frames should belong to the new process
+        *vaddr = frame;
+        return *vaddr;
     }
     dprintf(1, "Getting frame\n");
-    effective_process()->frames_available++; // if we are starting a new process, allocated frames should belong to the new process
-    process_frames++;
-
-    assert(free_list);
-    frame_entry_t* new_frame = free_list;
-    free_list = free_list->next_free;
-    unsigned idx = ((unsigned)new_frame-(unsigned)frame_table) / sizeof(frame_entry_t);
-    int err = frame_map_page(idx);
-    if (err) {
-        ERR("[frametable] Failed to map page: err %d\n", err);
-        *vaddr = 0;
+    *vaddr = frame_take();
+    if (*vaddr == 0) {
         return 0;
     }
-    new_frame->next_free = NULL;
-    *vaddr = FADDR_TO_VADDR(idx*PAGE_SIZE);
+    effective_process()->frames_available++; // if we are starting a new process, allocated frames should belong to the new process
+    process_frames++;
     dprintf(1, "Got frame\n");
     return *vaddr;
 }
 
 /**
- * Free the frame
- * @param vaddr Index of the frame to be removed
- * @return 0 on success, non-zero on failure
+ * Allocate a frame for the buffer cache. Only free frames are used, nothing
+ * is evicted for the cache and the frame belongs to no process.
+ *
+ * @param vaddr Pointer to the location the pointer will be provided
+ * @return sos vaddr of the frame; 0 if there is no free frame
  */
-int frame_free(seL4_Word vaddr) {
+seL4_Word frame_alloc_cache(seL4_Word *vaddr) {
+    assert(frame_table);
+    *vaddr = frame_available_frames() ? frame_take() : 0;
+    return *vaddr;
+}
+
+/**
+ * @brief Unmap a frame and put it back on the free list
+ */
+static int frame_release(seL4_Word vaddr) {
     seL4_Word idx = VADDR_TO_FADDR(vaddr) / PAGE_SIZE;
     assert(frame_table);
     if (idx <= 0 || idx > nframes) {
@@ -300,7 +317,19 @@ int frame_free(seL4_Word vaddr) {
     free_list = cur_frame;
     assert(free_list != NULL);
     dprintf(2, "[FRAME] Unmap complete\n");
+    return 0;
+}
 
+/**
+ * Free the frame
+ * @param vaddr Index of the frame to be removed
+ * @return 0 on success, non-zero on failure
+ */
+int frame_free(seL4_Word vaddr) {
+    int err = frame_release(vaddr);
+    if (err) {
+        return err;
+    }
     sos_proc_t* proc = current_process();
     assert(proc);
     proc->frames_available--;
@@ -308,3 +337,12 @@ int frame_free(seL4_Word vaddr) {
 
     return 0;
 }
+
+/**
+ * Free a frame of the buffer cache
+ * @param vaddr sos vaddr of the frame
+ * @return 0 on success, non-zero on failure
+ */
+int frame_free_cache(seL4_Word vaddr) {
+    return frame_release(vaddr);
+}
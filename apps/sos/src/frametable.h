@@ -15,6 +15,8 @@
 void frame_init(void);
 seL4_Word frame_alloc(seL4_Word *vaddr);
 int frame_free(seL4_Word vaddr);
+seL4_Word frame_alloc_cache(seL4_Word *vaddr);
+int frame_free_cache(seL4_Word vaddr);
 seL4_CPtr frame_cap(seL4_Word idx);
 int sos_map_frame(seL4_Word vaddr);
 int sos_unmap_frame(seL4_Word vaddr);
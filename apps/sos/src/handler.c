@@ -18,6 +18,8 @@
 #include "process.h"
 #include "syscall.h"
 #include "elf.h"
+#include "ring.h"
+#include "sos_poll.h"
 
 #define HANDLER_TYPES  (2)
 #define PAGE_ALIGN(a) (a & 0xfffff000)
@@ -65,24 +67,22 @@ int sos_vm_fault(seL4_Word faulttype, seL4_Word faultaddr) {
     }
 
     dprintf(3, "sos_vm_fault %08x\n", faultaddr);
-    /* Fault on an existing page and 
-     * we're not re-entering this handler in the middle of loading page from elf file*/
-    if (as_page_exists(as, faultaddr) && !proc->cont.binary_nfs_read) {
+    /* Fault on an existing page */
+    if (as_page_exists(as, faultaddr)) {
         if (swap_is_page_swapped(as, faultaddr)) { // fault on a page in disk 
-            swap_in_page(faultaddr); 
-            as_reference_page(current_process()->vspace, faultaddr, reg->rights);
-            current_process()->cont.page_eviction_process = NULL;
+            int err = swap_in_page(faultaddr); 
+            if (err) {
+                return err;
+            }
+            as_reference_page(as, faultaddr, reg->rights);
         } else if (!is_referenced(as, faultaddr)) { // fault on a page whose reference bit is 0
             as_reference_page(as, faultaddr, reg->rights);
         } else {
             assert(!"This shouldn't happen");
         }
     } else { /* Fault on an new page */
-        if (!proc->cont.create_page_done) {
-            if (process_create_page(faultaddr, reg->rights)) 
-                return ENOMEM;
-            proc->cont.create_page_done = true;
-        }
+        if (process_create_page(faultaddr, reg->rights)) 
+            return ENOMEM;
         dprintf(4, "[VMF] page doesn't exist\n");
         pte_t *pt = as_lookup_pte(as, faultaddr);
         if (pt == NULL) {
@@ -102,7 +102,7 @@ int sos_vm_fault(seL4_Word faulttype, seL4_Word faultaddr) {
                                         faultaddr);
             if (err) {
                 ERR("FAILED TO LOAD PAGE FOR PROC\n");
-                process_delete(proc);
+                return err;
             }
         }
     }
@@ -123,8 +123,7 @@ static int usleep_setup(void) {
 
 static int open_setup (void) {
     current_process()->cont.file_mode = (fmode_t)seL4_GetMR(1);
-    memset(current_process()->cont.path, 0, MAX_FILE_PATH_LENGTH);
-    ipc_read_str(OPEN_MESSAGE_START, current_process()->cont.path);
+    ipc_get_str(OPEN_MESSAGE_START, current_process()->cont.path, MAX_FILE_PATH_LENGTH);
     
     dprintf(4, "SYS OPEN %s\n", current_process()->cont.path);
     dprintf(4, "ipc %x %x %x %x\n", seL4_GetMR(2), seL4_GetMR(3), seL4_GetMR(4));
@@ -173,6 +172,114 @@ static int write_setup (void) {
     return 0;
 }
 
+static int pread_setup (void) {
+    int err = read_setup();
+    if (err) {
+        return err;
+    }
+    current_process()->cont.explicit_offset = true;
+    current_process()->cont.offset_arg = (size_t)seL4_GetMR(4);
+    return 0;
+}
+
+static int pwrite_setup (void) {
+    int err = write_setup();
+    if (err) {
+        return err;
+    }
+    current_process()->cont.explicit_offset = true;
+    current_process()->cont.offset_arg = (size_t)seL4_GetMR(4);
+    return 0;
+}
+
+static int lseek_setup (void) {
+    dprintf(4, "SYS LSEEK\n");
+    current_process()->cont.fd = (int)seL4_GetMR(1);
+    current_process()->cont.seek_offset = (long)seL4_GetMR(2);
+    current_process()->cont.seek_whence = (int)seL4_GetMR(3);
+    return 0;
+}
+
+static int read_inline_setup (void) {
+    dprintf(4, "SYS READ INLINE\n");
+    sos_proc_t *proc = current_process();
+    size_t nbyte = (size_t)seL4_GetMR(2);
+    if (nbyte > INLINE_IO_MAX) {
+        return EINVAL;
+    }
+    proc->cont.fd = (int)seL4_GetMR(1);
+    proc->cont.length_arg = nbyte;
+    proc->cont.iov = iov_create((seL4_Word)proc->inline_buf, nbyte, NULL, NULL, true);
+    if (proc->cont.iov == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static int write_inline_setup (void) {
+    dprintf(4, "SYS WRITE INLINE\n");
+    sos_proc_t *proc = current_process();
+    int fd = (int)seL4_GetMR(1);
+    size_t nbyte = (size_t)seL4_GetMR(2);
+    if (fd < 0 || nbyte > INLINE_IO_MAX) {
+        return EINVAL;
+    }
+    memcpy(proc->inline_buf, &seL4_GetIPCBuffer()->msg[INLINE_WRITE_MESSAGE_START], nbyte);
+    proc->cont.fd = fd;
+    proc->cont.length_arg = nbyte;
+    proc->cont.iov = iov_create((seL4_Word)proc->inline_buf, nbyte, NULL, NULL, true);
+    if (proc->cont.iov == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * @brief Load the buffers of a readv/writev into one io vector list
+ */
+static int iov_setup(iop_direction_t dir) {
+    sos_proc_t *proc = current_process();
+    int fd = (int)seL4_GetMR(1);
+    int cnt = (int)seL4_GetMR(2);
+    client_vaddr bufs[SOS_IOV_MAX];
+    size_t nbytes[SOS_IOV_MAX];
+    size_t total = 0;
+    if (fd < 0 || cnt <= 0 || cnt > SOS_IOV_MAX) {
+        return EINVAL;
+    }
+    for (int i = 0; i < cnt; i++) {
+        bufs[i] = seL4_GetMR(IOV_MESSAGE_START + 2 * i);
+        nbytes[i] = (size_t)seL4_GetMR(IOV_MESSAGE_START + 2 * i + 1);
+        if (bufs[i] == 0 && nbytes[i]) {
+            return EINVAL;
+        }
+        if (total + nbytes[i] < total) {
+            return EINVAL;
+        }
+        total += nbytes[i];
+    }
+    proc->cont.fd = fd;
+    proc->cont.length_arg = total;
+    if (total == 0) { // nothing to transfer, exec replies 0 straight away
+        return 0;
+    }
+    proc->cont.iov = cbufv_to_iov(bufs, nbytes, cnt, dir);
+    if (proc->cont.iov == NULL) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+static int readv_setup (void) {
+    dprintf(4, "SYS READV\n");
+    return iov_setup(WRITE);
+}
+
+static int writev_setup (void) {
+    dprintf(4, "SYS WRITEV\n");
+    return iov_setup(READ);
+}
+
 static int getdirent_setup (void) {
     dprintf(4, "SYS GETDIRENT\n");
     size_t nbyte = (size_t)seL4_GetMR(2);
@@ -222,8 +329,7 @@ static int proc_status_setup(void) {
 static int stat_setup (void) {
     current_process()->cont.client_addr = (client_vaddr)seL4_GetMR(1);
     dprintf(4, "SYS STAT\n");
-    memset(current_process()->cont.path, 0, MAX_FILE_PATH_LENGTH);
-    ipc_read_str(STAT_MESSAGE_START, current_process()->cont.path);
+    ipc_get_str(STAT_MESSAGE_START, current_process()->cont.path, MAX_FILE_PATH_LENGTH);
     return 0;
 }
 
@@ -234,10 +340,27 @@ static int close_setup(void) {
     return 0;
 }
 
+static int fsync_setup(void) {
+    dprintf(4, "SYS FSYNC\n");
+    current_process()->cont.fd = (int)seL4_GetMR(1);
+    return 0;
+}
+
+static int ring_register_setup(void) {
+    dprintf(4, "SYS RING REGISTER\n");
+    current_process()->cont.client_addr = (client_vaddr)seL4_GetMR(1);
+    return 0;
+}
+
+static int ring_enter_setup(void) {
+    dprintf(4, "SYS RING ENTER\n");
+    current_process()->cont.length_arg = (size_t)seL4_GetMR(1); // completions to wait for
+    return 0;
+}
+
 static int proc_create_setup(void) {
     dprintf(4, "SYS PROC_CREATE\n");
-    memset(current_process()->cont.path, 0, MAX_FILE_PATH_LENGTH);
-    ipc_read_str(PROC_CREATE_MESSAGE_START, current_process()->cont.path);
+    ipc_get_str(PROC_CREATE_MESSAGE_START, current_process()->cont.path, MAX_FILE_PATH_LENGTH);
     return 0;
 }
 
@@ -260,15 +383,45 @@ void register_handlers(void) {
     handlers[SOS_SYSCALL_WRITE][HANDLER_SETUP] = write_setup;
     handlers[SOS_SYSCALL_WRITE][HANDLER_EXEC] = sos__sys_write;
 
+    handlers[SOS_SYSCALL_READ_INLINE][HANDLER_SETUP] = read_inline_setup;
+    handlers[SOS_SYSCALL_READ_INLINE][HANDLER_EXEC] = sos__sys_read;
+
+    handlers[SOS_SYSCALL_WRITE_INLINE][HANDLER_SETUP] = write_inline_setup;
+    handlers[SOS_SYSCALL_WRITE_INLINE][HANDLER_EXEC] = sos__sys_write;
+
+    handlers[SOS_SYSCALL_READV][HANDLER_SETUP] = readv_setup;
+    handlers[SOS_SYSCALL_READV][HANDLER_EXEC] = sos__sys_read;
+
+    handlers[SOS_SYSCALL_WRITEV][HANDLER_SETUP] = writev_setup;
+    handlers[SOS_SYSCALL_WRITEV][HANDLER_EXEC] = sos__sys_write;
+
+    handlers[SOS_SYSCALL_PREAD][HANDLER_SETUP] = pread_setup;
+    handlers[SOS_SYSCALL_PREAD][HANDLER_EXEC] = sos__sys_read;
+
+    handlers[SOS_SYSCALL_PWRITE][HANDLER_SETUP] = pwrite_setup;
+    handlers[SOS_SYSCALL_PWRITE][HANDLER_EXEC] = sos__sys_write;
+
+    handlers[SOS_SYSCALL_LSEEK][HANDLER_SETUP] = lseek_setup;
+    handlers[SOS_SYSCALL_LSEEK][HANDLER_EXEC] = sos__sys_lseek;
+
+    handlers[SOS_SYSCALL_POLL][HANDLER_SETUP] = NULL;
+    handlers[SOS_SYSCALL_POLL][HANDLER_EXEC] = sos__sys_poll;
+
     handlers[SOS_SYSCALL_GETDIRENT][HANDLER_SETUP] = getdirent_setup;
     handlers[SOS_SYSCALL_GETDIRENT][HANDLER_EXEC] = sos__sys_getdirent;
 
+    handlers[SOS_SYSCALL_GETDIRENTS][HANDLER_SETUP] = getdirent_setup;
+    handlers[SOS_SYSCALL_GETDIRENTS][HANDLER_EXEC] = sos__sys_getdirents;
+
     handlers[SOS_SYSCALL_STAT][HANDLER_SETUP] = stat_setup;
     handlers[SOS_SYSCALL_STAT][HANDLER_EXEC] = sos__sys_stat;
 
     handlers[SOS_SYSCALL_CLOSE][HANDLER_SETUP] = close_setup;
     handlers[SOS_SYSCALL_CLOSE][HANDLER_EXEC] = sos__sys_close;
 
+    handlers[SOS_SYSCALL_FSYNC][HANDLER_SETUP] = fsync_setup;
+    handlers[SOS_SYSCALL_FSYNC][HANDLER_EXEC] = sos__sys_fsync;
+
     handlers[SOS_SYSCALL_PROC_CREATE][HANDLER_SETUP] = proc_create_setup;
     handlers[SOS_SYSCALL_PROC_CREATE][HANDLER_EXEC] =  sos__sys_proc_create;
 
@@ -283,29 +436,53 @@ void register_handlers(void) {
 
     handlers[SOS_SYSCALL_PROC_STATUS][HANDLER_SETUP] = proc_status_setup;
     handlers[SOS_SYSCALL_PROC_STATUS][HANDLER_EXEC] =  sos__sys_proc_status;
+
+    handlers[SOS_SYSCALL_RING_REGISTER][HANDLER_SETUP] = ring_register_setup;
+    handlers[SOS_SYSCALL_RING_REGISTER][HANDLER_EXEC] =  sos__sys_ring_register;
+
+    handlers[SOS_SYSCALL_RING_ENTER][HANDLER_SETUP] = ring_enter_setup;
+    handlers[SOS_SYSCALL_RING_ENTER][HANDLER_EXEC] =  sos__sys_ring_enter;
 }
 
-void handle_syscall(seL4_Word syscall_number) {
-    /* Save the caller */
+/**
+ * @brief Run the exec handler of a syscall, reply an error if it fails
+ */
+static void exec_syscall(seL4_Word syscall_number) {
     int err;
-    dprintf(4, "Handling syscall number %d\n", syscall_number);
-    assert(syscall_number > 0 && syscall_number < MAX_SYSCALL_NO);
-    if (handlers[syscall_number][HANDLER_SETUP] != NULL &&
-        !current_process()->cont.handler_initiated) {
-        err = handlers[syscall_number][HANDLER_SETUP]();
-        current_process()->cont.handler_initiated = true;
+    if (handlers[syscall_number][HANDLER_EXEC]) {
+        err = handlers[syscall_number][HANDLER_EXEC]();
         if (err > 0) {
             syscall_end_continuation(current_process(), 0, false);
             return ;
         }
+    } else {
+        ERR("Unknown syscall %d\n", syscall_number);
     }
-    if (handlers[syscall_number][HANDLER_EXEC]) {
-        err = handlers[syscall_number][HANDLER_EXEC]();
+}
+
+/**
+ * @brief Start a new syscall request: read its arguments and execute it
+ */
+void handle_syscall(seL4_Word syscall_number) {
+    int err;
+    dprintf(4, "Handling syscall number %d\n", syscall_number);
+    assert(syscall_number > 0 && syscall_number < MAX_SYSCALL_NO);
+    if (handlers[syscall_number][HANDLER_SETUP] != NULL) {
+        err = handlers[syscall_number][HANDLER_SETUP]();
         if (err > 0) {
             syscall_end_continuation(current_process(), 0, false);
             return ;
         }
-    } else {
-        ERR("Unknown syscall %d\n", syscall_number);
     }
+    exec_syscall(syscall_number);
+}
+
+/**
+ * @brief Continue a syscall whose device operation was resumed by a callback
+ *        (e.g. the next chunk of an NFS read). Arguments are already in cont
+ */
+void resume_syscall(seL4_Word syscall_number) {
+    dprintf(4, "Resuming syscall number %d\n", syscall_number);
+    assert(syscall_number > 0 && syscall_number < MAX_SYSCALL_NO);
+    exec_syscall(syscall_number);
 }
@@ -16,7 +16,6 @@
 #include <string.h>
 
 #include <cspace/cspace.h>
-#include <setjmp.h>
 
 #include <cpio/cpio.h>
 #include <nfs/nfs.h>
@@ -37,6 +36,9 @@
 #include "elf.h"
 #include "sos_nfs.h"
 #include "swap.h"
+#include "coroutine.h"
+#include "scheduler.h"
+#include "time_page.h"
 
 #include <device/mapping.h>
 #include <syscallno.h>
@@ -67,123 +69,169 @@
  * of an archive of attached applications.                */
 const seL4_BootInfo* _boot_info;
 
-jmp_buf ipc_event_env; // jmp_buf for main event loop
-
 seL4_CPtr _sos_ipc_ep_cap;
 seL4_CPtr _sos_interrupt_ep_cap;
 
+/**
+ * @brief Coroutine starting the first client
+ */
+static void bootstrap_request(void) {
+    pid_t pid = start_process(TEST_PROCESS_NAME, _sos_ipc_ep_cap);
+    if (pid < 0) {
+        dprintf(0, "Failed to start the first client\n");
+        return ;
+    }
+    assert(current_process()); // current process here should be set to the first process started 
+    memset(&current_process()->cont, 0, sizeof(cont_t));
+}
+
+/**
+ * @brief Coroutine handling a vm fault of the current process
+ */
+static void vm_fault_request(void) {
+    sos_proc_t *proc = current_process();
+    int err = sos_vm_fault(proc->cont.vm_fault_type, proc->cont.client_addr);
+    if (err) {
+        process_delete(proc);
+        dprintf(0, "vm_fault couldn't be handled, process is killed %d \n", err);
+    } else {
+        syscall_end_continuation(proc, 0, true); // reboot the client
+    }
+}
+
+/**
+ * @brief Coroutine handling a new syscall of the current process
+ */
+static void syscall_request(void) {
+    handle_syscall(current_process()->cont.syscall_number);
+}
+
+/**
+ * @brief Coroutine continuing a syscall after a device callback
+ */
+static void syscall_resume_request(void) {
+    resume_syscall(current_process()->cont.syscall_number);
+}
+
+/**
+ * @brief Handle clock and network interrupts
+ *
+ * @param badge badge received from the interrupt endpoint
+ */
+static void handle_irqs(seL4_Word badge) {
+    /*1. Clock interrupts*/
+    if (badge &  IRQ_BADGE_CLOCK) {
+        dprintf(4, "[MAIN] Starting timer interrupt\n");
+        timer_interrupt();
+        time_page_update();
+    }
+    /*2. Network interrupts (might be IO interrupts)*/
+    if (badge & IRQ_BADGE_NETWORK) {
+        dprintf(4, "[MAIN] Starting network interrupt\n");
+        /* All NFS callbacks are executed in network_irq(). 
+         * They put the pid of the request they belong to in the ready queue,
+         * so we can continue executions which fired those callbacks.*/
+        network_irq(); 
+        dprintf(4, "[MAIN] Leaving network interrupt\n");
+    }
+}
+
 /**
  * @brief Main event loop of sos
  *
+ *        Every request runs in its own coroutine (see coroutine.c). A request
+ *        which has to wait for NFS suspends its coroutine; the callback puts
+ *        the process on the ready queue and the loop resumes it from there.
+ *        Pending interrupts are polled every SCHED_IRQ_BATCH continuations,
+ *        so a long ready queue can't starve them.
+ *        A request which completes without blocking is answered through the
+ *        caller slot by the seL4_ReplyWait receiving the next message; only
+ *        requests which block get their reply cap saved.
+ *
  * @param ep endpoints where to receive triggered events
  */
 void event_loop(seL4_CPtr ep) {
     sos_proc_t *proc = NULL;
-    static bool bootstrapped = false;
-    static bool bootstrap_init = false;
+    int batch = 0;
     register_handlers();
-    int pid = setjmp(ipc_event_env);
-    if (!bootstrap_init) {
-        bootstrap_init = true;
-        int err = start_process(TEST_PROCESS_NAME, _sos_ipc_ep_cap);
-        if (err) {
-            dprintf(0, "Failed to start the first client\n");
-            return ;
-        }
-        assert(current_process()); // current process here should be set to the first process started 
-        memset(&current_process()->cont, 0, sizeof(cont_t));
-        bootstrapped = true;
+    if (coroutine_start(bootstrap_request)) {
+        dprintf(0, "Failed to start the first client\n");
+        return ;
     }
     while (1) {
-        dprintf(4, "[MAIN] Restart syscall loop\n");
         seL4_Word badge = 0;
         seL4_Word label;
-        seL4_MessageInfo_t message;
-/***** Prepare events and set up current process *****/
+        seL4_MessageInfo_t message, reply;
+/***** Resume executions whose callbacks have fired *****/
         if (has_ready_proc()) { 
-            /*1. Pick one resumed execution and continue it*/
+            syscall_flush_reply();
+            if (++batch > SCHED_IRQ_BATCH) {
+                batch = 0;
+                seL4_Poll(_sos_interrupt_ep_cap, &badge);
+                if (badge) {
+                    handle_irqs(badge);
+                    continue;
+                }
+            }
             dprintf(4, "[MAIN] Applying continuation\n");
-            pid = next_ready_proc();
+            pid_t pid = next_ready_proc();
             set_current_process(pid);
-            proc = process_lookup(pid);
-
-            label = proc->cont.ipc_label;
-        } else if (pid < -1) { 
-            /*sos got fatal error event, we quit*/
-            ERR("Fatal error happened in sos (error code : %d)!\n", pid);
-            break;
+            proc = current_process();
+            if (!proc) {
+                continue;
+            }
+            if (!coroutine_resume(pid) && coroutine_start(syscall_resume_request)) {
+                syscall_end_continuation(proc, 0, false);
+            }
+            continue;
+        }
+/***** Wait event sent via endpoint (could be IPC, network or clock ...) *****/
+        dprintf(4, "[MAIN] New continuation\n");
+        batch = 0;
+        if (syscall_take_reply(&reply)) {
+            /* the last request finished without blocking */
+            message = seL4_ReplyWait(ep, reply, &badge);
         } else {
-            /*Wait event sent via endpoint (could be IPC, network or clock ...)*/
-            dprintf(4, "[MAIN] New continuation\n");
             message = seL4_Wait(ep, &badge);
-            label = seL4_MessageInfo_get_label(message);
-            if (badge < MAX_PROCESS_NUM) {   // Check whether it is a IPC request from a client
-                set_current_process((int)badge);
-                proc = current_process();
-                dprintf(4, "[MAIN] Received %u from process\n", proc->pid);
-            }
         }
-/***** Handle received events *****/
+        label = seL4_MessageInfo_get_label(message);
         if(badge & IRQ_EP_BADGE){
-            /*1. Clock interrupts*/
-            if (badge &  IRQ_BADGE_CLOCK) {
-                dprintf(4, "[MAIN] Starting timer interrupt\n");
-                timer_interrupt();
-            }
-            /*2. Network interrupts (might be IO interrupts)*/
-            if (badge & IRQ_BADGE_NETWORK) {
-                dprintf(4, "[MAIN] Starting network interrupt\n");
-                /* All NFS callbacks are executed in network_irq(). 
-                 * Track them by putting corresponding pid into wait_proc_queue.
-                 * So we can continue executions which fired those callbacks.*/
-                network_irq(); 
-                dprintf(4, "[MAIN] Leaving network interrupt\n");
-            }
-        } else if (pid > 0 && !bootstrapped) {
-            /*3. Starting process of the first client was resumed*/
-            assert(pid == 1); // First client has pid 1
-            start_process(TEST_PROCESS_NAME, _sos_ipc_ep_cap);
-            memset(&current_process()->cont, 0, sizeof(cont_t));
-            bootstrapped = true;
-        } else if(label == seL4_VMFault){
-            /*4. An client caused page fault */
-            if (!pid || !proc->cont.syscall_loop_initiations) {
-                dprintf(4, "vm fault at 0x%08x, pc = 0x%08x, %s\n", seL4_GetMR(1),
-                        seL4_GetMR(0),
-                        seL4_GetMR(2) ? "Instruction Fault" : "Data fault");
-            }
-            if (proc->cont.syscall_loop_initiations == 0) { // Initialize continuation
-                proc->cont.vm_fault_type = seL4_GetMR(3);
-                proc->cont.client_addr = seL4_GetMR(1);
-                proc->cont.ipc_label = seL4_VMFault;
-                proc->cont.reply_cap = cspace_save_reply_cap(cur_cspace);
-            }
-            proc->cont.syscall_loop_initiations++;
-            int err = sos_vm_fault(proc->cont.vm_fault_type, proc->cont.client_addr);
-            if (err) {
+            handle_irqs(badge);
+            continue;
+        }
+        if (badge >= MAX_PROCESS_NUM || !process_lookup((pid_t)badge)) {
+            ERR("Rootserver got a message from an unknown badge %u\n", badge);
+            continue;
+        }
+        set_current_process((int)badge);
+        proc = current_process();
+        dprintf(4, "[MAIN] Received %u from process\n", proc->pid);
+        if(label == seL4_VMFault){
+            /*1. An client caused page fault */
+            dprintf(4, "vm fault at 0x%08x, pc = 0x%08x, %s\n", seL4_GetMR(1),
+                    seL4_GetMR(0),
+                    seL4_GetMR(2) ? "Instruction Fault" : "Data fault");
+            proc->cont.vm_fault_type = seL4_GetMR(3);
+            proc->cont.client_addr = seL4_GetMR(1);
+            proc->cont.ipc_label = seL4_VMFault;
+            syscall_defer_reply_cap(proc);
+            if (coroutine_start(vm_fault_request)) {
                 process_delete(proc);
-                dprintf(0, "vm_fault couldn't be handled, process is killed %d \n", err);
-            } else {
-                syscall_end_continuation(proc, 0, true); // reboot the client
             }
+            syscall_save_reply_cap();
         } else if(label == seL4_NoFault) {
-            /*5. Syscall requests from clients*/
-            if (proc->cont.syscall_loop_initiations == 0) { // Initialize continuation
-                dprintf(4, "[MAIN] Starting syscall\n");
-                proc->cont.syscall_number = seL4_GetMR(0);
-                proc->cont.reply_cap = cspace_save_reply_cap(cur_cspace);
-                proc->cont.ipc_label = label;
-            } else {
-                dprintf(4, "[MAIN] Restarting syscall %d\n", proc->cont.syscall_loop_initiations);
+            /*2. Syscall requests from clients*/
+            dprintf(4, "[MAIN] Starting syscall\n");
+            proc->cont.syscall_number = seL4_GetMR(0);
+            proc->cont.ipc_label = label;
+            syscall_defer_reply_cap(proc);
+            if (coroutine_start(syscall_request)) {
+                syscall_end_continuation(proc, 0, false);
             }
-            proc->cont.syscall_loop_initiations++;
-            /* Execute System call */
-            handle_syscall(proc->cont.syscall_number);
-            dprintf(0, "handle_syscall end\n");
+            syscall_save_reply_cap();
         }else{
             ERR("Rootserver got an unknown message\n");
         }
-        pid = 0;
     }
 }
 
@@ -310,6 +358,8 @@ static void _sos_init(seL4_CPtr* ipc_ep, seL4_CPtr* async_ep){
 
     /* Initialize and start the clock driver */
     start_timer(badge_irq_ep(*async_ep, IRQ_BADGE_CLOCK));
+    time_page_init();
+    network_start_timers();
 
     /* Initialize frame table and swap table*/
     frame_init();
@@ -0,0 +1,200 @@
+/**
+ * @file name_cache.c
+ * @brief Cache of NFS lookups under the mount point and of the attributes
+ *        they returned
+ *
+ * An entry maps a path to its file handle, or records that the path
+ * didn't exist. Entries are found by path, and by file handle when a
+ * write through sos makes their attributes stale. What the server said is
+ * trusted for a while only: file handles for NAME_TIMEOUT, attributes and
+ * missing files for ATTR_TIMEOUT. The least recently used entry makes room
+ * for a new one.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <clock/clock.h>
+#include <syscallno.h>
+
+#include "name_cache.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+/* Timeouts in milliseconds */
+#ifdef CONFIG_SOS_NFS_ATTR_TIMEOUT
+#define ATTR_TIMEOUT CONFIG_SOS_NFS_ATTR_TIMEOUT
+#else
+#define ATTR_TIMEOUT 3000
+#endif
+#ifdef CONFIG_SOS_NFS_NAME_TIMEOUT
+#define NAME_TIMEOUT CONFIG_SOS_NFS_NAME_TIMEOUT
+#else
+#define NAME_TIMEOUT 30000
+#endif
+
+#define NCACHE_ENTRIES      128
+#define NCACHE_BUCKETS      64  // power of two
+#define NCACHE_BUCKET(h)    ((h) & (NCACHE_BUCKETS - 1))
+#define MS                  1000ull
+
+typedef struct ncache_entry {
+    char name[MAX_FILE_PATH_LENGTH + 1];
+    bool used;
+    bool exists;
+    bool attr_valid;
+    fhandle3_t fh;
+    fattr3_t fattr;
+    timestamp_t name_expire;
+    timestamp_t attr_expire;
+    timestamp_t last_use;
+    struct ncache_entry *name_next;
+    struct ncache_entry *fh_next;
+} ncache_entry_t;
+
+static ncache_entry_t entries[NCACHE_ENTRIES];
+static ncache_entry_t *by_name[NCACHE_BUCKETS];
+static ncache_entry_t *by_fh[NCACHE_BUCKETS];
+
+static unsigned hash_bytes(const char *p, size_t n) {
+    unsigned h = 0;
+    for (size_t i = 0; i < n; i++) {
+        h = h * 31 + (unsigned char)p[i];
+    }
+    return h;
+}
+
+static inline unsigned name_bucket(const char *name) {
+    return NCACHE_BUCKET(hash_bytes(name, strlen(name)));
+}
+
+static inline unsigned fh_bucket(const fhandle3_t *fh) {
+    return NCACHE_BUCKET(hash_bytes(fh->data, NFS3_FHSIZE));
+}
+
+static ncache_entry_t *find_name(const char *name) {
+    ncache_entry_t *e = by_name[name_bucket(name)];
+    while (e && strcmp(e->name, name) != 0) {
+        e = e->name_next;
+    }
+    return e;
+}
+
+static void unlink_entry(ncache_entry_t *e) {
+    ncache_entry_t **p = &by_name[name_bucket(e->name)];
+    while (*p != e) {
+        p = &(*p)->name_next;
+    }
+    *p = e->name_next;
+    if (e->exists) {
+        p = &by_fh[fh_bucket(&e->fh)];
+        while (*p != e) {
+            p = &(*p)->fh_next;
+        }
+        *p = e->fh_next;
+    }
+    e->used = false;
+}
+
+/**
+ * @brief An unused entry, or the least recently used one
+ */
+static ncache_entry_t *alloc_entry(void) {
+    ncache_entry_t *victim = &entries[0];
+    for (int i = 0; i < NCACHE_ENTRIES; i++) {
+        if (!entries[i].used) {
+            return &entries[i];
+        }
+        if (entries[i].last_use < victim->last_use) {
+            victim = &entries[i];
+        }
+    }
+    unlink_entry(victim);
+    return victim;
+}
+
+/**
+ * @brief Look a path up
+ *
+ * @param fh, fattr filled in if the file was found
+ * @param attr_valid whether fattr can be used, or the attributes have to be
+ *        fetched again
+ */
+ncache_result_t ncache_lookup(const char *name, fhandle3_t *fh, fattr3_t *fattr,
+                              bool *attr_valid) {
+    ncache_entry_t *e = find_name(name);
+    if (e == NULL) {
+        return NCACHE_MISS;
+    }
+    timestamp_t now = time_stamp();
+    if (!e->exists) {
+        if (now >= e->attr_expire) {
+            unlink_entry(e);
+            return NCACHE_MISS;
+        }
+        return NCACHE_NOENT;
+    }
+    if (now >= e->name_expire) {
+        unlink_entry(e);
+        return NCACHE_MISS;
+    }
+    e->last_use = now;
+    *fh = e->fh;
+    *fattr = e->fattr;
+    *attr_valid = e->attr_valid && now < e->attr_expire;
+    dprintf(3, "[NCACHE] hit %s\n", name);
+    return NCACHE_FOUND;
+}
+
+/**
+ * @brief Remember the result of a lookup, or of creating the file
+ *
+ * @param fattr NULL if the server didn't return the attributes, they are
+ *        fetched when needed then
+ */
+void ncache_enter(const char *name, enum nfs_stat status, const fhandle3_t *fh,
+                  const fattr3_t *fattr) {
+    if (strlen(name) > MAX_FILE_PATH_LENGTH ||
+        (status != NFS_OK && status != NFSERR_NOENT)) {
+        return;
+    }
+    ncache_entry_t *e = find_name(name);
+    if (e) {
+        unlink_entry(e);
+    } else {
+        e = alloc_entry();
+    }
+    timestamp_t now = time_stamp();
+    strcpy(e->name, name);
+    e->used = true;
+    e->exists = status == NFS_OK;
+    e->last_use = now;
+    e->attr_expire = now + ATTR_TIMEOUT * MS;
+    unsigned i = name_bucket(name);
+    e->name_next = by_name[i];
+    by_name[i] = e;
+    if (e->exists) {
+        e->fh = *fh;
+        e->attr_valid = fattr != NULL;
+        if (fattr) {
+            e->fattr = *fattr;
+        }
+        e->name_expire = now + NAME_TIMEOUT * MS;
+        i = fh_bucket(fh);
+        e->fh_next = by_fh[i];
+        by_fh[i] = e;
+    }
+}
+
+/**
+ * @brief The file changes through sos, its size and times have to be
+ *        fetched again
+ */
+void ncache_invalidate_attr(const fhandle3_t *fh) {
+    for (ncache_entry_t *e = by_fh[fh_bucket(fh)]; e; e = e->fh_next) {
+        if (memcmp(&e->fh, fh, sizeof(fhandle3_t)) == 0) {
+            e->attr_valid = false;
+        }
+    }
+}
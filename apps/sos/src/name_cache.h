@@ -0,0 +1,21 @@
+/** name_cache.h --- NFS lookup results and file attributes **/
+
+#ifndef _SOS_NAME_CACHE_H_
+#define _SOS_NAME_CACHE_H_
+
+#include <stdbool.h>
+#include <nfs/nfs3.h>
+
+typedef enum ncache_result {
+    NCACHE_MISS,        // ask the server
+    NCACHE_NOENT,       // the server said recently that there's no such file
+    NCACHE_FOUND,
+} ncache_result_t;
+
+ncache_result_t ncache_lookup(const char *name, fhandle3_t *fh, fattr3_t *fattr,
+                              bool *attr_valid);
+void ncache_enter(const char *name, enum nfs_stat status, const fhandle3_t *fh,
+                  const fattr3_t *fattr);
+void ncache_invalidate_attr(const fhandle3_t *fh);
+
+#endif
@@ -28,6 +28,9 @@
 
 #include <nfs/nfs.h>
 #include <lwip/init.h>
+#include <lwip/ip_frag.h>
+#include <lwip/tcp_impl.h>
+#include <clock/clock.h>
 #include <netif/etharp.h>
 #include <ethdrivers/lwip.h>
 #include <ethdrivers/imx6.h>
@@ -50,6 +53,12 @@
 #  endif
 #endif
 
+#ifdef CONFIG_SOS_NFS_TCP
+#define SOS_NFS_TRANSPORT NFS3_TCP
+#else
+#define SOS_NFS_TRANSPORT NFS3_UDP
+#endif
+
 #define ARP_PRIME_TIMEOUT_MS     1000
 #define ARP_PRIME_RETRY_DELAY_MS   10
 
@@ -62,7 +71,7 @@ static struct net_irq {
 
 static seL4_CPtr _irq_ep;
 
-fhandle_t mnt_point = { { 0 } };
+fhandle3_t mnt_point = { 0, { 0 } };
 
 lwip_iface_t *lwip_iface;
 
@@ -147,6 +156,31 @@ network_prime_arp(struct ip_addr *gw){
     }
 }
 
+/* Ages fragments of datagrams that never complete out of the reassembly
+ * queue, so they don't hold the room of later ones */
+static void
+network_reass_tick(uint32_t id, void *data) {
+    (void)id;
+    (void)data;
+    ip_reass_tmr();
+    register_timer(IP_TMR_INTERVAL * 1000ULL, network_reass_tick, NULL);
+}
+
+/* Retransmissions and delayed acknowledgements of TCP connections */
+static void
+network_tcp_tick(uint32_t id, void *data) {
+    (void)id;
+    (void)data;
+    tcp_tmr();
+    register_timer(TCP_TMR_INTERVAL * 1000ULL, network_tcp_tick, NULL);
+}
+
+void
+network_start_timers(void) {
+    register_timer(IP_TMR_INTERVAL * 1000ULL, network_reass_tick, NULL);
+    register_timer(TCP_TMR_INTERVAL * 1000ULL, network_tcp_tick, NULL);
+}
+
 void 
 network_init(seL4_CPtr interrupt_ep) {
     struct ip_addr netmask, ipaddr, gw;
@@ -221,7 +255,12 @@ network_init(seL4_CPtr interrupt_ep) {
         if(!(err = nfs_init(&gw))){
             /* Print out the exports on this server */
             nfs_print_exports();
-            if ((err = nfs_mount(SOS_NFS_DIR, &mnt_point))){
+            err = nfs3_mount(SOS_NFS_DIR, &mnt_point, SOS_NFS_TRANSPORT);
+            if (err == RPCERR_COMM && SOS_NFS_TRANSPORT == NFS3_TCP) {
+                WARN("NFS over TCP failed, using UDP\n");
+                err = nfs3_mount(SOS_NFS_DIR, &mnt_point, NFS3_UDP);
+            }
+            if (err){
                 printf("Error mounting path '%s'!\n", SOS_NFS_DIR);
             }else{
                 printf("\nSuccessfully mounted '%s'\n", SOS_NFS_DIR);
@@ -12,9 +12,9 @@
 #define NETWORK_H
 
 #include <sel4/types.h>
-#include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 
-extern fhandle_t mnt_point;
+extern fhandle3_t mnt_point;
 
 /**
  * Initialises the network stack
@@ -36,4 +36,9 @@ extern int dma_init(seL4_Word paddr, int sizebits);
  */
 extern void network_irq(void);
 
+/**
+ * Starts the periodic work of the network stack, once the clock runs
+ */
+extern void network_start_timers(void);
+
 #endif
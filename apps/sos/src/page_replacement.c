@@ -12,7 +12,7 @@
 #include "process.h"
 #include "syscall.h"
 #include "swap.h"
-#include "handler.h"
+#include "coroutine.h"
 #include <assert.h>
 
 #define verbose 0
@@ -21,6 +21,22 @@
 
 extern size_t addrspace_pages;
 
+/**
+ * @brief   Kill the process we are allocating memory for and abandon the request.
+ *          If that process is being spawned, fail the spawning syscall as well.
+ *
+ * @param retval value returned to the spawning process
+ */
+static void __attribute__((noreturn)) swap_abort(int retval) {
+    sos_proc_t *proc = effective_process();
+    if (current_process()->cont.spawning_process == proc) {
+        WARN("Failed to start the new process");
+        syscall_end_continuation(current_process(), retval, false);
+    }
+    process_delete(proc);
+    coroutine_exit();
+}
+
 /**
  * Second chance page replacement algorithm.  Maintains a ref bit in the PTE,
  * which tracks whether the page has been referenced since the last time the
@@ -38,12 +54,7 @@ static pte_t* swap_choose_replacement_page(sos_addrspace_t* as) {
         if (head == as->repllist_head) {
             if (loop_count > 1) { // all pages are pinned or swaped 
                 dprintf(1, "[PR] No pages left for eviction. Invoking 'OOM killer'\n");
-                if (effective_process() != current_process()) {
-                    WARN("Failed to start the new process");
-                    syscall_end_continuation(current_process(), 0, false);
-                }
-                process_delete(effective_process());
-                longjmp(ipc_event_env, -1);
+                swap_abort(0);
             }
             loop_count++;
         }
@@ -76,65 +87,60 @@ static pte_t* swap_choose_replacement_page(sos_addrspace_t* as) {
 }
 
 /**
- * Evict a page from the address space, swapping it out to 'disk'
- * @param as Address space from which to evict
- * @return Zero if successful, non-zero otherwise.
+ * Evict a page from the address space, swapping it out to 'disk'.
+ * Blocks the current request until the page has been written.
+ * @param evict_proc Process from which to evict
+ * @return sos vaddr of the frame which held the evicted page, 0 if evict_proc
+ *         was deleted meanwhile (its frames went back to the frame table)
  */
-int swap_evict_page(sos_proc_t *evict_proc) {
+sos_vaddr swap_evict_page(sos_proc_t *evict_proc) {
     dprintf(3, "[PR] EVICTING PAGE\n");
-    sos_proc_t *proc = current_process();
-    assert(proc);
-    if (!proc->cont.page_replacement_victim) {
-        proc->cont.page_replacement_victim = swap_choose_replacement_page(evict_proc->vspace);
-    }
+    pid_t evict_pid = evict_proc->pid;
+    timestamp_t evict_start = evict_proc->start_time;
+    sos_addrspace_t *as = evict_proc->vspace;
+    pte_t *victim = swap_choose_replacement_page(as);
 
-    // Continuation
-    if (!proc->cont.swap_write_fired) {
-        addrspace_pages--;
-        evict_proc->vspace->pages_mapped--;
-        proc->cont.page_replacement_victim->pinned = true;
-        proc->cont.original_page_addr = LOAD_PAGE((seL4_Word)proc->cont.page_replacement_victim->addr);
+    addrspace_pages--;
+    as->pages_mapped--;
+    victim->pinned = true;
+    sos_vaddr frame = LOAD_PAGE((seL4_Word)victim->addr);
 
-        sos_swap_write(proc->cont.original_page_addr);
-        // Wait on network irq
-        longjmp(ipc_event_env, -1);
-    }
-
-    // Continuation
-    if (proc->cont.swap_status == SWAP_SUCCESS) {
-        dprintf(4, "[PR] EVICTED. Tidying up.\n");
-        dprintf(4, "victim: %p\n", proc->cont.page_replacement_victim);
-        assert(proc->cont.page_replacement_victim);
-        if (proc->cont.page_replacement_victim->refd) {
-            // Process has accessed in the interim
-            seL4_ARM_Page_Unmap(proc->cont.page_replacement_victim->page_cap);
-            cspace_revoke_cap(cur_cspace, proc->cont.page_replacement_victim->page_cap);
-            int err = cspace_delete_cap(cur_cspace, proc->cont.page_replacement_victim->page_cap);
-            if (err != CSPACE_NOERROR) {
-                ERR("[PR]: failed to delete page cap\n");
-            }
-            proc->cont.page_replacement_victim->page_cap = 0;
-            proc->cont.page_replacement_victim->refd = false;
+    swap_addr saddr;
+    int err = sos_swap_write(frame, &saddr);
+    evict_proc = process_lookup(evict_pid);
+    if (!evict_proc || evict_proc->start_time != evict_start) {
+        dprintf(3, "[PR] Process %d vanished during eviction\n", evict_pid);
+        if (!err) {
+            swap_free(saddr);
         }
-
-        proc->cont.page_replacement_victim->addr = SAVE_PAGE(proc->cont.swap_file_offset);
-        proc->cont.page_replacement_victim->swapd = true;
-        proc->cont.page_replacement_victim->pinned = false;
-        proc->cont.swap_write_fired = false;
-        proc->cont.swap_status = 0;
         return 0;
-    } else if (proc->cont.swap_status == SWAP_FAILED) {
+    }
+    if (err) {
         ERR("[PR] Deleting process due to swap failure\n");
-        if (effective_process() != current_process()) {
-            syscall_end_continuation(current_process(), -1, false);
+        victim->pinned = false;
+        addrspace_pages++;
+        as->pages_mapped++;
+        swap_abort(-1);
+    }
+
+    dprintf(4, "[PR] EVICTED. Tidying up.\n");
+    dprintf(4, "victim: %p\n", victim);
+    if (victim->refd) {
+        // Process has accessed in the interim
+        seL4_ARM_Page_Unmap(victim->page_cap);
+        cspace_revoke_cap(cur_cspace, victim->page_cap);
+        int err = cspace_delete_cap(cur_cspace, victim->page_cap);
+        if (err != CSPACE_NOERROR) {
+            ERR("[PR]: failed to delete page cap\n");
         }
-        process_delete(effective_process());
-        longjmp(ipc_event_env, -1);
-    } else {
-        dprintf(4, "[PR] Jumping back\n");
-        // Wait on network irq
-        longjmp(ipc_event_env, -1);
+        victim->page_cap = 0;
+        victim->refd = false;
     }
+
+    victim->addr = SAVE_PAGE(saddr);
+    victim->swapd = true;
+    victim->pinned = false;
+    return frame;
 }
 
 /**
@@ -151,65 +157,44 @@ bool swap_is_page_swapped(sos_addrspace_t* as, client_vaddr addr) {
 /**
  * @brief   read a page from swap file to memory
  *          It needs to allocate a new frame or swap out another page 
+ *          Blocks the current request until the page is in memory
  *
- * @param readin
+ * @param readin client address of the page to read in
  *
- * @return 
+ * @return 0 on success, non-zero on failure
  */
 int swap_in_page(client_vaddr readin) {
     dprintf(3, "[PR] STARTING PAGE REPLACEMENT\n");
     sos_proc_t* proc = current_process();
     sos_addrspace_t *as = proc->vspace;
 
-    if (!proc->cont.have_new_frame) {
-        assert(as->repllist_head && as->repllist_tail);
-        seL4_Word tmp;
-        if(frame_alloc(&tmp) == 0) {
-            ERR("Failed to make frame for page to swap in");
-            process_delete(current_process());
-        }
-        proc->cont.have_new_frame = true;
-        proc->cont.original_page_addr = tmp;
-        dprintf(3, "[PR] Finished eviction, new frame = %08x\n", proc->cont.original_page_addr);
-        dprintf(3, "[PR] proc %p, victim: %p\n", proc, proc->cont.page_replacement_victim);
+    assert(as->repllist_head && as->repllist_tail);
+    seL4_Word frame;
+    if (frame_alloc(&frame) == 0) {
+        ERR("Failed to make frame for page to swap in");
+        return ENOMEM;
     }
+    dprintf(3, "[PR] Finished eviction, new frame = %08x\n", frame);
 
-    dprintf(3, "[PR] replacement request %x\n", proc->cont.page_replacement_request);
-    if (proc->cont.page_replacement_request == 0) {
-        proc->cont.page_replacement_request = readin;
-        pte_t *to_load = as_lookup_pte(as, proc->cont.page_replacement_request);
-        assert(to_load);
-        assert(to_load->swapd);
-
-        dprintf(3, "[PR] READING in targeted replacement page\n");
-        assert(proc->cont.original_page_addr);
-        memset((void*)proc->cont.original_page_addr, 0, PAGE_SIZE);
-        dprintf(4, "[PR] reading in new page %08x from address %u\n", readin, LOAD_PAGE(to_load->addr));
+    pte_t *to_load = as_lookup_pte(as, readin);
+    assert(to_load);
+    assert(to_load->swapd);
 
-        sos_swap_read(proc->cont.original_page_addr, LOAD_PAGE(to_load->addr));
-        longjmp(ipc_event_env, -1);
+    dprintf(3, "[PR] READING in targeted replacement page\n");
+    memset((void*)frame, 0, PAGE_SIZE);
+    dprintf(4, "[PR] reading in new page %08x from address %u\n", readin, LOAD_PAGE(to_load->addr));
+    if (sos_swap_read(frame, LOAD_PAGE(to_load->addr))) {
+        sos_unmap_frame(frame);
+        return EIO;
     }
-    if (proc->cont.swap_status == SWAP_SUCCESS) {
-        pte_t *to_load = as_lookup_pte(as, proc->cont.page_replacement_request);
-        assert(to_load);
-        assert(to_load->swapd);
 
-        dprintf(3, "[PR] REPLACEMENT COMPLETE\n");
-        to_load->addr = SAVE_PAGE(proc->cont.original_page_addr);
-        assert(to_load->pinned == false);
-        addrspace_pages++;
-        as->pages_mapped++;
-        to_load->swapd = false;
-        dprintf(3, "[PR] OPR: %x\n", proc->cont.original_page_addr);
-        seL4_CPtr fc = frame_cap(proc->cont.original_page_addr);
-        seL4_ARM_Page_Unify_Instruction(fc, 0, PAGE_SIZE);
-        proc->cont.swap_status = 0;
-        proc->cont.page_replacement_request = 0;
-        proc->cont.original_page_addr = 0;
-        proc->cont.page_replacement_victim = NULL;
-        proc->cont.have_new_frame = false;
-        return 0;
-    } else {
-        longjmp(ipc_event_env, -1);
-    }
+    dprintf(3, "[PR] REPLACEMENT COMPLETE\n");
+    to_load->addr = SAVE_PAGE(frame);
+    assert(to_load->pinned == false);
+    addrspace_pages++;
+    as->pages_mapped++;
+    to_load->swapd = false;
+    seL4_CPtr fc = frame_cap(frame);
+    seL4_ARM_Page_Unify_Instruction(fc, 0, PAGE_SIZE);
+    return 0;
 }
@@ -5,7 +5,7 @@
 #include "addrspace.h"
 
 int swap_in_page(client_vaddr target);
-int swap_evict_page(sos_proc_t *as);
+sos_vaddr swap_evict_page(sos_proc_t *evict_proc);
 bool swap_is_page_swapped(sos_addrspace_t* as, client_vaddr addr);
 
 #endif
@@ -4,7 +4,6 @@
  */
 
 #include <sel4/sel4.h>
-#include <setjmp.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <device/vmem_layout.h>
@@ -26,6 +25,8 @@
 #include "elf.h"
 #include "file.h"
 #include "sos_nfs.h"
+#include "coroutine.h"
+#include "scheduler.h"
 
 #define verbose 0
 #include <log/debug.h>
@@ -48,13 +49,15 @@ static pid_entry_t pid_table[MAX_PROCESS_NUM];
 
 /* current client sos is serving */
 static sos_proc_t *curproc = NULL;
-extern jmp_buf ipc_event_env;
 /* number of running processes */
 static size_t running_pidesses = 0;
 /* number of swapable pages in memory */
 extern size_t addrspace_pages;
 /* last process evicted to swap out page */
 static pid_entry_t *last_evicted_proc = NULL;
+/* ring workers alive, they may take at most a quarter of all pids */
+#define MAX_WORKERS             (MAX_PROCESS_NUM / 4)
+static int nworkers = 0;
 
 /**
  * @brief minimum memory pages a process should have to be evicted to swap out pages
@@ -123,7 +126,6 @@ static seL4_CPtr init_ep(sos_proc_t *proc, seL4_CPtr fault_ep) {
  * @brief allocate fd table and create STDOUT, STDERR, BRINARY_READ_FD
  */
 static int init_fd_table(sos_proc_t *proc) {
-    if (proc->fd_table) return 0;
     frame_alloc((seL4_Word*)&proc->fd_table);
     if (!proc->fd_table) {
         return ENOMEM;
@@ -150,6 +152,17 @@ static int get_next_pid() {
     return pe->pid;
 }
 
+/**
+ * @brief Put a pid back at the end of free pid queue
+ */
+static void put_free_pid(pid_entry_t *p) {
+    p->prev= free_pid_tail;
+    p->next= NULL;
+    free_pid_tail = p;
+    if (!free_pid_head) free_pid_head = p;
+    if (p->prev) p->prev->next= p;
+}
+
 /**
  * @brief Initialize free pid queue and running pid queue
  */
@@ -225,6 +238,8 @@ static int process_unregister_wait(sos_proc_t *proc) {
  */
 sos_proc_t *select_eviction_process(void) {
 
+    // a ring worker allocates on behalf of its client
+    sos_proc_t *client = current_process()->owner ? current_process()->owner : current_process();
     if (last_evicted_proc == NULL) last_evicted_proc = running_pid_head;
 
     pid_entry_t *proc= last_evicted_proc->next;
@@ -243,7 +258,7 @@ sos_proc_t *select_eviction_process(void) {
             last_evicted_proc = &pid_table[i];
             return proc_table[i];
         }
-        if (proc->pid == current_process()->pid) {
+        if (proc->pid == client->pid) {
             proc = proc->next;
             continue;
         }
@@ -260,9 +275,9 @@ sos_proc_t *select_eviction_process(void) {
         }
         proc = proc->next;
     }
-    last_evicted_proc = &pid_table[current_process()->pid];
+    last_evicted_proc = &pid_table[client->pid];
     assert(proc_table[last_evicted_proc->pid]);
-    return current_process();
+    return client;
 }
 
 
@@ -271,68 +286,53 @@ sos_proc_t *select_eviction_process(void) {
  */
 sos_proc_t* process_create(char *name, seL4_CPtr fault_ep) {
     dprintf(3, "process_create\n");
-    sos_proc_t* proc;
-    if (!current_process()) { // we're creating the first process
+    bool first = (current_process() == NULL);
+    if (first) { // we're creating the first process
         proc_table_init();
-        proc = malloc(sizeof(sos_proc_t));
-        if (!proc) {
-            return NULL;
-        }
-        memset((void*)proc, 0, sizeof(sos_proc_t));
-        proc->pid = get_next_pid();
-        
-        proc->start_time = time_stamp();
-        proc_table[proc->pid] = proc;
+    }
+    sos_proc_t* proc = malloc(sizeof(sos_proc_t));
+    if (!proc) {
+        return NULL;
+    }
+    memset((void*)proc, 0, sizeof(sos_proc_t));
+    proc->pid = get_next_pid();
+    if(proc->pid < 1) {
+        free(proc);
+        return NULL;
+    }
+    proc->start_time = time_stamp();
+    proc_table[proc->pid] = proc;
+    if (first) {
         proc->cont.spawning_process = (void*)-1;
         set_current_process(proc->pid);
-    } else if (!current_process()->cont.spawning_process) {
-        proc = malloc(sizeof(sos_proc_t));
-        if (!proc) {
-            return NULL;
-        }
-        memset((void*)proc, 0, sizeof(sos_proc_t));
-        proc->pid = get_next_pid();
-        if(proc->pid < 1) {
-            free(proc);
-            return NULL;
-        }
-        proc->start_time = time_stamp();
-        proc_table[proc->pid] = proc;
-        current_process()->cont.spawning_process = proc;
     } else {
-        proc = effective_process();
+        current_process()->cont.spawning_process = proc;
     }
-    if (!proc->vspace || !proc->vspace->sos_ipc_buf_addr) {
-        assert(proc->pid >= 1);
-        if (as_create(&proc->vspace)) {
-            process_delete(proc);
-            return NULL;
-        }
-        if ((proc->cspace = cspace_create(1)) == 0){
-            process_delete(proc);
-            return NULL;
-        }
-        proc->user_ep_cap = init_ep(proc, fault_ep);
-        dprintf(3, "Initializing TCB\n");
-        if (init_tcb(proc)) {
-            process_delete(proc);
-            return NULL;
-        }
-        dprintf(3, "Finished initializing TCB\n");
+
+    if (as_create(&proc->vspace)) {
+        process_delete(proc);
+        return NULL;
     }
-    if (!proc->fd_table) {
-        int err = init_fd_table(proc);
-        if (err) {
-            process_delete(proc);
-            return NULL;
-        }
-        proc->status.pid = proc->pid;
-        proc->status.size = proc->frames_available * PAGE_SIZE;
-        proc->status.stime = time_stamp() / 1000;
-        strncpy(proc->status.command, name, N_NAME); 
-        proc_table[proc->pid] = proc;
-        dprintf(3, "Process create finished\n");
+    if ((proc->cspace = cspace_create(1)) == 0){
+        process_delete(proc);
+        return NULL;
     }
+    proc->user_ep_cap = init_ep(proc, fault_ep);
+    dprintf(3, "Initializing TCB\n");
+    if (init_tcb(proc)) {
+        process_delete(proc);
+        return NULL;
+    }
+    dprintf(3, "Finished initializing TCB\n");
+    if (init_fd_table(proc)) {
+        process_delete(proc);
+        return NULL;
+    }
+    proc->status.pid = proc->pid;
+    proc->status.size = proc->frames_available * PAGE_SIZE;
+    proc->status.stime = time_stamp() / 1000;
+    strncpy(proc->status.command, name, N_NAME); 
+    dprintf(3, "Process create finished\n");
     return proc;
 }
 
@@ -343,17 +343,16 @@ sos_proc_t* process_create(char *name, seL4_CPtr fault_ep) {
 void process_delete(sos_proc_t* proc) {
     dprintf(3, "process delete\n");
     assert(proc);
+    if (proc->owner) { // killing a ring worker kills the client it runs for
+        proc = proc->owner;
+    }
     // Remove it from running pid queue and add it to free pd queue
     {
         pid_entry_t* p = &pid_table[proc->pid];
         pid_entry_t* prev = p->prev, *next = p->next;
         assert(prev != p && next != p);
 
-        p->prev= free_pid_tail;
-        p->next= NULL;
-        free_pid_tail = p;
-        if (!free_pid_head) free_pid_head = p;
-        if (p->prev) p->prev->next= p;
+        put_free_pid(p);
 
         if(p->running) {
             p->running = false;
@@ -396,6 +395,7 @@ void process_delete(sos_proc_t* proc) {
     dprintf(4, "[AS] fd_table\n");
     free_fd_table(proc->fd_table);
     iov_free(proc->cont.iov);
+    ring_free(proc);
     dprintf(4, "[AS] wake up waiters \n");
     process_wake_waiters(proc);
     process_free_waiter_queue(proc);
@@ -403,6 +403,8 @@ void process_delete(sos_proc_t* proc) {
         dprintf(4, "[AS] destroying cspace\n");
         cspace_destroy(proc->cspace);
     }
+    coroutine_cancel(proc->pid);
+    remove_ready_proc(proc->pid);
     proc_table[proc->pid] = NULL;
 
     if(proc->frames_available != 0) {
@@ -413,6 +415,52 @@ void process_delete(sos_proc_t* proc) {
     dprintf(4, "process_delete finished\n");
 }
 
+/**
+ * @brief   Create the request context one ring submission runs in.
+ *          It gets a pid of its own, so it blocks, is resumed and gets its
+ *          callbacks independently of its client and of other submissions,
+ *          but it works on the client's address space and fd table.
+ */
+sos_proc_t *process_create_worker(sos_proc_t *owner) {
+    assert(owner && !owner->owner);
+    if (nworkers >= MAX_WORKERS) {
+        return NULL;
+    }
+    sos_proc_t *proc = malloc(sizeof(sos_proc_t));
+    if (!proc) {
+        return NULL;
+    }
+    memset((void*)proc, 0, sizeof(sos_proc_t));
+    proc->pid = get_next_pid();
+    if (proc->pid < 1) {
+        free(proc);
+        return NULL;
+    }
+    proc->owner = owner;
+    proc->vspace = owner->vspace;
+    proc->fd_table = owner->fd_table;
+    proc->start_time = time_stamp();
+    proc_table[proc->pid] = proc;
+    nworkers++;
+    return proc;
+}
+
+/**
+ * @brief   Free a ring worker, leaving what it shares with its client alone
+ */
+void process_delete_worker(sos_proc_t *proc) {
+    assert(proc && proc->owner);
+    put_free_pid(&pid_table[proc->pid]);
+    iov_free(proc->cont.iov);
+    process_wake_waiters(proc);
+    process_free_waiter_queue(proc);
+    coroutine_cancel(proc->pid);
+    remove_ready_proc(proc->pid);
+    proc_table[proc->pid] = NULL;
+    nworkers--;
+    free(proc);
+}
+
 sos_addrspace_t *current_as(void) {
     return proc_as(curproc);
 }
@@ -430,6 +478,9 @@ sos_proc_t *effective_process(void) {
     if (!curproc) {
         return NULL;
     }
+    if (curproc->owner) {
+        return curproc->owner;
+    }
     if (curproc->cont.spawning_process != 0 &&
         (unsigned)curproc->cont.spawning_process != (unsigned)-1) {
         return curproc->cont.spawning_process;
@@ -476,8 +527,13 @@ int process_wake_waiters(sos_proc_t *proc) {
     return 0;
 }
 
+/**
+ * @brief   Create a process and load its binary from NFS.
+ *          Blocks the current request while the binary is opened and read.
+ *
+ * @return pid of the new process, -1 on failure
+ */
 pid_t start_process(char* app_name, seL4_CPtr fault_ep) {
-    static sos_proc_t* proc = NULL;
     dprintf(3, "start_process\n");
     int err;
 
@@ -485,47 +541,53 @@ pid_t start_process(char* app_name, seL4_CPtr fault_ep) {
     seL4_UserContext context;
 
     /* These required for loading program sections */
-    proc = process_create(app_name, fault_ep);
+    sos_proc_t* proc = process_create(app_name, fault_ep);
+    if (!proc) return -1;
     sos_proc_t* cur_proc = current_process();
 
-    if (!proc) return -1;
+    /* open the binary */
+    cur_proc->cont.fd = BINARY_READ_FD;
+    cur_proc->cont.file_mode = FM_READ;
+    strncpy(cur_proc->cont.path, app_name, MAX_FILE_PATH_LENGTH);
+    cur_proc->cont.binary_nfs_open = true;
+    cur_proc->cont.binary_nfs_failed = false;
+    assert(proc->fd_table);
+    assert(proc->fd_table[BINARY_READ_FD]);
+    assert(proc->fd_table[BINARY_READ_FD]->io);
+    err = (proc->fd_table[BINARY_READ_FD])->io->open(cur_proc->cont.path, cur_proc->cont.file_mode);
+    if (!err) {
+        coroutine_wait();
+        err = cur_proc->cont.binary_nfs_failed;
+    }
+    cur_proc->cont.binary_nfs_open = false;
+    if (err) {
+        process_delete(proc);
+        return -1;
+    }
 
-    if (!cur_proc->cont.binary_nfs_open) {
-        cur_proc->cont.fd = BINARY_READ_FD;
-        cur_proc->cont.file_mode = FM_READ;
-        strncpy(cur_proc->cont.path, app_name, MAX_FILE_PATH_LENGTH);
-        cur_proc->cont.binary_nfs_open = true;
-        assert(proc->fd_table);
-        assert(proc->fd_table[cur_proc->cont.fd]);
-        assert(proc->fd_table[cur_proc->cont.fd]->io);
-        assert(effective_process());
-        (proc->fd_table[cur_proc->cont.fd])->io->open(cur_proc->cont.path, cur_proc->cont.file_mode);
-        longjmp(ipc_event_env, -1);
-    }
-
-    if (!cur_proc->cont.binary_nfs_read) {
-        frame_alloc(&cur_proc->cont.elf_load_addr);
-        assert(cur_proc->cont.elf_load_addr);
-        cur_proc->cont.iov = iov_create(cur_proc->cont.elf_load_addr, PAGE_SIZE, NULL, NULL, true);
-        cur_proc->cont.binary_nfs_read = true;
-        (proc->fd_table[cur_proc->cont.fd])->io->read(cur_proc->cont.iov, cur_proc->cont.fd, PAGE_SIZE);
-        longjmp(ipc_event_env, -1);
-        dprintf(1, "\nStarting \"%s\"...\n", app_name);
+    /* read the elf header */
+    seL4_Word elf_load_addr;
+    if (frame_alloc(&elf_load_addr) == 0) {
+        process_delete(proc);
+        return -1;
     }
+    iovec_t *iov = iov_create(elf_load_addr, PAGE_SIZE, NULL, NULL, true);
+    if (!iov || elf_read(proc, iov, 0, PAGE_SIZE)) {
+        sos_unmap_frame(elf_load_addr);
+        process_delete(proc);
+        return -1;
+    }
+    dprintf(1, "\nStarting \"%s\"...\n", app_name);
 
     sos_addrspace_t *as = proc_as(proc);
     assert(as);
 
-    if (!cur_proc->cont.as_activated) {
-        /* load the elf image */
-        err = elf_load(proc, (char*)cur_proc->cont.elf_load_addr);
-        if (err) {
-            assert(effective_process() != current_process());
-            sos_unmap_frame(cur_proc->cont.elf_load_addr);
-            process_delete(effective_process());
-            return -1;
-        }
-        cur_proc->cont.as_activated = true;
+    /* load the elf image */
+    err = elf_load(proc, (char*)elf_load_addr);
+    if (err) {
+        sos_unmap_frame(elf_load_addr);
+        process_delete(proc);
+        return -1;
     }
     as_activate(as);
 
@@ -540,11 +602,11 @@ pid_t start_process(char* app_name, seL4_CPtr fault_ep) {
     }
     /* Start the new process */
     memset(&context, 0, sizeof(context));
-    context.pc = elf_getEntryPoint((void*)cur_proc->cont.elf_load_addr);
+    context.pc = elf_getEntryPoint((void*)elf_load_addr);
     context.sp = PROCESS_STACK_TOP;
     assert(proc && proc->tcb_cap);
     seL4_TCB_WriteRegisters(proc->tcb_cap, 1, 0, 2, &context);
-    sos_unmap_frame(cur_proc->cont.elf_load_addr);
+    sos_unmap_frame(elf_load_addr);
 
     return proc->pid;
 }
@@ -577,7 +639,7 @@ int register_to_proc(sos_proc_t* proc, pid_t pid) {
 int register_to_all_proc(pid_t pid) {
     int err = 0;
     for (int i = 1; i < MAX_PROCESS_NUM; i++) {
-        if(proc_table[i] != NULL && pid != i) {
+        if(proc_table[i] != NULL && !proc_table[i]->owner && pid != i) {
             register_to_proc(proc_table[i], pid);
         }
     }
@@ -595,7 +657,7 @@ int get_all_proc_stat(char *buf, size_t maxn) {
     int cnt = 0;
     for (int i = 1;i < MAX_PROCESS_NUM && cnt < maxn; i++) {
         sos_proc_t * proc = proc_table[i];
-        if (proc) {
+        if (proc && !proc->owner) {
             memcpy(buf+offset, (char*)&proc->status, sizeof(sos_process_t));
             offset += sizeof(sos_process_t);
             cnt++;
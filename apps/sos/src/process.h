@@ -10,6 +10,7 @@
 #include <sel4/sel4.h>
 #include "addrspace.h"
 #include "file.h"
+#include "ring.h"
 #include <syscallno.h>
 #include <sos.h>
 
@@ -18,6 +19,8 @@
 #define MAX_PROCESS_NUM         (1024)
 
 // TODO: This should now be backed by a dedicated sel4 frame as is big
+// Request state shared with callbacks. Blocking work keeps its own progress
+// on the request's coroutine stack (see coroutine.h)
 typedef struct continuation {
     seL4_CPtr reply_cap;
     int fd;
@@ -29,27 +32,24 @@ typedef struct continuation {
     seL4_Word syscall_number;
     seL4_Word vm_fault_type;
     seL4_Word client_addr;
-    seL4_Word elf_load_addr;
-    seL4_Word page_replacement_request;
-    seL4_Word original_page_addr;
-    bool create_page_done;
-    bool as_activated;
-    uint32_t cookie;
     bool binary_nfs_open;
     bool binary_nfs_read;
-    pte_t* page_replacement_victim;
+    bool binary_nfs_failed;
     size_t reply_length;
     size_t length_arg;
     int position_arg;
+    bool explicit_offset;   // pread/pwrite: use offset_arg, not the file position
+    size_t offset_arg;
+    long seek_offset;
+    int seek_whence;
+    bool poll_waiting;      // suspended in poll until an fd is ready
+    bool poll_timed_out;
+    uint32_t poll_timer;
     fmode_t file_mode;
-    int parent_pid;
     sos_vaddr swap_page;
     size_t swap_file_offset;
     size_t swap_cnt;
-    // Number of times a continuation has been started
-    int syscall_loop_initiations;
-    bool handler_initiated;
-    bool swap_status;
+    int swap_status;
     char path[MAX_FILE_PATH_LENGTH];
     pid_t pid;
     char* proc_stat_buf;
@@ -57,11 +57,7 @@ typedef struct continuation {
     int elf_header;
     unsigned elf_segment_pos;
     void* spawning_process;
-    void* page_eviction_process;
-    seL4_Word alloc_page_frame;
     timestamp_t callback_start_time;
-    bool swap_write_fired;
-    bool have_new_frame;
     int brk;
     uint64_t delay;
 } cont_t;
@@ -81,6 +77,11 @@ typedef struct process {
     seL4_CPtr user_ep_cap;
     fd_table_t fd_table;
     cont_t cont;
+    ring_t *ring; // registered submission/completion ring, if any
+    struct process *owner; // ring worker: client whose submission it runs
+    // data of an inline read or write, outside cont so it isn't cleared
+    // on every reply
+    seL4_Word inline_buf[INLINE_IO_MAX / sizeof(seL4_Word)];
 
     pid_t waiting_pid; // pid of process I'm waiting. -1: any, 0: none
     pid_entry_t* waiter_queue; // processes waiting for me
@@ -95,6 +96,8 @@ typedef struct process {
 
 sos_proc_t* process_create(char* name, seL4_CPtr fault_ep);
 void process_delete(sos_proc_t* proc);
+sos_proc_t *process_create_worker(sos_proc_t *owner);
+void process_delete_worker(sos_proc_t *proc);
 sos_addrspace_t *proc_as(sos_proc_t *proc);
 sos_addrspace_t *current_as(void);
 sos_proc_t *current_process(void);
@@ -0,0 +1,415 @@
+/**
+ * @file ring.c
+ * @brief Batched client I/O through shared submission/completion rings
+ *
+ * A client registers one page holding a sos_ring_t, fills in submission
+ * entries and rings the doorbell (SOS_SYSCALL_RING_ENTER) once for the
+ * whole batch. Every entry is handed to a worker of its own (see
+ * process_create_worker()), so entries block and complete independently
+ * and the doorbell can be answered before any of them is done. Workers
+ * run the normal syscall handlers; their reply is diverted into a
+ * completion entry, posted as soon as it is in.
+ *
+ * Entries on the same fd share its open file and offset, so they run one
+ * after the other in submission order; a close can't pull the file from
+ * under a read or write still in flight. At most RING_WORKERS entries of
+ * a ring run at once, the others wait for a worker to finish.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <syscallno.h>
+
+#include "ring.h"
+#include "process.h"
+#include "syscall.h"
+#include "handler.h"
+#include "coroutine.h"
+#include "scheduler.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+_Static_assert(sizeof(sos_ring_t) <= PAGE_SIZE, "sos_ring_t must fit in a page");
+_Static_assert((SOS_RING_ENTRIES & (SOS_RING_ENTRIES - 1)) == 0,
+               "SOS_RING_ENTRIES must be a power of two");
+
+#define RING_IDX(i)     ((i) & (SOS_RING_ENTRIES - 1))
+
+/* Entries of one ring running at once, each takes a pid */
+#define RING_WORKERS    (8)
+
+/**
+ * @brief Bring the ring page in and return where sos can access it.
+ *        The address is only good until the request blocks again
+ */
+static sos_ring_t *ring_map(sos_proc_t *proc) {
+    iovec_t page = {.vstart = proc->ring->vaddr, .sz = sizeof(sos_ring_t)};
+    iov_ensure_loaded(page);
+    return (sos_ring_t*)as_lookup_sos_vaddr(proc->vspace, proc->ring->vaddr);
+}
+
+/**
+ * @brief Copy between sos and client memory, client pages are faulted in
+ *        as needed
+ *
+ * @param dir WRITE to copy into the client, READ to copy out of it
+ */
+static int ring_copy(sos_proc_t *proc, client_vaddr addr, void *buf, size_t n,
+                     iop_direction_t dir) {
+    iovec_t *iov = cbuf_to_iov(addr, n, dir);
+    if (iov == NULL) {
+        return EFAULT;
+    }
+    char *pos = buf;
+    for (iovec_t *v = iov; v; v = v->next) {
+        iov_ensure_loaded(*v);
+        sos_vaddr p = as_lookup_sos_vaddr(proc->vspace, v->vstart);
+        if (p == 0) {
+            iov_free(iov);
+            return EFAULT;
+        }
+        if (dir == WRITE) {
+            memcpy((char*)p, pos, v->sz);
+        } else {
+            memcpy(pos, (char*)p, v->sz);
+        }
+        pos += v->sz;
+    }
+    iov_free(iov);
+    return 0;
+}
+
+/**
+ * @brief Load the arguments of a submission into cont, as the setup
+ *        handler of the matching syscall does from message registers
+ */
+static int ring_entry_setup(sos_proc_t *proc, sos_sqe_t *sqe) {
+    cont_t *cont = &proc->cont;
+    cont->syscall_number = sqe->opcode;
+    switch (sqe->opcode) {
+    case SOS_SYSCALL_OPEN:
+    case SOS_SYSCALL_STAT:
+        if (sqe->len == 0 || sqe->len >= MAX_FILE_PATH_LENGTH) {
+            return EINVAL;
+        }
+        memset(cont->path, 0, MAX_FILE_PATH_LENGTH);
+        if (ring_copy(proc, sqe->addr, cont->path, sqe->len, READ)) {
+            return EFAULT;
+        }
+        if (sqe->opcode == SOS_SYSCALL_STAT) {
+            cont->client_addr = sqe->addr2;
+            return 0;
+        }
+        cont->file_mode = (fmode_t)sqe->flags;
+        cont->fd = fd_create(proc->fd_table, NULL, device_handler_str(cont->path),
+                             cont->file_mode);
+        return cont->fd < 0 ? ENOMEM : 0;
+    case SOS_SYSCALL_PREAD:
+    case SOS_SYSCALL_PWRITE:
+        cont->explicit_offset = true;
+        cont->offset_arg = sqe->off;
+        /* fall through */
+    case SOS_SYSCALL_READ:
+    case SOS_SYSCALL_WRITE:
+        if (sqe->addr == 0) {
+            return EINVAL;
+        }
+        cont->fd = sqe->fd;
+        cont->client_addr = sqe->addr;
+        cont->length_arg = sqe->len;
+        cont->iov = cbuf_to_iov(sqe->addr, sqe->len,
+                                (sqe->opcode == SOS_SYSCALL_READ ||
+                                 sqe->opcode == SOS_SYSCALL_PREAD) ? WRITE : READ);
+        return cont->iov ? 0 : EFAULT;
+    case SOS_SYSCALL_CLOSE:
+        cont->fd = sqe->fd;
+        return 0;
+    default:
+        return ENOSYS;
+    }
+}
+
+/**
+ * @brief Slot of the submission a worker runs
+ */
+static ring_entry_t *ring_entry_of(sos_proc_t *worker) {
+    ring_t *ring = worker->owner->ring;
+    for (int i = 0; i < SOS_RING_ENTRIES; i++) {
+        if (ring->entries[i].used && ring->entries[i].worker == worker) {
+            return &ring->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Whether a submission works on an open fd
+ */
+static bool ring_uses_fd(sos_sqe_t *sqe) {
+    switch (sqe->opcode) {
+    case SOS_SYSCALL_READ:
+    case SOS_SYSCALL_WRITE:
+    case SOS_SYSCALL_PREAD:
+    case SOS_SYSCALL_PWRITE:
+    case SOS_SYSCALL_CLOSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void ring_startq_add(ring_t *ring, ring_entry_t *e) {
+    e->next = NULL;
+    if (ring->startq_tail) {
+        ring->startq_tail->next = e;
+    } else {
+        ring->startq = e;
+    }
+    ring->startq_tail = e;
+}
+
+static ring_entry_t *ring_startq_take(ring_t *ring) {
+    ring_entry_t *e = ring->startq;
+    if (e) {
+        ring->startq = e->next;
+        if (ring->startq == NULL) {
+            ring->startq_tail = NULL;
+        }
+    }
+    return e;
+}
+
+/**
+ * @brief Publish the completion of an entry, let the next entry on its fd
+ *        start and free the slot. Wakes the doorbell if it waits for it
+ */
+static void ring_entry_post(sos_proc_t *owner, ring_entry_t *e) {
+    ring_t *ring = owner->ring;
+    if (e->sqe.opcode == SOS_SYSCALL_STAT && e->res == 0 &&
+        ring_copy(owner, e->sqe.addr2, &e->stat, sizeof(sos_stat_t), WRITE)) {
+        e->res = -1;
+    }
+    sos_ring_t *shared = ring_map(owner);
+    if (shared) {
+        sos_cqe_t *cqe = &shared->cqes[RING_IDX(ring->cq_tail)];
+        cqe->user_data = e->sqe.user_data;
+        cqe->res = e->res;
+        shared->cq_tail = ++ring->cq_tail;
+    }
+    dprintf(3, "[RING] %d posted opcode %u: %d\n", owner->pid, e->sqe.opcode, e->res);
+    if (e->after) {
+        ring_startq_add(ring, e->after);
+    }
+    e->used = false;
+    e->worker = NULL;
+    ring->inflight--;
+    if (ring->waiting && (ring->inflight == 0 || shared == NULL ||
+                          ring->cq_tail - shared->cq_head >= ring->wait_nr)) {
+        add_ready_proc(owner->pid, READY_SYSCALL);
+    }
+}
+
+/**
+ * @brief Give waiting entries workers while the ring has some to spare.
+ *        An entry no worker can be found for fails if nothing else runs,
+ *        or it would never start.
+ */
+static void ring_start(sos_proc_t *owner) {
+    ring_t *ring = owner->ring;
+    while (ring->nworkers < RING_WORKERS && ring->startq) {
+        sos_proc_t *worker = process_create_worker(owner);
+        if (worker == NULL && ring->nworkers) {
+            return; // retried as soon as a running entry is done
+        }
+        ring_entry_t *e = ring_startq_take(ring);
+        if (worker == NULL) {
+            e->done = true;
+            e->res = -1;
+            ring_entry_post(owner, e);
+            continue;
+        }
+        e->worker = worker;
+        ring->nworkers++;
+        worker->cont.syscall_number = SOS_SYSCALL_RING_ENTER;
+        add_ready_proc(worker->pid, READY_SYSCALL);
+    }
+}
+
+/**
+ * @brief Body of a worker: run its submission to completion, post it and
+ *        hand the worker's place to a waiting entry. The worker is
+ *        suspended while the device works, other entries and the client
+ *        carry on meanwhile. It is gone when this returns
+ */
+static void ring_entry_run(sos_proc_t *worker) {
+    sos_proc_t *owner = worker->owner;
+    ring_entry_t *e = ring_entry_of(worker);
+    assert(e);
+    dprintf(3, "[RING] %d running opcode %u as %d\n", owner->pid,
+            e->sqe.opcode, worker->pid);
+    if (ring_entry_setup(worker, &e->sqe)) {
+        syscall_end_continuation(worker, 0, false);
+    } else {
+        resume_syscall(e->sqe.opcode);
+    }
+    while (!e->done) {
+        /* woken for the next chunk of the operation, or its completion */
+        e->waiting = true;
+        coroutine_wait();
+        e->waiting = false;
+        if (!e->done) {
+            resume_syscall(e->sqe.opcode);
+        }
+    }
+    ring_entry_post(owner, e);
+    owner->ring->nworkers--;
+    ring_start(owner);
+    process_delete_worker(worker);
+}
+
+/**
+ * @brief Whether replies to proc belong to a ring submission
+ */
+bool ring_entry_active(sos_proc_t *proc) {
+    return proc->owner != NULL;
+}
+
+/**
+ * @brief Take the reply of a ring submission in place of
+ *        syscall_end_continuation(). The worker posts it once it runs again
+ */
+void ring_complete(sos_proc_t *proc, int retval, bool success) {
+    ring_entry_t *e = ring_entry_of(proc);
+    assert(e && !e->done);
+    e->res = success ? retval : -1;
+    if (success && proc->cont.syscall_number == SOS_SYSCALL_STAT) {
+        ipc_get_bin(1, &e->stat, sizeof(sos_stat_t));
+    }
+    e->done = true;
+    iov_free(proc->cont.iov);
+    memset(&proc->cont, 0, sizeof(cont_t));
+    if (e->waiting) { // completed from a callback
+        add_ready_proc(proc->pid, READY_SYSCALL);
+    }
+}
+
+int sos__sys_ring_register(void) {
+    sos_proc_t *proc = current_process();
+    client_vaddr addr = proc->cont.client_addr;
+    if (proc->ring) {
+        return EBUSY;
+    }
+    if (addr == 0 || addr % PAGE_SIZE) {
+        return EINVAL;
+    }
+    iovec_t *iov = cbuf_to_iov(addr, sizeof(sos_ring_t), WRITE);
+    if (iov == NULL) {
+        return EFAULT;
+    }
+    iov_free(iov);
+    proc->ring = malloc(sizeof(ring_t));
+    if (proc->ring == NULL) {
+        return ENOMEM;
+    }
+    memset(proc->ring, 0, sizeof(ring_t));
+    proc->ring->vaddr = addr;
+    sos_ring_t *shared = ring_map(proc);
+    if (shared == NULL) {
+        ring_free(proc);
+        return EFAULT;
+    }
+    proc->ring->sq_head = shared->sq_head;
+    proc->ring->cq_tail = shared->cq_tail;
+    dprintf(3, "[RING] %d registered ring at %08x\n", proc->pid, addr);
+    syscall_end_continuation(proc, 0, true);
+    return 0;
+}
+
+/**
+ * @brief Doorbell: hand pending submissions to workers while the
+ *        completion queue has room for them, then reply with the number
+ *        consumed. With a wait count the reply is held back until that
+ *        many completions are waiting in the completion queue, or nothing
+ *        is left in flight. The first run of a worker comes here too.
+ */
+int sos__sys_ring_enter(void) {
+    sos_proc_t *proc = current_process();
+    if (proc->owner) {
+        ring_entry_run(proc);
+        return 0;
+    }
+    ring_t *ring = proc->ring;
+    if (ring == NULL) {
+        return EINVAL;
+    }
+    unsigned wait_nr = proc->cont.length_arg;
+    sos_ring_t *shared = ring_map(proc);
+    if (shared == NULL) {
+        return EFAULT;
+    }
+    int consumed = 0;
+    while (1) {
+        uint32_t sq_tail = shared->sq_tail;
+        if (ring->sq_head == sq_tail ||
+            sq_tail - ring->sq_head > SOS_RING_ENTRIES ||
+            ring->inflight + (ring->cq_tail - shared->cq_head) >= SOS_RING_ENTRIES) {
+            break;
+        }
+        ring_entry_t *e = ring->entries;
+        while (e->used) { // a free slot is left, see the check above
+            e++;
+        }
+        memset(e, 0, sizeof(ring_entry_t));
+        e->used = true;
+        e->sqe = shared->sqes[RING_IDX(ring->sq_head)];
+        shared->sq_head = ++ring->sq_head;
+        ring->inflight++;
+        consumed++;
+        ring_entry_t *prev = NULL;
+        if (ring_uses_fd(&e->sqe)) { // last entry taken on the same fd
+            for (int i = 0; i < SOS_RING_ENTRIES && !prev; i++) {
+                ring_entry_t *o = &ring->entries[i];
+                if (o != e && o->used && o->after == NULL &&
+                    ring_uses_fd(&o->sqe) && o->sqe.fd == e->sqe.fd) {
+                    prev = o;
+                }
+            }
+        }
+        if (prev) {
+            prev->after = e;
+        } else {
+            ring_startq_add(ring, e);
+        }
+    }
+    ring_start(proc);
+    ring->wait_nr = wait_nr;
+    while (wait_nr && ring->inflight &&
+           ring->cq_tail - shared->cq_head < wait_nr) {
+        ring->waiting = true;
+        coroutine_wait();
+        ring->waiting = false;
+        shared = ring_map(proc);
+        if (shared == NULL) {
+            return EFAULT;
+        }
+    }
+    syscall_end_continuation(proc, consumed, true);
+    return 0;
+}
+
+void ring_free(sos_proc_t *proc) {
+    if (proc->ring) {
+        for (int i = 0; i < SOS_RING_ENTRIES; i++) {
+            if (proc->ring->entries[i].used && proc->ring->entries[i].worker) {
+                process_delete_worker(proc->ring->entries[i].worker);
+            }
+        }
+    }
+    free(proc->ring);
+    proc->ring = NULL;
+}
@@ -0,0 +1,49 @@
+/** ring.h --- Submission/completion rings shared with clients **/
+
+#ifndef _SOS_RING_STATE_H_
+#define _SOS_RING_STATE_H_
+
+#include <stdbool.h>
+#include <sos.h>
+#include <sos_ring.h>
+#include "sos_type.h"
+
+struct process;
+
+// A submission taken from the ring, until its completion is posted
+typedef struct ring_entry {
+    bool used;              // slot holds a submission
+    struct process *worker; // NULL until the entry is started
+    sos_sqe_t sqe;
+    struct ring_entry *next;    // next entry waiting to be started
+    struct ring_entry *after;   // entry on the same fd started after this one
+    bool waiting;           // worker is suspended until the entry completes
+    bool done;
+    int res;
+    sos_stat_t stat;        // result of a stat submission
+} ring_entry_t;
+
+// sos side state of a registered ring. Indices are kept here and only
+// published to the shared page, so a client can't make sos skip or replay
+// entries by scribbling over them.
+typedef struct ring {
+    client_vaddr vaddr;     // page the client registered
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    unsigned inflight;      // submissions taken but not posted yet
+    unsigned nworkers;      // entries running
+    ring_entry_t *startq;   // entries ready to start, in submission order
+    ring_entry_t *startq_tail;
+    unsigned wait_nr;       // completions the suspended doorbell waits for
+    bool waiting;           // ring_enter is suspended until wait_nr are posted
+    ring_entry_t entries[SOS_RING_ENTRIES];
+} ring_t;
+
+int sos__sys_ring_register(void);
+int sos__sys_ring_enter(void);
+
+bool ring_entry_active(struct process *proc);
+void ring_complete(struct process *proc, int retval, bool success);
+void ring_free(struct process *proc);
+
+#endif
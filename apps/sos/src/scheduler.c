@@ -0,0 +1,126 @@
+/**
+ * @file scheduler.c
+ * @brief Ready queue of processes whose continuations can be resumed
+ *
+ * One FIFO per priority class, linked through a pid indexed table, so
+ * enqueue, dequeue and removal are O(1) and a pid is queued at most once.
+ * Classes are served by weighted round robin: a higher class runs first,
+ * but every non-empty class gets its share of each round.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include "scheduler.h"
+#include "process.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+typedef struct ready_entry {
+    pid_t next, prev;       // 0 terminates the list
+    ready_class_t cls;
+    bool queued;
+} ready_entry_t;
+
+/* continuations run per class in one round */
+static const int class_weight[READY_CLASSES] = {
+    [READY_PAGING] = 4,
+    [READY_SYSCALL] = 2,
+    [READY_BACKGROUND] = 1,
+};
+
+static ready_entry_t ready_table[MAX_PROCESS_NUM];
+static pid_t class_head[READY_CLASSES], class_tail[READY_CLASSES];
+/* continuations each class may still run in the current round */
+static int class_credit[READY_CLASSES];
+static int nready = 0;
+
+static void ready_append(pid_t pid, ready_class_t cls) {
+    ready_entry_t *e = &ready_table[pid];
+    e->cls = cls;
+    e->queued = true;
+    e->next = 0;
+    e->prev = class_tail[cls];
+    if (class_tail[cls]) {
+        ready_table[class_tail[cls]].next = pid;
+    } else {
+        class_head[cls] = pid;
+    }
+    class_tail[cls] = pid;
+    nready++;
+}
+
+static void ready_unlink(pid_t pid) {
+    ready_entry_t *e = &ready_table[pid];
+    assert(e->queued);
+    if (e->prev) {
+        ready_table[e->prev].next = e->next;
+    } else {
+        class_head[e->cls] = e->next;
+    }
+    if (e->next) {
+        ready_table[e->next].prev = e->prev;
+    } else {
+        class_tail[e->cls] = e->prev;
+    }
+    e->queued = false;
+    nready--;
+}
+
+/**
+ * @brief Add a client to ready client queue (resume a process)
+ *        A pid already queued keeps its place, or moves up if cls is higher.
+ *
+ * @param pid process whose continuation is ready
+ * @param cls priority class of the work being resumed
+ */
+void add_ready_proc(pid_t pid, ready_class_t cls) {
+    assert(pid > 0 && pid < MAX_PROCESS_NUM);
+    assert(cls < READY_CLASSES);
+    ready_entry_t *e = &ready_table[pid];
+    if (e->queued) {
+        if (e->cls <= cls) {
+            return;
+        }
+        ready_unlink(pid);
+    }
+    dprintf(4, "[SCHED] %d ready in class %d\n", pid, cls);
+    ready_append(pid, cls);
+}
+
+/**
+ * @brief Drop a process from the ready queue, e.g. when it is deleted
+ */
+void remove_ready_proc(pid_t pid) {
+    assert(pid > 0 && pid < MAX_PROCESS_NUM);
+    if (ready_table[pid].queued) {
+        ready_unlink(pid);
+    }
+}
+
+/**
+ * @brief Retrive next ready client process
+ */
+pid_t next_ready_proc(void) {
+    assert(nready > 0);
+    while (1) {
+        for (int cls = 0; cls < READY_CLASSES; cls++) {
+            if (class_head[cls] && class_credit[cls] > 0) {
+                pid_t pid = class_head[cls];
+                class_credit[cls]--;
+                ready_unlink(pid);
+                return pid;
+            }
+        }
+        /* every non-empty class used up its share, start a new round */
+        for (int cls = 0; cls < READY_CLASSES; cls++) {
+            class_credit[cls] = class_weight[cls];
+        }
+    }
+}
+
+bool has_ready_proc(void) {
+    return nready > 0;
+}
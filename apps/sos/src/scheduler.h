@@ -0,0 +1,25 @@
+/** scheduler.h --- Ready queue of continuations waiting to be resumed **/
+
+#ifndef _SOS_SCHEDULER_H_
+#define _SOS_SCHEDULER_H_
+
+#include <stdbool.h>
+#include <sos.h>
+
+/* Priority classes of resumable work, highest priority first */
+typedef enum ready_class {
+    READY_PAGING,       // swap in/out and elf loading for a process waiting on memory
+    READY_SYSCALL,      // syscall completions (NFS replies, device state machines)
+    READY_BACKGROUND,   // writeback, prefetch and other work nobody waits on
+    READY_CLASSES
+} ready_class_t;
+
+/* Maximum number of continuations run before interrupts are polled again */
+#define SCHED_IRQ_BATCH     (8)
+
+void add_ready_proc(pid_t pid, ready_class_t cls);
+void remove_ready_proc(pid_t pid);
+pid_t next_ready_proc(void);
+bool has_ready_proc(void);
+
+#endif
@@ -14,6 +14,7 @@
 #include "file.h"
 #include "process.h"
 #include "page_replacement.h"
+#include "sos_poll.h"
 
 #define SERIAL_BUF_SIZE  1024
 
@@ -29,6 +30,7 @@ io_device_t serial_io = {
     .read = sos_serial_read,
     .write = sos_serial_write,
     .getdirent = NULL,
+    .getdirents = NULL,
     .stat = NULL
 };
 
@@ -42,6 +44,15 @@ static inline unsigned CONST min(unsigned a, unsigned b)
     return (a < b) ? a : b;
 }
 
+/**
+ * @brief Whether a read of the console would return without blocking:
+ *        a full line, or a full buffer, is waiting
+ */
+bool sos_serial_readable(void) {
+    return line_buflen == SERIAL_BUF_SIZE ||
+           (line_buflen > 0 && memchr(line_buf, '\n', line_buflen) != NULL);
+}
+
 /**
  * @brief   Send line buffer to console reader
  *          1. No console reader - do nothing
@@ -58,7 +69,13 @@ static inline void try_send_buffer() {
     if (proc == NULL) {
         return ;
     }
-    if (proc->cont.syscall_number != SOS_SYSCALL_READ )
+    if (proc->cont.syscall_number == SOS_SYSCALL_POLL) {
+        poll_wake(reader_pid);
+        return;
+    }
+    if (proc->cont.syscall_number != SOS_SYSCALL_READ &&
+        proc->cont.syscall_number != SOS_SYSCALL_READ_INLINE &&
+        proc->cont.syscall_number != SOS_SYSCALL_READV)
         return;
     assert(line_buflen > 0 );
     assert(proc->cont.iov); 
@@ -71,6 +88,11 @@ static inline void try_send_buffer() {
         assert(v->sz);
         
         int n = min(buflen - pos, v->sz);
+        if (v->sos_iov_flag) { // inline read
+            memcpy((char*)v->vstart, buf+pos, n);
+            pos += n;
+            continue;
+        }
         sos_vaddr dst = as_lookup_sos_vaddr(proc->vspace, v->vstart);
         assert(dst);
         memcpy((char*)dst, buf+pos, n);
@@ -162,6 +184,9 @@ int sos_serial_read(iovec_t* vec, int fd, int count) {
     cont_t *cont = &(proc->cont);
     cont->iov = vec;
     for (; vec != NULL; vec = vec->next) {
+        if (vec->sos_iov_flag) {
+            continue;
+        }
         iov_ensure_loaded(*vec); 
         pte_t* pt = as_lookup_pte(current_process()->vspace, vec->vstart);
         pt->pinned = true;
@@ -188,9 +213,12 @@ int sos_serial_write(iovec_t* vec, int fd, int count) {
     assert(vec);
 
     for (iovec_t *v = vec; v ; v = v->next) {
-        iov_ensure_loaded(*v);
         if (v->sz == 0) return 0;
-        sos_vaddr src = as_lookup_sos_vaddr(current_process()->vspace, v->vstart);
+        sos_vaddr src = v->vstart;
+        if (!v->sos_iov_flag) {
+            iov_ensure_loaded(*v);
+            src = as_lookup_sos_vaddr(current_process()->vspace, v->vstart);
+        }
         assert(src);
         sent += serial_send(serial, (char*)src, v->sz);
     }
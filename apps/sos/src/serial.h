@@ -13,6 +13,8 @@ int sos_serial_write(iovec_t* vec, int fd, int count);
 
 int sos_serial_close(int fd);
 
+bool sos_serial_readable(void);
+
 void sos_serial_init(void);
 
 extern io_device_t serial_io;
@@ -6,11 +6,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <clock/clock.h>
 #include <errno.h>
-#include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 #include <clock/clock.h>
 #include "network.h"
 #include "file.h"
@@ -18,6 +19,11 @@
 #include "sos_nfs.h"
 #include "syscall.h"
 #include "addrspace.h"
+#include "scheduler.h"
+#include "coroutine.h"
+#include "buffer_cache.h"
+#include "name_cache.h"
+#include "dir_cache.h"
 
 #define verbose 0
 #include <log/debug.h>
@@ -30,7 +36,8 @@ io_device_t nfs_io = {
     .read = sos_nfs_read,
     .write = sos_nfs_write,
     .stat = sos_nfs_getattr,
-    .getdirent = sos_nfs_readdir
+    .getdirent = sos_nfs_readdir,
+    .getdirents = sos_nfs_readdirs
 };
 
 static inline unsigned CONST umin(unsigned a, unsigned b)
@@ -38,6 +45,22 @@ static inline unsigned CONST umin(unsigned a, unsigned b)
     return (a < b) ? a : b;
 }
 
+/**
+ * @brief Binary reads done for a vm fault count as paging, anything else
+ *        resumes a syscall
+ */
+static inline ready_class_t ready_class(sos_proc_t *proc) {
+    return proc->cont.ipc_label == seL4_VMFault ? READY_PAGING : READY_SYSCALL;
+}
+
+/**
+ * @brief Position a request reads or writes at: its own for pread/pwrite,
+ *        the position of the open file otherwise
+ */
+static inline size_t *io_offset(sos_proc_t *proc, of_entry_t *of) {
+    return proc->cont.explicit_offset ? &proc->cont.offset_arg : &of->offset;
+}
+
 
 static void
 /**
@@ -45,8 +68,8 @@ static void
  *        Return client fd or error
  *
   */
-sos_nfs_create_callback(uintptr_t cb, enum nfs_stat status, fhandle_t *fh,
-                        fattr_t *fattr) {
+sos_nfs_create_callback(uintptr_t cb, enum nfs_stat status, fhandle3_t *fh,
+                        fattr3_t *fattr) {
     pid_t pid = ((callback_info_t*)cb)->pid;
     dprintf(3, "Entering nfs_create_callback: %d\n", (int)pid);
     set_current_process(pid);
@@ -58,6 +81,10 @@ sos_nfs_create_callback(uintptr_t cb, enum nfs_stat status, fhandle_t *fh,
 
     sos_proc_t *proc = current_process();
     int fd = proc->cont.fd;
+    if (status == NFS_OK && fh == NULL) {
+        ERR("create of %s returned no file handle\n", proc->cont.path);
+        status = NFSERR_IO;
+    }
     if (status != NFS_OK) {
         fd_free(proc->fd_table, fd);
         syscall_end_continuation(proc, 0, false);
@@ -66,13 +93,15 @@ sos_nfs_create_callback(uintptr_t cb, enum nfs_stat status, fhandle_t *fh,
 
     of_entry_t *of = fd_lookup(proc, fd);
     assert(of);
-    of->fhandle = malloc(sizeof(fhandle_t));
+    of->fhandle = malloc(sizeof(fhandle3_t));
     if (of->fhandle == NULL) {
         fd_free(proc->fd_table, fd);
         syscall_end_continuation(proc, 0, false);
         return;
     }
     *(of->fhandle) = *fh;
+    ncache_enter(proc->cont.path, NFS_OK, fh, fattr);
+    dcache_invalidate(&mnt_point);
     dprintf(2, "sos_nfs_create_callback %d\n", proc->cont.fd);
     syscall_end_continuation(proc, fd, true);
 }
@@ -85,7 +114,7 @@ static void
             resume the process if it's starting a new process.
  */
 sos_nfs_open_callback(uintptr_t cb, enum nfs_stat status,
-                      fhandle_t* fh, fattr_t* fattr) {
+                      fhandle3_t* fh, fattr3_t* fattr) {
     pid_t pid = ((callback_info_t*)cb)->pid;
     set_current_process(pid);
     if (!callback_valid((callback_info_t*)cb)) {
@@ -103,17 +132,15 @@ sos_nfs_open_callback(uintptr_t cb, enum nfs_stat status,
     assert(of);
     dprintf(3, "status: %d %s\n", status, cur_proc->cont.path);
     if (status == NFSERR_NOENT && (of->mode & FM_WRITE)) {
-        uint32_t clock_upper = time_stamp() >> 32;
-        uint32_t clock_lower = (time_stamp() << 32) >> 32;
-
-        struct sattr default_attr = {.mode = 0x7,
-                                     .uid = 0,
-                                     .gid = 0,
-                                     .size = 0,
-                                     .atime = {clock_upper, clock_lower},
-                                     .mtime = {clock_upper, clock_lower}};
+        // the server stamps the times of a new file
+        sattr3_t default_attr = {.mode = 0x7,
+                                 .uid = 0,
+                                 .gid = 0,
+                                 .size = 0,
+                                 .atime = {(uint32_t)-1, 0},
+                                 .mtime = {(uint32_t)-1, 0}};
         dprintf(2, "sos_nfs_open_callback %s %d\n", cur_proc->cont.path, cur_proc->cont.fd);
-        int err = nfs_create(&mnt_point, cur_proc->cont.path, &default_attr, sos_nfs_create_callback, cb);
+        int err = nfs3_create(&mnt_point, cur_proc->cont.path, &default_attr, sos_nfs_create_callback, cb);
         if (err > 0) {
             free((callback_info_t*)cb);
         }
@@ -121,27 +148,44 @@ sos_nfs_open_callback(uintptr_t cb, enum nfs_stat status,
     } else if (status != NFS_OK) {
         // Clean up the preemptively created FD.
         fd_free(proc->fd_table, fd);
-        if (cur_proc->cont.binary_nfs_open) {
-            process_delete(proc);
+        if (cur_proc->cont.binary_nfs_open) { // let start_process clean up
+            cur_proc->cont.binary_nfs_failed = true;
+            add_ready_proc(pid, READY_SYSCALL);
+        } else {
+            syscall_end_continuation(cur_proc, SOS_NFS_ERR, false);
         }
-        syscall_end_continuation(current_process(), SOS_NFS_ERR, false);
         free((callback_info_t*)cb);
         return;
     }
     dprintf(3, "File already existsh on FS.\n");
+    bcache_validate(fh, fattr); // close-to-open: drop what changed on the server
 
-    of->fhandle = (fhandle_t*)malloc(sizeof(fhandle_t));
+    of->fhandle = (fhandle3_t*)malloc(sizeof(fhandle3_t));
     *(of->fhandle) = *fh;
     assert(proc);
     if (!cur_proc->cont.binary_nfs_open) {
-        syscall_end_continuation(proc, fd, true);
+        syscall_end_continuation(cur_proc, fd, true);
     } else {
-        add_ready_proc(pid);
+        add_ready_proc(pid, READY_SYSCALL);
     }
     free((callback_info_t*)cb);
     dprintf(3, "Finishing nfs_open callback\n");
 }
 
+/**
+ * @brief   Remember what the server said about the name, then carry on as
+ *          for a cached answer
+ */
+static void
+sos_nfs_open_lookup_callback(uintptr_t cb, enum nfs_stat status,
+                             fhandle3_t* fh, fattr3_t* fattr) {
+    sos_proc_t *proc = process_lookup(((callback_info_t*)cb)->pid);
+    if (proc && callback_valid((callback_info_t*)cb)) {
+        ncache_enter(proc->cont.path, status, fh, fattr);
+    }
+    sos_nfs_open_callback(cb, status, fh, fattr);
+}
+
 /**
  * @brief   Fire open callback.
  * @return error
@@ -156,7 +200,24 @@ int sos_nfs_open(const char* filename, fmode_t mode) {
     }
     cb->pid = pid;
     cb->start_time = time_stamp();
-    int err = nfs_lookup(&mnt_point, filename, sos_nfs_open_callback,
+
+    fhandle3_t fh;
+    fattr3_t fattr;
+    bool attr_valid;
+    switch (ncache_lookup(filename, &fh, &fattr, &attr_valid)) {
+    case NCACHE_NOENT:
+        sos_nfs_open_callback((uintptr_t)cb, NFSERR_NOENT, NULL, NULL);
+        return 0;
+    case NCACHE_FOUND:
+        if (attr_valid) {
+            sos_nfs_open_callback((uintptr_t)cb, NFS_OK, &fh, &fattr);
+            return 0;
+        }
+        break; // the attributes are needed to check the cached data
+    case NCACHE_MISS:
+        break;
+    }
+    int err = nfs3_lookup(&mnt_point, filename, sos_nfs_open_lookup_callback,
                          (uintptr_t)cb);
     if (err > 0) {
         free((callback_info_t*)cb);
@@ -165,197 +226,976 @@ int sos_nfs_open(const char* filename, fmode_t mode) {
 }
 
 
+/* Read and write RPCs a single request keeps in flight */
+#ifdef CONFIG_SOS_NFS_READ_WINDOW
+#define NFS_READ_WINDOW CONFIG_SOS_NFS_READ_WINDOW
+#else
+#define NFS_READ_WINDOW 8
+#endif
+#ifdef CONFIG_SOS_NFS_WRITE_WINDOW
+#define NFS_WRITE_WINDOW CONFIG_SOS_NFS_WRITE_WINDOW
+#else
+#define NFS_WRITE_WINDOW 8
+#endif
+
+/* Small writes are gathered up to this size, and sent at the latest
+ * after NFS_WB_DELAY microseconds */
+#define NFS_WB_SIZE         BCACHE_BLOCK_SIZE
+#define NFS_WB_DELAY        200000
+
+/* Most data one read or write RPC carries, before asking the server */
+#ifdef CONFIG_SOS_NFS_XFER_SIZE
+#define NFS_XFER_SIZE CONFIG_SOS_NFS_XFER_SIZE
+#else
+#define NFS_XFER_SIZE 8192
+#endif
+
+/* Settled with the server at mount time, reads in whole blocks */
+static size_t nfs_rsize = BCACHE_BLOCK_SIZE;
+static size_t nfs_wsize = BCACHE_BLOCK_SIZE;
+
+/* Readahead window of a sequential reader, in blocks */
+#define NFS_RA_MIN_WINDOW   4
+#define NFS_RA_MAX_WINDOW   32
+/* Prefetch reads in flight for all files together */
+#define NFS_RA_MAX_INFLIGHT 32
+
+/* State of one pipelined read or write, kept on the stack of the request */
+typedef struct nfs_pipe {
+    pid_t pid;
+    ready_class_t ready;
+    sos_addrspace_t *as;        // where client pages are
+    of_entry_t *of;
+    const fhandle3_t *fh;
+    bool pin;                   // client pages are pinned while in flight
+    bool write;
+    int window;
+    iovec_t *next;              // first piece not requested yet
+    size_t next_offset;         // file offset of that piece
+    size_t start;
+    size_t end;                 // lowest offset a piece came up short at
+    int inflight;
+    bool failed;
+    bool waiting;               // the request is suspended on the replies
+} nfs_pipe_t;
+
+/* One read or write RPC, owns the iovs it covers. A read piece covers
+ * what the request wants of one file block, the RPC reads the whole block
+ * so it can be cached. */
+typedef struct nfs_piece {
+    callback_info_t cb;
+    nfs_pipe_t *pipe;
+    iovec_t *iov;
+    size_t offset;
+    size_t len;
+    unsigned epoch;             // of the buffer cache when the read was sent
+    struct nfs_piece *wnext;    // next read waiting on the same prefetch
+} nfs_piece_t;
+
 /**
- * @brief   Read callback function.
- *          Read data from NFS file and copy it to an iov. 
- *          When all iovs in iov list are filled, it reply to a syscall request 
- *          or resume the process if it's starting a new process.
+ * @brief Whether the request a piece belongs to is still there, the piece
+ *        is freed if not
+ */
+static bool nfs_piece_valid(nfs_piece_t *piece) {
+    if (!callback_valid(&piece->cb)) { // the pipe went with the request
+        iov_free(piece->iov);
+        free(piece);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Account for a finished piece: "count" bytes of it were done, or
+ *        none if it failed. Replies can land in any order, so the result
+ *        of the request is only settled by the lowest piece that came up
+ *        short. The request is woken to issue more or finish.
+ */
+static void nfs_piece_done(nfs_piece_t *piece, bool ok, size_t count) {
+    nfs_pipe_t *pipe = piece->pipe;
+    pipe->inflight--;
+    if (!ok) {
+        pipe->failed = true;
+        count = 0;
+    }
+    if (count < piece->len && piece->offset + count < pipe->end) {
+        pipe->end = piece->offset + count;
+    }
+    for (iovec_t *iov = piece->iov; iov; iov = iov->next) {
+        if (pipe->pin && !iov->sos_iov_flag) {
+            as_unpin_page(pipe->as, iov->vstart);
+        }
+    }
+    iov_free(piece->iov);
+    free(piece);
+    if (pipe->waiting) {
+        add_ready_proc(pipe->pid, pipe->ready);
+    }
+}
+
+/**
+ * @brief Copy the part of a file block a read piece wants to its iovs
  *
+ * @param block data of the block the piece lies in
+ * @param valid bytes of the block holding file data
+ * @return bytes copied
+ */
+static size_t nfs_piece_fill(nfs_piece_t *piece, const char *block, size_t valid) {
+    size_t pos = piece->offset % BCACHE_BLOCK_SIZE;
+    size_t done = 0;
+    for (iovec_t *iov = piece->iov; iov && pos < valid; iov = iov->next) {
+        size_t n = umin(iov->sz, valid - pos);
+        sos_vaddr dst = iov->sos_iov_flag ?
+                        iov->vstart : as_lookup_sos_vaddr(piece->pipe->as, iov->vstart);
+        assert(dst);
+        memcpy((char*)dst, block + pos, n);
+        pos += n;
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * @brief   Read callback function.
+ *          Cache the block read and copy the part the piece wants.
  */
 static void
-sos_nfs_read_callback(uintptr_t cb, enum nfs_stat status,
-                      fattr_t *fattr, int count, void* data) {
+sos_nfs_read_callback(uintptr_t token, enum nfs_stat status,
+                      fattr3_t *fattr, int count, bool eof, void* data) {
+    (void)eof;
     dprintf(3, "Read callback: %d\n", count);
-    (void)fattr;
-    pid_t pid = ((callback_info_t*)cb)->pid;
-    set_current_process(pid);
-    if (!callback_valid((callback_info_t*)cb)) {
-        free((callback_info_t*)cb);
+    nfs_piece_t *piece = (nfs_piece_t*)token;
+    if (!nfs_piece_valid(piece)) {
         return;
     }
-    free((callback_info_t*)cb);
+    bool ok = status == NFS_OK && count >= 0;
+    size_t done = 0;
+    if (ok) {
+        count = umin(count, BCACHE_BLOCK_SIZE);
+        bcache_insert(piece->pipe->fh, BCACHE_BLOCK(piece->offset), piece->epoch,
+                      data, count, fattr);
+        done = nfs_piece_fill(piece, data, count);
+        dprintf(2, "READ %d bytes at offset: %u\n", done, piece->offset);
+    }
+    nfs_piece_done(piece, ok, done);
+}
 
-    /*Use effective here, as When we open an executable file, 
-     * we define the reader is the new created client*/
+/**
+ * @brief Keep track of data of a file the server hasn't committed yet. A
+ *        write verifier other than the one of earlier unstable writes means
+ *        the server restarted and may have lost them.
+ */
+static void nfs_unstable_note(of_entry_t *of, enum nfs3_stable_how committed,
+                              const nfs3_writeverf_t *verf) {
+    if (of->unstable && memcmp(&of->verf, verf, sizeof(*verf)) != 0) {
+        ERR("[NFS] server restarted, unstable writes may be lost\n");
+        of->verf_lost = true;
+    }
+    if (of->unstable || committed == NFS3_UNSTABLE) {
+        of->unstable = true;
+        of->verf = *verf;
+    }
+}
 
-    sos_proc_t *proc = effective_process(), *cur_proc = current_process();
-    int fd = cur_proc->cont.fd;
-    if (count == 0) {
-        if (!cur_proc->cont.binary_nfs_read) {
-            syscall_end_continuation(cur_proc, cur_proc->cont.counter, true);
-            return;
-        } else {
-            add_ready_proc(pid);
-            return;
+/* A COMMIT a request waits on. Freed by the request, or by the callback
+ * if the request is gone. */
+typedef struct nfs_commit_req {
+    callback_info_t cb;
+    enum nfs_stat status;
+    nfs3_writeverf_t verf;
+    bool done;
+} nfs_commit_req_t;
+
+static void
+nfs_commit_callback(uintptr_t token, enum nfs_stat status, nfs3_writeverf_t *verf) {
+    nfs_commit_req_t *req = (nfs_commit_req_t*)token;
+    if (!callback_valid(&req->cb)) {
+        free(req);
+        return;
+    }
+    req->status = status;
+    req->verf = *verf;
+    req->done = true;
+    add_ready_proc(req->cb.pid, READY_SYSCALL);
+}
+
+/**
+ * @brief Have the server commit the unstable writes of a file, blocking
+ *        the request until it has
+ *
+ * @return 0, or EIO if the commit failed or written data was lost
+ */
+static int nfs_commit_wait(of_entry_t *of) {
+    nfs_commit_req_t *req = malloc(sizeof(nfs_commit_req_t));
+    if (req == NULL) {
+        return ENOMEM;
+    }
+    req->cb.pid = current_process()->pid;
+    req->cb.start_time = time_stamp();
+    req->done = false;
+    if (nfs3_commit(of->fhandle, 0, 0, nfs_commit_callback, (uintptr_t)req)) {
+        free(req);
+        return EIO;
+    }
+    while (!req->done) {
+        coroutine_wait();
+    }
+    int err = 0;
+    if (req->status != NFS_OK) {
+        ERR("[NFS] commit failed: %d\n", req->status);
+        err = EIO;
+    } else {
+        if (of->verf_lost || memcmp(&req->verf, &of->verf, sizeof(req->verf)) != 0) {
+            ERR("[NFS] the server lost unstable writes\n");
+            err = EIO;
         }
+        of->unstable = false;
+        of->verf_lost = false;
     }
+    free(req);
+    return err;
+}
 
+static void
+nfs_commit_orphan_callback(uintptr_t token, enum nfs_stat status,
+                           nfs3_writeverf_t *verf) {
+    (void)token;
+    (void)verf;
     if (status != NFS_OK) {
-        if (cur_proc->cont.binary_nfs_read) {
-            process_delete(proc);
-        }
-        syscall_end_continuation(cur_proc, SOS_NFS_ERR, false);
+        ERR("[NFS] commit of a closed file failed: %d\n", status);
+    }
+}
+
+/**
+ * @brief Commit the writes of a file nobody waits on any more
+ */
+static void nfs_commit_orphan(const fhandle3_t *fh) {
+    if (nfs3_commit(fh, 0, 0, nfs_commit_orphan_callback, 0)) {
+        ERR("[NFS] failed to send commit of a closed file\n");
+    }
+}
+
+/**
+ * @brief Similar to read_callback except it's writing
+ *
+ */
+static void
+nfs_write_callback(uintptr_t token, enum nfs_stat status, fattr3_t *fattr, int count,
+                   enum nfs3_stable_how committed, nfs3_writeverf_t *verf) {
+    (void)fattr;
+    nfs_piece_t *piece = (nfs_piece_t*)token;
+    if (!nfs_piece_valid(piece)) {
         return;
     }
-    cur_proc->cont.counter += count;
-    of_entry_t *of = fd_lookup(proc, fd);
-    of->offset += (unsigned)count;
+    bool ok = status == NFS_OK && count >= 0;
+    if (ok) {
+        nfs_unstable_note(piece->pipe->of, committed, verf);
+    }
+    dprintf(2, "WROTE %d bytes at offset: %u\n", count, piece->offset);
+    // a read sent while the write was in flight may have cached old data
+    bcache_invalidate(piece->pipe->fh, piece->offset, piece->len);
+    nfs_piece_done(piece, ok, ok ? umin(count, piece->len) : 0);
+}
 
-    sos_vaddr dst;
-    if (cur_proc->cont.iov->sos_iov_flag) {
-        dst = cur_proc->cont.iov->vstart;
-    } else {
-        dst = as_lookup_sos_vaddr(cur_proc->vspace, cur_proc->cont.iov->vstart);
-    }
-    assert(dst);
-    memcpy((char*)dst, data, (size_t)count);
-    dprintf(2, "READ %d bytes to %08x, now at offset: %u\n", count, cur_proc->cont.iov->vstart, of->offset);
-
-    iovec_t *iov = cur_proc->cont.iov;
-    if (cur_proc->cont.iov->sz == (size_t)count) { // finish reading an iov, and move to next one
-        cur_proc->cont.iov = iov->next;
-        if (!iov->sos_iov_flag)
-            as_unpin_page(cur_proc->vspace, iov->vstart);
-        free(iov);
-        iov = cur_proc->cont.iov;
-    } else {
-        iov->vstart += (size_t)count;
-        iov->sz -= (size_t)count;
+/* Blocks being read ahead into the buffer cache by one RPC */
+typedef struct nfs_prefetch {
+    fhandle3_t fh;              // copy, the file may be closed meanwhile
+    uint32_t block;             // first block read
+    uint32_t nblocks;
+    unsigned epoch;
+    nfs_piece_t *waiters;       // reads of the block that came in meanwhile
+    struct nfs_prefetch *next;
+} nfs_prefetch_t;
+
+static nfs_prefetch_t *prefetches;
+static int nprefetches;
+
+static nfs_prefetch_t *nfs_prefetch_find(const fhandle3_t *fh, uint32_t block) {
+    nfs_prefetch_t *pf = prefetches;
+    while (pf && !(pf->block <= block && block < pf->block + pf->nblocks &&
+                   memcmp(&pf->fh, fh, sizeof(fhandle3_t)) == 0)) {
+        pf = pf->next;
     }
+    return pf;
+}
 
-    if (iov == NULL) { // All iovs are filled
-        if (!cur_proc->cont.binary_nfs_read) {
-            syscall_end_continuation(cur_proc, cur_proc->cont.counter, true);
-            return;
+/**
+ * @brief Cache blocks read ahead, and finish the reads that were waiting
+ *        on them
+ */
+static void
+nfs_prefetch_callback(uintptr_t token, enum nfs_stat status,
+                      fattr3_t *fattr, int count, bool eof, void* data) {
+    (void)eof;
+    nfs_prefetch_t *pf = (nfs_prefetch_t*)token;
+    nfs_prefetch_t **p = &prefetches;
+    while (*p != pf) {
+        p = &(*p)->next;
+    }
+    *p = pf->next;
+    nprefetches--;
+
+    bool ok = status == NFS_OK && count >= 0;
+    if (ok) {
+        count = umin(count, pf->nblocks * BCACHE_BLOCK_SIZE);
+        // nothing to keep past EOF
+        for (size_t off = 0; off < (size_t)count; off += BCACHE_BLOCK_SIZE) {
+            bcache_insert(&pf->fh, pf->block + BCACHE_BLOCK(off), pf->epoch,
+                          (char*)data + off, umin(count - off, BCACHE_BLOCK_SIZE), fattr);
         }
     }
-    add_ready_proc(pid);
+    dprintf(3, "[RA] blocks %u+%u: %d bytes\n", pf->block, pf->nblocks, count);
+    while (pf->waiters) {
+        nfs_piece_t *piece = pf->waiters;
+        pf->waiters = piece->wnext;
+        if (nfs_piece_valid(piece)) {
+            size_t off = (BCACHE_BLOCK(piece->offset) - pf->block) * BCACHE_BLOCK_SIZE;
+            size_t valid = ok && (size_t)count > off ? umin(count - off, BCACHE_BLOCK_SIZE) : 0;
+            nfs_piece_done(piece, ok, valid ? nfs_piece_fill(piece, (char*)data + off, valid) : 0);
+        }
+    }
+    free(pf);
 }
 
 /**
- * @brief Fire the read callback
+ * @brief Start reading blocks into the buffer cache, nobody waits on them
+ */
+static void nfs_prefetch(const fhandle3_t *fh, uint32_t block, uint32_t nblocks) {
+    nfs_prefetch_t *pf = malloc(sizeof(nfs_prefetch_t));
+    if (pf == NULL) {
+        return;
+    }
+    pf->fh = *fh;
+    pf->block = block;
+    pf->nblocks = nblocks;
+    pf->epoch = bcache_epoch(fh);
+    pf->waiters = NULL;
+    if (nfs3_read(fh, (uint64_t)block * BCACHE_BLOCK_SIZE, nblocks * BCACHE_BLOCK_SIZE,
+                  nfs_prefetch_callback, (uintptr_t)pf)) {
+        free(pf);
+        return;
+    }
+    pf->next = prefetches;
+    prefetches = pf;
+    nprefetches++;
+}
+
+/**
+ * @brief Whether a block has to be read ahead
+ */
+static inline bool nfs_prefetch_wanted(const fhandle3_t *fh, uint32_t block) {
+    return !bcache_contains(fh, block) && !nfs_prefetch_find(fh, block);
+}
+
+/**
+ * @brief Track how a file is read and keep blocks ahead of a sequential
+ *        reader coming into the cache. The window doubles with every
+ *        sequential read and closes on a seek. Neighbouring blocks are
+ *        read by one RPC as far as the transfer size goes.
  *
+ * @param start offset the read started at
+ * @param done bytes it got
+ * @param eof whether it came up short
  */
-int sos_nfs_read(iovec_t* vec, int fd, int count) {
-    sos_proc_t *proc = effective_process(), *cur_proc = current_process();
-    pid_t pid = cur_proc->pid;
-    of_entry_t *of = fd_lookup(proc, fd);
+static void nfs_readahead(of_entry_t *of, size_t start, size_t done, bool eof) {
+    bool sequential = start == of->ra_next;
+    of->ra_next = start + done;
+    if (!sequential) {
+        dprintf(3, "[RA] random read at %u\n", start);
+        of->ra_window = 0;
+        of->ra_block = 0;
+        return;
+    }
+    if (eof) {
+        return;
+    }
+    of->ra_window = of->ra_window == 0 ? NFS_RA_MIN_WINDOW :
+                    umin(of->ra_window * 2, NFS_RA_MAX_WINDOW);
 
-    assert(cur_proc->cont.iov);
-    if (!cur_proc->cont.binary_nfs_read) {
-        iov_ensure_loaded(*cur_proc->cont.iov); // ensure the page to store the data is in memory
-        as_pin_page(proc->vspace, cur_proc->cont.iov->vstart);
+    uint32_t block = BCACHE_BLOCK(of->ra_next);
+    uint32_t last = block + of->ra_window;
+    if (block < of->ra_block) {
+        block = of->ra_block;
     }
+    uint32_t per_rpc = nfs_rsize / BCACHE_BLOCK_SIZE;
+    while (block < last && nprefetches < NFS_RA_MAX_INFLIGHT) {
+        if (!nfs_prefetch_wanted(of->fhandle, block)) {
+            block++;
+            continue;
+        }
+        uint32_t n = 1;
+        while (n < per_rpc && block + n < last &&
+               nfs_prefetch_wanted(of->fhandle, block + n)) {
+            n++;
+        }
+        nfs_prefetch(of->fhandle, block, n);
+        block += n;
+    }
+    of->ra_block = block;
+}
 
-    dprintf(2, "READING up to %d bytes to %08x, now at offset: %u\n",cur_proc->cont.iov->sz, cur_proc->cont.iov->vstart, of->offset);
-    dprintf(3, "READING USING PID %d\n", pid);
-    callback_info_t *cb = malloc(sizeof(callback_info_t));
-    if (!cb) {
+/**
+ * @brief Detach the next piece of the iov list: one iov, at most a write
+ *        RPC of it, for a write, for a read everything up to the end of
+ *        the file block it starts in. An iov crossing the end of the piece
+ *        is split.
+ */
+static iovec_t *nfs_pipe_take(nfs_pipe_t *pipe, size_t *len) {
+    iovec_t *head = pipe->next, *last = NULL;
+    size_t limit = pipe->write ? umin(head->sz, nfs_wsize) :
+                   BCACHE_BLOCK_SIZE - pipe->next_offset % BCACHE_BLOCK_SIZE;
+    size_t n = 0;
+    for (iovec_t *iov = head; iov && n < limit; iov = iov->next) {
+        if (n + iov->sz > limit) {
+            iovec_t *rest = iov_create(iov->vstart + (limit - n), iov->sz - (limit - n),
+                                       NULL, NULL, iov->sos_iov_flag);
+            if (rest == NULL) {
+                break;
+            }
+            rest->next = iov->next;
+            iov->next = rest;
+            iov->sz = limit - n;
+        }
+        n += iov->sz;
+        last = iov;
+    }
+    if (last == NULL) {
+        return NULL;
+    }
+    pipe->next = last->next;
+    current_process()->cont.iov = pipe->next;
+    last->next = NULL;
+    *len = n;
+    return head;
+}
+
+/**
+ * @brief Send the RPC for the next piece of the iov list. A read of a
+ *        cached block is done on the spot.
+ */
+static int nfs_pipe_issue(nfs_pipe_t *pipe) {
+    nfs_piece_t *piece = malloc(sizeof(nfs_piece_t));
+    if (piece == NULL) {
         return ENOMEM;
     }
-    cb->pid = pid;
-    cb->start_time = time_stamp();
-    int err = nfs_read(of->fhandle, (int)of->offset, (int)cur_proc->cont.iov->sz, sos_nfs_read_callback, (uintptr_t)cb);
-    if (err > 0) {
-        free((callback_info_t*)cb);
+    piece->iov = nfs_pipe_take(pipe, &piece->len);
+    if (piece->iov == NULL) {
+        free(piece);
+        return ENOMEM;
+    }
+    piece->cb.pid = pipe->pid;
+    piece->cb.start_time = time_stamp();
+    piece->pipe = pipe;
+    piece->offset = pipe->next_offset;
+    pipe->inflight++;
+    pipe->next_offset += piece->len;
+
+    for (iovec_t *iov = piece->iov; iov; iov = iov->next) {
+        if (pipe->pin && !iov->sos_iov_flag) {
+            iov_ensure_loaded(*iov); // ensure the page is in memory
+            as_pin_page(pipe->as, iov->vstart);
+        }
     }
+
+    int err;
+    uint32_t block = BCACHE_BLOCK(piece->offset);
+    if (pipe->write) {
+        iovec_t *iov = piece->iov;
+        sos_vaddr src = iov->sos_iov_flag ? // inline write, data is already in sos
+                        iov->vstart : as_lookup_sos_vaddr(pipe->as, iov->vstart);
+        assert(src);
+        dprintf(2, "Writing to offset: %u (%d)bytes\n", piece->offset, piece->len);
+        bcache_invalidate(pipe->fh, piece->offset, piece->len);
+        ncache_invalidate_attr(pipe->fh);
+        err = nfs3_write(pipe->fh, piece->offset, piece->len, (const void*)src,
+                         NFS3_UNSTABLE, nfs_write_callback, (uintptr_t)piece);
+    } else {
+        size_t valid;
+        sos_vaddr cached = bcache_lookup(pipe->fh, block, &valid);
+        if (cached) {
+            dprintf(2, "READ %d bytes at offset %u from cache\n", piece->len, piece->offset);
+            nfs_piece_done(piece, true, nfs_piece_fill(piece, (char*)cached, valid));
+            return 0;
+        }
+        nfs_prefetch_t *pf = nfs_prefetch_find(pipe->fh, block);
+        if (pf) { // already on its way
+            piece->wnext = pf->waiters;
+            pf->waiters = piece;
+            return 0;
+        }
+        piece->epoch = bcache_epoch(pipe->fh);
+        dprintf(2, "READING block %u for %d bytes at offset: %u\n", block, piece->len, piece->offset);
+        err = nfs3_read(pipe->fh, (uint64_t)block * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE,
+                        sos_nfs_read_callback, (uintptr_t)piece);
+    }
+    if (err) {
+        pipe->next_offset -= piece->len;
+        nfs_piece_done(piece, true, 0); // nothing done, but not a failed RPC either
+        return err;
+    }
+    return 0;
+}
+
+/**
+ * @brief Run the whole iov list of the current request through the pipe,
+ *        keeping up to pipe->window RPCs in flight. Returns once every
+ *        reply is in; the file position is advanced by what was done.
+ *
+ * @param done returns the bytes done contiguously from the start
+ * @return error that stopped more pieces being sent, 0 if none
+ */
+static int nfs_pipe_run(nfs_pipe_t *pipe, of_entry_t *of, size_t *done) {
+    sos_proc_t *cur_proc = current_process();
+    pipe->of = of;
+    pipe->fh = of->fhandle;
+    pipe->next = cur_proc->cont.iov;
+    pipe->start = pipe->next_offset = *io_offset(cur_proc, of);
+    pipe->end = SIZE_MAX;
+
+    int err = 0;
+    while (1) {
+        while (!err && !pipe->failed && pipe->next &&
+               pipe->inflight < pipe->window && pipe->next_offset < pipe->end) {
+            err = nfs_pipe_issue(pipe);
+        }
+        if (pipe->inflight == 0) {
+            break;
+        }
+        pipe->waiting = true;
+        coroutine_wait();
+        pipe->waiting = false;
+    }
+
+    size_t end = pipe->next_offset < pipe->end ? pipe->next_offset : pipe->end;
+    *done = end - pipe->start;
+    *io_offset(cur_proc, of) += *done;
+    iov_free(cur_proc->cont.iov);
+    cur_proc->cont.iov = NULL;
     return err;
 }
 
+/**
+ * @brief Answer a pipelined request: the bytes done if there are any,
+ *        otherwise what went wrong
+ */
+static int nfs_pipe_reply(nfs_pipe_t *pipe, int err, size_t done) {
+    sos_proc_t *cur_proc = current_process();
+    if (done == 0 && pipe->failed) {
+        syscall_end_continuation(cur_proc, SOS_NFS_ERR, false);
+    } else if (done == 0 && err) {
+        return err;
+    } else {
+        syscall_end_continuation(cur_proc, done, true);
+    }
+    return 0;
+}
+
+/* Write-back buffer of an open nfs file. Writes smaller than the buffer
+ * are gathered here while they follow on from each other, and go to the
+ * server as one RPC when the buffer fills, the writes stop being
+ * adjacent, the timer runs out, memory runs short, or the file is synced
+ * or closed. */
+/* A request waiting for the flushes of a buffer. Freed by the flush
+ * callback that wakes it */
+typedef struct nfs_wb_waiter {
+    callback_info_t cb;
+    struct nfs_wb_waiter *next;
+} nfs_wb_waiter_t;
+
+typedef struct nfs_wbuf {
+    fhandle3_t fh;               // copy, the buffer can outlive its open file
+    of_entry_t *of;             // NULL once the file is closed
+    size_t offset;              // file offset of data[0]
+    size_t len;
+    int inflight;               // flushes sent and not answered yet
+    int err;                    // of a flush nobody waited on
+    bool unstable;              // to commit once the file is closed
+    uint32_t timer;
+    nfs_wb_waiter_t *waiters;   // requests waiting for the flushes
+    struct nfs_wbuf *next;
+    char data[NFS_WB_SIZE];
+} nfs_wbuf_t;
+
+/* One flush RPC */
+typedef struct nfs_wb_flush {
+    nfs_wbuf_t *wb;
+    size_t offset;
+    size_t len;
+} nfs_wb_flush_t;
+
+static nfs_wbuf_t *wbufs;
 
 /**
- * @brief Similar to read_callback except it's writing
+ * @brief A flush was answered: resume every request waiting on the buffer,
+ *        they wait again if more is in flight
+ */
+static void nfs_wb_wake(nfs_wbuf_t *wb) {
+    while (wb->waiters) {
+        nfs_wb_waiter_t *w = wb->waiters;
+        wb->waiters = w->next;
+        if (callback_valid(&w->cb)) {
+            add_ready_proc(w->cb.pid, READY_SYSCALL);
+        }
+        free(w);
+    }
+}
+
+/**
+ * @brief Suspend the request until the next flush of the buffer is
+ *        answered. The buffer may be gone when this returns.
  *
+ * @return false if there is no memory to wait with
  */
+static bool nfs_wb_wait(nfs_wbuf_t *wb) {
+    nfs_wb_waiter_t *w = malloc(sizeof(nfs_wb_waiter_t));
+    if (w == NULL) {
+        ERR("[WB] no memory to wait for flushes\n");
+        return false;
+    }
+    w->cb.pid = current_process()->pid;
+    w->cb.start_time = time_stamp();
+    w->next = wb->waiters;
+    wb->waiters = w;
+    coroutine_wait();
+    return true;
+}
+
+static void nfs_wb_free(nfs_wbuf_t *wb) {
+    nfs_wbuf_t **p = &wbufs;
+    while (*p != wb) {
+        p = &(*p)->next;
+    }
+    *p = wb->next;
+    if (wb->timer) {
+        remove_timer(wb->timer);
+    }
+    if (wb->of) {
+        wb->of->wb = NULL;
+    }
+    nfs_wb_wake(wb);
+    free(wb);
+}
+
 static void
-nfs_write_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr, int count) {
+nfs_wb_callback(uintptr_t token, enum nfs_stat status, fattr3_t *fattr, int count,
+                enum nfs3_stable_how committed, nfs3_writeverf_t *verf) {
+    (void)fattr;
+    nfs_wb_flush_t *flush = (nfs_wb_flush_t*)token;
+    nfs_wbuf_t *wb = flush->wb;
+    dprintf(2, "[WB] flushed %d of %u bytes at %u\n", count, flush->len, flush->offset);
+    if (status != NFS_OK || count < 0 || (size_t)count < flush->len) {
+        ERR("[WB] deferred write at %u failed\n", flush->offset);
+        wb->err = EIO;
+    } else if (wb->of) {
+        nfs_unstable_note(wb->of, committed, verf);
+    } else if (committed == NFS3_UNSTABLE) {
+        wb->unstable = true;
+    }
+    bcache_invalidate(&wb->fh, flush->offset, flush->len);
+    ncache_invalidate_attr(&wb->fh); // a stat meanwhile may have cached the old size
+    free(flush);
 
-    pid_t pid = ((callback_info_t*)cb)->pid;
-    set_current_process(pid);
-    if (!callback_valid((callback_info_t*)cb)) {
-        free((callback_info_t*)cb);
-        return;
+    wb->inflight--;
+    nfs_wb_wake(wb);
+    if (wb->of == NULL && wb->inflight == 0) {
+        if (wb->unstable) {
+            nfs_commit_orphan(&wb->fh);
+        }
+        nfs_wb_free(wb);
     }
-    free((callback_info_t*)cb);
+}
 
-    sos_proc_t *proc = current_process();
-    int fd = proc->cont.fd;
-    if (status != NFS_OK) {
-        syscall_end_continuation(proc, SOS_NFS_ERR, false);
+/**
+ * @brief Send what the buffer holds, in as many RPCs as it takes, the
+ *        buffer is free again at once. A flush that can't be sent loses
+ *        its data and leaves an error.
+ */
+static void nfs_wb_start(nfs_wbuf_t *wb) {
+    if (wb->timer) {
+        remove_timer(wb->timer);
+        wb->timer = 0;
+    }
+    if (wb->len == 0) {
         return;
     }
-
-    proc->cont.counter += count;
-    of_entry_t *of = fd_lookup(proc, fd);
-    of->offset += (unsigned)count;
-
-    iovec_t *iov = proc->cont.iov;
-    if (proc->cont.iov->sz == (size_t)count) {
-        proc->cont.iov = iov->next;
-        as_unpin_page(proc->vspace, iov->vstart);
-        free(iov);
-        iov = proc->cont.iov;
-    } else {
-        iov->vstart += (size_t)count;
-        iov->sz -= (size_t)count;
+    bcache_invalidate(&wb->fh, wb->offset, wb->len);
+    ncache_invalidate_attr(&wb->fh);
+    for (size_t pos = 0; pos < wb->len; pos += nfs_wsize) {
+        nfs_wb_flush_t *flush = malloc(sizeof(nfs_wb_flush_t));
+        int err = ENOMEM;
+        if (flush) {
+            flush->wb = wb;
+            flush->offset = wb->offset + pos;
+            flush->len = umin(wb->len - pos, nfs_wsize);
+            err = nfs3_write(&wb->fh, flush->offset, flush->len, wb->data + pos,
+                             NFS3_UNSTABLE, nfs_wb_callback, (uintptr_t)flush);
+        }
+        if (err) {
+            ERR("[WB] failed to send %u bytes at %u\n", umin(wb->len - pos, nfs_wsize),
+                wb->offset + pos);
+            free(flush);
+            wb->err = EIO;
+        } else {
+            wb->inflight++;
+        }
     }
-    if (iov == NULL) {
-        syscall_end_continuation(proc, proc->cont.counter, true);
+    wb->offset += wb->len;
+    wb->len = 0;
+}
+
+static void nfs_wb_timeout(uint32_t id, void *data) {
+    (void)id;
+    nfs_wbuf_t *wb = data;
+    wb->timer = 0;
+    nfs_wb_start(wb);
+}
+
+/**
+ * @brief Flush the write-back buffer of a file and wait until the server
+ *        has everything written so far
+ */
+static void nfs_wb_drain(of_entry_t *of) {
+    if (of->wb == NULL) {
         return;
     }
-    add_ready_proc(pid);
+    nfs_wb_start(of->wb);
+    // the buffer leaves the file if it is closed meanwhile
+    while (of->wb && of->wb->inflight) {
+        if (!nfs_wb_wait(of->wb)) {
+            return;
+        }
+    }
 }
 
 /**
- * @brief  Fire the write callback
+ * @brief Flush the write-back buffers of a file, closed or not, and wait
+ *        until the server has everything written to it so far
  *
+ * @return whether there was anything to wait for
  */
+static bool nfs_wb_drain_fh(const fhandle3_t *fh) {
+    bool waited = false;
+again:
+    for (nfs_wbuf_t *wb = wbufs; wb; wb = wb->next) {
+        if (memcmp(&wb->fh, fh, sizeof(fhandle3_t)) != 0) {
+            continue;
+        }
+        nfs_wb_start(wb);
+        if (wb->inflight == 0) {
+            continue;
+        }
+        if (!nfs_wb_wait(wb)) {
+            return waited;
+        }
+        waited = true;
+        goto again; // the buffer of a closed file is freed with its last flush
+    }
+    return waited;
+}
 
-int sos_nfs_write(iovec_t* iov, int fd, int count) {
-    of_entry_t *of = fd_lookup(current_process(), fd);
-    dprintf(2, "[WRITE] Using %x for fd %d\n", of, fd);
+/**
+ * @brief Gather a small write into the buffer of the file
+ *
+ * @return 0 if the request's data was taken, otherwise it has to be sent
+ *         as it is
+ */
+static int nfs_wb_write(of_entry_t *of, size_t offset, size_t len) {
     sos_proc_t *proc = current_process();
-    pid_t pid = proc->pid;
+    nfs_wbuf_t *wb = of->wb;
+    if (wb == NULL) {
+        wb = malloc(sizeof(nfs_wbuf_t));
+        if (wb == NULL) {
+            return ENOMEM;
+        }
+        memset(wb, 0, offsetof(nfs_wbuf_t, data));
+        wb->fh = *of->fhandle;
+        wb->of = of;
+        wb->next = wbufs;
+        wbufs = wb;
+        of->wb = wb;
+    }
 
-    assert(proc->cont.iov);
-    iov_ensure_loaded(*proc->cont.iov);
-    as_pin_page(proc->vspace, proc->cont.iov->vstart);
+    // copying must not block, or a flush could move the buffer under it
+    for (iovec_t *iov = proc->cont.iov; iov; iov = iov->next) {
+        if (!iov->sos_iov_flag) {
+            iov_ensure_loaded(*iov);
+            as_pin_page(proc->vspace, iov->vstart);
+        }
+    }
+    if (wb->len && offset != wb->offset + wb->len) {
+        nfs_wb_start(wb);
+    }
+    if (wb->len == 0) {
+        wb->offset = offset;
+    }
+    for (iovec_t *iov = proc->cont.iov; iov; iov = iov->next) {
+        sos_vaddr src = iov->sos_iov_flag ?
+                        iov->vstart : as_lookup_sos_vaddr(proc->vspace, iov->vstart);
+        assert(src);
+        for (size_t pos = 0; pos < iov->sz;) {
+            size_t n = umin(iov->sz - pos, NFS_WB_SIZE - wb->len);
+            memcpy(wb->data + wb->len, (char*)src + pos, n);
+            wb->len += n;
+            pos += n;
+            if (wb->len == NFS_WB_SIZE) {
+                nfs_wb_start(wb);
+            }
+        }
+        if (!iov->sos_iov_flag) {
+            as_unpin_page(proc->vspace, iov->vstart);
+        }
+    }
+    if (wb->len && wb->timer == 0) {
+        wb->timer = register_timer(NFS_WB_DELAY, nfs_wb_timeout, wb);
+    }
+    return 0;
+}
 
-    sos_vaddr src = as_lookup_sos_vaddr(proc->vspace, iov->vstart);
-    assert(src);
-    dprintf(2, "Writing to offset: %u %d (%d)bytes\n", of->offset, count, iov->sz);
-    callback_info_t *cb = malloc(sizeof(callback_info_t));
-    if (!cb) {
-        return ENOMEM;
+/**
+ * @brief fsync: write out the buffer of the file, have the server commit
+ *        the unstable writes, and report any write that failed since the
+ *        last sync
+ */
+int sos_nfs_sync(of_entry_t *of) {
+    nfs_wb_drain(of);
+    int err = 0;
+    if (of->wb) {
+        err = of->wb->err;
+        of->wb->err = 0;
     }
-    cb->pid = pid;
-    cb->start_time = time_stamp();
-    int err = nfs_write(of->fhandle, of->offset, iov->sz,
-                        (const void*)src, nfs_write_callback,
-                        (uintptr_t)cb);
-    dprintf(3, "Result from nfs write: %d\n", err);
-    if (err > 0) {
-        free((callback_info_t*)cb);
+    if (of->unstable) {
+        int cerr = nfs_commit_wait(of);
+        if (!err) {
+            err = cerr;
+        }
     }
     return err;
 }
 
+/**
+ * @brief The file is closed: what is buffered still goes to the server,
+ *        the buffer is freed once it's there, and unstable writes are
+ *        committed after the last of it
+ */
+void sos_nfs_release(of_entry_t *of) {
+    nfs_wbuf_t *wb = of->wb;
+    if (wb) {
+        nfs_wb_start(wb);
+        wb->of = NULL;
+        of->wb = NULL;
+        if (wb->inflight) {
+            wb->unstable |= of->unstable;
+            return;
+        }
+        nfs_wb_free(wb);
+    }
+    if (of->unstable && of->fhandle) {
+        nfs_commit_orphan(of->fhandle);
+    }
+}
+
+/**
+ * @brief Memory is short: send every buffered write instead of holding it
+ */
+void sos_nfs_flush_all(void) {
+    for (nfs_wbuf_t *wb = wbufs; wb; wb = wb->next) {
+        nfs_wb_start(wb);
+    }
+}
+
+/**
+ * @brief Read the whole iov list, keeping up to NFS_READ_WINDOW RPCs in
+ *        flight. Returns once every reply is in, having replied to the
+ *        syscall, or for a binary read with cont.counter advanced.
+ */
+int sos_nfs_read(iovec_t* vec, int fd, int count) {
+    (void)vec;
+    (void)count;
+    /*Use effective here, as When we open an executable file, 
+     * we define the reader is the new created client*/
+    sos_proc_t *proc = effective_process(), *cur_proc = current_process();
+    of_entry_t *of = fd_lookup(proc, fd);
+    bool binary = cur_proc->cont.binary_nfs_read;
+
+    assert(cur_proc->cont.iov);
+    nfs_wb_drain(of); // read our own buffered writes back
+    nfs_pipe_t pipe = {
+        .pid = cur_proc->pid,
+        .ready = ready_class(cur_proc),
+        .as = proc->vspace,
+        .pin = !binary, // the loader pins the page it fills itself
+        .write = false,
+        .window = NFS_READ_WINDOW,
+    };
+    dprintf(3, "READING USING PID %d\n", pipe.pid);
+    size_t done;
+    int err = nfs_pipe_run(&pipe, of, &done);
+    if (!err && !pipe.failed) {
+        nfs_readahead(of, pipe.start, done, pipe.end != SIZE_MAX);
+    }
+
+    if (binary) { // let the loader clean up
+        cur_proc->cont.counter += done;
+        if (pipe.failed) {
+            cur_proc->cont.binary_nfs_failed = true;
+        }
+        return err;
+    }
+    return nfs_pipe_reply(&pipe, err, done);
+}
+
+/**
+ * @brief Write the whole iov list, keeping up to NFS_WRITE_WINDOW RPCs in
+ *        flight, and reply with the bytes written before the first short
+ *        or failed piece
+ */
+int sos_nfs_write(iovec_t* iov, int fd, int count) {
+    (void)iov;
+    sos_proc_t *proc = current_process();
+    of_entry_t *of = fd_lookup(proc, fd);
+    dprintf(2, "[WRITE] Using %x for fd %d\n", of, fd);
+
+    assert(proc->cont.iov);
+    size_t *offset = io_offset(proc, of);
+    if ((size_t)count < NFS_WB_SIZE && nfs_wb_write(of, *offset, count) == 0) {
+        *offset += count;
+        syscall_end_continuation(proc, count, true);
+        return 0;
+    }
+    nfs_wb_drain(of); // keep the order of the writes
+    nfs_pipe_t pipe = {
+        .pid = proc->pid,
+        .ready = READY_SYSCALL,
+        .as = proc->vspace,
+        .pin = true,
+        .write = true,
+        .window = NFS_WRITE_WINDOW,
+    };
+    size_t done;
+    int err = nfs_pipe_run(&pipe, of, &done);
+    return nfs_pipe_reply(&pipe, err, done);
+}
+
 /**
  * @brief Put status info in IPC buffer and reply it to client
  *
  */
-static void
-sos_nfs_getattr_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr) {
+static void sos_nfs_stat_reply(sos_proc_t *proc, const fattr3_t *fattr) {
+    sos_stat_t sos_attr;
+    sos_attr.st_type = fattr->type;
+    sos_attr.st_fmode = (int)fattr->mode;
+    sos_attr.st_size = fattr->size;
+    sos_attr.st_ctime = (long)fattr->ctime.seconds;
+    sos_attr.st_atime = (long)fattr->atime.seconds;
+    proc->cont.reply_length = 1 + ipc_put_bin(1, &sos_attr, sizeof(sos_stat_t));
+    syscall_end_continuation(proc, NFS_OK, true);
+}
+
+/**
+ * @brief Stat from a GETATTR, for a lookup that came without attributes
+ */
+static void sos_nfs_getattr_callback(uintptr_t cb, enum nfs_stat status,
+                                     fattr3_t *fattr) {
     pid_t pid = ((callback_info_t*)cb)->pid;
     set_current_process(pid);
     if (!callback_valid((callback_info_t*)cb)) {
@@ -367,47 +1207,136 @@ sos_nfs_getattr_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr) {
     sos_proc_t* proc = current_process();
     if (status != NFS_OK) {
         syscall_end_continuation(proc, SOS_NFS_ERR, false);
-        ERR("NFS failed\n");
+        ERR("getattr failed: %d\n", status);
         return;
     }
-    sos_stat_t sos_attr;
-    sos_attr.st_type = fattr->type;
-    sos_attr.st_fmode = (int)fattr->mode;
-    sos_attr.st_size = fattr->size;
-    sos_attr.st_ctime = (long)fattr->ctime.seconds;
-    sos_attr.st_atime = (long)fattr->atime.seconds;
-    ipc_write_bin(1, (char*)&sos_attr, sizeof(sos_stat_t));
-    proc->cont.reply_length = 2 + ((sizeof(sos_stat_t) + sizeof(seL4_Word) - 1) >> 2);
-    syscall_end_continuation(proc, status, true);
+    sos_nfs_stat_reply(proc, fattr);
 }
 
+/**
+ * @brief The lookup returns the attributes as well, no GETATTR is needed
+ *        unless the server left them out
+ */
 static void sos_nfs_lookup_for_attr(uintptr_t cb, enum nfs_stat status,
-                                    fhandle_t* fh, fattr_t* fattr) {
+                                    fhandle3_t* fh, fattr3_t* fattr) {
     pid_t pid = ((callback_info_t*)cb)->pid;
     set_current_process(pid);
     if (!callback_valid((callback_info_t*)cb)) {
+        free((callback_info_t*)cb);
         return;
     }
 
     sos_proc_t* proc = current_process();
-
+    ncache_enter(proc->cont.path, status, fh, fattr);
+    if (status == NFS_OK && fattr == NULL) {
+        if (nfs3_getattr(fh, sos_nfs_getattr_callback, cb) == RPC_OK) {
+            return;
+        }
+        status = NFSERR_IO;
+    }
+    free((callback_info_t*)cb);
     if (status != NFS_OK) {
         syscall_end_continuation(proc, SOS_NFS_ERR, false);
-        free((callback_info_t*)cb);
         ERR("Did not find file\n");
         return;
     }
-    int err = nfs_getattr(fh, sos_nfs_getattr_callback, cb);
+    sos_nfs_stat_reply(proc, fattr);
+}
+
+/* A LOOKUP a request waits on, see nfs_commit_req_t */
+typedef struct nfs_lookup_req {
+    callback_info_t cb;
+    enum nfs_stat status;
+    fhandle3_t fh;
+    fattr3_t fattr;
+    bool has_attr;
+    bool done;
+} nfs_lookup_req_t;
+
+static void
+nfs_lookup_wait_callback(uintptr_t token, enum nfs_stat status, fhandle3_t *fh,
+                         fattr3_t *fattr) {
+    nfs_lookup_req_t *req = (nfs_lookup_req_t*)token;
+    if (!callback_valid(&req->cb)) {
+        free(req);
+        return;
+    }
+    if (status == NFS_OK && fh == NULL) {
+        status = NFSERR_IO;
+    }
+    req->status = status;
+    if (status == NFS_OK) {
+        req->fh = *fh;
+    }
+    req->has_attr = fattr != NULL;
+    if (fattr) {
+        req->fattr = *fattr;
+    }
+    req->done = true;
+    add_ready_proc(req->cb.pid, READY_SYSCALL);
+}
+
+/**
+ * @brief Look a name up on the server and enter the answer in the name
+ *        cache, blocking the request until it is in
+ *
+ * @return 0, or the error the lookup couldn't be sent with
+ */
+static int nfs_lookup_wait(const char *path) {
+    nfs_lookup_req_t *req = malloc(sizeof(nfs_lookup_req_t));
+    if (req == NULL) {
+        return ENOMEM;
+    }
+    req->cb.pid = current_process()->pid;
+    req->cb.start_time = time_stamp();
+    req->done = false;
+    int err = nfs3_lookup(&mnt_point, path, nfs_lookup_wait_callback, (uintptr_t)req);
     if (err) {
-        syscall_end_continuation(proc, SOS_NFS_ERR, false);
-        free((callback_info_t*)cb);
+        free(req);
+        return err;
+    }
+    while (!req->done) {
+        coroutine_wait();
     }
+    ncache_enter(path, req->status, &req->fh, req->has_attr ? &req->fattr : NULL);
+    free(req);
+    return 0;
 }
 
 int sos_nfs_getattr(void) {
     sos_proc_t *proc = current_process();
     pid_t pid = proc->pid;
 
+    fhandle3_t fh;
+    fattr3_t fattr;
+    bool attr_valid;
+    ncache_result_t found = ncache_lookup(proc->cont.path, &fh, &fattr, &attr_valid);
+    if (found == NCACHE_MISS) { // the handle tells which buffers are the file's
+        int err = nfs_lookup_wait(proc->cont.path);
+        if (err) {
+            ERR("NFS stat said: %d\n", err);
+            return err;
+        }
+        found = ncache_lookup(proc->cont.path, &fh, &fattr, &attr_valid);
+    }
+    // buffered writes, ours or another process's, aren't in the size yet
+    if (found == NCACHE_FOUND && nfs_wb_drain_fh(&fh)) {
+        found = ncache_lookup(proc->cont.path, &fh, &fattr, &attr_valid);
+    }
+    switch (found) {
+    case NCACHE_NOENT:
+        syscall_end_continuation(proc, SOS_NFS_ERR, false);
+        return 0;
+    case NCACHE_FOUND:
+        if (attr_valid) {
+            sos_nfs_stat_reply(proc, &fattr);
+            return 0;
+        }
+        break; // a lookup costs the same as a getattr, and refreshes both
+    case NCACHE_MISS:
+        break;
+    }
+
     current_process()->cont.callback_start_time = time_stamp();
     callback_info_t *cb = malloc(sizeof(callback_info_t));
     if (!cb) {
@@ -415,8 +1344,8 @@ int sos_nfs_getattr(void) {
     }
     cb->pid = pid;
     cb->start_time = time_stamp();
-    int err = nfs_lookup(&mnt_point, current_process()->cont.path, sos_nfs_lookup_for_attr,
-                         (uintptr_t)cb);
+    int err = nfs3_lookup(&mnt_point, current_process()->cont.path, sos_nfs_lookup_for_attr,
+                          (uintptr_t)cb);
     if (err) {
         free(cb);
         ERR("NFS stat said: %d\n", err);
@@ -425,12 +1354,11 @@ int sos_nfs_getattr(void) {
 }
 
 /**
- * @brief Return file name in a certain position to client 
+ * @brief Finish a SEEK_END lseek once the file size is known
  *
  */
 static void
-nfs_readdir_callback(uintptr_t cb, enum nfs_stat status, int num_files,
-                     char* file_names[], nfscookie_t nfscookie) {
+sos_nfs_seek_end_callback(uintptr_t cb, enum nfs_stat status, fattr3_t *fattr) {
     pid_t pid = ((callback_info_t*)cb)->pid;
     set_current_process(pid);
     if (!callback_valid((callback_info_t*)cb)) {
@@ -440,59 +1368,261 @@ nfs_readdir_callback(uintptr_t cb, enum nfs_stat status, int num_files,
     free((callback_info_t*)cb);
 
     sos_proc_t *proc = current_process();
-    if (status != NFS_OK) {
+    of_entry_t *of = fd_lookup(proc, proc->cont.fd);
+    if (status != NFS_OK || of == NULL) {
         syscall_end_continuation(proc, SOS_NFS_ERR, false);
         return;
     }
-    if (proc->cont.position_arg <= 0) {
+    long pos = (long)fattr->size + proc->cont.seek_offset;
+    if (pos < 0) {
         syscall_end_continuation(proc, SOS_NFS_ERR, false);
         return;
     }
-    dprintf(2, "readir_callback:count=%d,target=%d,nfiles=%d\n", proc->cont.counter, proc->cont.position_arg, num_files);
-    if (proc->cont.position_arg <= proc->cont.counter + num_files) {
-        char *file = file_names[proc->cont.position_arg - proc->cont.counter - 1];
-        size_t str_len = umin(strlen(file) + 1, proc->cont.length_arg);
-        ipc_write_bin(1, file, str_len);
-        proc->cont.reply_length = 2 + ((str_len + sizeof(seL4_Word) - 1) >> 2);
-        syscall_end_continuation(proc, strlen(file) + 1, true);
-        return;
+    of->offset = (size_t)pos;
+    syscall_end_continuation(proc, pos, true);
+}
+
+int sos_nfs_lseek_end(of_entry_t *of) {
+    nfs_wb_drain(of); // the size has to include buffered writes
+    callback_info_t *cb = malloc(sizeof(callback_info_t));
+    if (!cb) {
+        return ENOMEM;
     }
-    proc->cont.counter += num_files;
+    cb->pid = current_process()->pid;
+    cb->start_time = time_stamp();
+    int err = nfs3_getattr(of->fhandle, sos_nfs_seek_end_callback, (uintptr_t)cb);
+    if (err) {
+        free(cb);
+    }
+    return err;
+}
 
-    if (nfscookie == 0) {
-        proc->cont.reply_length = 2;
-        seL4_SetMR(1, 0);
-        syscall_end_continuation(proc, 0, true);
+/* One READDIRPLUS call filling a listing. Freed by the request, or by the
+ * callback if the request is gone. */
+typedef struct nfs_readdir_req {
+    callback_info_t cb;
+    dcache_dir_t *dir;
+    enum nfs_stat status;
+    int err;
+    nfscookie3_t cookie;
+    nfs3_cookieverf_t verf;
+    bool done;
+} nfs_readdir_req_t;
+
+/**
+ * @brief Add the names to the listing, and remember the handles and
+ *        attributes that came with them so opening or stating the files
+ *        needs no lookup
+ */
+static void
+nfs_readdir_callback(uintptr_t token, enum nfs_stat status, int num_files,
+                     nfs3_dirent_t *files, nfscookie3_t nfscookie,
+                     nfs3_cookieverf_t *verf) {
+    nfs_readdir_req_t *req = (nfs_readdir_req_t*)token;
+    if (!callback_valid(&req->cb)) {
+        dcache_abort(req->dir);
+        free(req);
         return;
     }
-    proc->cont.cookie = nfscookie;
-    add_ready_proc(pid);
+    dprintf(2, "readdir_callback: nfiles=%d, cookie=%llu\n", num_files, nfscookie);
+    for (int i = 0; status == NFS_OK && !req->err && i < num_files; i++) {
+        req->err = dcache_append(req->dir, files[i].name);
+        if (files[i].fh) {
+            ncache_enter(files[i].name, NFS_OK, files[i].fh, files[i].fattr);
+        }
+    }
+    req->status = status;
+    req->cookie = nfscookie;
+    if (status == NFS_OK) {
+        req->verf = *verf;
+    }
+    req->done = true;
+    add_ready_proc(req->cb.pid, READY_SYSCALL);
+}
+
+/**
+ * @brief Read a whole directory from the server into a new listing,
+ *        blocking the request until the last READDIR is answered
+ *
+ * @param err returns what went wrong if there is no listing
+ * @return the listing, not installed in the cache yet
+ */
+static dcache_dir_t *nfs_readdir_fill(const fhandle3_t *dir, int *err) {
+    dcache_dir_t *d = dcache_begin(dir);
+    if (d == NULL) {
+        *err = ENOMEM;
+        return NULL;
+    }
+    nfscookie3_t cookie = 0;
+    nfs3_cookieverf_t verf = {{ 0 }};
+    do {
+        nfs_readdir_req_t *req = malloc(sizeof(nfs_readdir_req_t));
+        if (req == NULL) {
+            *err = ENOMEM;
+            break;
+        }
+        req->cb.pid = current_process()->pid;
+        req->cb.start_time = time_stamp();
+        req->dir = d;
+        req->err = 0;
+        req->done = false;
+        *err = nfs3_readdirplus(dir, cookie, &verf, nfs_readdir_callback, (uintptr_t)req);
+        if (*err) {
+            free(req);
+            break;
+        }
+        while (!req->done) {
+            coroutine_wait();
+        }
+        if (req->status != NFS_OK) {
+            ERR("readdir failed: %d\n", req->status);
+            *err = EIO;
+        } else {
+            *err = req->err;
+        }
+        cookie = req->cookie;
+        verf = req->verf;
+        free(req);
+    } while (!*err && cookie != 0);
+
+    if (*err) {
+        dcache_abort(d);
+        return NULL;
+    }
+    return d;
 }
 
+/**
+ * @brief The listing of the mount point, read from the server if there is
+ *        no recent one. Blocks the request.
+ *
+ * @param fresh returns whether the listing was just read, and has to be
+ *        installed with dcache_commit() once the request is done with it
+ * @return the listing, NULL if it couldn't be read and *err says why
+ */
+static dcache_dir_t *nfs_listing(bool *fresh, int *err) {
+    dcache_dir_t *d = dcache_find(&mnt_point);
+    *fresh = d == NULL;
+    *err = 0;
+    if (d == NULL) {
+        d = nfs_readdir_fill(&mnt_point, err);
+    }
+    return d;
+}
+
+/**
+ * @brief Return file name in a certain position to client 
+ *
+ */
 int sos_nfs_readdir(void) {
-    pid_t pid = current_process()->pid;
-    if (current_process()->cont.length_arg == 0) {
+    sos_proc_t *proc = current_process();
+    if (proc->cont.length_arg == 0) {
         return 1;
     }
-    callback_info_t *cb = malloc(sizeof(callback_info_t));
-    if (!cb) {
-        return ENOMEM;
+    if (proc->cont.position_arg <= 0) {
+        return EINVAL;
     }
-    cb->pid = pid;
-    cb->start_time = time_stamp();
-    int err = nfs_readdir(&mnt_point, current_process()->cont.cookie, nfs_readdir_callback,
-                          (uintptr_t)cb);
-    if (err < 0) {
-        free(cb);
+    bool fresh;
+    int err;
+    dcache_dir_t *d = nfs_listing(&fresh, &err);
+    if (d == NULL) {
+        return err;
     }
-    return err;
+
+    int pos = proc->cont.position_arg - 1;
+    dprintf(2, "readdir: target=%d, nfiles=%d\n", pos, dcache_count(d));
+    if (pos < dcache_count(d)) {
+        const char *file = dcache_name(d, pos);
+        size_t str_len = umin(strlen(file) + 1, proc->cont.length_arg);
+        proc->cont.reply_length = 1 + ipc_put_bin(1, file, str_len);
+        syscall_end_continuation(proc, strlen(file) + 1, true);
+    } else {
+        proc->cont.reply_length = 2;
+        seL4_SetMR(1, 0);
+        syscall_end_continuation(proc, 0, true);
+    }
+    if (fresh) {
+        dcache_commit(d);
+    }
+    return 0;
 }
 
-int sos_nfs_init(const char* dir) {
+/**
+ * @brief Return as many file names from a certain position on as fit in
+ *        the client's buffer and the reply, each NUL terminated. The first
+ *        one is truncated if the buffer is too small for it.
+ */
+int sos_nfs_readdirs(void) {
+    sos_proc_t *proc = current_process();
+    if (proc->cont.length_arg == 0) {
+        return 1;
+    }
+    if (proc->cont.position_arg <= 0) {
+        return EINVAL;
+    }
+    bool fresh;
     int err;
-    err = register_tick_event(nfs_timeout);
-    if (err) {
+    dcache_dir_t *d = nfs_listing(&fresh, &err);
+    if (d == NULL) {
         return err;
     }
+
+    char names[seL4_MsgMaxLength * sizeof(seL4_Word)];
+    size_t room = umin(proc->cont.length_arg, ipc_room(2));
+    size_t used = 0;
+    int n = 0;
+    for (int pos = proc->cont.position_arg - 1; pos < dcache_count(d); pos++) {
+        const char *file = dcache_name(d, pos);
+        size_t len = strlen(file) + 1;
+        if (used + len > room) {
+            if (n == 0) {
+                memcpy(names, file, room - 1);
+                names[room - 1] = 0;
+                used = room;
+                n = 1;
+            }
+            break;
+        }
+        memcpy(names + used, file, len);
+        used += len;
+        n++;
+    }
+    dprintf(2, "readdirs: %d names from %d\n", n, proc->cont.position_arg - 1);
+    proc->cont.reply_length = 1 + ipc_put_bin(1, names, used);
+    syscall_end_continuation(proc, n, true);
+    if (fresh) {
+        dcache_commit(d);
+    }
+    return 0;
+}
+
+/**
+ * @brief Settle how much data one read or write RPC carries: as much as
+ *        both sos and the server take, in whole blocks for reads
+ */
+static void nfs_negotiate_xfer(void) {
+    nfs3_fsinfo_t info;
+    if (nfs3_fsinfo(&mnt_point, &info) != RPC_OK) {
+        WARN("NFS FSINFO failed, transfers stay at %u bytes\n", nfs_wsize);
+        return;
+    }
+    size_t max = umin(NFS_XFER_SIZE, NFS3_MAXDATA);
+    size_t rsize = umin(max, info.rtmax) / BCACHE_BLOCK_SIZE * BCACHE_BLOCK_SIZE;
+    size_t wsize = umin(max, info.wtmax) & ~3;
+    if (rsize == 0) {
+        WARN("NFS server reads %u bytes at most, less than a block\n", info.rtmax);
+    } else {
+        nfs_rsize = rsize;
+    }
+    if (wsize > 0) {
+        nfs_wsize = wsize;
+    }
+    dprintf(0, "NFS transfers: %u byte reads, %u byte writes\n", nfs_rsize, nfs_wsize);
+}
+
+int sos_nfs_init(const char* dir) {
+    /* every request gets its own retransmission deadline, no periodic tick */
+    nfs_set_timer(register_timer, remove_timer, time_stamp);
+    nfs_negotiate_xfer();
     return 0;
 }
@@ -1,13 +1,13 @@
 #ifndef _SOS_NFS_H_
 #define _SOS_NFS_H_
 
-#include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 #include "syscall.h"
 
 /**
  * NFS mount point
  */
-extern fhandle_t mnt_point;
+extern fhandle3_t mnt_point;
 
 int sos_nfs_open(const char* filename, fmode_t mode);
 
@@ -17,8 +17,18 @@ int sos_nfs_write(iovec_t* iov, int fd, int count);
 
 int sos_nfs_getattr(void);
 
+int sos_nfs_lseek_end(of_entry_t *of);
+
 int sos_nfs_readdir(void);
 
+int sos_nfs_readdirs(void);
+
+int sos_nfs_sync(of_entry_t *of);
+
+void sos_nfs_release(of_entry_t *of);
+
+void sos_nfs_flush_all(void);
+
 int sos_nfs_init(const char* dir);
 
 extern io_device_t nfs_io;
@@ -0,0 +1,116 @@
+/**
+ * @file sos_poll.c
+ * @brief poll() over a process's open files
+ *
+ * NFS files and console output are always ready. Only console input can
+ * make poll block; serial.c wakes the poller when a line arrives, and a
+ * timer wakes it when the timeout expires. The request stays suspended
+ * in its coroutine between wake-ups and re-checks every fd.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <syscallno.h>
+#include <clock/clock.h>
+
+#include "sos_poll.h"
+#include "process.h"
+#include "syscall.h"
+#include "serial.h"
+#include "coroutine.h"
+#include "scheduler.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+/**
+ * @brief Wake a process suspended in poll, so it checks its fds again
+ */
+void poll_wake(pid_t pid) {
+    sos_proc_t *proc = process_lookup(pid);
+    if (proc && proc->cont.syscall_number == SOS_SYSCALL_POLL && proc->cont.poll_waiting) {
+        proc->cont.poll_waiting = false;
+        add_ready_proc(pid, READY_SYSCALL);
+    }
+}
+
+static void poll_timeout(uint32_t id, void *data) {
+    sos_proc_t *proc = process_lookup((pid_t)data);
+    if (proc && proc->cont.poll_timer == id) { // not a later request of a reused pid
+        proc->cont.poll_timer = 0;
+        proc->cont.poll_timed_out = true;
+        poll_wake(proc->pid);
+    }
+}
+
+/**
+ * @brief Readiness of one fd for the requested events
+ */
+static short poll_fd(sos_proc_t *proc, int fd, short events) {
+    of_entry_t *of = fd_lookup(proc, fd);
+    if (of == NULL || of->io == NULL) {
+        return POLLNVAL;
+    }
+    short revents = 0;
+    if ((events & POLLIN) && (of->mode & FM_READ)) {
+        if (of->io != &serial_io || sos_serial_readable()) {
+            revents |= POLLIN;
+        }
+    }
+    if ((events & POLLOUT) && (of->mode & FM_WRITE)) {
+        revents |= POLLOUT;
+    }
+    return revents;
+}
+
+int sos__sys_poll(void) {
+    sos_proc_t *proc = current_process();
+    int nfds = (int)seL4_GetMR(1);
+    int timeout = (int)seL4_GetMR(2);
+    int fds[SOS_POLL_MAX];
+    short events[SOS_POLL_MAX];
+    short revents[SOS_POLL_MAX];
+
+    if (nfds < 0 || nfds > SOS_POLL_MAX) {
+        return EINVAL;
+    }
+    for (int i = 0; i < nfds; i++) {
+        fds[i] = (int)seL4_GetMR(POLL_MESSAGE_START + 2 * i);
+        events[i] = (short)seL4_GetMR(POLL_MESSAGE_START + 2 * i + 1);
+    }
+    if (timeout > 0) {
+        proc->cont.poll_timer = register_timer(1000ULL * timeout, poll_timeout,
+                                               (void*)proc->pid);
+        if (proc->cont.poll_timer == 0) {
+            return ENOMEM;
+        }
+    }
+
+    int ready;
+    while (1) {
+        ready = 0;
+        for (int i = 0; i < nfds; i++) {
+            revents[i] = fds[i] < 0 ? 0 : poll_fd(proc, fds[i], events[i]);
+            ready += revents[i] != 0;
+        }
+        if (ready || timeout == 0 || proc->cont.poll_timed_out) {
+            break;
+        }
+        dprintf(3, "[POLL] %d waiting on %d fds\n", proc->pid, nfds);
+        proc->cont.poll_waiting = true;
+        coroutine_wait();
+    }
+    if (proc->cont.poll_timer) {
+        remove_timer(proc->cont.poll_timer);
+    }
+    for (int i = 0; i < nfds; i++) {
+        seL4_SetMR(POLL_REPLY_START + i, (seL4_Word)revents[i]);
+    }
+    proc->cont.reply_length = POLL_REPLY_START + nfds;
+    syscall_end_continuation(proc, ready, true);
+    return 0;
+}
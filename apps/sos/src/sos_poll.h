@@ -0,0 +1,12 @@
+/** sos_poll.h --- Waiting on several file descriptors and a timeout **/
+
+#ifndef _SOS_POLL_H_
+#define _SOS_POLL_H_
+
+#include <sos.h>
+
+int sos__sys_poll(void);
+
+void poll_wake(pid_t pid);
+
+#endif
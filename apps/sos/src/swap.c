@@ -4,11 +4,11 @@
  */
 
 #include <stdbool.h>
-#include <setjmp.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <assert.h>
-#include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 #include <limits.h>
 #include <clock/clock.h>
 
@@ -16,6 +16,8 @@
 #include "process.h"
 #include "network.h"
 #include "syscall.h"
+#include "coroutine.h"
+#include "scheduler.h"
 
 #define verbose 0
 #include <log/debug.h>
@@ -25,35 +27,34 @@
 #define ALIGNED(page) (page % PAGE_SIZE == 0)
 #define VADDR_TO_SADDR(vaddr) ((vaddr-swap_table)*PAGE_SIZE)
 
-static const int swap_generic_error = -2;
-#define OPEN -1
-
-static fhandle_t swap_handle;
+static fhandle3_t swap_handle;
 static bool inited = false;
+/* Swap pages are written unstable. The server reports the same verifier
+ * until it restarts, and pages written before a restart may be lost. */
+static nfs3_writeverf_t swap_verf;
+static bool swap_verf_valid = false;
 
 /*free page space list*/
 static swap_entry_t * free_list;
 /*swap table: each entry in swap table represents a page size space in swap file*/
 static swap_entry_t * swap_table;
-extern jmp_buf ipc_event_env;
 
 /**
  * @brief   Allocate a swap page space. 
  *          Takes O(1) time to get a free space from free_list 
- *          Kill current client if it fails to allocate it
  *
- * @return offset in swap file
+ * @param saddr where to store the offset in swap file
+ *
+ * @return 0 on success, ENOSPC if the swap file is full
  */
-static swap_addr swap_alloc(void) {
+static int swap_alloc(swap_addr *saddr) {
     if (free_list == NULL) {
         ERR("swap file is full !");
-        process_delete(current_process());
-        longjmp(ipc_event_env, -1);
-    } else {
-        swap_addr ret = VADDR_TO_SADDR(free_list);
-        free_list = free_list->next_free;
-        return ret;
+        return ENOSPC;
     }
+    *saddr = VADDR_TO_SADDR(free_list);
+    free_list = free_list->next_free;
+    return 0;
 }
 
 /**
@@ -71,8 +72,8 @@ void swap_free(swap_addr saddr) {
  * @brief swap file creation callback. Stop sos if it fails to create swap file
  */
 static void
-sos_nfs_swap_create_callback(uintptr_t cb, enum nfs_stat status, fhandle_t *fh,
-                        fattr_t *fattr) {
+sos_nfs_swap_create_callback(uintptr_t cb, enum nfs_stat status, fhandle3_t *fh,
+                        fattr3_t *fattr) {
     dprintf(4, "[SWAP] Invoking nfs_create callback\n");
     pid_t token = ((callback_info_t*)cb)->pid;
     set_current_process(token);
@@ -83,28 +84,33 @@ sos_nfs_swap_create_callback(uintptr_t cb, enum nfs_stat status, fhandle_t *fh,
     free((callback_info_t*)cb);
 
     sos_proc_t *proc = current_process();
+    if (status == NFS_OK && fh == NULL) {
+        ERR("[SWAP] create returned no file handle\n");
+        status = NFSERR_IO;
+    }
     if (status != NFS_OK) {
         ERR("[SWAP] Failed to create swap file\n");
-        return;
+        proc->cont.swap_status = SWAP_FAILED;
+    } else {
+        swap_handle = *fh;
+        inited = true;
+        proc->cont.swap_status = SWAP_SUCCESS;
     }
-    swap_handle = *fh;
-    inited = true;
-    add_ready_proc(proc->pid);
-    return;
+    add_ready_proc(proc->pid, READY_PAGING);
 }
 
 /**
- * @brief open swap file callback
+ * @brief Create the swap file, blocking until the NFS server answered
+ *
+ * @return 0 on success, non-zero on failure
  */
-static void sos_swap_open(void) {
-    uint32_t clock_upper = time_stamp() >> 32;
-    uint32_t clock_lower = (time_stamp() << 32) >> 32;
-    struct sattr default_attr = {.mode = 0x7,
-                                     .uid = 0,
-                                     .gid = 0,
-                                     .size = 0,
-                                     .atime = {clock_upper, clock_lower},
-                                     .mtime = {clock_upper, clock_lower}};
+static int sos_swap_open(void) {
+    sattr3_t default_attr = {.mode = 0x7,
+                             .uid = 0,
+                             .gid = 0,
+                             .size = 0,
+                             .atime = {(uint32_t)-1, 0},
+                             .mtime = {(uint32_t)-1, 0}};
 
     sos_proc_t *proc = current_process();
     proc->cont.swap_status = SWAP_RUNNING;
@@ -115,24 +121,27 @@ static void sos_swap_open(void) {
     if (!cb) {
         ERR("[SWAP] nfs_create failed\n");
         proc->cont.swap_status = SWAP_FAILED;
-        longjmp(ipc_event_env, swap_generic_error);
+        return ENOMEM;
     }
     cb->pid = pid;
     cb->start_time = time_stamp();
-    if(nfs_create(&mnt_point, SWAP_FILE, &default_attr, sos_nfs_swap_create_callback,
+    if(nfs3_create(&mnt_point, SWAP_FILE, &default_attr, sos_nfs_swap_create_callback,
                   (uintptr_t)cb)) {
         free((callback_info_t*)cb);
         ERR("[SWAP] nfs_create failed\n");
         proc->cont.swap_status = SWAP_FAILED;
-        longjmp(ipc_event_env, swap_generic_error);
+        return EIO;
     }
+    coroutine_wait();
+    return proc->cont.swap_status == SWAP_SUCCESS ? 0 : EIO;
 }
 
 /**
  * @brief similar to nfs_write_callback, except it resume the process when writing complete 
  */
 static void
-swap_write_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr, int count) {
+swap_write_callback(uintptr_t cb, enum nfs_stat status, fattr3_t *fattr, int count,
+                    enum nfs3_stable_how committed, nfs3_writeverf_t *verf) {
     dprintf(4, "[SWAP] Write callback\n");
     pid_t token = ((callback_info_t*)cb)->pid;
     set_current_process(token);
@@ -146,8 +155,14 @@ swap_write_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr, int coun
         ERR("[SWAP] Failed to write to swap file");
         proc->cont.swap_status = SWAP_FAILED;
         free((callback_info_t*)cb);
+        add_ready_proc(proc->pid, READY_PAGING);
         return;
     }
+    if (swap_verf_valid && memcmp(&swap_verf, verf, sizeof(*verf)) != 0) {
+        ERR("[SWAP] server restarted, swapped out pages may be lost\n");
+    }
+    swap_verf = *verf;
+    swap_verf_valid = true;
     proc->cont.swap_cnt += count;
 
     dprintf(3, "[SWAP] write callback: sos addr: %x, offset: %u, proc->cont.swap_cnt: %u, count: %d\n",
@@ -157,39 +172,44 @@ swap_write_callback(uintptr_t cb, enum nfs_stat status, fattr_t *fattr, int coun
         proc->cont.swap_status = SWAP_SUCCESS;
         proc->cont.swap_cnt = 0;
         free((callback_info_t*)cb);
-        add_ready_proc(proc->pid);
+        add_ready_proc(proc->pid, READY_PAGING);
         return;
     }
     int cnt = proc->cont.swap_cnt;
     dprintf(3, "[SWAP] Asking to write PAGE_SIZE - cnt (%u) bytes\n", PAGE_SIZE - cnt);
-    if (nfs_write(&swap_handle, proc->cont.swap_file_offset + cnt, PAGE_SIZE - cnt,
-                  (void*)(proc->cont.swap_page+cnt), swap_write_callback,
-                  (uintptr_t)cb)) {
+    if (nfs3_write(&swap_handle, proc->cont.swap_file_offset + cnt, PAGE_SIZE - cnt,
+                   (void*)(proc->cont.swap_page+cnt), NFS3_UNSTABLE, swap_write_callback,
+                   (uintptr_t)cb)) {
         proc->cont.swap_status = SWAP_FAILED;
+        free((callback_info_t*)cb);
+        add_ready_proc(proc->pid, READY_PAGING);
         return;
     }
 }
 
 /**
- * @brief swap write
+ * @brief swap write, blocks the current request until the page is on disk
  *
  * @param page page need to be swapped out
+ * @param saddr where to store the swap file offset of the page
  *
- * @return swap file offset
+ * @return 0 on success, non-zero on failure
  */
-swap_addr sos_swap_write(sos_vaddr page) {
+int sos_swap_write(sos_vaddr page, swap_addr *saddr) {
     assert(ALIGNED(page));
     sos_proc_t *proc = current_process();
 
-    proc->cont.swap_status = SWAP_RUNNING;
     dprintf(3, "[SWAP] Swap write invoked\n");
-    if (!inited) {
-        sos_swap_open();
-        longjmp(ipc_event_env, -1);
+    if (!inited && sos_swap_open()) {
+        return EIO;
     }
     pid_t pid = proc->pid;
+    proc->cont.swap_status = SWAP_RUNNING;
     proc->cont.swap_page = page;
-    proc->cont.swap_file_offset = swap_alloc();
+    proc->cont.swap_cnt = 0;
+    if (swap_alloc(&proc->cont.swap_file_offset)) {
+        return ENOSPC;
+    }
     assert(ALIGNED(proc->cont.swap_file_offset));
     // compute chksum
     {
@@ -204,26 +224,32 @@ swap_addr sos_swap_write(sos_vaddr page) {
     callback_info_t *cb = malloc(sizeof(callback_info_t));
     if (!cb) {
         ERR("Unable to create callback\n");
-        longjmp(ipc_event_env, -1);
+        swap_free(proc->cont.swap_file_offset);
+        return ENOMEM;
     }
     cb->pid = pid;
     cb->start_time = time_stamp();
 
-    if (nfs_write(&swap_handle, proc->cont.swap_file_offset, PAGE_SIZE,
-                  (const void*)proc->cont.swap_page, swap_write_callback,
-                  (uintptr_t)cb) != RPC_OK) {
+    if (nfs3_write(&swap_handle, proc->cont.swap_file_offset, PAGE_SIZE,
+                   (const void*)proc->cont.swap_page, NFS3_UNSTABLE, swap_write_callback,
+                   (uintptr_t)cb) != RPC_OK) {
         proc->cont.swap_status = SWAP_FAILED;
         free((callback_info_t*)cb);
-        process_delete(current_process());
-        longjmp(ipc_event_env, swap_generic_error);
+        swap_free(proc->cont.swap_file_offset);
+        return EIO;
+    }
+    coroutine_wait();
+    if (proc->cont.swap_status != SWAP_SUCCESS) {
+        swap_free(proc->cont.swap_file_offset);
+        return EIO;
     }
-    proc->cont.swap_write_fired = true;
-    return proc->cont.swap_file_offset;
+    *saddr = proc->cont.swap_file_offset;
+    return 0;
 }
 
 static void
 swap_read_callback(uintptr_t cb, enum nfs_stat status,
-                      fattr_t *fattr, int count, void* data) {
+                      fattr3_t *fattr, int count, bool eof, void* data) {
     dprintf(4, "[SWAP] Read callback\n");
     assert(cb);
     pid_t token = ((callback_info_t*)cb)->pid;
@@ -235,23 +261,19 @@ swap_read_callback(uintptr_t cb, enum nfs_stat status,
     free((callback_info_t*)cb);
 
     (void)fattr;
+    (void)eof;
     sos_proc_t *proc = current_process();
     assert(proc);
-    if (status != NFS_OK) {
+    add_ready_proc(proc->pid, READY_PAGING);
+    if (status != NFS_OK || count == 0) {
         ERR("Failed to read from swap file\n");
-        process_delete(proc);
-        return;
-    }
-    if (count == 0) {
-        ERR("Failed to read from swap file\n");
-        process_delete(proc);
+        proc->cont.swap_status = SWAP_FAILED;
         return;
     }
 
     assert(count == PAGE_SIZE);
     assert(proc->cont.swap_status != SWAP_SUCCESS);
     proc->cont.swap_status = SWAP_SUCCESS;
-    add_ready_proc(proc->pid);
     memcpy((char*)proc->cont.swap_page, (char*)data, count);
     { // check chksum
         int code = 0;
@@ -268,12 +290,14 @@ swap_read_callback(uintptr_t cb, enum nfs_stat status,
 }
 
 /**
- * @brief swap in
+ * @brief swap in, blocks the current request until the page is read
  *
  * @param page vaddr of page needs to be swapped in
  * @param pos position of page in swap file
+ *
+ * @return 0 on success, non-zero on failure
  */
-void sos_swap_read(sos_vaddr page, swap_addr pos) {
+int sos_swap_read(sos_vaddr page, swap_addr pos) {
     assert(inited);
     assert(ALIGNED(page));
     assert(ALIGNED(pos));
@@ -290,17 +314,19 @@ void sos_swap_read(sos_vaddr page, swap_addr pos) {
     if (!cb) {
         ERR("[SWAP] Read failed\n");
         proc->cont.swap_status = SWAP_FAILED;
-        longjmp(ipc_event_env, swap_generic_error);
+        return ENOMEM;
     }
     cb->pid = pid;
     cb->start_time = time_stamp();
 
-    if(nfs_read(&swap_handle, pos, PAGE_SIZE, swap_read_callback, (uintptr_t)cb)) {
+    if(nfs3_read(&swap_handle, pos, PAGE_SIZE, swap_read_callback, (uintptr_t)cb)) {
         ERR("[SWAP] Read failed\n");
         proc->cont.swap_status = SWAP_FAILED;
         free((callback_info_t*)cb);
-        longjmp(ipc_event_env, swap_generic_error);
+        return EIO;
     }
+    coroutine_wait();
+    return proc->cont.swap_status == SWAP_SUCCESS ? 0 : EIO;
 }
 
 void swap_init(void * vaddr) {
@@ -10,17 +10,19 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
-#include <setjmp.h>
 #include <serial/serial.h>
 #include <cspace/cspace.h>
 #include <limits.h>
 #include "serial.h"
+#include "sos_nfs.h"
 #include "frametable.h"
 #include "page_replacement.h"
 #include "process.h"
 #include "file.h"
 #include "addrspace.h"
 #include "syscall.h"
+#include "coroutine.h"
+#include "ring.h"
 #include <assert.h>
 #include <sos.h>
 #include <syscallno.h>
@@ -30,17 +32,9 @@
 #include <log/debug.h>
 #include <log/panic.h>
 
-#define PRINT_MESSAGE_START (2)
-
 extern io_device_t serial_io;
 extern io_device_t nfs_io;
 extern seL4_CPtr _sos_ipc_ep_cap;
-/* Contains client whose syscall executions are ready to continue after callbacks get executed */
-static pid_t ready_procs[MAX_PROCESS_NUM];
-static int head = 0, tail = -1, nproc = 0;
-
-extern jmp_buf ipc_event_env;
-
 static inline unsigned CONST umin(unsigned a, unsigned b) {
     return (a < b) ? a : b;
 }
@@ -49,36 +43,6 @@ static inline unsigned CONST umax(unsigned a, unsigned b) {
     return (a > b) ? a : b;
 }
 
-/**
- * @brief Add a client to ready client queue (resume a process)
- *
- */
-void add_ready_proc(pid_t pid) {
-    assert(pid);
-    nproc++;
-    tail = (tail+1) % MAX_PROCESS_NUM;
-    ready_procs[tail] = pid;
-    assert(nproc <= MAX_PROCESS_NUM);
-    for (int i =  head; i < tail; i = (i+1)%MAX_PROCESS_NUM) {
-        assert(ready_procs[i] != pid);  
-    }
-}
-
-/**
- * @brief Retrive next ready client process 
- */
-pid_t next_ready_proc() {
-    nproc--;
-    assert(ready_procs[head]);    
-    pid_t ret = ready_procs[head];
-    ready_procs[head] = 0;
-    head = (head+1)%MAX_PROCESS_NUM;
-    return ret;
-}
-bool has_ready_proc() {
-    return nproc > 0;
-}
-
 /**
  * @brief unpin pages in iov list
  *
@@ -104,6 +68,87 @@ void iov_free(iovec_t *iov) {
     }
 }
 
+/* Reply fast path. A new request leaves its reply cap in the kernel's caller
+ * slot; it is only saved into our cspace if the request blocks. A request
+ * which finishes before that parks its reply here, and the event loop sends
+ * it with the seL4_ReplyWait that receives the next message. */
+static pid_t unsaved_reply_pid = 0;
+static bool reply_pending = false;
+static seL4_MessageInfo_t pending_reply;
+static seL4_Word pending_mrs[seL4_MsgMaxLength];
+
+/**
+ * @brief Leave the reply cap of a new request in the caller slot
+ *
+ */
+void syscall_defer_reply_cap(sos_proc_t *proc) {
+    assert(!unsaved_reply_pid && !reply_pending);
+    proc->cont.reply_cap = seL4_CapNull;
+    unsaved_reply_pid = proc->pid;
+}
+
+/**
+ * @brief Save the reply cap of the current request if it is still pending.
+ *        Must be called before sos waits on its endpoint again.
+ */
+void syscall_save_reply_cap(void) {
+    if (!unsaved_reply_pid) {
+        return;
+    }
+    sos_proc_t *proc = process_lookup(unsaved_reply_pid);
+    unsaved_reply_pid = 0;
+    if (proc) { // the client may have been killed by its own request
+        proc->cont.reply_cap = cspace_save_reply_cap(cur_cspace);
+        conditional_panic(!proc->cont.reply_cap, "Failed to save reply cap");
+    }
+}
+
+/**
+ * @brief Hand the parked reply, if any, to the event loop. Restores the
+ *        message registers it was built with.
+ *
+ * @return true if reply has to be sent
+ */
+bool syscall_take_reply(seL4_MessageInfo_t *reply) {
+    if (!reply_pending) {
+        return false;
+    }
+    size_t length = seL4_MessageInfo_get_length(pending_reply);
+    for (size_t i = 0; i < length; i++) {
+        seL4_SetMR(i, pending_mrs[i]);
+    }
+    reply_pending = false;
+    *reply = pending_reply;
+    return true;
+}
+
+/**
+ * @brief Send the parked reply right away, for when sos has more work to do
+ *        before it waits on its endpoint
+ */
+void syscall_flush_reply(void) {
+    seL4_MessageInfo_t reply;
+    if (syscall_take_reply(&reply)) {
+        seL4_Reply(reply);
+    }
+}
+
+static void syscall_reply(sos_proc_t *proc, seL4_MessageInfo_t reply) {
+    if (proc->cont.reply_cap != seL4_CapNull) {
+        seL4_Send(proc->cont.reply_cap, reply);
+        cspace_free_slot(cur_cspace, proc->cont.reply_cap);
+        return;
+    }
+    assert(proc->pid == unsaved_reply_pid && !reply_pending);
+    unsaved_reply_pid = 0;
+    size_t length = seL4_MessageInfo_get_length(reply);
+    for (size_t i = 0; i < length; i++) {
+        pending_mrs[i] = seL4_GetMR(i);
+    }
+    pending_reply = reply;
+    reply_pending = true;
+}
+
 /**
  * @brief same to syscall_end_continuation, but return a 64 bit value
  *
@@ -122,8 +167,7 @@ void syscall_end_continuation64(sos_proc_t *proc, uint64_t retval, bool success)
     seL4_SetMR(0, retval & 0xffffffff);
     seL4_SetMR(1, retval>>32);
     seL4_SetTag(reply);
-    assert(proc->cont.reply_cap != seL4_CapNull);
-    seL4_Send(proc->cont.reply_cap, reply);
+    syscall_reply(proc, reply);
     iov_free(proc->cont.iov);
     memset(&proc->cont, 0, sizeof(cont_t));
     dprintf(4, "SYSCALL ENDED\n", retval);
@@ -138,6 +182,16 @@ void syscall_end_continuation64(sos_proc_t *proc, uint64_t retval, bool success)
  */
 void syscall_end_continuation(sos_proc_t *proc, int retval, bool success) {
     assert(proc);
+    if (ring_entry_active(proc)) { // the reply goes to the completion ring
+        ring_complete(proc, retval, success);
+        return;
+    }
+    if (proc->cont.syscall_number == SOS_SYSCALL_READ_INLINE && success && retval > 0) {
+        // data read goes back in the message registers following retval
+        memcpy(&seL4_GetIPCBuffer()->msg[INLINE_READ_REPLY_START], proc->inline_buf, retval);
+        proc->cont.reply_length = INLINE_READ_REPLY_START +
+                                  (retval + sizeof(seL4_Word) - 1) / sizeof(seL4_Word);
+    }
     seL4_MessageInfo_t reply;
     dprintf(4, "ENDING SYSCALL\n", retval);
     dprintf(4, "[SYSEND] Returning %d\n", retval);
@@ -149,8 +203,7 @@ void syscall_end_continuation(sos_proc_t *proc, int retval, bool success) {
     }
     seL4_SetMR(0, retval);
     seL4_SetTag(reply);
-    assert(proc->cont.reply_cap != seL4_CapNull);
-    seL4_Send(proc->cont.reply_cap, reply);
+    syscall_reply(proc, reply);
     iov_free(proc->cont.iov);
     memset(&proc->cont, 0, sizeof(cont_t));
     dprintf(4, "SYSCALL ENDED\n", retval);
@@ -174,67 +227,6 @@ static bool check_region(sos_addrspace_t *as, client_vaddr page, iop_direction_t
     return true;
 }
 
-/**
- * Pack message bytes into seL4_words
- * @param msgdata message to be printed
- * @param count length of the message
- * @returns the number of bytes encoded
- */
-void ipc_write_bin(int start, char* msgdata, size_t length) {
-    size_t mr_idx,i,j;
-    seL4_Word pack;
-    i = 0;
-    seL4_SetMR(start, length);
-    mr_idx = start + 1;
-    while(i < length) {
-        pack = 0;
-        j = sizeof(seL4_Word);
-        while (j > 0 && i < length) {
-            pack = pack | ((seL4_Word)msgdata[i] << ((--j)*8));
-            i++;
-        }
-        seL4_SetMR(mr_idx, pack);
-        mr_idx++;
-    }
-}
-
-/**
- * Unpack characters from seL4_Words and stop when meeting null byte.
- * @param msgBuf starting point of buffer to store contents.
- * @param packed_data word packed with 4 bytes
-*/
-static int unpack_word_str(char* msgBuf, seL4_Word packed_data) {
-    int length = 0;
-    int j = sizeof(seL4_Word);
-    while (j > 0) {
-        // Unpack data encoded 4-chars per word.
-        *msgBuf = (char)(packed_data >> ((--j) * 8));
-        if (*msgBuf == 0) {
-            return length;
-        }
-        length++;
-        msgBuf++;
-    }
-    return length;
-}
-
-/**
- * @brief Read a string from IPC buffer
- *
- */
-void ipc_read_str(int start, char *buf) {
-    assert(buf && start > 0);
-    int k = 0, i ;
-    for (i = start; i < seL4_MsgMaxLength; i++) {
-       int len = unpack_word_str(buf+k, seL4_GetMR(i)); 
-       k += len;
-       if (len < sizeof(seL4_Word)) break;
-    }
-    if (k < MAX_FILE_PATH_LENGTH) {
-        buf[k] = 0;
-    }
-}
-
 /**
  * @brief Check whether a callback has been expired
  *
@@ -254,6 +246,8 @@ bool callback_valid(callback_info_t *cb) {
 
 /**
  * @brief Ensure given io vector is in memory, similar as vm_fault except it doesn't consider elf loading
+ *        May block the current request while a page is swapped in.
+ *        The client is killed if its page can't be brought back.
  *
  * @param iov io vector
  */
@@ -263,9 +257,12 @@ void iov_ensure_loaded(iovec_t iov) {
     assert(reg); // addr in iov must already have been checked
     if (as_page_exists(as, iov.vstart)) {
         if (swap_is_page_swapped(as, iov.vstart)) {
-            swap_in_page(iov.vstart);
+            if (swap_in_page(iov.vstart)) {
+                ERR("Failed to swap in %08x, killing client\n", iov.vstart);
+                process_delete(current_process());
+                coroutine_exit();
+            }
             as_reference_page(current_process()->vspace, iov.vstart, reg->rights);
-            current_process()->cont.page_eviction_process = NULL;
         } else if (!is_referenced(as, iov.vstart)) {
             as_reference_page(as, iov.vstart, reg->rights);
         }
@@ -351,6 +348,40 @@ iovec_t *cbuf_to_iov(client_vaddr buf, size_t nbyte, iop_direction_t dir) {
     return iohead;
 }
 
+/**
+ * @brief Transfer several client buffers to a single io vector list, so a
+ *        vectored request reaches its device as one operation
+ *
+ * @param bufs buffer addresses
+ * @param nbytes buffer sizes
+ * @param cnt number of buffers
+ * @param dir IO type, read or write
+ *
+ * @return io vector list, NULL if a buffer is invalid or all are empty
+ */
+iovec_t *cbufv_to_iov(const client_vaddr *bufs, const size_t *nbytes, int cnt,
+                      iop_direction_t dir) {
+    iovec_t *iohead = NULL;
+    iovec_t *iotail = NULL;
+    for (int i = 0; i < cnt; i++) {
+        if (nbytes[i] == 0) {
+            continue;
+        }
+        iovec_t *iov = cbuf_to_iov(bufs[i], nbytes[i], dir);
+        if (iov == NULL) {
+            iov_free(iohead);
+            return NULL;
+        }
+        if (iohead == NULL) {
+            iohead = iov;
+        } else {
+            iotail->next = iov;
+        }
+        for (iotail = iov; iotail->next; iotail = iotail->next);
+    }
+    return iohead;
+}
+
 io_device_t* device_handler_str(const char* filename) {
     if (strcmp(filename, "console") == 0) {
         return &serial_io;
@@ -399,6 +430,9 @@ int sos__sys_read(void){
     }
     io_device_t *dev = device_handler_fd(file);
     assert(dev);
+    if (current_process()->cont.explicit_offset && dev != &nfs_io) {
+        return ESPIPE;
+    }
     return dev->read(current_process()->cont.iov, file, nbyte);
 }
 
@@ -421,9 +455,46 @@ int sos__sys_write(void) {
     }
     io_device_t *dev = device_handler_fd(file);
     assert(dev);
+    if (current_process()->cont.explicit_offset && dev != &nfs_io) {
+        return ESPIPE;
+    }
     return dev->write(current_process()->cont.iov, file,nbyte);
 }
 
+/**
+ * Move the file position of an open file. Seeking from the end needs the
+ * file size from the server.
+ */
+int sos__sys_lseek(void) {
+    sos_proc_t *proc = current_process();
+    of_entry_t *of = fd_lookup(proc, proc->cont.fd);
+    if (of == NULL) {
+        return EINVAL;
+    }
+    if (of->io != &nfs_io) {
+        return ESPIPE;
+    }
+    long base;
+    switch (proc->cont.seek_whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (long)of->offset;
+        break;
+    case SEEK_END:
+        return sos_nfs_lseek_end(of);
+    default:
+        return EINVAL;
+    }
+    if (base + proc->cont.seek_offset < 0) {
+        return EINVAL;
+    }
+    of->offset = (size_t)(base + proc->cont.seek_offset);
+    syscall_end_continuation(proc, of->offset, true);
+    return 0;
+}
+
 int sos__sys_stat(void) {
     return nfs_io.stat();
 }
@@ -436,6 +507,14 @@ int sos__sys_getdirent(void) {
     return nfs_io.getdirent();
 }
 
+int sos__sys_getdirents(void) {
+    if (current_process()->cont.length_arg == 0) {
+        syscall_end_continuation(current_process(), 0, true);
+        return 0;
+    }
+    return nfs_io.getdirents();
+}
+
 int sos__sys_waitpid(void) {
     int err = 0;
     pid_t pid = current_process()->cont.pid;
@@ -491,7 +570,11 @@ int sos__sys_close(void) {
     if (io == NULL) {
         err = fd_free(current_process()->fd_table, file);
     } else if (io->close == NULL) { // NFS file
+        int werr = sos_nfs_sync(of); // deferred write errors show up here
         err = fd_free(current_process()->fd_table, file);
+        if (!err) {
+            err = werr;
+        }
     } else {
         err = io->close(file); // serial device
     }
@@ -503,6 +586,26 @@ int sos__sys_close(void) {
     }
 }
 
+/**
+ * @brief Write out buffered writes of a file, reply an error if any write
+ *        to it failed since the last sync
+ */
+int sos__sys_fsync(void) {
+    sos_proc_t *proc = current_process();
+    of_entry_t *of = fd_lookup(proc, proc->cont.fd);
+    if (of == NULL || of->io == NULL) {
+        return EINVAL;
+    }
+    if (of->io == &nfs_io) {
+        int err = sos_nfs_sync(of);
+        if (err) {
+            return err;
+        }
+    }
+    syscall_end_continuation(proc, 0, true);
+    return 0;
+}
+
 int sos__sys_proc_create(void) {
     pid_t pid = start_process(current_process()->cont.path, _sos_ipc_ep_cap);
     if (pid > 0) {
@@ -555,6 +658,7 @@ static void sys_notify_client(uint32_t id, void *data) {
 int sos__sys_usleep(void) {
     if (current_process()->cont.delay == 0) {
         syscall_end_continuation(current_process(), 0, true);
+        return 0;
     }
     int id = register_timer(current_process()->cont.delay, sys_notify_client, (int*)current_process()->pid);
     if (id == 0) return ENOMEM;
@@ -2,6 +2,7 @@
 #define _SOS_SYSCALL_H_
 
 #include <sos.h>
+#include <sos_ipc.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <serial/serial.h>
@@ -20,12 +21,17 @@ int sos__sys_read(void);
 
 int sos__sys_write(void);
 
+int sos__sys_lseek(void);
+
 int sos__sys_stat(void) ;
 
 int sos__sys_getdirent(void);
+int sos__sys_getdirents(void);
 
 int sos__sys_close(void);
 
+int sos__sys_fsync(void);
+
 int sos__sys_proc_create(void);
 
 int sos__sys_getpid(void);
@@ -42,12 +48,15 @@ int sos__sys_timestamp(void);
 
 int sos__sys_brk(void);
 
-void ipc_read_str(int start, char *buf);
 
 void iov_ensure_loaded(iovec_t iov);
 
 void syscall_end_continuation(sos_proc_t *proc, int retval, bool success);
 void syscall_end_continuation64(sos_proc_t *proc, uint64_t retval, bool success);
+void syscall_defer_reply_cap(sos_proc_t *proc);
+void syscall_save_reply_cap(void);
+bool syscall_take_reply(seL4_MessageInfo_t *reply);
+void syscall_flush_reply(void);
 
 void iov_free(iovec_t *iov);
 
@@ -56,12 +65,9 @@ typedef struct callback_info {
     timestamp_t start_time;
 } callback_info_t;
 
-void add_ready_proc(pid_t pid) ;
-pid_t next_ready_proc(void) ;
-bool has_ready_proc(void) ;
-
 iovec_t *cbuf_to_iov(client_vaddr buf, size_t nbyte, iop_direction_t dir);
-void ipc_write_bin(int start, char* msgdata, size_t length);
+iovec_t *cbufv_to_iov(const client_vaddr *bufs, const size_t *nbytes, int cnt,
+                      iop_direction_t dir);
 io_device_t* device_handler_str(const char* filename);
 iovec_t* iov_create(seL4_Word vstart, size_t sz, iovec_t *iohead, iovec_t *iotail, bool sos_iov_flag);
 bool callback_valid(callback_info_t *cb);
@@ -0,0 +1,75 @@
+/**
+ * @file time_page.c
+ * @brief Let clients read the time without a syscall
+ *
+ * The timer registers and a page holding the upper half of the counter
+ * are mapped read-only into every address space; libsos combines them
+ * into a timestamp (see sos_time.h). Only the upper half is maintained
+ * here, on timer interrupts, the rest comes straight from the hardware.
+ */
+
+#include <stddef.h>
+#include <assert.h>
+
+#include <cspace/cspace.h>
+#include <clock/clock.h>
+#include <device/mapping.h>
+#include <device/vmem_layout.h>
+#include <ut/ut.h>
+#include <sos_time.h>
+
+#include "time_page.h"
+
+#define verbose 0
+#include <log/debug.h>
+#include <log/panic.h>
+
+static sos_time_page_t *time_page = NULL;
+static seL4_CPtr time_page_cap = seL4_CapNull;
+
+/**
+ * @brief Allocate and fill in the time page, the timer must be started
+ */
+void time_page_init(void) {
+    assert(timer_frame_cap() != seL4_CapNull);
+    seL4_Word paddr = ut_alloc(seL4_PageBits);
+    conditional_panic(!paddr, "No memory for the time page");
+    int err = cspace_ut_retype_addr(paddr, seL4_ARM_SmallPageObject, seL4_PageBits,
+                                    cur_cspace, &time_page_cap);
+    conditional_panic(err, "Failed to retype the time page");
+    err = map_page(time_page_cap, seL4_CapInitThreadPD, SOS_TIME_PAGE,
+                   seL4_AllRights, seL4_ARM_Default_VMAttributes);
+    conditional_panic(err, "Failed to map the time page");
+    time_page = (sos_time_page_t*)SOS_TIME_PAGE;
+    time_page->counter_offset = offsetof(gpt_register_t, cnt);
+    time_page->shift = 0; // the counter is prescaled to 1MHz
+    time_page->high = time_stamp() >> 32;
+}
+
+/**
+ * @brief Publish the upper half of the counter after it rolled over.
+ *        Called after each timer interrupt
+ */
+void time_page_update(void) {
+    uint32_t high = time_stamp() >> 32;
+    if (time_page == NULL || time_page->high == high) {
+        return;
+    }
+    time_page->seq++;
+    __sync_synchronize();
+    time_page->high = high;
+    __sync_synchronize();
+    time_page->seq++;
+}
+
+/**
+ * @brief Map the time page and the timer registers into a new address space
+ */
+int time_page_map(sos_addrspace_t *as) {
+    int err = as_map_shared_frame(as, PROCESS_TIME_PAGE, time_page_cap,
+                                  seL4_ARM_Default_VMAttributes);
+    if (err) {
+        return err;
+    }
+    return as_map_shared_frame(as, PROCESS_TIMER_PAGE, timer_frame_cap(), 0);
+}
@@ -0,0 +1,12 @@
+/** time_page.h --- Read-only time page shared with every client **/
+
+#ifndef _SOS_TIME_PAGE_H_
+#define _SOS_TIME_PAGE_H_
+
+#include "addrspace.h"
+
+void time_page_init(void);
+void time_page_update(void);
+int time_page_map(sos_addrspace_t *as);
+
+#endif
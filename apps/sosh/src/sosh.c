@@ -199,20 +199,22 @@ static int dir(int argc, char **argv) {
     }
 
     while (1) {
-        r = sos_getdirent(i, buf, BUF_SIZ);
-        if (r < 0) {
-            printf("dirent(%d) failed: %d\n", i, r);
+        int n = sos_getdirents(i, buf, BUF_SIZ);
+        if (n < 0) {
+            printf("dirent(%d) failed: %d\n", i, n);
             break;
-        } else if (!r) {
+        } else if (!n) {
             break;
         }
-        r = sos_stat(buf, &sbuf);
-        if (r < 0) {
-            printf("stat(%s) failed: %d\n", buf, r);
-            break;
+        char *name = buf;
+        for (; n > 0; n--, i++, name += strlen(name) + 1) {
+            r = sos_stat(name, &sbuf);
+            if (r < 0) {
+                printf("stat(%s) failed: %d\n", name, r);
+                return 0;
+            }
+            prstat(name);
         }
-        prstat(buf);
-        i++;
     }
     return 0;
 }
@@ -62,6 +62,14 @@ int start_timer(seL4_CPtr interrupt_ep);
  */
 uint32_t register_timer(uint64_t delay, timer_callback_t callback, void *data);
 
+/*
+ * Register a callback to be called every "period" microseconds, until the
+ * timer is removed
+ *
+ * Returns 0 on failure, otherwise an unique ID for this timer
+ */
+uint32_t register_periodic_timer(uint64_t period, timer_callback_t callback, void *data);
+
 /*
  * Remove a previously registered callback by its ID
  *    id: Unique ID returned by register_time
@@ -83,6 +91,14 @@ int timer_interrupt(void);
  */
 timestamp_t time_stamp(void);
 
+/*
+ * Frame capability of the page holding the timer registers, so the free
+ * running counter can be mapped read-only into other address spaces.
+ *
+ * Returns seL4_CapNull if the driver was never started.
+ */
+seL4_CPtr timer_frame_cap(void);
+
 /*
  * Stop clock driver operation.
  *
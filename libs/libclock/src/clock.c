@@ -18,6 +18,17 @@
 
 #define MAX_CALLBACK_ID 20
 
+/* Timer ids are a pool slot plus a generation, so a stale id can't remove
+ * the timer that reused its slot */
+#define TIMER_SLOT_BITS     20
+#define TIMER_SLOT_MASK     (BITS(TIMER_SLOT_BITS) - 1)
+#define TIMER_MAX_SLOTS     TIMER_SLOT_MASK
+#define TIMER_POOL_INITIAL  64
+
+/* Compare 2 is never armed closer than this to the counter, so a deadline
+ * isn't missed while it is being written */
+#define TIMER_MIN_DELAY     10
+
 #define CLOCK_SUBTICK_CAP 100000ul
 
 #define BITS(n) (1ul<<(n))
@@ -47,25 +58,34 @@ static bool handling_interrupt = false;
 gpt_register_t *gpt_reg;
 static uint32_t high_count = 0; // higher bits of timer counter
 static seL4_CPtr _timer_cap = seL4_CapNull;
+static seL4_CPtr _gpt_frame_cap = seL4_CapNull; // page of the GPT registers
 
 struct callback {
     bool valid;
     uint32_t id;
     timestamp_t next_timeout;
     uint64_t delay;
+    bool periodic;
     timer_callback_t fun;
     void *data;
+    uint32_t heap_pos;      // index in timer_heap, while queued
+    uint32_t next_free;     // next slot of the free list, while unused
 };
 
 typedef struct callback callback_t;
 
 static tick_callback_t tick_callbacks[MAX_CALLBACK_ID+1]; /* callbacks get called every tick */
-static callback_t callback_arr[MAX_CALLBACK_ID+1];       /* callback_arr contains all the callback functions */
-static callback_t* ordered_callbacks[MAX_CALLBACK_ID+1]; /* ordered index on top of callbacks (increasing by timeouts) */
 
-static timestamp_t g_cur_time; /* global reference to current time, so it can be accessed by cmp function */
-static timestamp_t next_timeout; /* timeout of next callback */
-static int next_cb = 0; /*idex of next callback */ 
+/* Timer pool, grown on demand. Slot 0 is never used, so 0 is never an id */
+static callback_t *timer_pool;
+static uint32_t timer_pool_size;
+static uint32_t timer_free;             /* head of free slots, 0 if none */
+
+/* Binary min-heap of pool slots ordered by next_timeout */
+static uint32_t *timer_heap;
+static uint32_t timer_heap_len;
+
+static timestamp_t next_timeout; /* timeout compare 2 is armed for */
 
 static seL4_CPtr
 enable_irq(int irq, seL4_CPtr aep) {
@@ -105,49 +125,166 @@ static void disable_outcmp2(void) {
     gpt_reg->cr &= ~GPT_CR_OM2;
 }
 
-int callback_cmp(const void *a, const void *b) {
-    callback_t *x = *(callback_t**)a, *y = *(callback_t**)b;
-    if (!x->valid && !y->valid) return 0;
-    if (!x->valid) return 1;
-    if (!y->valid) return -1;
-    if ((x->next_timeout - g_cur_time) < (y->next_timeout - g_cur_time))
-        return -1;
-    if ((x->next_timeout - g_cur_time) > (y->next_timeout - g_cur_time))
-        return 1;
-    if ((x->next_timeout - g_cur_time) == (y->next_timeout - g_cur_time))
-        return 0;
-    conditional_panic(true, "The impossible has happened");
-    return 0;
+static inline bool timer_before(uint32_t a, uint32_t b) {
+    return timer_pool[a].next_timeout < timer_pool[b].next_timeout;
+}
+
+static inline void heap_set(uint32_t pos, uint32_t slot) {
+    timer_heap[pos] = slot;
+    timer_pool[slot].heap_pos = pos;
 }
 
+static void heap_sift_up(uint32_t pos) {
+    uint32_t slot = timer_heap[pos];
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (!timer_before(slot, timer_heap[parent])) {
+            break;
+        }
+        heap_set(pos, timer_heap[parent]);
+        pos = parent;
+    }
+    heap_set(pos, slot);
+}
+
+static void heap_sift_down(uint32_t pos) {
+    uint32_t slot = timer_heap[pos];
+    while (1) {
+        uint32_t child = 2 * pos + 1;
+        if (child >= timer_heap_len) {
+            break;
+        }
+        if (child + 1 < timer_heap_len && timer_before(timer_heap[child + 1], timer_heap[child])) {
+            child++;
+        }
+        if (!timer_before(timer_heap[child], slot)) {
+            break;
+        }
+        heap_set(pos, timer_heap[child]);
+        pos = child;
+    }
+    heap_set(pos, slot);
+}
 
 /**
- * @brief Get ordered_callbacks and setup outcmp2  
+ * @brief Queue a timer by its next_timeout, O(log n)
  */
-static void update_timeout(void) {
-    timestamp_t cur_time = time_stamp();
-    timestamp_t closest_timeout = cur_time - 1;
-    callback_t *cb;
-    bool updated = false;
-    for (int i = 1; i <= MAX_CALLBACK_ID; i++) {
-        cb = &callback_arr[i];
-        if (cb->valid && cb->next_timeout - cur_time <= closest_timeout - cur_time){
-            closest_timeout = cb->next_timeout;
-            updated = true;
-        }
+static void heap_push(uint32_t slot) {
+    heap_set(timer_heap_len++, slot);
+    heap_sift_up(timer_heap_len - 1);
+}
+
+/**
+ * @brief Unqueue the timer at heap position pos, O(log n)
+ */
+static void heap_remove(uint32_t pos) {
+    uint32_t last = timer_heap[--timer_heap_len];
+    if (pos == timer_heap_len) {
+        return;
+    }
+    heap_set(pos, last);
+    if (pos > 0 && timer_before(last, timer_heap[(pos - 1) / 2])) {
+        heap_sift_up(pos);
+    } else {
+        heap_sift_down(pos);
     }
-    /*if callback_arr is not empty, we setup the next cmp2 interrupt*/
-    if (updated) {
-        g_cur_time = cur_time;
-        qsort(ordered_callbacks, MAX_CALLBACK_ID, sizeof(callback_t*), callback_cmp);
-        next_cb = 0;
-        update_outcmp2(closest_timeout);
-        assert(closest_timeout == ordered_callbacks[0]->next_timeout);
-    } /*otherwise turn off cmp2*/
-    else {
+}
+
+/**
+ * @brief Double the timer pool and the heap, putting the new slots on the
+ *        free list
+ *
+ * @return false if out of memory or ids
+ */
+static bool timer_pool_grow(void) {
+    uint32_t size = timer_pool_size ? 2 * timer_pool_size : TIMER_POOL_INITIAL;
+    if (size > TIMER_MAX_SLOTS) {
+        return false;
+    }
+    callback_t *pool = realloc(timer_pool, size * sizeof(callback_t));
+    if (pool == NULL) {
+        return false;
+    }
+    timer_pool = pool;
+    uint32_t *heap = realloc(timer_heap, size * sizeof(uint32_t));
+    if (heap == NULL) {
+        return false;
+    }
+    timer_heap = heap;
+    uint32_t first = timer_pool_size ? timer_pool_size : 1;
+    memset(&timer_pool[timer_pool_size], 0, (size - timer_pool_size) * sizeof(callback_t));
+    for (uint32_t i = size - 1; i >= first; i--) {
+        timer_pool[i].next_free = timer_free;
+        timer_free = i;
+    }
+    timer_pool_size = size;
+    return true;
+}
+
+static void timer_slot_free(uint32_t slot) {
+    timer_pool[slot].valid = false;
+    timer_pool[slot].next_free = timer_free;
+    timer_free = slot;
+}
+
+/**
+ * @brief Pool slot of a live timer id, 0 if the timer is gone
+ */
+static uint32_t timer_slot(uint32_t id) {
+    uint32_t slot = id & TIMER_SLOT_MASK;
+    if (slot == 0 || slot >= timer_pool_size) {
+        return 0;
+    }
+    if (!timer_pool[slot].valid || timer_pool[slot].id != id) {
+        return 0;
+    }
+    return slot;
+}
+
+/**
+ * @brief Arm compare 2 for the earliest timer, or turn it off
+ */
+static void update_timeout(void) {
+    if (timer_heap_len == 0) {
         disable_outcmp2();
+        return;
     }
+    timestamp_t t = timer_pool[timer_heap[0]].next_timeout;
+    timestamp_t earliest = time_stamp() + TIMER_MIN_DELAY;
+    update_outcmp2(t < earliest ? earliest : t);
+}
 
+/**
+ * @brief Run every timer whose timeout has passed. Periodic timers are
+ *        queued again for their next period.
+ */
+static void run_expired_timers(void) {
+    timestamp_t now = time_stamp();
+    while (timer_heap_len > 0) {
+        uint32_t slot = timer_heap[0];
+        callback_t *c = &timer_pool[slot];
+        if (c->next_timeout > now) {
+            break;
+        }
+        heap_remove(0);
+        uint32_t id = c->id;
+        timer_callback_t fun = c->fun;
+        void *data = c->data;
+        if (!c->periodic) {
+            timer_slot_free(slot);
+        }
+        /* the callback may register or remove timers, growing the pool */
+        fun(id, data);
+        if (timer_slot(id) == slot && timer_pool[slot].periodic) {
+            c = &timer_pool[slot];
+            c->next_timeout += c->delay;
+            if (c->next_timeout <= now) { // don't replay missed periods
+                c->next_timeout = now + c->delay;
+            }
+            heap_push(slot);
+        }
+    }
+    update_timeout();
 }
 
 /**
@@ -157,26 +294,28 @@ static void update_timeout(void) {
 int start_timer(seL4_CPtr interrupt_ep) {
     static gpt_register_t* gpt_clock_addr = NULL;
     if (gpt_clock_addr == NULL) {
-        gpt_clock_addr = map_device((void*)CLOCK_GPT_PADDR, sizeof(gpt_register_t));
+        gpt_clock_addr = map_device_frames((void*)CLOCK_GPT_PADDR, sizeof(gpt_register_t),
+                                           &_gpt_frame_cap);
         _timer_cap = enable_irq(GPT_IRQ, interrupt_ep);
     }
     gpt_reg = gpt_clock_addr;
     gpt_reg->cr = GPT_CR_OM1 | GPT_CR_FRR | GPT_CR_CLKSRC | GPT_CR_ENMOD ;
     gpt_reg->sr = 0;
-    gpt_reg->ir = GPT_IR_ROVIE | GPT_IR_OF1IE;
+    gpt_reg->ir = GPT_IR_ROVIE; // compare 1 only runs while tick events exist
     gpt_reg->pr = GPT_PRESCALER;
 
     gpt_reg->ocr1 = CLOCK_SUBTICK_CAP;
     gpt_reg->cr |= GPT_CR_EN;
     assert(gpt_reg->cr == 0b00000000010000000000001001000011);
-    for (int i = 0; i < MAX_CALLBACK_ID; i++)
-        ordered_callbacks[i] = &callback_arr[i+1];
+    update_timeout();
 
     return 0;
 }
 
 /**
- * @brief Insert a tick_callback in tick_callback array, takes O(n) time
+ * @brief Insert a tick_callback in tick_callback array, takes O(n) time.
+ *        The tick interrupt is only enabled by the first tick callback, so
+ *        an idle timer with no deadlines takes no interrupts
  *
  * @param callback_fun
  *
@@ -194,19 +333,16 @@ uint32_t register_tick_event(tick_callback_t callback_fun) {
         return ENOMEM;
     }
     tick_callbacks[i] = callback_fun;
+    if (!(gpt_reg->ir & GPT_IR_OF1IE)) {
+        gpt_reg->ocr1 = time_stamp() + CLOCK_SUBTICK_CAP;
+        gpt_reg->sr &= GPT_SR_OF1;
+        gpt_reg->ir |= GPT_IR_OF1IE;
+    }
     return 0;
 }
 
-/**
- * @brief add timer to callback array, takes O(n) time
- *
- * @param delay
- * @param callback_fun
- * @param data
- *
- * @return index of callback in callback array, or 0 if fail to add it
- */
-uint32_t register_timer(uint64_t delay, timer_callback_t callback_fun, void *data) {
+static uint32_t add_timer(uint64_t delay, bool periodic, timer_callback_t callback_fun,
+                          void *data) {
     if (callback_fun == NULL) {
         dprintf(1, "invalid callback_fun\n");
         return 0;
@@ -215,44 +351,77 @@ uint32_t register_timer(uint64_t delay, timer_callback_t callback_fun, void *dat
         WARN("timer hasn't been initialised \n");
         return 0;
     }
-    callback_t *cb = NULL;
-    timestamp_t cur = time_stamp();
-
-    for (int i = 1; i <= MAX_CALLBACK_ID; i++) {
-        if (!callback_arr[i].valid) {
-            cb = &callback_arr[i];
-            cb->valid = true;
-            cb->id = i;
-            cb->delay = delay;
-            cb->next_timeout = cur + delay;
-            cb->fun = callback_fun;
-            cb->data = data;
-            break;
-        }
+    if (periodic && delay == 0) {
+        return 0;
     }
-    update_timeout();
-    if (cb) return cb->id;
-    else return 0;
+    if (timer_free == 0 && !timer_pool_grow()) {
+        ERR("Not registering new timer. Out of memory.\n");
+        return 0;
+    }
+    uint32_t slot = timer_free;
+    callback_t *cb = &timer_pool[slot];
+    timer_free = cb->next_free;
+
+    uint32_t generation = (cb->id >> TIMER_SLOT_BITS) + 1;
+    cb->id = (generation << TIMER_SLOT_BITS) | slot;
+    cb->valid = true;
+    cb->periodic = periodic;
+    cb->delay = delay;
+    cb->next_timeout = time_stamp() + delay;
+    cb->fun = callback_fun;
+    cb->data = data;
+    heap_push(slot);
+    if (cb->heap_pos == 0) { // new earliest timer
+        update_timeout();
+    }
+    return cb->id;
+}
+
+/**
+ * @brief Add a one-shot timer, takes O(log n) time
+ *
+ * @param delay
+ * @param callback_fun
+ * @param data
+ *
+ * @return id of the timer, or 0 if fail to add it
+ */
+uint32_t register_timer(uint64_t delay, timer_callback_t callback_fun, void *data) {
+    return add_timer(delay, false, callback_fun, data);
+}
+
+/**
+ * @brief Add a timer firing every "period" microseconds until it is
+ *        removed, takes O(log n) time
+ *
+ * @return id of the timer, or 0 if fail to add it
+ */
+uint32_t register_periodic_timer(uint64_t period, timer_callback_t callback_fun, void *data) {
+    return add_timer(period, true, callback_fun, data);
 }
 
 /**
- * @brief remove a timer, takes O(1) time
+ * @brief remove a timer, takes O(log n) time
  *
- * @param id index of timer needs to be removed
+ * @param id of the timer to remove
  *
  * @return 
  */
 int remove_timer(uint32_t id) {
-    if (id == 0 && id > MAX_CALLBACK_ID)
-        return CLOCK_R_FAIL;
-    if (!callback_arr[id].valid)
+    uint32_t slot = timer_slot(id);
+    if (slot == 0)
         return CLOCK_R_FAIL;
     if (!(gpt_reg->cr & GPT_CR_EN)) {
         return CLOCK_R_UINT;
     }
-    callback_arr[id].valid = false;
-
-    update_timeout();
+    uint32_t pos = timer_pool[slot].heap_pos;
+    if (pos < timer_heap_len && timer_heap[pos] == slot) { // not currently firing
+        heap_remove(pos);
+    }
+    timer_slot_free(slot);
+    if (pos == 0) {
+        update_timeout();
+    }
     return CLOCK_R_OK;
 }
 
@@ -265,7 +434,7 @@ int timer_interrupt(void) {
     int i;
     handling_interrupt = true;
     /* handler tick interrupt */
-    if (gpt_reg->sr & GPT_SR_OF1) {
+    if ((gpt_reg->sr & GPT_SR_OF1) && (gpt_reg->ir & GPT_IR_OF1IE)) {
         gpt_reg->ocr1 = time_stamp() + CLOCK_SUBTICK_CAP;
         gpt_reg->sr &= GPT_SR_OF1;
         for (i = 0; i < MAX_CALLBACK_ID; i++) {
@@ -277,24 +446,8 @@ int timer_interrupt(void) {
     }
     /* handler timer interrupt */
     if (gpt_reg->sr & GPT_SR_OF2) {
-        assert(ordered_callbacks[next_cb]->next_timeout == next_timeout);
-        for (i = 0; i < 5; i++) {
-        }
-        while (next_cb < MAX_CALLBACK_ID) { /* trigger all timers meet timeout */
-            callback_t *c = ordered_callbacks[next_cb];
-            if (c->next_timeout != next_timeout) break;
-            c->fun(c->id, c->data);
-            c->valid = false;
-            next_cb++;
-        }
-        /*set cmp2 to trigger next timer in ordered_calbacks, which should has the closet timeout, as it's ordered*/
-        if(next_cb < MAX_CALLBACK_ID) {
-            update_outcmp2(ordered_callbacks[next_cb]->next_timeout);
-        }
-        else
-            disable_outcmp2();
-
         gpt_reg->sr &= GPT_SR_OF2;
+        run_expired_timers();
     }
     /*update high bits of counter if it's a overflow interrupt*/
     if (gpt_reg->sr & GPT_SR_ROV) {
@@ -333,6 +486,13 @@ timestamp_t time_stamp(void) {
     return time;
 }
 
+/**
+ * Frame cap of the GPT register page
+ */
+seL4_CPtr timer_frame_cap(void) {
+    return _gpt_frame_cap;
+}
+
 /**
  * Stop the timer
  * If called from within timer_interrupt, timer_interrupt will clean up later.
@@ -37,4 +37,15 @@ int map_page(seL4_CPtr frame_cap, seL4_ARM_PageDirectory pd, seL4_Word vaddr,
  */
 void* map_device(void* paddr, int size);
 
+ /**
+ * Maps a device to virtual memory like map_device, and returns the
+ * frame capabilities so the device can be mapped elsewhere too
+ *
+ * @param paddr the physical address of the device
+ * @param size the number of bytes that this device occupies
+ * @param caps receives one frame capability per page, may be NULL
+ * @return The new virtual address of the device
+ */
+void* map_device_frames(void* paddr, int size, seL4_CPtr *caps);
+
 #endif
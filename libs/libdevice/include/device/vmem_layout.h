@@ -23,6 +23,9 @@
 #define FRAME_SIZE_BITS     (30)
 #define FRAME_VEND          (FRAME_VSTART + (1ull << FRAME_SIZE_BITS))
 
+/* Page sos shares read-only with all clients (see PROCESS_TIME_PAGE) */
+#define SOS_TIME_PAGE       (0x70000000)
+
 /* From this address onwards is where any devices will get mapped in
  * by the map_device function. You should not use any addresses beyond
  * here without first modifying map_device */
@@ -35,6 +38,10 @@
 #define PROCESS_STACK_BOTTOM   (0x80000000)
 #define PROCESS_STACK_TOP   (0x90000000)
 #define PROCESS_IPC_BUFFER  (0xA0000000)
+/* Read-only pages through which clients read the time without a syscall:
+ * the sos_time_page_t and the timer registers themselves */
+#define PROCESS_TIME_PAGE   (0xA0002000)
+#define PROCESS_TIMER_PAGE  (0xA0003000)
 #define PROCESS_VMEM_START  (0xC0000000)
 
 #define PROCESS_SCRATCH     (0xD0000000)
@@ -75,6 +75,11 @@ map_page(seL4_CPtr frame_cap, seL4_ARM_PageDirectory pd, seL4_Word vaddr,
 
 void* 
 map_device(void* paddr, int size){
+    return map_device_frames(paddr, size, NULL);
+}
+
+void* 
+map_device_frames(void* paddr, int size, seL4_CPtr *caps){
     static seL4_Word virt = DEVICE_START;
     seL4_Word phys = (seL4_Word)paddr;
     seL4_Word vstart = virt;
@@ -98,6 +103,9 @@ map_device(void* paddr, int size){
                        seL4_AllRights,
                        0);
         assert(!err);
+        if(caps){
+            *caps++ = frame_cap;
+        }
         /* Next address */
         phys += (1 << seL4_PageBits);
         virt += (1 << seL4_PageBits);
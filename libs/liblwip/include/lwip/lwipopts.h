@@ -44,14 +44,27 @@
 #define MEM_LIBC_MALLOC                 1
 #define MEMP_MEM_MALLOC                 1
 
-/* Minimal changes to opt.h required for tcp unit tests: */
+/* NFS over TCP: full sized segments, and windows that hold a few 8 KiB
+ * reads or writes. tcp_tmr() has to be called every TCP_TMR_INTERVAL. */
 #define MEM_SIZE                        16000
-#define TCP_SND_QUEUELEN                40
+#define TCP_MSS                         1460
+#define TCP_SND_BUF                     (16 * TCP_MSS)
+#define TCP_WND                         (16 * TCP_MSS)
+#define TCP_SND_QUEUELEN                (4 * TCP_SND_BUF / TCP_MSS)
 #define MEMP_NUM_TCP_SEG                TCP_SND_QUEUELEN
-#define TCP_SND_BUF                     (12 * TCP_MSS)
-#define TCP_WND                         (10 * TCP_MSS)
 
 /* Minimal changes to opt.h required for etharp unit tests: */
 #define ETHARP_SUPPORT_STATIC_ENTRIES   1
 
+/* NFS calls and replies of several KiB travel as IP fragments. Enough
+ * fragments are held for every read in flight to be reassembled at once:
+ * 6 per 8 KiB datagram at a 1500 byte MTU. Reassembly ages in seconds,
+ * ip_reass_tmr() has to be called every IP_TMR_INTERVAL. */
+#define IP_REASSEMBLY                   1
+#define IP_FRAG                         1
+#define IP_REASS_MAX_PBUFS              192
+#define IP_REASS_MAXAGE                 3
+#define MEMP_NUM_REASSDATA              32
+#define MEMP_NUM_FRAG_PBUF              32
+
 #endif /* __LWIPOPTS_H__ */
@@ -84,6 +84,8 @@ typedef enum nfs_stat {
     NFSERR_ACCES       = 13,
 /// File exists.  The file specified already exists.
     NFSERR_EXIST       = 17,
+/// Attempt to do a cross-device hard link (NFSv3 only).
+    NFSERR_XDEV        = 18,
 /// No such device.
     NFSERR_NODEV       = 19,
 /// Not a directory.  The caller specified a non-directory in a directory
@@ -92,6 +94,8 @@ typedef enum nfs_stat {
 /// Is a directory.  The caller specified a directory in a non-directory 
 /// operation.
     NFSERR_ISDIR       = 21,
+/// Invalid argument or unsupported argument for an operation (NFSv3 only).
+    NFSERR_INVAL       = 22,
 /// File too large.  The operation caused a file to grow beyond the servers
 /// limit.
     NFSERR_FBIG        = 27,
@@ -100,6 +104,8 @@ typedef enum nfs_stat {
     NFSERR_NOSPC       = 28,
 /// Read-only file system.  Write attempted on a read-only file system.
     NFSERR_ROFS        = 30,
+/// Too many hard links (NFSv3 only).
+    NFSERR_MLINK       = 31,
 /// File name too long.  The file name in an operation was too long.
     NFSERR_NAMETOOLONG = 63,
 /// Directory not empty.  Attempted to remove a directory that was not empty.
@@ -113,6 +119,23 @@ typedef enum nfs_stat {
     NFSERR_STALE       = 70,
 /// The servers write cache used in the "WRITECACHE" call got flushed to disk.
     NFSERR_WFLUSH      = 99,
+/// Illegal NFS file handle (NFSv3 only).
+    NFSERR_BADHANDLE   = 10001,
+/// Update synchronization mismatch in a guarded SETATTR (NFSv3 only).
+    NFSERR_NOT_SYNC    = 10002,
+/// A READDIR or READDIRPLUS cookie is stale (NFSv3 only).
+    NFSERR_BAD_COOKIE  = 10003,
+/// The operation is not supported (NFSv3 only).
+    NFSERR_NOTSUPP     = 10004,
+/// The buffer or request is too small (NFSv3 only).
+    NFSERR_TOOSMALL    = 10005,
+/// An error occurred on the server which does not map to any of the legal
+/// NFS protocol error values (NFSv3 only).
+    NFSERR_SERVERFAULT = 10006,
+/// An attempt was made to create an object of an unsupported type (NFSv3 only).
+    NFSERR_BADTYPE     = 10007,
+/// The server is busy, the request should be retried later (NFSv3 only).
+    NFSERR_JUKEBOX     = 10008,
 /// A communication error occurred at the RPC layer.
     NFSERR_COMM       = 200 
 } nfs_stat_t;
@@ -318,7 +341,8 @@ typedef void (*nfs_remove_cb_t)(uintptr_t token, enum nfs_stat status);
  *                       @ref nfs_readdir in order to read the remaining file
  *                       names from the directory  The value of nfscookie will
  *                       be given as 0 when there are no more file entries to
- *                       read.
+ *                       read, either because this reply is empty or because
+ *                       the server marked it as the last one.
  */
 typedef void (*nfs_readdir_cb_t)(uintptr_t token, enum nfs_stat status, 
                                  int num_files, char* file_names[],
@@ -380,10 +404,61 @@ enum rpc_stat nfs_init(const struct ip_addr *server);
  * Since this NFS library runs over the unreliable UDP protocol, it is possible
  * that packets may be dropped. To allow NFS to retransmit packets that might
  * have been dropped you must arrange for nfs_timeout to be called every 100ms.
- * This could be achieved by using a timer.
+ * This could be achieved by using a timer. Not needed once a timer service
+ * has been provided with @ref nfs_set_timer.
  */
 void nfs_timeout(void);
 
+/**
+ * One-shot timer service used for retransmissions.
+ * @param[in] delay    Microseconds before the callback is run
+ * @param[in] callback Called with the id returned and data
+ * @param[in] data     Passed to the callback
+ * @return             A non zero timer id, or 0 on failure
+ */
+typedef uint32_t (*nfs_timer_add_t)(uint64_t delay,
+                                    void (*callback)(uint32_t id, void *data),
+                                    void *data);
+typedef int (*nfs_timer_remove_t)(uint32_t id);
+/// The current time in microseconds.
+typedef uint64_t (*nfs_time_now_t)(void);
+
+/**
+ * Drive retransmission from per-request deadlines instead of a periodic
+ * nfs_timeout. Every outstanding request gets its own timer, which is
+ * removed when the reply arrives.
+ *
+ * The retransmission timeout of a request follows the round trip times
+ * measured for its procedure, and doubles with each retransmission. A
+ * request that gets no reply after its last retry fails: its callback is
+ * run with NFSERR_COMM.
+ * @param[in] add    Registers a one-shot timer
+ * @param[in] remove Cancels a timer registered with add
+ * @param[in] now    The clock round trip times are measured with
+ */
+void nfs_set_timer(nfs_timer_add_t add, nfs_timer_remove_t remove,
+                   nfs_time_now_t now);
+
+/**
+ * Counters of the transport since @ref nfs_init.
+ */
+typedef struct nfs_stats {
+/// Requests sent.
+    uint32_t calls;
+/// Requests sent again for lack of a reply.
+    uint32_t retransmits;
+/// Replies that came twice, their retransmission was not needed.
+    uint32_t spurious;
+/// Requests given up on.
+    uint32_t timeouts;
+} nfs_stats_t;
+
+/**
+ * Read the transport counters.
+ * @param[out] stats Filled in
+ */
+void nfs_get_stats(nfs_stats_t *stats);
+
 
 
 /**
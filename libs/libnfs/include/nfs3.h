@@ -0,0 +1,460 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/**
+ * @file   nfs3.h
+ *
+ * @brief  Network File System version 3 (NFSv3) client
+ *
+ * The version 3 protocol (RFC 1813) is provided alongside version 2
+ * (@ref nfs.h) with the same asynchronous, callback driven interface: a
+ * reply runs the callback registered for it with the token given to the
+ * call. Transactions are sent over UDP and retransmitted until a reply
+ * arrives, or over a single TCP connection if the file system was mounted
+ * with NFS3_TCP. TCP suits bulk transfers: the stream is paced and
+ * recovers from loss by itself, where a lost fragment costs a whole UDP
+ * datagram. The connection is made again if it is lost, and the
+ * transactions without a reply are sent again over it.
+ *
+ * Over version 2, version 3 offers 64 bit file sizes and offsets, file
+ * handles of up to 64 bytes, READDIRPLUS which returns the handle and
+ * attributes of each directory entry with its name, ACCESS, and UNSTABLE
+ * writes: the server may reply to a write before the data is on disk. The
+ * client then sends a COMMIT covering any number of such writes and keeps
+ * the data until the COMMIT is answered. Every write and commit reply
+ * carries a write verifier that changes when the server restarts; a
+ * verifier different from that of the writes means their data may have
+ * been lost and has to be written again.
+ *
+ * A READ or WRITE moves up to NFS3_MAXDATA bytes, more than fits a packet,
+ * so larger transfers rely on the IP layer fragmenting and reassembling
+ * datagrams. What a mounted file system takes in one transfer is found
+ * with @ref nfs3_fsinfo, callers should stay within both limits.
+ *
+ * Attributes and file handles are optional in many version 3 replies.
+ * Callbacks are given NULL for any that the server left out.
+ *
+ * @ref nfs_init must be called before any version 3 call, it sets up the
+ * transport for both versions.
+ */
+
+#ifndef __NFS_NFS3_H
+#define __NFS_NFS3_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <lwip/ip_addr.h>
+#include <nfs/nfs.h>
+
+/// The maximum size in bytes of the opaque file handle.
+#define NFS3_FHSIZE         64
+/// The most data in bytes sent or asked for in one READ or WRITE.
+#define NFS3_MAXDATA      8192
+/// The size in bytes of the write verifier.
+#define NFS3_WRITEVERFSIZE   8
+/// The size in bytes of the READDIR and READDIRPLUS cookie verifier.
+#define NFS3_COOKIEVERFSIZE  8
+
+/// Permission bits of @ref nfs3_access.
+#define NFS3_ACCESS_READ     0x0001
+#define NFS3_ACCESS_LOOKUP   0x0002
+#define NFS3_ACCESS_MODIFY   0x0004
+#define NFS3_ACCESS_EXTEND   0x0008
+#define NFS3_ACCESS_DELETE   0x0010
+#define NFS3_ACCESS_EXECUTE  0x0020
+
+/// Transports of the version 3 calls, see @ref nfs3_mount.
+enum nfs3_transport {
+    NFS3_UDP = 0,
+    NFS3_TCP = 1
+};
+
+/**
+ * A version 3 file handle. Only the first "len" bytes of "data" are
+ * significant, the rest is kept zero so handles can be compared whole.
+ */
+typedef struct fhandle3 {
+    uint32_t len;
+    char data[NFS3_FHSIZE];
+} fhandle3_t;
+
+/**
+ * Seconds and nanoseconds since midnight January 1, 1970, Greenwich Mean
+ * Time.
+ */
+typedef struct nfstime3 {
+    uint32_t seconds;
+    uint32_t nseconds;
+} nfstime3_t;
+
+/**
+ * The attributes of a file, as @ref fattr_t with 64 bit sizes and
+ * nanosecond times.
+ */
+typedef struct fattr3 {
+/// The type of the file.
+    ftype_t    type;
+/// The access mode encoded as a set of bits, as in stat(2).
+    uint32_t   mode;
+/// The number of hard links to the file.
+    uint32_t   nlink;
+/// The user identification number of the owner of the file.
+    uint32_t   uid;
+/// The group identification number of the group of the file.
+    uint32_t   gid;
+/// The size in bytes of the file.
+    uint64_t   size;
+/// The number of bytes of disk space the file actually uses.
+    uint64_t   used;
+/// The device number of the file if it is type NFCHR or NFBLK.
+    uint32_t   rdev_major;
+    uint32_t   rdev_minor;
+/// The file system identifier for the file system containing the file.
+    uint64_t   fsid;
+/// A number that uniquely identifies the file within its file system.
+    uint64_t   fileid;
+/// The time when the file data was last accessed.
+    nfstime3_t atime;
+/// The time when the file data was last modified.
+    nfstime3_t mtime;
+/// The time when the attributes of the file were last changed.
+    nfstime3_t ctime;
+} fattr3_t;
+
+/**
+ * The attributes to give a file on creation. As with @ref sattr_t, a field
+ * of all ones (-1) is left as the server chooses. A time with "seconds" of
+ * -1 is left, any other is set to the value given.
+ */
+typedef struct sattr3 {
+    uint32_t   mode;
+    uint32_t   uid;
+    uint32_t   gid;
+    uint64_t   size;
+    nfstime3_t atime;
+    nfstime3_t mtime;
+} sattr3_t;
+
+/**
+ * How far the server has to have taken written data before it replies.
+ */
+typedef enum nfs3_stable_how {
+/// The server may reply before the data is on stable storage. The data
+/// is safe once a COMMIT covering it has been answered.
+    NFS3_UNSTABLE  = 0,
+/// The data is on stable storage, some of the metadata may not be.
+    NFS3_DATA_SYNC = 1,
+/// The data and all metadata are on stable storage.
+    NFS3_FILE_SYNC = 2
+} nfs3_stable_how_t;
+
+/**
+ * The write verifier. It stays the same for as long as the server keeps
+ * uncommitted data.
+ */
+typedef struct nfs3_writeverf {
+    char data[NFS3_WRITEVERFSIZE];
+} nfs3_writeverf_t;
+
+/**
+ * A READDIRPLUS cookie, and the verifier the server pairs it with.
+ */
+typedef uint64_t nfscookie3_t;
+typedef struct nfs3_cookieverf {
+    char data[NFS3_COOKIEVERFSIZE];
+} nfs3_cookieverf_t;
+
+/**
+ * Transfer limits of a mounted file system, returned by @ref nfs3_fsinfo.
+ */
+typedef struct nfs3_fsinfo {
+/// The most data in bytes the server returns for one READ.
+    uint32_t rtmax;
+/// The preferred size in bytes of a READ.
+    uint32_t rtpref;
+/// The most data in bytes the server accepts in one WRITE.
+    uint32_t wtmax;
+/// The preferred size in bytes of a WRITE.
+    uint32_t wtpref;
+/// The preferred size in bytes of a READDIRPLUS reply.
+    uint32_t dtpref;
+/// The largest file size the server supports.
+    uint64_t maxfilesize;
+} nfs3_fsinfo_t;
+
+/**
+ * A directory entry returned by @ref nfs3_readdirplus.
+ */
+typedef struct nfs3_dirent {
+/// The NULL terminated name of the entry.
+    char        *name;
+/// The file ID of the entry.
+    uint64_t     fileid;
+/// The attributes of the entry, NULL if the server didn't return them.
+    fattr3_t    *fattr;
+/// A handle to the entry, NULL if the server didn't return one.
+    fhandle3_t  *fh;
+} nfs3_dirent_t;
+
+/**
+ * A call back function provided by the caller of @ref nfs3_getattr.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] fattr  If status is NFS_OK, the attributes of the file. Valid
+ *                   only until the callback returns.
+ */
+typedef void (*nfs3_getattr_cb_t)(uintptr_t token, enum nfs_stat status,
+                                  fattr3_t *fattr);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_lookup.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] fh     If status is NFS_OK, a handle to the file.
+ * @param[in] fattr  If status is NFS_OK, the attributes of the file, or
+ *                   NULL if the server didn't return them.
+ * "fh" and "fattr" are valid only until the callback returns.
+ */
+typedef void (*nfs3_lookup_cb_t)(uintptr_t token, enum nfs_stat status,
+                                 fhandle3_t *fh, fattr3_t *fattr);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_access.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] access If status is NFS_OK, the NFS3_ACCESS_* bits asked
+ *                   for that the server grants.
+ */
+typedef void (*nfs3_access_cb_t)(uintptr_t token, enum nfs_stat status,
+                                 uint32_t access);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_read.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] fattr  The attributes of the file, or NULL if the server
+ *                   didn't return them.
+ * @param[in] count  If status is NFS_OK, the number of bytes read.
+ * @param[in] eof    If status is NFS_OK, whether the read reached the end
+ *                   of the file.
+ * @param[in] data   The "count" bytes read.
+ * "fattr" and "data" are valid only until the callback returns.
+ */
+typedef void (*nfs3_read_cb_t)(uintptr_t token, enum nfs_stat status,
+                               fattr3_t *fattr, int count, bool eof,
+                               void *data);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_write.
+ * @param[in] token     The unmodified token provided to the call.
+ * @param[in] status    The NFS call status.
+ * @param[in] fattr     The attributes of the file after the write, or NULL
+ *                      if the server didn't return them.
+ * @param[in] count     If status is NFS_OK, the number of bytes written.
+ * @param[in] committed If status is NFS_OK, how far the data was taken.
+ *                      May be more stable than asked for.
+ * @param[in] verf      If status is NFS_OK, the write verifier.
+ * "fattr" and "verf" are valid only until the callback returns.
+ */
+typedef void (*nfs3_write_cb_t)(uintptr_t token, enum nfs_stat status,
+                                fattr3_t *fattr, int count,
+                                enum nfs3_stable_how committed,
+                                nfs3_writeverf_t *verf);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_commit.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] verf   If status is NFS_OK, the write verifier. Data written
+ *                   UNSTABLE with another verifier has to be written again.
+ */
+typedef void (*nfs3_commit_cb_t)(uintptr_t token, enum nfs_stat status,
+                                 nfs3_writeverf_t *verf);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_create.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ * @param[in] fh     If status is NFS_OK, a handle to the file created, or
+ *                   NULL if the server didn't return one.
+ * @param[in] fattr  If status is NFS_OK, the attributes of the file
+ *                   created, or NULL if the server didn't return them.
+ */
+typedef void (*nfs3_create_cb_t)(uintptr_t token, enum nfs_stat status,
+                                 fhandle3_t *fh, fattr3_t *fattr);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_remove.
+ * @param[in] token  The unmodified token provided to the call.
+ * @param[in] status The NFS call status.
+ */
+typedef void (*nfs3_remove_cb_t)(uintptr_t token, enum nfs_stat status);
+
+/**
+ * A call back function provided by the caller of @ref nfs3_readdirplus.
+ * @param[in] token       The unmodified token provided to the call.
+ * @param[in] status      The NFS call status.
+ * @param[in] num_entries The number of entries read.
+ * @param[in] entries     The entries read. They, and the names, handles and
+ *                        attributes they point to, are valid only until the
+ *                        callback returns.
+ * @param[in] cookie      The cookie to read the next entries with, 0 when
+ *                        there are no more.
+ * @param[in] verf        The cookie verifier to pass with "cookie".
+ */
+typedef void (*nfs3_readdirplus_cb_t)(uintptr_t token, enum nfs_stat status,
+                                      int num_entries, nfs3_dirent_t *entries,
+                                      nfscookie3_t cookie,
+                                      nfs3_cookieverf_t *verf);
+
+/**
+ * Synchronous function used to mount a file system with the version 3
+ * protocol. The transport chosen serves all version 3 calls that follow,
+ * whichever file system they are on.
+ * @param[in]  dir       The path that should be mounted.
+ * @param[out] pfh       The handle to the mounted directory if the call was
+ *                       successful.
+ * @param[in]  transport NFS3_UDP or NFS3_TCP.
+ * @return               RPC_OK if the call was successful and pfh was
+ *                       updated.
+ *                       RPCERR_NOSUP if the server doesn't speak version 3.
+ *                       RPCERR_COMM if no TCP connection could be made, the
+ *                       file system may be mounted with NFS3_UDP instead.
+ */
+enum rpc_stat nfs3_mount(const char *dir, fhandle3_t *pfh,
+                         enum nfs3_transport transport);
+
+/**
+ * Synchronous function used to retrieve the transfer limits of a mounted
+ * file system.
+ * @param[in]  fh   The handle of the mounted directory.
+ * @param[out] info The limits if the call was successful.
+ * @return          RPC_OK if the call was successful and info was updated.
+ */
+enum rpc_stat nfs3_fsinfo(const fhandle3_t *fh, nfs3_fsinfo_t *info);
+
+/**
+ * Retrieve the attributes of a file.
+ * @param[in] fh       A handle to the file.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_getattr(const fhandle3_t *fh,
+                           nfs3_getattr_cb_t callback, uintptr_t token);
+
+/**
+ * Look up the file named "name" in a directory.
+ * @param[in] pfh      A handle to the directory.
+ * @param[in] name     The NULL terminated name to look up.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_lookup(const fhandle3_t *pfh, const char *name,
+                          nfs3_lookup_cb_t callback, uintptr_t token);
+
+/**
+ * Ask which of the NFS3_ACCESS_* bits in "access" the server would grant
+ * on a file.
+ * @param[in] fh       A handle to the file.
+ * @param[in] access   The permissions to check.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_access(const fhandle3_t *fh, uint32_t access,
+                          nfs3_access_cb_t callback, uintptr_t token);
+
+/**
+ * Read at most "count" bytes from "offset" in a file.
+ * @param[in] fh       A handle to the file.
+ * @param[in] offset   The position to start reading at.
+ * @param[in] count    The number of bytes to read.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_read(const fhandle3_t *fh, uint64_t offset, int count,
+                        nfs3_read_cb_t callback, uintptr_t token);
+
+/**
+ * Write at most "count" bytes of "data" at "offset" in a file. No more
+ * than NFS3_MAXDATA bytes are sent, the callback is told how much was
+ * written.
+ * @param[in] fh       A handle to the file.
+ * @param[in] offset   The position to start writing at.
+ * @param[in] count    The number of bytes to write.
+ * @param[in] data     The data to write.
+ * @param[in] stable   How far the server has to take the data before it
+ *                     replies.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_write(const fhandle3_t *fh, uint64_t offset, int count,
+                         const void *data, enum nfs3_stable_how stable,
+                         nfs3_write_cb_t callback, uintptr_t token);
+
+/**
+ * Have the server put data written UNSTABLE to "count" bytes from
+ * "offset" on stable storage. A "count" of 0 commits to the end of the
+ * file.
+ * @param[in] fh       A handle to the file.
+ * @param[in] offset   The start of the range to commit.
+ * @param[in] count    The length of the range, 0 for all of the file.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_commit(const fhandle3_t *fh, uint64_t offset, uint32_t count,
+                          nfs3_commit_cb_t callback, uintptr_t token);
+
+/**
+ * Create the file "name" in a directory, or truncate it if it is there
+ * already and "sattr" gives a size of 0.
+ * @param[in] pfh      A handle to the directory.
+ * @param[in] name     The NULL terminated name of the file.
+ * @param[in] sattr    The attributes to give the file.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_create(const fhandle3_t *pfh, const char *name,
+                          const sattr3_t *sattr,
+                          nfs3_create_cb_t callback, uintptr_t token);
+
+/**
+ * Remove the file "name" from a directory.
+ * @param[in] pfh      A handle to the directory.
+ * @param[in] name     The NULL terminated name of the file.
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_remove(const fhandle3_t *pfh, const char *name,
+                          nfs3_remove_cb_t callback, uintptr_t token);
+
+/**
+ * Read the entries of a directory with their handles and attributes.
+ * Start with a cookie of 0 and a zeroed verifier, and carry on with those
+ * given to the callback until it is given a cookie of 0.
+ * @param[in] pfh      A handle to the directory.
+ * @param[in] cookie   Where to carry on from.
+ * @param[in] verf     The verifier given with "cookie".
+ * @param[in] callback Called once the reply arrives.
+ * @param[in] token    Passed, unmodified, to the callback.
+ * @return             RPC_OK if the request was sent.
+ */
+enum rpc_stat nfs3_readdirplus(const fhandle3_t *pfh, nfscookie3_t cookie,
+                               const nfs3_cookieverf_t *verf,
+                               nfs3_readdirplus_cb_t callback, uintptr_t token);
+
+#endif /* __NFS_NFS3_H */
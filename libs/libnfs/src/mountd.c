@@ -26,6 +26,7 @@
 
 #define MNT_NUMBER    100005
 #define MNT_VERSION   1
+#define MNT_VERSION3  3
 
 #define MNTPROC_EXPORT 5
 #define MNTPROC_MNT    1
@@ -47,9 +48,12 @@
  ******************************************/
 
 static struct udp_pcb* 
-mnt_new_udp(const struct ip_addr *server)
+mnt_new_udp(const struct ip_addr *server, int version)
 {
-    int port = portmapper_getport(server, MNT_NUMBER, MNT_VERSION);
+    int port = portmapper_getport(server, MNT_NUMBER, version);
+    if (port <= 0) {
+        return NULL;
+    }
     return rpc_new_udp(server, port, PORT_ROOT);
 }
 
@@ -100,7 +104,7 @@ mountd_print_exports(const struct ip_addr *server)
     int err;
 
     /* open a port */
-    mnt_pcb = mnt_new_udp(server); 
+    mnt_pcb = mnt_new_udp(server, MNT_VERSION);
     assert(mnt_pcb);
 
     /* construct the call */
@@ -171,7 +175,7 @@ mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
     enum rpc_stat stat;
 
     /* open a port */
-    mnt_pcb = mnt_new_udp(server); 
+    mnt_pcb = mnt_new_udp(server, MNT_VERSION);
     assert(mnt_pcb);
 
     /* Construct the call */
@@ -204,3 +208,81 @@ mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
 }
 
 
+/******************************************
+ *** Mount, version 3
+ ******************************************/
+
+struct mountd_mnt3_token {
+    enum rpc_stat stat;
+    fhandle3_t *pfh;
+};
+
+static void
+mountd_mount3_cb(void* callback, uintptr_t token, struct pbuf* pbuf)
+{
+    struct mountd_mnt3_token* t = (struct mountd_mnt3_token*)token;
+    struct rpc_reply_hdr reply_hdr;
+    enum rpc_reply_err err;
+    int pos;
+
+    (void)callback;
+
+    t->stat = RPCERR_NOSUP;
+    err = rpc_read_hdr(pbuf, &reply_hdr, &pos);
+    if(err == RPCERR_OK){
+        uint32_t status;
+        /* Read the response, the auth flavors after the handle are ignored */
+        pb_readl(pbuf, &status, &pos);
+        if (status == 0) {
+            memset(t->pfh, 0, sizeof(*(t->pfh)));
+            pb_readl(pbuf, &t->pfh->len, &pos);
+            if (t->pfh->len <= NFS3_FHSIZE) {
+                pb_read(pbuf, t->pfh->data, t->pfh->len, &pos);
+                t->stat = RPC_OK;
+            }
+        }
+    }
+}
+
+enum rpc_stat
+mountd_mount3(const struct ip_addr *server, const char *dir, fhandle3_t *pfh)
+{
+    struct mountd_mnt3_token token;
+    struct udp_pcb *mnt_pcb;
+    struct pbuf *pbuf;
+    int pos;
+    enum rpc_stat stat;
+
+    /* open a port */
+    mnt_pcb = mnt_new_udp(server, MNT_VERSION3);
+    if(mnt_pcb == NULL){
+        debug("mountd: no version 3 mount service\n");
+        return RPCERR_NOSUP;
+    }
+
+    /* Construct the call */
+    pbuf = rpcpbuf_init(MNT_NUMBER, MNT_VERSION3, MNTPROC_MNT, &pos);
+    if(pbuf == NULL){
+        udp_remove(mnt_pcb);
+        return RPCERR_NOBUF;
+    }
+
+    pb_write_str(pbuf, dir, strlen(dir), &pos);
+
+    /* Make the call */
+    token.pfh = pfh;
+    token.stat = RPC_OK;
+    stat = rpc_call(pbuf, pos, mnt_pcb, &mountd_mount3_cb, NULL, (uintptr_t)&token);
+    udp_remove(mnt_pcb);
+
+    if (stat != RPC_OK) {
+        debug("mountd: RPC error mounting %s\n", dir);
+        return stat;
+    }else if(token.stat != RPC_OK){
+        debug("mountd: server refused to mount %s\n", dir);
+        return token.stat;
+    }else {
+        debug("mountd: Mounted path %s with version 3\n", dir);
+        return RPC_OK;
+    }
+}
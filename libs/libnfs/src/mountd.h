@@ -23,6 +23,7 @@
 #define __MOUNTD_H
 
 #include <nfs/nfs.h>
+#include <nfs/nfs3.h>
 #include <lwip/ip_addr.h>
 
 
@@ -38,6 +39,19 @@
 enum rpc_stat mountd_mount(const struct ip_addr *server, const char *dir, 
                            fhandle_t *pfh);
 
+/**
+ * Mounts a directory over the network with version 3 of the mount protocol,
+ * for use with NFS version 3
+ * @param[in]  server The IP address of the server to mount from
+ * @param[in]  dir    The name of the directory to mount
+ * @param[out] pfh    If the value returned is RPC_OK, "pfh" contains the
+ *                    version 3 file handle of the mounted path.
+ * @return            RPC_OK on success, otherwise and appropriate error
+ *                    code it returned.
+ */
+enum rpc_stat mountd_mount3(const struct ip_addr *server, const char *dir,
+                            fhandle3_t *pfh);
+
 /**
  * Prints the directories exported by a server
  * @param[in] server  The IP address of the server to query
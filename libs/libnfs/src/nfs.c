@@ -87,6 +87,19 @@ nfs_timeout(void)
     rpc_timeout(100);
 }
 
+void
+nfs_set_timer(nfs_timer_add_t add, nfs_timer_remove_t remove,
+              nfs_time_now_t now)
+{
+    rpc_set_timer(add, remove, now);
+}
+
+void
+nfs_get_stats(nfs_stats_t *stats)
+{
+    rpc_get_stats(stats);
+}
+
 enum rpc_stat
 nfs_mount(const char * dir, fhandle_t *pfh)
 {
@@ -110,20 +123,28 @@ enum rpc_stat
 nfs_init(const struct ip_addr *server)
 {
     int port;
+    int v3;
     /* Initialise our RPC transport layer */
     if(init_rpc(server)){
         printf("Error receiving time using UDP time protocol\n");
         return RPCERR_NOSUP;
     }
 
+    /* Version 3 is optional, but enough on its own */
+    v3 = nfs3_init(server);
+
     /* make and RPC to get nfs info */
     port = portmapper_getport(server, NFS_NUMBER, NFS_VERSION);
     switch(port){
     case -1:
         printf( "Communication error when acquiring NFS port from portmapper\n" );
-        return RPCERR_COMM;
+        return (v3 == 0) ? RPC_OK : RPCERR_COMM;
     case -0:
     case -2:
+        if (v3 == 0) {
+            debug("NFSv2 is not supported, only version 3 is available\n");
+            return RPC_OK;
+        }
         printf( "Error when acquiring NFS port number from portmapper: Not supported\n" );
         return RPCERR_NOSUP;
     default:
@@ -477,48 +498,55 @@ _nfs_readdir_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
         /* get the status out */
         pb_readl(pbuf, &status, &pos);
         if (status == NFS_OK) {
-            struct filelist {
-                char *file;
-                struct filelist *next;
-            };
-            struct filelist *head = NULL;
-            struct filelist **tail = &head;
-            uint32_t more;
+            int first = pos;
+            size_t name_bytes = 0;
+            uint32_t more, eof;
+            char *names;
             int i;
 
             debug("Getting entries\n");
-            /* First read all of our names into a chain */
+            /* Size the reply first, so the names and the array pointing at
+             * them fit in a single allocation */
             while(pb_readl(pbuf, &more, &pos), more) {
                 uint32_t size, fileid;
-                char* name = NULL;
                 /* File ID (ignored) */
                 pb_readl(pbuf, &fileid, &pos);
-                /* Read in the file name length and file name */
                 pb_readl(pbuf, &size, &pos);
-                name = (char*)malloc(size + 1);
-                pb_read(pbuf, name, size, &pos);
-                name[size] = '\0';
+                pos += size;
                 pb_alignl(&pos);
                 /* Read the cookie: The last value read will be used for the
                  * next call call to nfs_readdir for more file names */
                 pb_readl(pbuf, &next_cookie, &pos);
-                /* update records */
-                *tail = (struct filelist*)malloc(sizeof(struct filelist));
-                (*tail)->file = name;
-                (*tail)->next = NULL;
-                tail = &(*tail)->next;
+                name_bytes += size + 1;
                 num_entries++;
             }
-            /* Now flatten the chain */
-            entries = (char**)malloc(sizeof(char*)*num_entries);
-            assert(entries);
-            for(i = 0; i < num_entries; i++){
-                struct filelist *old_head;
-                assert(head);
-                old_head = head;
-                head = head->next;
-                entries[i] = old_head->file;
-                free(old_head);
+            /* Nothing more to ask for if the server says this is the end */
+            pb_readl(pbuf, &eof, &pos);
+            if (eof) {
+                next_cookie = 0;
+            }
+            if (num_entries == 0) {
+                /* the end of the directory */
+            } else if ((entries = (char**)malloc(sizeof(char*) * num_entries +
+                                                 name_bytes)) == NULL) {
+                status = NFSERR_COMM;
+                num_entries = 0;
+            } else {
+                /* Now copy the names out behind the array */
+                names = (char*)&entries[num_entries];
+                pos = first;
+                for(i = 0; i < num_entries; i++){
+                    uint32_t size, fileid, cookie;
+                    pb_readl(pbuf, &more, &pos);
+                    pb_readl(pbuf, &fileid, &pos);
+                    pb_readl(pbuf, &size, &pos);
+                    pb_read(pbuf, names, size, &pos);
+                    names[size] = '\0';
+                    pb_alignl(&pos);
+                    pb_readl(pbuf, &cookie, &pos);
+                    entries[i] = names;
+                    names += size + 1;
+                }
             }
         }
     }
@@ -526,13 +554,7 @@ _nfs_readdir_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
     cb(token, status, num_entries, entries, next_cookie);
 
     /* Clean up */
-    if (entries){
-        int i;
-        for(i = 0; i < num_entries; i++){
-            free(entries[i]);
-        }
-        free(entries);
-    }
+    free(entries);
 }
 
 /* send a request for a directory item */
@@ -12,5 +12,15 @@
 #define __NFS_H
 
 #include <nfs/nfs.h>
+#include <nfs/nfs3.h>
+
+/**
+ * Finds the version 3 service of a server and opens a port to it. Called
+ * by nfs_init.
+ * @param[in] server  The IP address of the NFS server
+ * @return            0 on success, -1 if the server doesn't provide
+ *                    version 3.
+ */
+int nfs3_init(const struct ip_addr *server);
 
 #endif /* __NFS_H */
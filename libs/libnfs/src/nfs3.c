@@ -0,0 +1,802 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "nfs.h"
+#include "rpc.h"
+#include "mountd.h"
+#include "portmapper.h"
+#include "pbuf_helpers.h"
+
+#include <nfs/nfs3.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+
+//#define DEBUG_NFS3 1
+#ifdef DEBUG_NFS3
+#define debug(x...) printf(x)
+#else
+#define debug(x...)
+#endif
+
+
+#define NFS_NUMBER    100003
+#define NFS3_VERSION  3
+
+#define NFSPROC3_NULL          0
+#define NFSPROC3_GETATTR       1
+#define NFSPROC3_SETATTR       2
+#define NFSPROC3_LOOKUP        3
+#define NFSPROC3_ACCESS        4
+#define NFSPROC3_READLINK      5
+#define NFSPROC3_READ          6
+#define NFSPROC3_WRITE         7
+#define NFSPROC3_CREATE        8
+#define NFSPROC3_MKDIR         9
+#define NFSPROC3_SYMLINK      10
+#define NFSPROC3_MKNOD        11
+#define NFSPROC3_REMOVE       12
+#define NFSPROC3_RMDIR        13
+#define NFSPROC3_RENAME       14
+#define NFSPROC3_LINK         15
+#define NFSPROC3_READDIR      16
+#define NFSPROC3_READDIRPLUS  17
+#define NFSPROC3_FSSTAT       18
+#define NFSPROC3_FSINFO       19
+#define NFSPROC3_PATHCONF     20
+#define NFSPROC3_COMMIT       21
+
+/* createmode3 */
+#define UNCHECKED  0
+#define GUARDED    1
+#define EXCLUSIVE  2
+
+/* time_how */
+#define DONT_CHANGE          0
+#define SET_TO_SERVER_TIME   1
+#define SET_TO_CLIENT_TIME   2
+
+/*
+ * Most bytes of directory information, and of the whole reply, asked for
+ * in a READDIRPLUS. A reply larger than a packet comes in IP fragments.
+ */
+#define READDIRPLUS_DIRCOUNT  1024
+#define READDIRPLUS_MAXCOUNT  4096
+
+/* Arguments of a WRITE before the data: handle, offset, count, stable
+ * and the length of the data */
+#define WRITE3_ARGS  (sizeof(uint32_t) + NFS3_FHSIZE + sizeof(uint64_t) + \
+                      3 * sizeof(uint32_t))
+
+static struct udp_pcb *_nfs3_pcb = NULL;
+/* Used instead of _nfs3_pcb once a mount asked for TCP */
+static struct rpc_tcp *_nfs3_tcp = NULL;
+static bool _nfs3_use_tcp = false;
+
+/******************************************
+ *** XDR of the version 3 types
+ ******************************************/
+
+static void
+pb_write_fh3(struct pbuf *pbuf, const fhandle3_t *fh, int *pos)
+{
+    uint32_t padding = 0;
+    pb_writel(pbuf, fh->len, pos);
+    pb_write(pbuf, fh->data, fh->len, pos);
+    pb_write(pbuf, &padding, ((*pos + 3) & ~3) - *pos, pos);
+}
+
+static void
+pb_read_fh3(struct pbuf *pbuf, fhandle3_t *fh, int *pos)
+{
+    memset(fh, 0, sizeof(*fh));
+    pb_readl(pbuf, &fh->len, pos);
+    assert(fh->len <= NFS3_FHSIZE);
+    pb_read(pbuf, fh->data, fh->len, pos);
+    pb_alignl(pos);
+}
+
+static void
+pb_read_time3(struct pbuf *pbuf, nfstime3_t *t, int *pos)
+{
+    pb_readl(pbuf, &t->seconds, pos);
+    pb_readl(pbuf, &t->nseconds, pos);
+}
+
+static void
+pb_read_fattr3(struct pbuf *pbuf, fattr3_t *fattr, int *pos)
+{
+    uint32_t type;
+    pb_readl(pbuf, &type, pos);
+    fattr->type = type;
+    pb_readl(pbuf, &fattr->mode, pos);
+    pb_readl(pbuf, &fattr->nlink, pos);
+    pb_readl(pbuf, &fattr->uid, pos);
+    pb_readl(pbuf, &fattr->gid, pos);
+    pb_readll(pbuf, &fattr->size, pos);
+    pb_readll(pbuf, &fattr->used, pos);
+    pb_readl(pbuf, &fattr->rdev_major, pos);
+    pb_readl(pbuf, &fattr->rdev_minor, pos);
+    pb_readll(pbuf, &fattr->fsid, pos);
+    pb_readll(pbuf, &fattr->fileid, pos);
+    pb_read_time3(pbuf, &fattr->atime, pos);
+    pb_read_time3(pbuf, &fattr->mtime, pos);
+    pb_read_time3(pbuf, &fattr->ctime, pos);
+}
+
+/* post_op_attr: returns fattr if the attributes follow, otherwise NULL */
+static fattr3_t *
+pb_read_post_op_attr(struct pbuf *pbuf, fattr3_t *fattr, int *pos)
+{
+    uint32_t follows;
+    pb_readl(pbuf, &follows, pos);
+    if (!follows) {
+        return NULL;
+    }
+    pb_read_fattr3(pbuf, fattr, pos);
+    return fattr;
+}
+
+/* wcc_data: the attributes before are skipped, those after returned */
+static fattr3_t *
+pb_read_wcc_data(struct pbuf *pbuf, fattr3_t *fattr, int *pos)
+{
+    uint32_t follows;
+    pb_readl(pbuf, &follows, pos);
+    if (follows) {
+        /* size, mtime and ctime */
+        *pos += sizeof(uint64_t) + 2 * sizeof(nfstime3_t);
+    }
+    return pb_read_post_op_attr(pbuf, fattr, pos);
+}
+
+static void
+pb_write_set_time3(struct pbuf *pbuf, const nfstime3_t *t, int *pos)
+{
+    if (t->seconds == (uint32_t)-1) {
+        pb_writel(pbuf, DONT_CHANGE, pos);
+    } else {
+        pb_writel(pbuf, SET_TO_CLIENT_TIME, pos);
+        pb_writel(pbuf, t->seconds, pos);
+        pb_writel(pbuf, t->nseconds, pos);
+    }
+}
+
+static void
+pb_write_sattr3(struct pbuf *pbuf, const sattr3_t *sattr, int *pos)
+{
+    pb_writel(pbuf, sattr->mode != (uint32_t)-1, pos);
+    if (sattr->mode != (uint32_t)-1) {
+        pb_writel(pbuf, sattr->mode, pos);
+    }
+    pb_writel(pbuf, sattr->uid != (uint32_t)-1, pos);
+    if (sattr->uid != (uint32_t)-1) {
+        pb_writel(pbuf, sattr->uid, pos);
+    }
+    pb_writel(pbuf, sattr->gid != (uint32_t)-1, pos);
+    if (sattr->gid != (uint32_t)-1) {
+        pb_writel(pbuf, sattr->gid, pos);
+    }
+    pb_writel(pbuf, sattr->size != (uint64_t)-1, pos);
+    if (sattr->size != (uint64_t)-1) {
+        pb_writell(pbuf, sattr->size, pos);
+    }
+    pb_write_set_time3(pbuf, &sattr->atime, pos);
+    pb_write_set_time3(pbuf, &sattr->mtime, pos);
+}
+
+/* Start a call, NULL if there is no buffer or no version 3 server */
+static struct pbuf *
+nfs3_pbuf_init(int proc, int *pos)
+{
+    if (_nfs3_pcb == NULL) {
+        return NULL;
+    }
+    return rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, proc, pos);
+}
+
+static enum rpc_stat
+nfs3_send(struct pbuf *pbuf, int pos, rpc_cb_fn func, void *callback,
+          uintptr_t token)
+{
+    if (_nfs3_use_tcp) {
+        return rpc_send_tcp(pbuf, pos, _nfs3_tcp, func, callback, token);
+    }
+    return nfs3_send(pbuf, pos, func, callback, token);
+}
+
+static enum rpc_stat
+nfs3_call(struct pbuf *pbuf, int pos, rpc_cb_fn func, void *callback,
+          uintptr_t token)
+{
+    if (_nfs3_use_tcp) {
+        return rpc_call_tcp(pbuf, pos, _nfs3_tcp, func, callback, token);
+    }
+    return rpc_call(pbuf, pos, _nfs3_pcb, func, callback, token);
+}
+
+/* Read the header and status of a reply */
+static uint32_t
+nfs3_read_status(struct pbuf *pbuf, int *pos)
+{
+    struct rpc_reply_hdr hdr;
+    uint32_t status = NFSERR_COMM;
+    if (rpc_read_hdr(pbuf, &hdr, pos) == RPCERR_OK) {
+        pb_readl(pbuf, &status, pos);
+    }
+    return status;
+}
+
+/******************************************
+ *** Initialisation and mounting
+ ******************************************/
+
+int
+nfs3_init(const struct ip_addr *server)
+{
+    int port = portmapper_getport(server, NFS_NUMBER, NFS3_VERSION);
+    if (port <= 0) {
+        debug("NFSv3 is not available: %d\n", port);
+        return -1;
+    }
+    debug("NFSv3 port number is %d\n", port);
+    _nfs3_pcb = rpc_new_udp(server, port, PORT_ROOT);
+    assert(_nfs3_pcb);
+    return 0;
+}
+
+/* Connect over TCP to the server _nfs3_pcb talks to */
+static int
+nfs3_connect_tcp(void)
+{
+    int port = portmapper_getport_tcp(&_nfs3_pcb->remote_ip, NFS_NUMBER,
+                                      NFS3_VERSION);
+    if (port <= 0) {
+        debug("NFSv3 is not available over TCP: %d\n", port);
+        return -1;
+    }
+    debug("NFSv3 TCP port number is %d\n", port);
+    _nfs3_tcp = rpc_new_tcp(&_nfs3_pcb->remote_ip, port);
+    return _nfs3_tcp == NULL ? -1 : 0;
+}
+
+enum rpc_stat
+nfs3_mount(const char *dir, fhandle3_t *pfh, enum nfs3_transport transport)
+{
+    enum rpc_stat stat;
+    if (_nfs3_pcb == NULL) {
+        return RPCERR_NOSUP;
+    }
+    stat = mountd_mount3(&_nfs3_pcb->remote_ip, dir, pfh);
+    if (stat != RPC_OK) {
+        return stat;
+    }
+    if (transport == NFS3_TCP && _nfs3_tcp == NULL && nfs3_connect_tcp()) {
+        return RPCERR_COMM;
+    }
+    _nfs3_use_tcp = transport == NFS3_TCP;
+    return RPC_OK;
+}
+
+struct nfs3_fsinfo_token {
+    enum nfs_stat status;
+    nfs3_fsinfo_t *info;
+};
+
+static void
+_nfs3_fsinfo_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct nfs3_fsinfo_token *t = (struct nfs3_fsinfo_token*)token;
+    fattr3_t fattr;
+    uint32_t rtmult, wtmult;
+    int pos;
+
+    (void)callback;
+    t->status = nfs3_read_status(pbuf, &pos);
+    if (t->status == NFS_OK) {
+        pb_read_post_op_attr(pbuf, &fattr, &pos);
+        pb_readl(pbuf, &t->info->rtmax, &pos);
+        pb_readl(pbuf, &t->info->rtpref, &pos);
+        pb_readl(pbuf, &rtmult, &pos);
+        pb_readl(pbuf, &t->info->wtmax, &pos);
+        pb_readl(pbuf, &t->info->wtpref, &pos);
+        pb_readl(pbuf, &wtmult, &pos);
+        pb_readl(pbuf, &t->info->dtpref, &pos);
+        pb_readll(pbuf, &t->info->maxfilesize, &pos);
+    }
+}
+
+enum rpc_stat
+nfs3_fsinfo(const fhandle3_t *fh, nfs3_fsinfo_t *info)
+{
+    struct nfs3_fsinfo_token token;
+    struct pbuf *pbuf;
+    enum rpc_stat stat;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_FSINFO, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+
+    token.status = NFSERR_COMM;
+    token.info = info;
+    stat = nfs3_call(pbuf, pos, &_nfs3_fsinfo_cb, NULL, (uintptr_t)&token);
+    if (stat != RPC_OK) {
+        return stat;
+    }
+    if (token.status != NFS_OK) {
+        debug("NFSv3 FSINFO failed: %d\n", token.status);
+        return RPCERR_NOSUP;
+    }
+    debug("NFSv3 rtmax %u wtmax %u\n", info->rtmax, info->wtmax);
+    return RPC_OK;
+}
+
+/******************************************
+ *** Async functions
+ ******************************************/
+
+static void
+_nfs3_getattr_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_getattr_cb_t cb = callback;
+    fattr3_t fattr;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        pb_read_fattr3(pbuf, &fattr, &pos);
+    }
+    cb(token, status, &fattr);
+}
+
+enum rpc_stat
+nfs3_getattr(const fhandle3_t *fh, nfs3_getattr_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_GETATTR, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_getattr_cb, func, token);
+}
+
+static void
+_nfs3_lookup_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_lookup_cb_t cb = callback;
+    fhandle3_t fh;
+    fattr3_t fattr, *pattr = NULL;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        pb_read_fh3(pbuf, &fh, &pos);
+        pattr = pb_read_post_op_attr(pbuf, &fattr, &pos);
+    }
+    cb(token, status, &fh, pattr);
+}
+
+enum rpc_stat
+nfs3_lookup(const fhandle3_t *pfh, const char *name,
+            nfs3_lookup_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_LOOKUP, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, pfh, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_lookup_cb, func, token);
+}
+
+static void
+_nfs3_access_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_access_cb_t cb = callback;
+    fattr3_t fattr;
+    uint32_t access = 0;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        pb_read_post_op_attr(pbuf, &fattr, &pos);
+        pb_readl(pbuf, &access, &pos);
+    }
+    cb(token, status, access);
+}
+
+enum rpc_stat
+nfs3_access(const fhandle3_t *fh, uint32_t access,
+            nfs3_access_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_ACCESS, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_writel(pbuf, access, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_access_cb, func, token);
+}
+
+static void
+_nfs3_read_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_read_cb_t cb = callback;
+    fattr3_t fattr, *pattr = NULL;
+    char *data = NULL;
+    uint32_t count = 0, eof = 0, size;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status != NFSERR_COMM) {
+        pattr = pb_read_post_op_attr(pbuf, &fattr, &pos);
+    }
+    if (status == NFS_OK) {
+        pb_readl(pbuf, &count, &pos);
+        pb_readl(pbuf, &eof, &pos);
+        pb_readl(pbuf, &size, &pos);
+        /* malloc for data since pbuf may be part of a chain */
+        data = malloc(size);
+        assert(data != NULL);
+        pb_read(pbuf, data, size, &pos);
+        count = size;
+    }
+
+    cb(token, status, pattr, count, eof, data);
+
+    free(data);
+}
+
+enum rpc_stat
+nfs3_read(const fhandle3_t *fh, uint64_t offset, int count,
+          nfs3_read_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    if (count > NFS3_MAXDATA) {
+        count = NFS3_MAXDATA;
+    }
+    pbuf = nfs3_pbuf_init(NFSPROC3_READ, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_writell(pbuf, offset, &pos);
+    pb_writel(pbuf, count, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_read_cb, func, token);
+}
+
+struct write3_token_wrapper {
+    uintptr_t token;
+    int count;
+};
+
+static void
+_nfs3_write_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct write3_token_wrapper *t = (struct write3_token_wrapper*)token;
+    nfs3_write_cb_t cb = callback;
+    fattr3_t fattr, *pattr = NULL;
+    nfs3_writeverf_t verf;
+    uint32_t count = 0, committed = NFS3_UNSTABLE;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status != NFSERR_COMM) {
+        pattr = pb_read_wcc_data(pbuf, &fattr, &pos);
+    }
+    if (status == NFS_OK) {
+        pb_readl(pbuf, &count, &pos);
+        pb_readl(pbuf, &committed, &pos);
+        pb_read(pbuf, verf.data, sizeof(verf.data), &pos);
+        if (count > t->count) {
+            count = t->count;
+        }
+    }
+
+    cb(t->token, status, pattr, count, committed, &verf);
+
+    free(t);
+}
+
+enum rpc_stat
+nfs3_write(const fhandle3_t *fh, uint64_t offset, int count, const void *data,
+           enum nfs3_stable_how stable, nfs3_write_cb_t func, uintptr_t token)
+{
+    struct write3_token_wrapper *t;
+    struct pbuf *pbuf;
+    int limit;
+    int pos;
+    int err;
+
+    if (_nfs3_pcb == NULL) {
+        return RPCERR_NOBUF;
+    }
+    if (count > NFS3_MAXDATA) {
+        count = NFS3_MAXDATA;
+    }
+    t = (struct write3_token_wrapper*)malloc(sizeof(*t));
+    if (t == NULL) {
+        return RPCERR_NOMEM;
+    }
+    pbuf = rpcpbuf_init_len(NFS_NUMBER, NFS3_VERSION, NFSPROC3_WRITE,
+                            WRITE3_ARGS + count, &pos);
+    if (pbuf == NULL) {
+        free(t);
+        return RPCERR_NOBUF;
+    }
+
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_writell(pbuf, offset, &pos);
+    /* The pbuf is sized for the data, this only guards the header:
+     * count, stable and the length of the data go before it */
+    limit = (pbuf->tot_len - pos - 3 * sizeof(uint32_t)) & ~3;
+    if (count > limit) {
+        count = limit;
+    }
+    pb_writel(pbuf, count, &pos);
+    pb_writel(pbuf, stable, &pos);
+    pb_writel(pbuf, count, &pos);
+    pb_write(pbuf, data, count, &pos);
+    pb_alignl(&pos);
+
+    t->token = token;
+    t->count = count;
+    err = nfs3_send(pbuf, pos, &_nfs3_write_cb, func, (uintptr_t)t);
+    if (err) {
+        free(t);
+    }
+    return err;
+}
+
+static void
+_nfs3_commit_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_commit_cb_t cb = callback;
+    fattr3_t fattr;
+    nfs3_writeverf_t verf;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        pb_read_wcc_data(pbuf, &fattr, &pos);
+        pb_read(pbuf, verf.data, sizeof(verf.data), &pos);
+    }
+    cb(token, status, &verf);
+}
+
+enum rpc_stat
+nfs3_commit(const fhandle3_t *fh, uint64_t offset, uint32_t count,
+            nfs3_commit_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_COMMIT, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_writell(pbuf, offset, &pos);
+    pb_writel(pbuf, count, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_commit_cb, func, token);
+}
+
+static void
+_nfs3_create_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_create_cb_t cb = callback;
+    fhandle3_t fh, *pfh = NULL;
+    fattr3_t fattr, *pattr = NULL;
+    uint32_t status, follows;
+    int pos;
+
+    assert(callback != NULL);
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        pb_readl(pbuf, &follows, &pos);
+        if (follows) {
+            pb_read_fh3(pbuf, &fh, &pos);
+            pfh = &fh;
+        }
+        pattr = pb_read_post_op_attr(pbuf, &fattr, &pos);
+    }
+    debug("NFS3 CREATE CALLBACK\n");
+    cb(token, status, pfh, pattr);
+}
+
+enum rpc_stat
+nfs3_create(const fhandle3_t *pfh, const char *name, const sattr3_t *sattr,
+            nfs3_create_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_CREATE, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, pfh, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+    pb_writel(pbuf, UNCHECKED, &pos);
+    pb_write_sattr3(pbuf, sattr, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_create_cb, func, token);
+}
+
+static void
+_nfs3_remove_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_remove_cb_t cb = callback;
+    int pos;
+
+    assert(callback != NULL);
+    debug("NFS3 REMOVE CALLBACK\n");
+    cb(token, nfs3_read_status(pbuf, &pos));
+}
+
+enum rpc_stat
+nfs3_remove(const fhandle3_t *pfh, const char *name,
+            nfs3_remove_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_REMOVE, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, pfh, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_remove_cb, func, token);
+}
+
+/* Skip or read one entryplus3 after its value_follows. "ent" NULL skips */
+static void
+pb_read_entryplus3(struct pbuf *pbuf, nfs3_dirent_t *ent, char *name,
+                   fattr3_t *fattr, fhandle3_t *fh, uint32_t *namelen,
+                   nfscookie3_t *cookie, int *pos)
+{
+    fattr3_t skip_attr;
+    fhandle3_t skip_fh;
+    uint64_t fileid;
+    uint32_t follows;
+
+    pb_readll(pbuf, &fileid, pos);
+    pb_readl(pbuf, namelen, pos);
+    if (ent) {
+        pb_read(pbuf, name, *namelen, pos);
+        name[*namelen] = '\0';
+        ent->name = name;
+        ent->fileid = fileid;
+    } else {
+        *pos += *namelen;
+    }
+    pb_alignl(pos);
+    pb_readll(pbuf, cookie, pos);
+    fattr = pb_read_post_op_attr(pbuf, ent ? fattr : &skip_attr, pos);
+    pb_readl(pbuf, &follows, pos);
+    if (follows) {
+        pb_read_fh3(pbuf, ent ? fh : &skip_fh, pos);
+    }
+    if (ent) {
+        ent->fattr = fattr;
+        ent->fh = follows ? fh : NULL;
+    }
+}
+
+static void
+_nfs3_readdirplus_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
+{
+    nfs3_readdirplus_cb_t cb = callback;
+    nfs3_dirent_t *entries = NULL;
+    nfs3_cookieverf_t verf;
+    nfscookie3_t cookie = 0;
+    fattr3_t dir_attr;
+    int num_entries = 0;
+    uint32_t status;
+    int pos;
+
+    assert(callback != NULL);
+    debug("NFS3 READDIRPLUS CALLBACK\n");
+    status = nfs3_read_status(pbuf, &pos);
+    if (status == NFS_OK) {
+        size_t name_bytes = 0;
+        uint32_t more, eof, namelen;
+        int first, i;
+
+        pb_read_post_op_attr(pbuf, &dir_attr, &pos);
+        pb_read(pbuf, verf.data, sizeof(verf.data), &pos);
+        /* Size the reply first, so that the entries with their attributes,
+         * handles and names fit in a single allocation */
+        first = pos;
+        while (pb_readl(pbuf, &more, &pos), more) {
+            pb_read_entryplus3(pbuf, NULL, NULL, NULL, NULL, &namelen, &cookie, &pos);
+            name_bytes += namelen + 1;
+            num_entries++;
+        }
+        pb_readl(pbuf, &eof, &pos);
+        if (eof) {
+            cookie = 0;
+        }
+        if (num_entries > 0) {
+            entries = malloc(num_entries * (sizeof(nfs3_dirent_t) + sizeof(fattr3_t) +
+                                            sizeof(fhandle3_t)) + name_bytes);
+            if (entries == NULL) {
+                status = NFSERR_COMM;
+                num_entries = 0;
+            }
+        }
+        if (entries) {
+            fattr3_t *fattrs = (fattr3_t*)&entries[num_entries];
+            fhandle3_t *fhs = (fhandle3_t*)&fattrs[num_entries];
+            char *names = (char*)&fhs[num_entries];
+            nfscookie3_t c;
+            pos = first;
+            for (i = 0; i < num_entries; i++) {
+                pb_readl(pbuf, &more, &pos);
+                pb_read_entryplus3(pbuf, &entries[i], names, &fattrs[i], &fhs[i],
+                                   &namelen, &c, &pos);
+                names += namelen + 1;
+            }
+        }
+    }
+
+    cb(token, status, num_entries, entries, cookie, &verf);
+
+    free(entries);
+}
+
+enum rpc_stat
+nfs3_readdirplus(const fhandle3_t *pfh, nfscookie3_t cookie,
+                 const nfs3_cookieverf_t *verf,
+                 nfs3_readdirplus_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = nfs3_pbuf_init(NFSPROC3_READDIRPLUS, &pos);
+    if (pbuf == NULL) {
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, pfh, &pos);
+    pb_writell(pbuf, cookie, &pos);
+    pb_write(pbuf, verf->data, sizeof(verf->data), &pos);
+    pb_writel(pbuf, READDIRPLUS_DIRCOUNT, &pos);
+    pb_writel(pbuf, READDIRPLUS_MAXCOUNT, &pos);
+    return nfs3_send(pbuf, pos, &_nfs3_readdirplus_cb, func, token);
+}
@@ -85,6 +85,14 @@ pb_writel(struct pbuf* pbuf, uint32_t v, int* pos)
     pb_write_arrl(pbuf, &v, sizeof(v), pos);
 }
 
+/* XDR hypers go most significant long first */
+void
+pb_writell(struct pbuf* pbuf, uint64_t v, int* pos)
+{
+    pb_writel(pbuf, (uint32_t)(v >> 32), pos);
+    pb_writel(pbuf, (uint32_t)v, pos);
+}
+
 /* Read a string from the pbuf, update pos and return 0 on success */
 void
 pb_write_str(struct pbuf* pbuf, const char* str, uint32_t len, int* pos)
@@ -131,6 +139,15 @@ pb_readl(struct pbuf* pbuf, uint32_t *v, int* pos)
     pb_read_arrl(pbuf, v, sizeof(*v), pos);
 }
 
+void
+pb_readll(struct pbuf* pbuf, uint64_t *v, int* pos)
+{
+    uint32_t hi, lo;
+    pb_readl(pbuf, &hi, pos);
+    pb_readl(pbuf, &lo, pos);
+    *v = ((uint64_t)hi << 32) | lo;
+}
+
 void
 pb_read_str(struct pbuf* pbuf, char* str, int maxlen, int* pos)
 {
@@ -34,6 +34,11 @@ void pb_writel(struct pbuf* pbuf, uint32_t v, int* pos);
  * return 0 on success */
 void pb_readl(struct pbuf* pbuf, uint32_t *v, int* pos);
 
+/* Write a host order hyper (64 bit) into the buf in network order */
+void pb_writell(struct pbuf* pbuf, uint64_t v, int* pos);
+/* Read a network order hyper (64 bit) from the buf in host order */
+void pb_readll(struct pbuf* pbuf, uint64_t *v, int* pos);
+
 /* Write an array of host order longs into the buf in network order.
  * Size is the size of the array in bytes.
  * Update pos and return 0 on success */
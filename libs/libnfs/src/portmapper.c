@@ -47,8 +47,9 @@ getport_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
     }
 }
 
-int 
-portmapper_getport(const struct ip_addr *server, uint32_t prog, uint32_t vers)
+static int
+getport(const struct ip_addr *server, uint32_t prog, uint32_t vers,
+        uint32_t proto)
 {
     struct udp_pcb* rpc_pcb;
     struct pbuf *pbuf;
@@ -67,7 +68,7 @@ portmapper_getport(const struct ip_addr *server, uint32_t prog, uint32_t vers)
     /* Fill the call data */
     pb_writel(pbuf, prog, &pos);
     pb_writel(pbuf, vers, &pos);
-    pb_writel(pbuf, IPPROTO_UDP, &pos);
+    pb_writel(pbuf, proto, &pos);
     pb_writel(pbuf, 0, &pos);
 
     /* Make the call */
@@ -85,4 +86,15 @@ portmapper_getport(const struct ip_addr *server, uint32_t prog, uint32_t vers)
     }
 }
 
+int 
+portmapper_getport(const struct ip_addr *server, uint32_t prog, uint32_t vers)
+{
+    return getport(server, prog, vers, IPPROTO_UDP);
+}
 
+int
+portmapper_getport_tcp(const struct ip_addr *server, uint32_t prog,
+                       uint32_t vers)
+{
+    return getport(server, prog, vers, IPPROTO_TCP);
+}
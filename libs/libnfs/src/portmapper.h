@@ -26,4 +26,11 @@
  */
 int portmapper_getport(const ip_addr_t *server, uint32_t prog, uint32_t vers);
 
+/**
+ * As portmapper_getport, for the port the server listens on for TCP
+ * connections. The query itself goes over UDP.
+ */
+int portmapper_getport_tcp(const ip_addr_t *server, uint32_t prog,
+                           uint32_t vers);
+
 #endif /* __PORTMAPPER_H */
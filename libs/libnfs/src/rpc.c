@@ -15,9 +15,12 @@
 #include "pbuf_helpers.h"
 #include "common.h"
 
+#include <lwip/tcp.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 
@@ -42,13 +45,33 @@
 
 #define CALL_TIMEOUT_MS 10
 #define CALL_RETRIES     5
+/* Calls that nobody waits for are given longer */
+#define SEND_RETRIES     7
 
 #define ROOT_PORT_MIN 45
 #define ROOT_PORT_MAX 1024
 
 #define UDP_PAYLOAD 1400
+/* Room for the call header and credentials, host name included */
+#define RPC_HDR_MAX 128
+
+/* Retransmission timeouts, before the round trip time of a procedure is
+ * known and within which estimates are kept */
+#define RTO_INITIAL_MS     500
+#define RTO_MIN_MS          20
+#define RTO_MAX_MS        8000
+#define RTO_MAX_BACKOFF      4
+/* TCP calls are not retransmitted, just given up on after this */
+#define RPC_TCP_TIMEOUT_MS 30000
+
+/* Record marking over TCP: RFC 5531, section 11 */
+#define RECORD_LAST        0x80000000
+/* Replies are handed on in a single pbuf */
+#define RECORD_MAX         0xffff
+#define RX_MIN             2048
 
-#define RETRANSMIT_DELAY_MS 500
+#define CONNECT_TIMEOUT_MS 3000
+#define RECONNECT_DELAY_MS 1000
 
 
 /************************************************************
@@ -106,10 +129,51 @@ enum auth_flavor {
 #define ROUNDDOWN(v, r) ((v) - ((v) & ((r) - 1)))
 #define ROUNDUP(v, r)   ROUNDDOWN(v + (r) - 1, r)
 
-static inline struct pbuf*
-pbuf_new(u16_t length)
+/* Lends the data of a call to lwIP without copying it. The call is held
+ * until lwIP lets go, even if it is answered and freed meanwhile */
+struct rpc_ref {
+    struct pbuf_custom pc;
+    struct pbuf *call;
+};
+
+static void
+rpc_ref_free(struct pbuf *p)
 {
-    return pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+    struct rpc_ref *ref = (struct rpc_ref*)p;
+    pbuf_free(ref->call);
+    free(ref);
+}
+
+/* PBUF_REF pbufs over the data of a call. They have no room for headers,
+ * so lwIP puts the headers in a pbuf of its own in front and the call is
+ * left as it is, ready to be sent again */
+static struct pbuf *
+rpc_ref_chain(struct pbuf *call)
+{
+    struct pbuf *chain = NULL;
+    struct pbuf *p, *q;
+    struct rpc_ref *ref;
+    for (q = call; q != NULL; q = q->next) {
+        ref = malloc(sizeof(*ref));
+        if (ref == NULL) {
+            if (chain != NULL) {
+                pbuf_free(chain);
+            }
+            return NULL;
+        }
+        ref->pc.custom_free_function = rpc_ref_free;
+        ref->call = call;
+        p = pbuf_alloced_custom(PBUF_RAW, q->len, PBUF_REF, &ref->pc,
+                                q->payload, q->len);
+        assert(p != NULL);
+        pbuf_ref(call);
+        if (chain == NULL) {
+            chain = p;
+        } else {
+            pbuf_cat(chain, p);
+        }
+    }
+    return chain;
 }
 
 static inline enum rpc_stat
@@ -117,12 +181,12 @@ my_udp_send(struct udp_pcb* pcb, struct pbuf *pbuf)
 {
     int err;
     struct pbuf *p;
-    /* LWIP does not preserve the pbuf so make a copy first */
-    p = pbuf_new(pbuf->tot_len);
+    /* LWIP writes its headers in front of the payload, send a reference
+     * to the call instead of the call itself */
+    p = rpc_ref_chain(pbuf);
     if(p == NULL){
         return RPCERR_NOBUF;
     }
-    assert(!pbuf_copy(p, pbuf));
     err = udp_send(pcb, p);
     pbuf_free(p);
     switch(err){
@@ -168,18 +232,317 @@ get_xid(void)
  *  Mailboxes
  ***********************************************************/
 
+/* Outstanding calls are indexed by xid in a hash table. xids are handed
+ * out sequentially, so the low bits spread them evenly over the buckets */
+#define RPC_HASH_BUCKETS  256
+#define RPC_HASH(xid)     ((xid) & (RPC_HASH_BUCKETS - 1))
+
+/* Queue entries are carved from pool chunks of this many and recycled */
+#define RPC_POOL_CHUNK     64
+
+/* A TCP connection to a server. Any number of calls are outstanding on it
+ * at once, each sent as one record and matched to its reply by xid like
+ * over UDP. If the connection is lost, it is made again and the calls
+ * without a reply are sent again. */
+struct rpc_tcp {
+    struct tcp_pcb *pcb;    /* NULL while there is no connection */
+    struct ip_addr server;
+    int port;
+    int connected;
+    uint32_t timer;         /* reconnection timer, 0 if none */
+    /* Bytes received and not yet handed on. The fragments of the record
+     * being received are joined at the start, markers dropped */
+    char *rx;
+    int rx_len;
+    int rx_size;
+    int rec_len;
+    struct rpc_tcp *next;
+};
+
+static struct rpc_tcp *tcp_conns = NULL;
+
 struct rpc_queue {
     struct udp_pcb *pcb;
+    struct rpc_tcp *tcp;    /* if sent over TCP instead */
+    int sent;               /* on the current TCP connection */
     struct pbuf *pbuf;
     xid_t xid;
-    int timeout;
-    struct rpc_queue *next;
+    int retries;            /* transmissions after the first */
+    int max_retries;
+    uint64_t sent_at;       /* last transmission */
+    uint64_t deadline;      /* of the reply to it */
+    uint32_t rto;           /* in us, doubled by each retransmission */
+    uint32_t timer;         /* retransmission timer, 0 if none */
+    struct rpc_queue *hnext;                /* hash bucket chain */
+    struct rpc_queue *next, *prev;          /* all outstanding, oldest first */
     void (*func) (void *, uintptr_t, struct pbuf *);
     void *callback;
     uintptr_t arg;
 };
 
-struct rpc_queue *queue = NULL;
+static struct rpc_queue *rpc_hash[RPC_HASH_BUCKETS];
+static struct rpc_queue *queue = NULL;      /* for rpc_timeout */
+static struct rpc_queue *queue_tail = NULL;
+static struct rpc_queue *rpc_free = NULL;
+
+static struct rpc_queue *
+rpc_entry_alloc(void)
+{
+    struct rpc_queue *q_item;
+    int i;
+    if (rpc_free == NULL) {
+        q_item = malloc(RPC_POOL_CHUNK * sizeof(struct rpc_queue));
+        if (q_item == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < RPC_POOL_CHUNK; i++) {
+            q_item[i].next = rpc_free;
+            rpc_free = &q_item[i];
+        }
+    }
+    q_item = rpc_free;
+    rpc_free = q_item->next;
+    return q_item;
+}
+
+static void
+rpc_entry_free(struct rpc_queue *q_item)
+{
+    q_item->next = rpc_free;
+    rpc_free = q_item;
+}
+
+/* Remove item from the queue -- doesn't free the memory */
+static struct rpc_queue *
+get_from_queue(xid_t xid)
+{
+    struct rpc_queue **link, *tmp;
+
+    for (link = &rpc_hash[RPC_HASH(xid)]; *link != NULL; link = &(*link)->hnext) {
+        if ((*link)->xid == xid) {
+            break;
+        }
+    }
+    tmp = *link;
+    if (tmp == NULL) {
+        return NULL;
+    }
+    *link = tmp->hnext;
+
+    if (tmp->prev == NULL) {
+        queue = tmp->next;
+    } else {
+        tmp->prev->next = tmp->next;
+    }
+    if (tmp->next == NULL) {
+        queue_tail = tmp->prev;
+    } else {
+        tmp->next->prev = tmp->prev;
+    }
+    return tmp;
+}
+
+/* Timer service, if set retransmissions are driven by per packet timers */
+static nfs_timer_add_t timer_add = NULL;
+static nfs_timer_remove_t timer_remove = NULL;
+static nfs_time_now_t time_now = NULL;
+/* Until there is a clock, time advances with rpc_timeout */
+static uint64_t poll_clock = 0;
+
+static nfs_stats_t stats;
+/* Retransmitted calls answered lately: a further reply to one of these is
+ * a duplicate, any other unknown xid is a stray */
+#define ANSWERED_XIDS      16
+static xid_t answered_xids[ANSWERED_XIDS];
+static int answered_next = 0;
+
+static void rpc_retransmit(uint32_t id, void *data);
+static int rpc_tcp_connect(struct rpc_tcp *conn);
+
+/* Microseconds */
+static uint64_t
+rpc_now(void)
+{
+    return time_now != NULL ? time_now() : poll_clock;
+}
+
+/************************************************************
+ *  Round trip times
+ ***********************************************************/
+
+/* Round trip times are estimated per procedure (Jacobson/Karels), as a
+ * READ of 8 KiB takes longer than a GETATTR. Procedures that collide in
+ * the table take turns, starting afresh each time. */
+#define RTT_SLOTS          32
+#define RTT_SLOT(prog, vers, proc) \
+    (((prog) * 31 + (vers) * 7 + (proc)) & (RTT_SLOTS - 1))
+
+struct rpc_rtt {
+    uint32_t prog, vers, proc;
+    uint32_t srtt;          /* smoothed round trip time in us, times 8 */
+    uint32_t rttvar;        /* mean deviation in us, times 4 */
+    int backoff;            /* calls start with the timeout doubled this often */
+};
+
+static struct rpc_rtt rtt_table[RTT_SLOTS];
+
+/* Estimator of the procedure a call is for */
+static struct rpc_rtt *
+rtt_of(struct pbuf *pbuf)
+{
+    uint32_t prog, vers, proc;
+    struct rpc_rtt *rtt;
+    int pos = offsetof(call_body_hdr_t, prog);
+    pb_readl(pbuf, &prog, &pos);
+    pb_readl(pbuf, &vers, &pos);
+    pb_readl(pbuf, &proc, &pos);
+    rtt = &rtt_table[RTT_SLOT(prog, vers, proc)];
+    if (rtt->prog != prog || rtt->vers != vers || rtt->proc != proc) {
+        memset(rtt, 0, sizeof(*rtt));
+        rtt->prog = prog;
+        rtt->vers = vers;
+        rtt->proc = proc;
+    }
+    return rtt;
+}
+
+/* A reply came in "us" after a call that went out once */
+static void
+rtt_sample(struct rpc_rtt *rtt, uint32_t us)
+{
+    int32_t err;
+    if (rtt->srtt == 0) {
+        rtt->srtt = us << 3;
+        rtt->rttvar = us << 1;
+    } else {
+        err = us - (rtt->srtt >> 3);
+        rtt->srtt += err;
+        if (err < 0) {
+            err = -err;
+        }
+        rtt->rttvar += err - (rtt->rttvar >> 2);
+    }
+    rtt->backoff = 0;
+}
+
+/* Timeout of the first transmission of a call, in us */
+static uint32_t
+rtt_rto(const struct rpc_rtt *rtt)
+{
+    uint32_t rto = RTO_INITIAL_MS * 1000;
+    if (rtt->srtt != 0) {
+        rto = (rtt->srtt >> 3) + rtt->rttvar;
+        if (rto < RTO_MIN_MS * 1000) {
+            rto = RTO_MIN_MS * 1000;
+        }
+    }
+    rto <<= rtt->backoff;
+    return rto < RTO_MAX_MS * 1000 ? rto : RTO_MAX_MS * 1000;
+}
+
+/************************************************************
+ *  Retransmission
+ ***********************************************************/
+
+static void
+arm_retransmit(struct rpc_queue *q_item)
+{
+    q_item->deadline = rpc_now() + q_item->rto;
+    if (timer_add != NULL) {
+        q_item->timer = timer_add(q_item->rto, rpc_retransmit, q_item);
+    }
+}
+
+static void
+disarm_retransmit(struct rpc_queue *q_item)
+{
+    if (q_item->timer != 0 && timer_remove != NULL) {
+        timer_remove(q_item->timer);
+    }
+    q_item->timer = 0;
+}
+
+/* Give up on a call, its callback is given no reply */
+static void
+rpc_give_up(struct rpc_queue *q_item)
+{
+    struct rpc_queue *tmp;
+    debug("rpc: giving up on 0x%08x\n", q_item->xid);
+    stats.timeouts++;
+    if (q_item->tcp != NULL && q_item->sent && q_item->tcp->pcb != NULL) {
+        /* lwIP may still hold on to the call, and the connection is
+         * likely broken anyway. Calls still on it go out on the next */
+        tcp_abort(q_item->tcp->pcb);
+    }
+    tmp = get_from_queue(q_item->xid);
+    assert(tmp == q_item);
+    disarm_retransmit(q_item);
+    q_item->func(q_item->callback, q_item->arg, NULL);
+    pbuf_free(q_item->pbuf);
+    rpc_entry_free(q_item);
+}
+
+/* Deadline of a call expired without a reply: send it again with twice the
+ * timeout, or give up on it. Returns 1 if given up */
+static int
+rpc_expired(struct rpc_queue *q_item)
+{
+    if (q_item->tcp != NULL || q_item->retries >= q_item->max_retries) {
+        /* TCP retransmits by itself, the call is lost if it took this long */
+        rpc_give_up(q_item);
+        return 1;
+    }
+    debug("rpc: retransmission of 0x%08x\n", q_item->xid);
+    q_item->retries++;
+    stats.retransmits++;
+    if (q_item->retries == 1) {
+        /* Later calls start from the longer timeout, until one gets a
+         * reply without being sent again */
+        struct rpc_rtt *rtt = rtt_of(q_item->pbuf);
+        if (rtt->backoff < RTO_MAX_BACKOFF) {
+            rtt->backoff++;
+        }
+    }
+    q_item->rto = q_item->rto < RTO_MAX_MS * 1000 / 2 ?
+                  q_item->rto * 2 : RTO_MAX_MS * 1000;
+    /* Try again after another delay, whether or not it went out */
+    q_item->sent_at = rpc_now();
+    my_udp_send(q_item->pcb, q_item->pbuf);
+    arm_retransmit(q_item);
+    return 0;
+}
+
+static void
+rpc_retransmit(uint32_t id, void *data)
+{
+    struct rpc_queue *q_item = (struct rpc_queue*)data;
+    (void)id;
+    q_item->timer = 0;
+    (void)rpc_expired(q_item);
+}
+
+void
+rpc_set_timer(nfs_timer_add_t add, nfs_timer_remove_t remove,
+              nfs_time_now_t now)
+{
+    struct rpc_queue *q_item;
+    timer_add = add;
+    timer_remove = remove;
+    time_now = now;
+    /* Packets sent before the timer service existed */
+    for (q_item = queue; q_item != NULL; q_item = q_item->next) {
+        q_item->sent_at = rpc_now();
+        if (q_item->timer == 0) {
+            arm_retransmit(q_item);
+        }
+    }
+}
+
+void
+rpc_get_stats(nfs_stats_t *out)
+{
+    *out = stats;
+}
 
 /* 
  * Poll to see if packets should be resent.
@@ -193,100 +556,426 @@ void
 rpc_timeout(int ms)
 {
     struct rpc_queue *q_item;
+    struct rpc_tcp *conn;
+    uint64_t now;
+
+    poll_clock += ms * 1000ULL;
+    now = rpc_now();
+again:
     for (q_item = queue; q_item != NULL; q_item = q_item->next) {
-        q_item->timeout += ms;
-        if (q_item->timeout > RETRANSMIT_DELAY_MS) {
-            debug("rpc_timeout: Retransmission of 0x%08x\n", q_item->xid);
-            if(my_udp_send(q_item->pcb, q_item->pbuf)){
-                /* Try again later */
-            }else{
-                q_item->timeout = 0;
-            }
+        if (now < q_item->deadline) {
+            continue;
+        }
+        disarm_retransmit(q_item);
+        if (rpc_expired(q_item)) {
+            /* The callback may have done anything to the list */
+            goto again;
+        }
+    }
+    /* Lost connections, when there is no timer to make them again */
+    for (conn = tcp_conns; conn != NULL; conn = conn->next) {
+        if (conn->pcb == NULL && conn->timer == 0) {
+            rpc_tcp_connect(conn);
         }
     }
 }
 
 
 static void
-add_to_queue(struct pbuf *pbuf, struct udp_pcb* pcb, 
-         void (*func)(void *, uintptr_t, struct pbuf *),
+add_to_queue(struct pbuf *pbuf, struct udp_pcb* pcb, struct rpc_tcp *tcp,
+         int max_retries, void (*func)(void *, uintptr_t, struct pbuf *),
          void *callback, uintptr_t arg)
 {
     /* Need a lock here */
     struct rpc_queue *q_item;
-    struct rpc_queue *tmp;
-    q_item = malloc(sizeof(struct rpc_queue));
+    struct rpc_queue **bucket;
+    q_item = rpc_entry_alloc();
     assert(q_item != NULL);
 
-    q_item->next = NULL;
     q_item->pbuf = pbuf;
     q_item->xid = extract_xid(pbuf);
     q_item->pcb = pcb;
-    q_item->timeout = 0;
+    q_item->tcp = tcp;
+    q_item->sent = 0;
+    q_item->timer = 0;
+    q_item->retries = 0;
+    q_item->max_retries = max_retries;
+    q_item->sent_at = rpc_now();
+    q_item->rto = tcp != NULL ? RPC_TCP_TIMEOUT_MS * 1000 : rtt_rto(rtt_of(pbuf));
     q_item->func = func;
     q_item->arg = arg;
     q_item->callback = callback;
 
-    if (queue == NULL) {
-        /* Add at start of the linked list */
-        queue = q_item;
-    } else {
-        /* Add to end of the linked list */
-        for(tmp = queue; tmp->next != NULL; tmp = tmp->next)
-            ;
-        tmp->next = q_item;
-    }
-}
-
-/* Remove item from the queue -- doesn't free the memory */
-static struct rpc_queue *
-get_from_queue(xid_t xid)
-{
-    struct rpc_queue *tmp, *last = NULL;
+    /* Index by xid */
+    bucket = &rpc_hash[RPC_HASH(q_item->xid)];
+    q_item->hnext = *bucket;
+    *bucket = q_item;
 
-    for (tmp = queue; tmp != NULL && tmp->xid != xid; tmp = tmp->next) {
-        last = tmp;
-        ;
-    }
-    if (tmp == NULL) {
-        return NULL;
-    } else if (last == NULL) {
-        queue = tmp->next;
+    /* Add to end of the outstanding list */
+    q_item->next = NULL;
+    q_item->prev = queue_tail;
+    if (queue_tail == NULL) {
+        queue = q_item;
     } else {
-        last->next = tmp->next;
+        queue_tail->next = q_item;
     }
+    queue_tail = q_item;
 
-    return tmp;
+    stats.calls++;
+    arm_retransmit(q_item);
 }
 
 /**********************************
  *** RPC transport
  **********************************/
 
+/* Hand a reply to the call it answers, and free it */
 static void
-my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
-    struct ip_addr *addr, u16_t port)
+rpc_dispatch(struct pbuf *p)
 {
     xid_t xid;
     struct rpc_queue *q_item;
-    (void)port;
 
     xid = extract_xid(p);
 
     q_item = get_from_queue(xid);
 
     debug("Recieved a reply for xid: %u (%d) %p\n", xid, p->len, q_item);
+    if (q_item == NULL) {
+        int i;
+        for (i = 0; i < ANSWERED_XIDS; i++) {
+            if (answered_xids[i] == xid) {
+                /* The call was retransmitted, but the first transmission
+                 * got through after all */
+                stats.spurious++;
+                break;
+            }
+        }
+    }
     if (q_item != NULL){
+        disarm_retransmit(q_item);
+        if (q_item->retries > 0) {
+            answered_xids[answered_next] = xid;
+            answered_next = (answered_next + 1) % ANSWERED_XIDS;
+        }
+        if (q_item->retries == 0 && q_item->tcp == NULL && time_now != NULL) {
+            /* Replies to retransmitted calls may answer any transmission,
+             * and rpc_timeout ticks are too coarse to time */
+            rtt_sample(rtt_of(q_item->pbuf), rpc_now() - q_item->sent_at);
+        }
         assert(q_item->func);
         q_item->func(q_item->callback, q_item->arg, p);
         /* Clean up the queue item */
         pbuf_free(q_item->pbuf);
-        free(q_item);
+        rpc_entry_free(q_item);
     }
     /* Done with the incoming packet so free it */
     pbuf_free(p);
 }
 
+static void
+my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+    struct ip_addr *addr, u16_t port)
+{
+    (void)port;
+    rpc_dispatch(p);
+}
+
+/* Privileged ports, handed out in turn */
+static int
+next_root_port(void)
+{
+    static int root_port = -1;
+    if(root_port >= ROOT_PORT_MAX || root_port < ROOT_PORT_MIN){
+        root_port = ROOT_PORT_MIN;
+        debug("Recycling ports\n");
+    }
+    return root_port++;
+}
+
+/**********************************
+ *** TCP transport
+ **********************************/
+
+static void rpc_tcp_lost(struct rpc_tcp *conn);
+
+/* Queue one call as a single fragment record. Nothing is queued unless the
+ * whole record fits, as half a record would break the stream */
+static err_t
+rpc_tcp_write(struct rpc_tcp *conn, struct pbuf *pbuf)
+{
+    struct tcp_pcb *pcb = conn->pcb;
+    uint32_t marker;
+    struct pbuf *p;
+    int segs;
+    err_t err;
+
+    /* Segments each write may take: one per pbuf, one per MSS */
+    segs = 1 + pbuf->tot_len / TCP_MSS + 1;
+    for (p = pbuf; p != NULL; p = p->next) {
+        segs++;
+    }
+    if (tcp_sndbuf(pcb) < sizeof(marker) + pbuf->tot_len ||
+        tcp_sndqueuelen(pcb) + segs > TCP_SND_QUEUELEN) {
+        return ERR_MEM;
+    }
+
+    marker = htonl(RECORD_LAST | pbuf->tot_len);
+    err = tcp_write(pcb, &marker, sizeof(marker),
+                    TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+    /* The call itself is not copied. It is only freed once answered, and
+     * the reply acknowledges it, so lwIP is done with it by then. Calls
+     * given up on take the connection with them */
+    for (p = pbuf; p != NULL && err == ERR_OK; p = p->next) {
+        err = tcp_write(pcb, p->payload, p->len,
+                        p->next != NULL ? TCP_WRITE_FLAG_MORE : 0);
+    }
+    return err;
+}
+
+/* Send the calls on a connection that haven't gone out on it yet, oldest
+ * first, for as long as the send buffer has room */
+static void
+rpc_tcp_flush(struct rpc_tcp *conn)
+{
+    struct rpc_queue *q_item;
+    int wrote = 0;
+    if (!conn->connected) {
+        return;
+    }
+    for (q_item = queue; q_item != NULL; q_item = q_item->next) {
+        if (q_item->tcp != conn || q_item->sent) {
+            continue;
+        }
+        if (rpc_tcp_write(conn, q_item->pbuf) != ERR_OK) {
+            /* More once the server acknowledges some */
+            break;
+        }
+        q_item->sent = 1;
+        wrote = 1;
+    }
+    if (wrote) {
+        tcp_output(conn->pcb);
+    }
+}
+
+/* Hand on the complete records received. Returns -1 if the stream makes no
+ * sense */
+static int
+rpc_tcp_records(struct rpc_tcp *conn)
+{
+    uint32_t marker, len;
+    struct pbuf *p;
+    char *frag;
+    int left;
+
+    while ((left = conn->rx_len - conn->rec_len) >= (int)sizeof(marker)) {
+        frag = conn->rx + conn->rec_len;
+        memcpy(&marker, frag, sizeof(marker));
+        marker = ntohl(marker);
+        len = marker & ~RECORD_LAST;
+        if (conn->rec_len + len > RECORD_MAX) {
+            printf("rpc: record of %u bytes over TCP\n", conn->rec_len + len);
+            return -1;
+        }
+        if (left - sizeof(marker) < len) {
+            /* Rest of the fragment still to come */
+            break;
+        }
+        /* Join the fragment to the ones before */
+        memmove(frag, frag + sizeof(marker), left - sizeof(marker));
+        conn->rx_len -= sizeof(marker);
+        conn->rec_len += len;
+        if (!(marker & RECORD_LAST)) {
+            continue;
+        }
+        p = pbuf_alloc(PBUF_RAW, conn->rec_len, PBUF_RAM);
+        if (p != NULL) {
+            pbuf_take(p, conn->rx, conn->rec_len);
+            rpc_dispatch(p);
+        } else {
+            printf("rpc: no memory for a reply of %d bytes\n", conn->rec_len);
+        }
+        conn->rx_len -= conn->rec_len;
+        memmove(conn->rx, conn->rx + conn->rec_len, conn->rx_len);
+        conn->rec_len = 0;
+    }
+    return 0;
+}
+
+static err_t
+rpc_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    char *rx;
+    int size;
+
+    if (p == NULL) {
+        /* Closed by the server. Aborted rather than closed: a closing pcb
+         * lingers with segments pointing into calls that are sent again
+         * on the next connection, and freed once answered there */
+        debug("rpc: connection to port %d closed\n", conn->port);
+        tcp_arg(pcb, NULL);
+        conn->pcb = NULL;
+        rpc_tcp_lost(conn);
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    if (conn->rx_len + p->tot_len > conn->rx_size) {
+        size = conn->rx_size ? conn->rx_size : RX_MIN;
+        while (size < conn->rx_len + p->tot_len) {
+            size *= 2;
+        }
+        rx = realloc(conn->rx, size);
+        if (rx == NULL) {
+            /* lwIP offers it again later */
+            return ERR_MEM;
+        }
+        conn->rx = rx;
+        conn->rx_size = size;
+    }
+    pbuf_copy_partial(p, conn->rx + conn->rx_len, p->tot_len, 0);
+    conn->rx_len += p->tot_len;
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+
+    if (rpc_tcp_records(conn)) {
+        /* Calls answered are gone, the others go out again */
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
+}
+
+static err_t
+rpc_tcp_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+    (void)pcb;
+    (void)len;
+    rpc_tcp_flush((struct rpc_tcp*)arg);
+    return ERR_OK;
+}
+
+static err_t
+rpc_tcp_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    (void)pcb;
+    (void)err;
+    debug("rpc: connected to port %d\n", conn->port);
+    conn->connected = 1;
+    rpc_tcp_flush(conn);
+    return ERR_OK;
+}
+
+/* lwIP has freed the pcb already */
+static void
+rpc_tcp_err(void *arg, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    if (conn == NULL) {
+        /* Given up on already */
+        return;
+    }
+    debug("rpc: connection to port %d failed (%d)\n", conn->port, err);
+    (void)err;
+    conn->pcb = NULL;
+    rpc_tcp_lost(conn);
+}
+
+static void
+rpc_tcp_reconnect(uint32_t id, void *data)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)data;
+    (void)id;
+    conn->timer = 0;
+    if (rpc_tcp_connect(conn)) {
+        rpc_tcp_lost(conn);
+    }
+}
+
+/* The connection is gone. Make it again after a while, and send what is
+ * still without a reply again then */
+static void
+rpc_tcp_lost(struct rpc_tcp *conn)
+{
+    struct rpc_queue *q_item;
+    conn->connected = 0;
+    conn->rx_len = 0;
+    conn->rec_len = 0;
+    for (q_item = queue; q_item != NULL; q_item = q_item->next) {
+        if (q_item->tcp == conn) {
+            q_item->sent = 0;
+        }
+    }
+    if (timer_add != NULL && conn->timer == 0) {
+        conn->timer = timer_add(RECONNECT_DELAY_MS * 1000ULL,
+                                rpc_tcp_reconnect, conn);
+    }
+}
+
+/* Start connecting, rpc_tcp_connected is called once it is up */
+static int
+rpc_tcp_connect(struct rpc_tcp *conn)
+{
+    struct tcp_pcb *pcb;
+    int tries;
+    err_t err;
+
+    pcb = tcp_new();
+    if (pcb == NULL) {
+        return -1;
+    }
+    /* Servers want calls from a privileged port. Ports of earlier
+     * connections may still be in use */
+    tries = ROOT_PORT_MAX - ROOT_PORT_MIN;
+    do {
+        err = tcp_bind(pcb, IP_ADDR_ANY, next_root_port());
+    } while (err == ERR_USE && --tries > 0);
+    if (err != ERR_OK) {
+        tcp_close(pcb);
+        return -1;
+    }
+    tcp_arg(pcb, conn);
+    tcp_recv(pcb, rpc_tcp_recv);
+    tcp_sent(pcb, rpc_tcp_sent);
+    tcp_err(pcb, rpc_tcp_err);
+    conn->pcb = pcb;
+    err = tcp_connect(pcb, &conn->server, conn->port, rpc_tcp_connected);
+    if (err != ERR_OK) {
+        tcp_arg(pcb, NULL);
+        tcp_abort(pcb);
+        conn->pcb = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**********************************
+ *** Sending calls
+ **********************************/
+
+/* Once queued a call is answered through its callback, if only with no
+ * reply when it is given up on. A first transmission that fails is
+ * retransmitted like a lost one. */
+static enum rpc_stat
+rpc_send_on(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
+            struct rpc_tcp *tcp, int max_retries,
+            void (*func)(void *, uintptr_t, struct pbuf *),
+            void *callback, uintptr_t token)
+{
+    pbuf_realloc(pbuf, len);
+    /* Add to a queue */
+    add_to_queue(pbuf, pcb, tcp, max_retries, func, callback, token);
+    if (tcp != NULL) {
+        /* Goes out when there is room, or a connection */
+        rpc_tcp_flush(tcp);
+    } else if (my_udp_send(pcb, pbuf) != RPC_OK) {
+        debug("rpc: first transmission of 0x%08x failed\n", extract_xid(pbuf));
+    }
+    return RPC_OK;
+}
 
 enum rpc_stat
 rpc_send(struct pbuf *pbuf, int len, struct udp_pcb *pcb, 
@@ -294,10 +983,17 @@ rpc_send(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
      void *callback, uintptr_t token)
 {
     assert(pcb);
-    pbuf_realloc(pbuf, len);
-    /* Add to a queue */
-    add_to_queue(pbuf, pcb, func, callback, token);
-    return my_udp_send(pcb, pbuf);
+    return rpc_send_on(pbuf, len, pcb, NULL, SEND_RETRIES, func, callback,
+                       token);
+}
+
+enum rpc_stat
+rpc_send_tcp(struct pbuf *pbuf, int len, struct rpc_tcp *tcp,
+     void (*func)(void *, uintptr_t, struct pbuf *),
+     void *callback, uintptr_t token)
+{
+    assert(tcp);
+    return rpc_send_on(pbuf, len, NULL, tcp, 0, func, callback, token);
 }
 
 struct rpc_call_arg {
@@ -305,6 +1001,7 @@ struct rpc_call_arg {
     uintptr_t token;
     void* callback;
     volatile int complete;
+    int replied;
 };
 
 static void
@@ -317,23 +1014,19 @@ rpc_call_cb(void *callback, uintptr_t token, struct pbuf *pbuf)
 
     call_arg->func(call_arg->callback, call_arg->token, pbuf);
 
+    call_arg->replied = pbuf != NULL;
     call_arg->complete = 1;
 }
 
-enum rpc_stat
-rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb, 
-     void (*func)(void *, uintptr_t, struct pbuf *), 
-     void *callback, uintptr_t token)
+static enum rpc_stat
+rpc_call_on(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
+            struct rpc_tcp *tcp,
+            void (*func)(void *, uintptr_t, struct pbuf *),
+            void *callback, uintptr_t token)
 {
     struct rpc_call_arg call_arg;
-    struct rpc_queue *q_item;
-    int time_out;
     enum rpc_stat stat;
-    xid_t xid;
 
-    /* If we give up early, we must ensure that the argument remains in memory
-     * just in case the packet comes in later */
-    assert(pcb);
     assert(pbuf);
 
     /* GeneratrSend the thing with the unlock frunction as a callback */
@@ -341,34 +1034,42 @@ rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
     call_arg.callback = callback;
     call_arg.token = token;
     call_arg.complete = 0;
+    call_arg.replied = 0;
 
     /* Make the call */
-    xid = extract_xid(pbuf);
-    stat = rpc_send(pbuf, pbuf->tot_len, pcb, &rpc_call_cb, NULL, 
-                   (uintptr_t)&call_arg);
+    stat = rpc_send_on(pbuf, pbuf->tot_len, pcb, tcp, CALL_RETRIES,
+                       &rpc_call_cb, NULL, (uintptr_t)&call_arg);
     if(stat){
         return stat;
     }
 
-    /* Wait for the response */
-    time_out = RETRANSMIT_DELAY_MS * (CALL_RETRIES + 1);
-    while(time_out >= 0){
+    /* Wait for the response, or for the call to be given up on. Either
+     * way it is off the queue when complete */
+    while(!call_arg.complete){
         _usleep(CALL_TIMEOUT_MS * 1000);
-        if(call_arg.complete) {
-            /* Success */
-            return 0;
+        if(!call_arg.complete){
+            rpc_timeout(CALL_TIMEOUT_MS);
         }
-        rpc_timeout(CALL_TIMEOUT_MS);
-        time_out -= CALL_TIMEOUT_MS;
     }
+    return call_arg.replied ? RPC_OK : RPCERR_COMM;
+}
 
-    /* If we get here, we have failed. Data is on the stack so make sure 
-     * we remove references from the queue */
-    q_item = get_from_queue(xid);
-    assert(q_item);
-    pbuf_free(q_item->pbuf);
-    free(q_item);
-    return RPCERR_COMM;
+enum rpc_stat
+rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb, 
+     void (*func)(void *, uintptr_t, struct pbuf *), 
+     void *callback, uintptr_t token)
+{
+    assert(pcb);
+    return rpc_call_on(pbuf, len, pcb, NULL, func, callback, token);
+}
+
+enum rpc_stat
+rpc_call_tcp(struct pbuf *pbuf, int len, struct rpc_tcp *tcp,
+     void (*func)(void *, uintptr_t, struct pbuf *),
+     void *callback, uintptr_t token)
+{
+    assert(tcp);
+    return rpc_call_on(pbuf, len, NULL, tcp, func, callback, token);
 }
 
 
@@ -390,17 +1091,12 @@ rpc_new_udp(const struct ip_addr *server, int remote_port,
             enum port_type local_port)
 {
     struct udp_pcb* ret;
-    static int root_port = -1;
     struct ip_addr s = *server;
     ret = udp_new();
     assert(ret);
     udp_recv(ret, my_recv, NULL);
     if(local_port == PORT_ROOT){
-        if(root_port >= ROOT_PORT_MAX || root_port < ROOT_PORT_MIN){
-            root_port = ROOT_PORT_MIN;
-            debug("Recycling ports\n");
-        }
-        udp_bind(ret, IP_ADDR_ANY, root_port++);
+        udp_bind(ret, IP_ADDR_ANY, next_root_port());
     }else{
         /* let lwip decide for itself */
     }
@@ -408,11 +1104,53 @@ rpc_new_udp(const struct ip_addr *server, int remote_port,
     return ret;
 }
 
+struct rpc_tcp *
+rpc_new_tcp(const struct ip_addr *server, int remote_port)
+{
+    struct rpc_tcp *conn;
+    int time_out;
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->server = *server;
+    conn->port = remote_port;
+    if (rpc_tcp_connect(conn)) {
+        free(conn);
+        return NULL;
+    }
+    /* Wait for the connection, so that a server without TCP is noticed */
+    for (time_out = CONNECT_TIMEOUT_MS; time_out >= 0 && !conn->connected;
+         time_out -= CALL_TIMEOUT_MS) {
+        _usleep(CALL_TIMEOUT_MS * 1000);
+    }
+    if (!conn->connected) {
+        if (conn->timer != 0 && timer_remove != NULL) {
+            timer_remove(conn->timer);
+        }
+        if (conn->pcb != NULL) {
+            tcp_arg(conn->pcb, NULL);
+            tcp_abort(conn->pcb);
+        }
+        free(conn->rx);
+        free(conn);
+        return NULL;
+    }
+    conn->next = tcp_conns;
+    tcp_conns = conn;
+    return conn;
+}
+
 
 enum rpc_reply_err
 rpc_read_hdr(struct pbuf* pbuf, struct rpc_reply_hdr* hdr, int* pos)
 {
     *pos = 0;
+    if(pbuf == NULL){
+        /* The call was given up on */
+        return RPCERR_TIMEOUT;
+    }
     /* read in the header */
     pb_read_arrl(pbuf, (uint32_t*)hdr, sizeof(*hdr), pos);
     if(hdr->msg_type != MSG_REPLY){
@@ -495,14 +1233,21 @@ rpc_write_hdr(struct pbuf* pbuf, int prog, int vers, int proc, int* pos)
 }
 
 struct pbuf *
-rpcpbuf_init(int prognum, int vernum, int procnum, int* pos)
+rpcpbuf_init_len(int prognum, int vernum, int procnum, int payload, int* pos)
 {
     struct pbuf* pbuf;
-    pbuf = pbuf_alloc(PBUF_TRANSPORT, UDP_PAYLOAD, PBUF_RAM);
+    /* Never sent as it is, lwIP is given references to it */
+    pbuf = pbuf_alloc(PBUF_RAW, RPC_HDR_MAX + payload, PBUF_RAM);
     if(pbuf) {
         rpc_write_hdr(pbuf, prognum, vernum, procnum, pos);
     }
     return pbuf;
 }
 
+struct pbuf *
+rpcpbuf_init(int prognum, int vernum, int procnum, int* pos)
+{
+    return rpcpbuf_init_len(prognum, vernum, procnum, UDP_PAYLOAD - RPC_HDR_MAX, pos);
+}
+
 
@@ -16,6 +16,9 @@
 #include <lwip/udp.h>
 #include <nfs/nfs.h>
 
+/* A TCP connection, see rpc_new_tcp */
+struct rpc_tcp;
+
 enum port_type {
     PORT_ANY,
     PORT_ROOT
@@ -29,7 +32,8 @@ enum rpc_reply_err {
     RPCERR_FAILURE      = -3,
     RPCERR_NOT_OK       = -4,
     RPCERR_NOT_FOUND    = -5,
-    RPCERR_NEXT_AVAIL   = -6
+    RPCERR_NEXT_AVAIL   = -6,
+    RPCERR_TIMEOUT      = -7
 };
 
 enum msg_type {
@@ -53,7 +57,8 @@ struct rpc_reply_hdr {
  *** Transport layer interface 
  *******************************/
 
-/* rpc callback functions called when a packet is received */
+/* rpc callback functions called when a packet is received, or with a NULL
+ * packet when the call is given up on after its retries */
 typedef void (*rpc_cb_fn)(void* cb, uintptr_t token, struct pbuf* pbuf);
 
 /**
@@ -74,6 +79,19 @@ int init_rpc(const struct ip_addr *server);
 struct udp_pcb* rpc_new_udp(const struct ip_addr* server, int remote_port, 
                             enum port_type local_port);
 
+/**
+ * Connect to a server over TCP, for use with the rpc_send_tcp and
+ * rpc_call_tcp functions. Calls are sent as records (RFC 5531), any number
+ * of them outstanding at once. A lost connection is made again and the
+ * calls still without a reply are sent again; calls are not retransmitted
+ * otherwise. The local port is a privileged one.
+ * @param[in] server      The IP address of the server to connect to
+ * @param[in] remote_port The remote port to connect to
+ * @return On success; a reference to the connection, once it is up.
+ *         Otherwise; NULL.
+ */
+struct rpc_tcp* rpc_new_tcp(const struct ip_addr* server, int remote_port);
+
 /**
  * Allocates a pbuf and writes the rpc header 
  * @param[in] prog The program number
@@ -87,9 +105,25 @@ struct udp_pcb* rpc_new_udp(const struct ip_addr* server, int remote_port,
  */
 struct pbuf * rpcpbuf_init(int prog, int vers, int proc, int* pos);
 
+/**
+ * Allocates a pbuf with room for "payload" bytes of arguments after the
+ * rpc header, and writes the header. Calls larger than a packet are sent
+ * as IP fragments.
+ * @param[in] prog    The program number
+ * @param[in] vers    The version number
+ * @param[in] proc    The proceedure number
+ * @param[in] payload The number of bytes of arguments to make room for
+ * @param[out] pos    As for rpcpbuf_init
+ * @return On success; A reference to the newly allocated pbuf.
+ *         Otherwise; NULL.
+ */
+struct pbuf * rpcpbuf_init_len(int prog, int vers, int proc, int payload,
+                               int* pos);
+
 /**
  * Read and check the rpc header from the pbuf
- * @param[in] pbuf A reference to the pbuf to probe
+ * @param[in] pbuf A reference to the pbuf to probe, NULL if the call was
+ *                 given up on (RPCERR_TIMEOUT)
  * @param[out] hdr A reference to a rpc header structure to fill.
  * @param[out] pos The position is assumed to initially be zero. The
  *                 value at this address will contain the next position to
@@ -102,7 +136,9 @@ enum rpc_reply_err rpc_read_hdr(struct pbuf* pbuf,
 
 /**
  * Send an RPC packet, add a callback for this packet to the queue and
- * retransmitt as necessary. 
+ * retransmitt as necessary. The retransmission timeout adapts to the round
+ * trip times of the procedure and doubles with each retransmission. After
+ * the last retry the callback is run with no packet.
  * Free the pbuf only once the response is handled.
  * @param[in] pbuf     The pbuf to send
  * @param[in] len      The length of the payload
@@ -116,6 +152,13 @@ enum rpc_reply_err rpc_read_hdr(struct pbuf* pbuf,
 enum rpc_stat rpc_send(struct pbuf *pbuf, int len, struct udp_pcb *pcb, 
                        rpc_cb_fn func, void *callback, uintptr_t token);
 
+/**
+ * As rpc_send, over a TCP connection. The call is queued if the connection
+ * can't take it yet.
+ */
+enum rpc_stat rpc_send_tcp(struct pbuf *pbuf, int len, struct rpc_tcp *tcp,
+                           rpc_cb_fn func, void *callback, uintptr_t token);
+
 /**
  * Send am RPC packet and wait for a response before returning.
  * Frees the pbuf after use
@@ -131,6 +174,12 @@ enum rpc_stat rpc_send(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
 enum rpc_stat rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb, 
                        rpc_cb_fn func, void *callback, uintptr_t token);
 
+/**
+ * As rpc_call, over a TCP connection.
+ */
+enum rpc_stat rpc_call_tcp(struct pbuf *pbuf, int len, struct rpc_tcp *tcp,
+                           rpc_cb_fn func, void *callback, uintptr_t token);
+
 
 /**
  * Retransmit packets as necessary
@@ -138,4 +187,19 @@ enum rpc_stat rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
  */
 void rpc_timeout(int ms);
 
+/**
+ * Retransmit from a per packet timer instead of rpc_timeout
+ * @param add     Registers a one-shot timer
+ * @param remove  Cancels a timer
+ * @param now     The clock round trip times are measured with
+ */
+void rpc_set_timer(nfs_timer_add_t add, nfs_timer_remove_t remove,
+                   nfs_time_now_t now);
+
+/**
+ * Counters of calls and retransmissions
+ * @param[out] stats Filled in
+ */
+void rpc_get_stats(nfs_stats_t *stats);
+
 #endif /* __RPC_H */
@@ -73,6 +73,12 @@ int sos_sys_close(int file);
 /* Closes an open file. Returns 0 if successful, -1 if not (invalid "file").
  */
 
+int sos_sys_fsync(int file);
+/* Write out data of an open file that SOS still buffers. Returns 0 if
+ * successful, -1 if not (invalid "file", or a write to the file failed
+ * since it was last synced).
+ */
+
 int sos_sys_read(int file, char *buf, size_t nbyte);
 /* Read from an open file, into "buf", max "nbyte" bytes.
  * Returns the number of bytes read.
@@ -86,12 +92,58 @@ int sos_sys_write(int file, char *buf, size_t nbyte);
  * Returns -1 on error (invalid file).
  */
 
+int sos_sys_pread(int file, char *buf, size_t nbyte, size_t offset);
+/* Read from an open file at "offset", into "buf", max "nbyte" bytes.
+ * The file position is neither used nor moved.
+ * Returns the number of bytes read, -1 on error.
+ */
+
+int sos_sys_pwrite(int file, char *buf, size_t nbyte, size_t offset);
+/* Write to an open file at "offset", from "buf", max "nbyte" bytes.
+ * The file position is neither used nor moved.
+ * Returns the number of bytes written.
+ */
+
+long sos_sys_lseek(int file, long offset, int whence);
+/* Move the file position to "offset" relative to the start (SEEK_SET),
+ * the current position (SEEK_CUR) or the end of the file (SEEK_END).
+ * Returns the new position, -1 on error (invalid file, console).
+ */
+
+struct pollfd;
+
+int sos_sys_poll(struct pollfd *fds, int nfds, int timeout);
+/* Wait until one of "fds" is ready or "timeout" milliseconds passed, -1
+ * waits forever and 0 doesn't wait. Fills in revents of every entry.
+ * Returns the number of ready entries, -1 on error.
+ */
+
+struct iovec;
+
+int sos_sys_readv(int file, const struct iovec *iov, int iovcnt);
+/* Read from an open file into the "iovcnt" buffers of "iov", in order.
+ * Returns the number of bytes read, -1 on error (invalid file).
+ */
+
+int sos_sys_writev(int file, const struct iovec *iov, int iovcnt);
+/* Write to an open file from the "iovcnt" buffers of "iov", in order.
+ * Returns the number of bytes written.
+ */
+
 int sos_getdirent(int pos, char *name, size_t nbyte);
 /* Reads name of entry "pos" in directory into "name", max "nbyte" bytes.
  * Returns number of bytes returned, zero if "pos" is next free entry,
  * -1 if error (non-existent entry).
  */
 
+int sos_getdirents(int pos, char *buf, size_t nbyte);
+/* Reads the names of entries "pos" onwards in directory into "buf", max
+ * "nbyte" bytes, each name NUL terminated and following the one before.
+ * The first name is truncated if it doesn't fit.
+ * Returns number of names returned, zero if "pos" is next free entry,
+ * -1 if error.
+ */
+
 int sos_stat(const char *path, sos_stat_t *buf);
 /* Returns information about file "path" through "buf".
  * Returns 0 if successful, -1 otherwise (invalid name).
@@ -123,6 +175,11 @@ pid_t sos_process_wait(pid_t pid);
 
 int64_t sos_sys_time_stamp(void);
 /* Returns time in microseconds since booting.
+ * Read from the time page SOS shares with every process, no syscall needed.
+ */
+
+int64_t sos_sys_time_stamp_ipc(void);
+/* Same as sos_sys_time_stamp, but asks SOS.
  */
 
 void sos_sys_usleep(int msec);
@@ -0,0 +1,68 @@
+/* Message register marshalling shared by libsos and SOS
+ *
+ * Both ends run on the same CPU, so strings and binary blobs are copied
+ * into the IPC buffer as they are in memory, a word at a time, instead of
+ * being packed byte by byte. Message layouts (*_MESSAGE_START) are in
+ * syscallno.h.
+ */
+
+#ifndef _SOS_IPC_H
+#define _SOS_IPC_H
+
+#include <string.h>
+#include <sel4/sel4.h>
+#include <syscallno.h>
+
+/* Message registers needed for "bytes" bytes */
+#define IPC_WORDS(bytes)    (((bytes) + sizeof(seL4_Word) - 1) / sizeof(seL4_Word))
+
+/* Bytes available from message register "start" to the end of the buffer */
+static inline size_t ipc_room(int start) {
+    return (seL4_MsgMaxLength - start) * sizeof(seL4_Word);
+}
+
+/* Store a string, NUL terminated and truncated to fit, from register
+ * "start". Returns the number of registers used. */
+static inline size_t ipc_put_str(int start, const char *str) {
+    char *dst = (char*)&seL4_GetIPCBuffer()->msg[start];
+    size_t len = strnlen(str, ipc_room(start) - 1);
+    memcpy(dst, str, len);
+    dst[len] = 0;
+    return IPC_WORDS(len + 1);
+}
+
+/* Load a string stored by ipc_put_str into "buf" of "size" bytes */
+static inline size_t ipc_get_str(int start, char *buf, size_t size) {
+    const char *src = (const char*)&seL4_GetIPCBuffer()->msg[start];
+    size_t max = size - 1 < ipc_room(start) ? size - 1 : ipc_room(start);
+    size_t len = strnlen(src, max);
+    memcpy(buf, src, len);
+    buf[len] = 0;
+    return len;
+}
+
+/* Store "length" bytes, preceded by the length, from register "start".
+ * Returns the number of registers used. */
+static inline size_t ipc_put_bin(int start, const void *data, size_t length) {
+    if (length > ipc_room(start + 1)) {
+        length = ipc_room(start + 1);
+    }
+    seL4_SetMR(start, length);
+    memcpy(&seL4_GetIPCBuffer()->msg[start + 1], data, length);
+    return 1 + IPC_WORDS(length);
+}
+
+/* Load at most "size" bytes stored by ipc_put_bin. Returns the length */
+static inline size_t ipc_get_bin(int start, void *buf, size_t size) {
+    size_t length = seL4_GetMR(start);
+    if (length > size) {
+        length = size;
+    }
+    if (length > ipc_room(start + 1)) {
+        length = ipc_room(start + 1);
+    }
+    memcpy(buf, &seL4_GetIPCBuffer()->msg[start + 1], length);
+    return length;
+}
+
+#endif
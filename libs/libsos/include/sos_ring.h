@@ -0,0 +1,99 @@
+/* Submission/completion rings shared between a client and SOS */
+
+#ifndef _SOS_RING_H
+#define _SOS_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Entries per ring, must be a power of two */
+#define SOS_RING_ENTRIES 64
+
+/* Submission entry. opcode is one of SOS_SYSCALL_OPEN, READ, WRITE, PREAD,
+ * PWRITE, STAT and CLOSE; arguments are used as for the matching system
+ * call:
+ *   open:   addr/len = path, flags = FM_* mode
+ *   read:   fd, addr/len = buffer
+ *   write:  fd, addr/len = buffer
+ *   pread:  fd, addr/len = buffer, off = file offset
+ *   pwrite: fd, addr/len = buffer, off = file offset
+ *   stat:   addr/len = path, addr2 = sos_stat_t to fill
+ *   close:  fd
+ */
+typedef struct {
+    uint32_t opcode;
+    int32_t  fd;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t flags;
+    uint32_t addr2;
+    uint32_t off;
+    uint32_t user_data; /* handed back in the completion */
+} sos_sqe_t;
+
+/* Completion entry, res is what the system call would have returned */
+typedef struct {
+    uint32_t user_data;
+    int32_t  res;
+} sos_cqe_t;
+
+/* The whole ring lives in one page-aligned page of the client. The client
+ * produces at sq_tail and consumes at cq_head, SOS does the opposite.
+ * Indices are free running and wrap modulo SOS_RING_ENTRIES. */
+typedef struct {
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    sos_sqe_t sqes[SOS_RING_ENTRIES];
+    sos_cqe_t cqes[SOS_RING_ENTRIES];
+} sos_ring_t;
+
+int sos_ring_register(sos_ring_t *ring);
+/* Register "ring" with SOS. "ring" must be page aligned and zeroed.
+ * Returns 0 if successful, -1 otherwise.
+ */
+
+int sos_ring_enter(unsigned wait_nr);
+/* Ring the doorbell: SOS starts all pending submissions it has completion
+ * room for and returns at once; each completion is posted when its
+ * operation finishes, in whatever order they finish. With wait_nr > 0 the
+ * call returns only once at least wait_nr completions are waiting, or
+ * nothing is left running. Returns the number of submissions consumed,
+ * -1 on error.
+ */
+
+/* Next free submission entry, or NULL if the ring is full */
+static inline sos_sqe_t *sos_ring_get_sqe(sos_ring_t *ring) {
+    if (ring->sq_tail - ring->sq_head == SOS_RING_ENTRIES) {
+        return NULL;
+    }
+    return &ring->sqes[ring->sq_tail & (SOS_RING_ENTRIES - 1)];
+}
+
+/* Publish the entry returned by the last sos_ring_get_sqe() */
+static inline void sos_ring_submit(sos_ring_t *ring) {
+    __sync_synchronize();
+    ring->sq_tail++;
+}
+
+/* Oldest unseen completion, or NULL if there is none */
+static inline sos_cqe_t *sos_ring_peek_cqe(sos_ring_t *ring) {
+    if (ring->cq_head == ring->cq_tail) {
+        return NULL;
+    }
+    __sync_synchronize();
+    return &ring->cqes[ring->cq_head & (SOS_RING_ENTRIES - 1)];
+}
+
+/* Release the completion returned by sos_ring_peek_cqe() */
+static inline void sos_ring_cqe_seen(sos_ring_t *ring) {
+    ring->cq_head++;
+}
+
+/* Submissions SOS hasn't consumed yet, i.e. whether the doorbell is needed */
+static inline bool sos_ring_pending(sos_ring_t *ring) {
+    return ring->sq_head != ring->sq_tail;
+}
+
+#endif
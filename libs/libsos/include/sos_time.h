@@ -0,0 +1,19 @@
+/* Time page SOS maps read-only into every client at PROCESS_TIME_PAGE */
+
+#ifndef _SOS_TIME_H
+#define _SOS_TIME_H
+
+#include <stdint.h>
+
+/* The timer counter page is mapped at PROCESS_TIMER_PAGE. Time since
+ * booting in microseconds is ((high << 32) | counter) >> shift, read
+ * consistently: seq is odd while SOS updates the page, and changes
+ * whenever high does. */
+typedef struct {
+    volatile uint32_t seq;
+    volatile uint32_t high;     /* upper 32 bits of the counter */
+    uint32_t counter_offset;    /* of the counter in the timer page */
+    uint32_t shift;             /* counter ticks per microsecond, as log2 */
+} sos_time_page_t;
+
+#endif
@@ -22,11 +22,42 @@
 #define SOS_SYSCALL_WAITPID (14)
 #define SOS_SYSCALL_PROC_DELETE (15)
 #define SOS_SYSCALL_PROC_STATUS (16)
+#define SOS_SYSCALL_RING_REGISTER (17)
+#define SOS_SYSCALL_RING_ENTER (18)
+#define SOS_SYSCALL_READ_INLINE (19)
+#define SOS_SYSCALL_WRITE_INLINE (20)
+#define SOS_SYSCALL_READV (21)
+#define SOS_SYSCALL_WRITEV (22)
+#define SOS_SYSCALL_PREAD (23)
+#define SOS_SYSCALL_PWRITE (24)
+#define SOS_SYSCALL_LSEEK (25)
+#define SOS_SYSCALL_POLL (26)
+#define SOS_SYSCALL_FSYNC (27)
+#define SOS_SYSCALL_GETDIRENTS (28)
 
+/* First message register of a syscall's string or payload argument,
+ * see sos_ipc.h */
 #define OPEN_MESSAGE_START (2)
 #define PRINT_MESSAGE_START (2)
 #define STAT_MESSAGE_START (2)
 #define PROC_CREATE_MESSAGE_START (1)
+#define INLINE_WRITE_MESSAGE_START (3)
+#define INLINE_READ_REPLY_START (1)
+#define IOV_MESSAGE_START (3)
+#define POLL_MESSAGE_START (3)
+#define POLL_REPLY_START (1)
+
+/* Reads and writes up to this many bytes carry their data in the message
+ * registers instead of going through client memory */
+#define INLINE_IO_MAX (100 * 4)
+
+/* Buffers passed by one readv/writev request, each a (base, length) pair of
+ * message registers. Longer vectors are split by libsos */
+#define SOS_IOV_MAX (32)
+
+/* File descriptors one poll request can wait on, each an (fd, events)
+ * pair of message registers */
+#define SOS_POLL_MAX (32)
 
 #define STDIN_FD (0)
 #define STDOUT_FD (1)
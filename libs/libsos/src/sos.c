@@ -15,66 +15,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sos.h>
+#include <sos_ring.h>
+#include <sos_time.h>
+#include <device/vmem_layout.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <syscallno.h>
+#include <sos_ipc.h>
 #include <sel4/sel4.h>
 
 #define verbose 5
 #include <log/debug.h>
 #include <log/panic.h>
 
-/**
- * @brief Writing a string message to IPC buffer by packing them to seL4_Words
- *
- * @param start position where the message is inserted
- * @param msgdata bytes need to be packed
- */
-static void ipc_write_str(int start, const char* msgdata) {
-    size_t mr_idx,i,j;
-    seL4_Word pack;
-    i = 0;
-    mr_idx = start;
-    int count = strlen(msgdata);
-    while(i < count) {
-        pack = 0;
-        j = sizeof(seL4_Word);
-        while (j > 0 && i < count) {
-            pack = pack | ((seL4_Word)msgdata[i] << ((--j)*8));
-            i++;
-        }
-        seL4_SetMR(mr_idx, pack);
-        mr_idx++;
-    }
-    seL4_SetMR(mr_idx, 0);
-}
-
-/**
- * @brief Unpack a seL4_Word to 4 bytes
- *
- * @param msgBuf buffer to store unpacked bytes
- * @param packed_data seL4_Word needs to be unpacked
- *
- */
-static void unpack_word_bin(char* msgBuf, seL4_Word packed_data) {
-    int j = sizeof(seL4_Word);
-    while (j > 0) {
-        // Unpack data encoded 4-chars per word.
-        *msgBuf = (char)(packed_data >> ((--j) * 8));
-        msgBuf++;
-    }
-}
-
-static void ipc_read_bin(int start, char *buf) {
-    assert(buf && start > 0);
-    size_t length = seL4_GetMR(start);
-    int k = 0, i;
-    for (i = start + 1; i < seL4_MsgMaxLength && k < length; i++) {
-       unpack_word_bin(buf+k, seL4_GetMR(i));
-       k += sizeof(seL4_Word);
-    }
-}
-
 fmode_t mode2fmode(mode_t mode) {
     fmode_t ret = 0;
     if (mode == 0 || (mode & O_RDWR)) {
@@ -87,15 +42,12 @@ fmode_t mode2fmode(mode_t mode) {
 }
 
 int sos_sys_open(const char *path, fmode_t mode) {
-    int len = ((strlen(path)+1) + sizeof(seL4_Word)-1) >> 2;
     mode = mode2fmode(mode);
-    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2 + len);
+    size_t len = ipc_put_str(OPEN_MESSAGE_START, path);
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, OPEN_MESSAGE_START + len);
     seL4_SetTag(tag);
     seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_OPEN);
     seL4_SetMR(1, (seL4_Word)mode);
-    ipc_write_str(OPEN_MESSAGE_START, path);
-    char data[100];
-    sprintf(data, "sys_open %x %x %x %x\n", seL4_GetMR(2), seL4_GetMR(3), seL4_GetMR(4));
     seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
     if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
         return -1;
@@ -103,7 +55,48 @@ int sos_sys_open(const char *path, fmode_t mode) {
         return seL4_GetMR(0);
 }
 
+/**
+ * @brief Small reads get their data back in the message registers
+ */
+static int sos_sys_read_inline(int file, char *buf, size_t nbyte) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 3);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_READ_INLINE);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)nbyte);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    int count = (int)seL4_GetMR(0);
+    if (count > 0) {
+        memcpy(buf, &seL4_GetIPCBuffer()->msg[INLINE_READ_REPLY_START], count);
+    }
+    return count;
+}
+
+/**
+ * @brief Small writes carry their data in the message registers
+ */
+static int sos_sys_write_inline(int file, char *buf, size_t nbyte) {
+    size_t words = (nbyte + sizeof(seL4_Word) - 1) / sizeof(seL4_Word);
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0,
+                                                  INLINE_WRITE_MESSAGE_START + words);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_WRITE_INLINE);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)nbyte);
+    memcpy(&seL4_GetIPCBuffer()->msg[INLINE_WRITE_MESSAGE_START], buf, nbyte);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return 0;
+    else 
+        return seL4_GetMR(0);
+}
+
 int sos_sys_read(int file, char *buf, size_t nbyte) {
+    if (buf && nbyte <= INLINE_IO_MAX) {
+        return sos_sys_read_inline(file, buf, nbyte);
+    }
     seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
     seL4_SetTag(tag);
     seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_READ);
@@ -119,6 +112,9 @@ int sos_sys_read(int file, char *buf, size_t nbyte) {
 }
 
 int sos_sys_write(int file, char *buf, size_t nbyte) {
+    if (buf && nbyte <= INLINE_IO_MAX) {
+        return sos_sys_write_inline(file, buf, nbyte);
+    }
     seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
     seL4_SetTag(tag);
     seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_WRITE); 
@@ -133,6 +129,158 @@ int sos_sys_write(int file, char *buf, size_t nbyte) {
         return seL4_GetMR(0);
 }
 
+int sos_sys_pread(int file, char *buf, size_t nbyte, size_t offset) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 5);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_PREAD);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)buf);
+    seL4_SetMR(3, (seL4_Word)nbyte);
+    seL4_SetMR(4, (seL4_Word)offset);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    else
+        return seL4_GetMR(0);
+}
+
+int sos_sys_pwrite(int file, char *buf, size_t nbyte, size_t offset) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 5);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_PWRITE);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)buf);
+    seL4_SetMR(3, (seL4_Word)nbyte);
+    seL4_SetMR(4, (seL4_Word)offset);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return 0;
+    else
+        return seL4_GetMR(0);
+}
+
+long sos_sys_lseek(int file, long offset, int whence) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_LSEEK);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)offset);
+    seL4_SetMR(3, (seL4_Word)whence);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    else
+        return (long)seL4_GetMR(0);
+}
+
+int sos_sys_poll(struct pollfd *fds, int nfds, int timeout) {
+    if (nfds < 0 || nfds > SOS_POLL_MAX) {
+        return -1;
+    }
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0,
+                                                  POLL_MESSAGE_START + 2 * nfds);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_POLL);
+    seL4_SetMR(1, (seL4_Word)nfds);
+    seL4_SetMR(2, (seL4_Word)timeout);
+    for (int i = 0; i < nfds; i++) {
+        seL4_SetMR(POLL_MESSAGE_START + 2 * i, (seL4_Word)fds[i].fd);
+        seL4_SetMR(POLL_MESSAGE_START + 2 * i + 1, (seL4_Word)fds[i].events);
+    }
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    for (int i = 0; i < nfds; i++) {
+        fds[i].revents = (short)seL4_GetMR(POLL_REPLY_START + i);
+    }
+    return seL4_GetMR(0);
+}
+
+/**
+ * @brief Issue one vectored request for at most SOS_IOV_MAX buffers
+ */
+static int sos_sys_iov_call(seL4_Word syscall, int file, const struct iovec *iov, int iovcnt) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0,
+                                                  IOV_MESSAGE_START + 2 * iovcnt);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, syscall);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)iovcnt);
+    for (int i = 0; i < iovcnt; i++) {
+        seL4_SetMR(IOV_MESSAGE_START + 2 * i, (seL4_Word)iov[i].iov_base);
+        seL4_SetMR(IOV_MESSAGE_START + 2 * i + 1, (seL4_Word)iov[i].iov_len);
+    }
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    else
+        return seL4_GetMR(0);
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+int sos_sys_readv(int file, const struct iovec *iov, int iovcnt) {
+    int total = 0;
+    while (iovcnt > 0) {
+        int n = iovcnt < SOS_IOV_MAX ? iovcnt : SOS_IOV_MAX;
+        int ret = sos_sys_iov_call(SOS_SYSCALL_READV, file, iov, n);
+        if (ret < 0) {
+            return total ? total : -1;
+        }
+        total += ret;
+        if ((size_t)ret < iov_total(iov, n)) { // end of file or console line
+            break;
+        }
+        iov += n;
+        iovcnt -= n;
+    }
+    return total;
+}
+
+int sos_sys_writev(int file, const struct iovec *iov, int iovcnt) {
+    size_t nbyte = iov_total(iov, iovcnt);
+    if (nbyte <= INLINE_IO_MAX) {
+        // e.g. a flushed printf: gather straight into the message registers
+        char *dst = (char*)&seL4_GetIPCBuffer()->msg[INLINE_WRITE_MESSAGE_START];
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0,
+                                                      INLINE_WRITE_MESSAGE_START + IPC_WORDS(nbyte));
+        seL4_SetTag(tag);
+        seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_WRITE_INLINE);
+        seL4_SetMR(1, (seL4_Word)file);
+        seL4_SetMR(2, (seL4_Word)nbyte);
+        seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+        if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+            return 0;
+        else
+            return seL4_GetMR(0);
+    }
+    int total = 0;
+    while (iovcnt > 0) {
+        int n = iovcnt < SOS_IOV_MAX ? iovcnt : SOS_IOV_MAX;
+        int ret = sos_sys_iov_call(SOS_SYSCALL_WRITEV, file, iov, n);
+        if (ret <= 0) {
+            break;
+        }
+        total += ret;
+        if ((size_t)ret < iov_total(iov, n)) {
+            break;
+        }
+        iov += n;
+        iovcnt -= n;
+    }
+    return total;
+}
+
 void sos_sys_usleep(int msec) {
     seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2);
     seL4_SetTag(tag);
@@ -143,7 +291,27 @@ void sos_sys_usleep(int msec) {
 }
 
 
+/**
+ * @brief Read the time from the pages SOS maps into every client,
+ *        no syscall needed
+ */
 int64_t sos_sys_time_stamp(void) {
+    const sos_time_page_t *tp = (const sos_time_page_t*)PROCESS_TIME_PAGE;
+    const volatile uint32_t *counter =
+        (const volatile uint32_t*)(PROCESS_TIMER_PAGE + tp->counter_offset);
+    uint32_t seq, high, low;
+    do {
+        seq = tp->seq;
+        high = tp->high;
+        low = *counter;
+    } while ((seq & 1) || seq != tp->seq);
+    return (int64_t)((((uint64_t)high << 32) | low) >> tp->shift);
+}
+
+/**
+ * @brief Ask SOS for the time, for when the time page can't be used
+ */
+int64_t sos_sys_time_stamp_ipc(void) {
     seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
     seL4_SetTag(tag);
     seL4_SetMR(0, SOS_SYSCALL_TIMESTAMP); 
@@ -161,15 +329,14 @@ int sos_stat(const char *path, sos_stat_t *buf) {
     if (path == NULL) {
         return -1;
     }
-    int len = ((strlen(path)+1) + sizeof(seL4_Word)-1) >> 2;
-    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2+len);
+    size_t len = ipc_put_str(STAT_MESSAGE_START, path);
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, STAT_MESSAGE_START + len);
     seL4_SetTag(tag);
     seL4_SetMR(0, SOS_SYSCALL_STAT);
     seL4_SetMR(1, (seL4_Word)buf);
-    ipc_write_str(STAT_MESSAGE_START, path);
     seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
     if(seL4_MessageInfo_get_label(reply) == seL4_NoFault) {
-        ipc_read_bin(1, (char*)buf);
+        ipc_get_bin(1, buf, sizeof(sos_stat_t));
         return 0;
     } else {
         return -1;
@@ -185,7 +352,7 @@ int sos_getdirent(int pos, char *name, size_t nbyte) {
     seL4_SetMR(2, nbyte-1); 
     seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
     if(seL4_MessageInfo_get_label(reply) == seL4_NoFault) {
-        ipc_read_bin(1, (char*)name);
+        ipc_get_bin(1, name, nbyte - 1);
         name[nbyte - 1] = 0;
         return seL4_GetMR(0);
     } else {
@@ -193,6 +360,23 @@ int sos_getdirent(int pos, char *name, size_t nbyte) {
     }
 }
 
+int sos_getdirents(int pos, char *buf, size_t nbyte) {
+    if (nbyte == 0) return 0;
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 3);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_GETDIRENTS);
+    seL4_SetMR(1, pos + 1); // in sos, index starts from 1
+    seL4_SetMR(2, nbyte);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if(seL4_MessageInfo_get_label(reply) == seL4_NoFault) {
+        int n = seL4_GetMR(0);
+        ipc_get_bin(1, buf, nbyte);
+        return n;
+    } else {
+        return -1;
+    }
+}
+
 size_t sos_write(void *data, size_t count) {
     return sos_sys_write(STDOUT_FD , (char*)data, count);
 }
@@ -202,12 +386,11 @@ size_t sos_read(void *vData, size_t count) {
 }
 
 pid_t sos_process_create(const char *path) {
-
-    int len = ((strlen(path)+1) + sizeof(seL4_Word)-1) >> 2;
-    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2 + len);
+    size_t len = ipc_put_str(PROC_CREATE_MESSAGE_START, path);
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0,
+                                                  PROC_CREATE_MESSAGE_START + len);
     seL4_SetTag(tag);
     seL4_SetMR(0, (seL4_Word)SOS_SYSCALL_PROC_CREATE);
-    ipc_write_str(PROC_CREATE_MESSAGE_START, path);
 
     seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
     if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
@@ -264,6 +447,19 @@ pid_t sos_my_id(void) {
         return seL4_GetMR(0);
 }
 
+int sos_sys_fsync(int file) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_FSYNC);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if(seL4_MessageInfo_get_label(reply) == seL4_NoFault) {
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
 int sos_sys_close(int file) {
     seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2);
     seL4_SetTag(tag);
@@ -277,4 +473,26 @@ int sos_sys_close(int file) {
     }
 }
 
+int sos_ring_register(sos_ring_t *ring) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_RING_REGISTER);
+    seL4_SetMR(1, (seL4_Word)ring);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    else 
+        return 0;
+}
 
+int sos_ring_enter(unsigned wait_nr) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_RING_ENTER);
+    seL4_SetMR(1, wait_nr);
+    seL4_MessageInfo_t reply = seL4_Call(SYSCALL_ENDPOINT_SLOT, tag);
+    if (seL4_MessageInfo_get_label(reply) != seL4_NoFault)
+        return -1;
+    else 
+        return seL4_GetMR(0);
+}
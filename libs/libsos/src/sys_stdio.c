@@ -25,6 +25,7 @@
 #include <sys/resource.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <poll.h>
 #include <limits.h>
 
 #include <sys/types.h>
@@ -64,16 +65,8 @@ sys_writev(va_list ap)
         return 0;
     }
 
-    /* Write the buffer to console if the fd is for stdout or stderr. */
-    if (fildes == STDOUT_FD || fildes == STDERR_FD) {
-        for (int i = 0; i < iovcnt; i++) {
-            ret += sos_write(iov[i].iov_base, iov[i].iov_len);
-        }
-    } else {
-        for (int i = 0; i < iovcnt; i++) {
-            ret += sos_sys_write(fildes, iov[i].iov_base, iov[i].iov_len);
-        }
-    }
+    /* The whole vector goes to sos in one request */
+    ret = sos_sys_writev(fildes, iov, iovcnt);
 
     return ret;
 }
@@ -83,14 +76,14 @@ long sys_readv(va_list ap)
     int fd = va_arg(ap, int);
     struct iovec *iov = va_arg(ap, struct iovec*);
     int iovcnt = va_arg(ap, int);
-    int i;
-    long read;
 
-    read = 0;
-    for (i = 0; i < iovcnt; i++) {
-        read += sos_sys_read(fd, iov[i].iov_base, iov[i].iov_len);
+    if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
     }
-    return read;
+    if (iovcnt == 1) { // plain read(), may go inline
+        return sos_sys_read(fd, iov[0].iov_base, iov[0].iov_len);
+    }
+    return sos_sys_readv(fd, iov, iovcnt);
 }
 
 long sys_read(va_list ap)
@@ -113,6 +106,70 @@ long sys_write(va_list ap)
     return writev(fd, &iov, 1);
 }
 
+/* 64 bit offsets arrive as a register pair, which arm aligns to an even
+ * register. NFS offsets are 32 bit, so larger ones are rejected */
+static int
+sys_offset_arg(va_list ap, size_t *offset)
+{
+#ifdef ARCH_ARM
+    (void)va_arg(ap, long);
+#endif
+    unsigned long lo = va_arg(ap, unsigned long);
+    long hi = va_arg(ap, long);
+    if (hi != 0 || lo > LONG_MAX) {
+        return -EINVAL;
+    }
+    *offset = lo;
+    return 0;
+}
+
+long sys_pread64(va_list ap)
+{
+    int fd = va_arg(ap, int);
+    void *buf = va_arg(ap, void*);
+    size_t count = va_arg(ap, size_t);
+    size_t offset;
+    int err = sys_offset_arg(ap, &offset);
+    if (err) {
+        return err;
+    }
+    return sos_sys_pread(fd, buf, count, offset);
+}
+
+long sys_pwrite64(va_list ap)
+{
+    int fd = va_arg(ap, int);
+    void *buf = va_arg(ap, void*);
+    size_t count = va_arg(ap, size_t);
+    size_t offset;
+    int err = sys_offset_arg(ap, &offset);
+    if (err) {
+        return err;
+    }
+    return sos_sys_pwrite(fd, buf, count, offset);
+}
+
+long sys_lseek(va_list ap)
+{
+    int fd = va_arg(ap, int);
+    long offset = va_arg(ap, long);
+    int whence = va_arg(ap, int);
+    if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+        return -EINVAL;
+    }
+    long ret = sos_sys_lseek(fd, offset, whence);
+    return ret < 0 ? -EINVAL : ret;
+}
+
+long sys_poll(va_list ap)
+{
+    struct pollfd *fds = va_arg(ap, struct pollfd *);
+    nfds_t nfds = va_arg(ap, nfds_t);
+    int timeout = va_arg(ap, int);
+    int ret = sos_sys_poll(fds, nfds, timeout);
+    return ret < 0 ? -EINVAL : ret;
+}
+
 long
 sys_ioctl(va_list ap)
 {
@@ -169,3 +226,10 @@ sys_close(va_list ap)
     int fd = va_arg(ap, int);
     return sos_sys_close(fd);
 }
+
+long
+sys_fsync(va_list ap)
+{
+    int fd = va_arg(ap, int);
+    return sos_sys_fsync(fd) ? -EIO : 0;
+}
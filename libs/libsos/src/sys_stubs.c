@@ -2117,11 +2117,11 @@ long sys_sysinfo(va_list ap)
     assert(!"sys_sysinfo not implemented");
     return 0;
 }
-long sys_fsync(va_list ap)
+/*long sys_fsync(va_list ap)
 {
     assert(!"sys_fsync not implemented");
     return 0;
-}
+}*/
 long sys_sigreturn(va_list ap)
 {
     assert(!"sys_sigreturn not implemented");
@@ -2321,11 +2321,11 @@ long sys_getresuid(va_list ap)
     assert(!"sys_getresuid not implemented");
     return 0;
 }
-long sys_poll(va_list ap)
+/*long sys_poll(va_list ap)
 {
     assert(!"sys_poll not implemented");
     return 0;
-}
+}*/
 long sys_nfsservctl(va_list ap)
 {
     assert(!"sys_nfsservctl not implemented");
@@ -2381,16 +2381,16 @@ long sys_rt_sigsuspend(va_list ap)
     assert(!"sys_rt_sigsuspend not implemented");
     return 0;
 }
-long sys_pread64(va_list ap)
+/*long sys_pread64(va_list ap)
 {
     assert(!"sys_pread64 not implemented");
     return 0;
-}
-long sys_pwrite64(va_list ap)
+}*/
+/*long sys_pwrite64(va_list ap)
 {
     assert(!"sys_pwrite64 not implemented");
     return 0;
-}
+}*/
 long sys_chown(va_list ap)
 {
     assert(!"sys_chown not implemented");
@@ -3335,11 +3335,11 @@ long sys_process_vm_writev(va_list ap)
     assert(!"sys_process_vm_writev not implemented");
     return 0;
 }
-long sys_lseek(va_list ap)
+/*long sys_lseek(va_list ap)
 {
     assert(!"sys_lseek not implemented");
     return 0;
-}
+}*/
 long sys_access(va_list ap)
 {
     assert(!"sys_access not implemented");